@@ -128,6 +128,15 @@ typedef enum
   _az_HTTP_RESPONSE_KIND_EOF = 3,
 } _az_http_response_kind;
 
+/**
+ * @brief Receives a chunk of the body of a successful HTTP response, as it arrives.
+ *
+ * @param user_context The context given to #az_http_response_set_body_callback.
+ * @param body_chunk The next bytes of the body. They are only valid during the call.
+ * @return AZ_OK to keep receiving the body, or any failed result to abort the request with it.
+ */
+typedef az_result (*az_http_response_body_fn)(void* user_context, az_span body_chunk);
+
 /**
  * @brief Allows you to parse an HTTP response's status line, headers, and body.
  *
@@ -149,6 +158,14 @@ typedef struct
       _az_http_response_kind next_kind;
       // After parsing an element, next_kind refers to the next expected element
     } parser;
+    struct
+    {
+      az_http_response_body_fn callback;
+      void* user_context;
+      // The number of bytes matched of the blank line ending the headers.
+      int32_t end_of_headers_matched;
+      bool is_streaming; // all headers were received and the body goes to the callback.
+    } body;
   } _internal;
 } az_http_response;
 
@@ -158,7 +175,8 @@ typedef struct
  *
  * @param response The pointer to an az_http_response instance which is to be initialized.
  * @param buffer A span over the byte buffer that is to be filled with the HTTP response data. This
- * buffer must be large enough to hold the entire response.
+ * buffer must be large enough to hold the entire response, or only its status line and headers when
+ * its body is streamed by #az_http_response_set_body_callback.
  */
 AZ_NODISCARD AZ_INLINE az_result az_http_response_init(az_http_response* response, az_span buffer)
 {
@@ -176,6 +194,28 @@ AZ_NODISCARD AZ_INLINE az_result az_http_response_init(az_http_response* respons
   return AZ_OK;
 }
 
+/**
+ * @brief az_http_response_set_body_callback makes a response deliver the body of a successful (2xx)
+ * HTTP response to \p callback as it arrives, instead of holding it in the response buffer.
+ *
+ * @details Only the status line and headers are kept in the buffer, which then only needs to be
+ * large enough for them, whatever the size of the body. The body of any other response is kept in
+ * the buffer as usual, so that errors can still be read with #az_http_response_get_body. For a
+ * streamed body, #az_http_response_get_body returns an empty span.
+ *
+ * If the request fails while the body is being received, \p callback may already have been given
+ * part of it.
+ *
+ * @param response The az_http_response, after it was initialized by #az_http_response_init.
+ * @param callback The function receiving the body. _NULL_ keeps the body in the buffer.
+ * @param user_context The context passed to \p callback.
+ * @return AZ_OK = The callback was set.
+ */
+AZ_NODISCARD az_result az_http_response_set_body_callback(
+    az_http_response* response,
+    az_http_response_body_fn callback,
+    void* user_context);
+
 /**
  * @brief Represents the result of making an HTTP request.
  * An application obtains this initialized structure by calling #az_http_response_get_status_line.
@@ -206,6 +206,14 @@ AZ_NODISCARD int32_t az_http_request_headers_count(_az_http_request const* reque
 AZ_NODISCARD az_result
 az_http_client_send_request(_az_http_request const* request, az_http_response* ref_response);
 
+/**
+ * @brief Releases what the HTTP transport keeps between requests, such as idle connections.
+ *
+ * @details Call it once no more requests are sent, and before cleaning up the HTTP stack: with
+ * libcurl, before `curl_global_cleanup()`. Requests sent afterwards still work, starting afresh.
+ */
+void az_http_client_cleanup(void);
+
 #include <azure/core/_az_cfg_suffix.h>
 
 #endif // _az_HTTP_TRANSPORT_H
@@ -20,6 +20,7 @@
 #include <azure/core/az_span.h>
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include <azure/core/_az_cfg_prefix.h>
@@ -69,6 +70,11 @@ typedef struct
   struct
   {
     bool string_has_escaped_chars;
+
+    // For number tokens, the offsets within the slice of the '.' starting the fraction part and of
+    // the 'e'/'E' starting the exponent part, or 0 if the number doesn't have that part.
+    int32_t number_fraction_index;
+    int32_t number_exponent_index;
   } _internal;
 } az_json_token;
 
@@ -465,11 +471,21 @@ typedef struct
 
   struct
   {
+    // The buffer being read, and how much of it has been read so far.
     az_span json_buffer;
     int32_t bytes_consumed;
     bool is_complex_json;
     _az_json_bit_stack bit_stack;
     az_json_reader_options options;
+
+    // The buffers the JSON text is split across, and the index of the one being read. Only used
+    // when more than one buffer was passed to #az_json_reader_chunked_init().
+    az_span* json_buffers;
+    int32_t number_of_buffers;
+    int32_t buffer_index;
+
+    // Where tokens which straddle two buffers are copied to, so they can be read contiguously.
+    az_span token_buffer;
   } _internal;
 } az_json_reader;
 
@@ -492,6 +508,36 @@ AZ_NODISCARD az_result az_json_reader_init(
     az_span json_buffer,
     az_json_reader_options const* options);
 
+/**
+ * @brief Initializes an #az_json_reader to read the JSON payload split across the provided
+ * buffers, in order, without first putting it back together.
+ *
+ * @param[out] json_reader A pointer to an #az_json_reader instance to initialize.
+ * @param[in] json_buffers An array of #az_span over the byte buffers containing the JSON text to
+ * read. The array and the buffers must stay valid while the reader is in use. Buffers may be empty,
+ * and may split the JSON text anywhere, including in the middle of a token.
+ * @param[in] number_of_buffers The number of buffers in \p json_buffers.
+ * @param[in] token_buffer An #az_span over a byte buffer which a string, number or literal token
+ * straddling two buffers is copied into, so that its #az_json_token.slice is contiguous. It must be
+ * large enough for the largest such token, quotes included. Any other token is read in place.
+ * @param[in] options __[nullable]__ A reference to an #az_json_reader_options
+ * structure which defines custom behavior of the #az_json_reader. If `NULL` is passed, the reader
+ * will use the default options (i.e. #az_json_reader_options_default()).
+ *
+ * @return An #az_result value indicating the result of the operation:
+ *         - #AZ_OK if the az_json_reader is initialized successfully
+ *
+ * @remarks The slice of a token copied into \p token_buffer is only valid until the next token
+ * straddling two buffers is read. #az_json_reader_next_token() returns
+ * #AZ_ERROR_INSUFFICIENT_SPAN_SIZE when such a token doesn't fit in \p token_buffer.
+ */
+AZ_NODISCARD az_result az_json_reader_chunked_init(
+    az_json_reader* json_reader,
+    az_span json_buffers[],
+    int32_t number_of_buffers,
+    az_span token_buffer,
+    az_json_reader_options const* options);
+
 /**
  * @brief Reads the next token in the JSON text and updates the reader state.
  *
@@ -518,6 +564,83 @@ AZ_NODISCARD az_result az_json_reader_next_token(az_json_reader* json_reader);
  */
 AZ_NODISCARD az_result az_json_reader_skip_children(az_json_reader* json_reader);
 
+/**
+ * @brief Defines the type of the output slot an #az_json_extract_field is stored into.
+ */
+typedef enum
+{
+  AZ_JSON_EXTRACT_BOOLEAN, ///< A `bool`, see #az_json_token_get_boolean.
+  AZ_JSON_EXTRACT_INT32, ///< An `int32_t`, see #az_json_token_get_int32.
+  AZ_JSON_EXTRACT_INT64, ///< An `int64_t`, see #az_json_token_get_int64.
+  AZ_JSON_EXTRACT_UINT32, ///< A `uint32_t`, see #az_json_token_get_uint32.
+  AZ_JSON_EXTRACT_UINT64, ///< A `uint64_t`, see #az_json_token_get_uint64.
+  AZ_JSON_EXTRACT_DOUBLE, ///< A `double`, see #az_json_token_get_double.
+  AZ_JSON_EXTRACT_STRING, ///< A `char` array, see #az_json_token_get_string.
+  AZ_JSON_EXTRACT_TOKEN, ///< An #az_json_token, for values which need to be handled by the caller.
+} az_json_extract_kind;
+
+/**
+ * @brief Describes a JSON property to extract with #az_json_extract, and where to store its value.
+ *
+ * @details Use #AZ_JSON_EXTRACT_FIELD to define the fields as a static table.
+ */
+typedef struct
+{
+  /// The names of the properties leading to the value from the root object, separated by '/'. For
+  /// example, "desired/targetTemperature".
+  az_span path;
+
+  /// The type of the output slot.
+  az_json_extract_kind kind;
+
+  /// The offset of the output slot within the destination structure.
+  size_t offset;
+
+  /// The size of the output slot, in bytes.
+  int32_t size;
+} az_json_extract_field;
+
+/**
+ * @brief Defines an #az_json_extract_field which stores the value at \p path into \p member of the
+ * destination structure of type \p type.
+ */
+#define AZ_JSON_EXTRACT_FIELD(path, kind, type, member) \
+  { \
+    AZ_SPAN_LITERAL_FROM_STR(path), kind, offsetof(type, member), \
+        (int32_t)sizeof(((type*)0)->member) \
+  }
+
+/**
+ * @brief Extracts the values of a set of properties from a JSON object, in a single pass.
+ *
+ * @param json_buffer An #az_span containing the JSON object to read.
+ * @param fields An array of #az_json_extract_field describing the properties to extract.
+ * @param fields_count The number of elements in \p fields, from 1 to 32.
+ * @param[out] destination A pointer to the structure holding the output slots of \p fields.
+ * @param[out] out_found_fields A pointer to a bit mask receiving which fields were found: bit `i`
+ * is set if the value of `fields[i]` was stored.
+ *
+ * @return AZ_OK if the JSON object was read successfully, even if some fields were not found.<br>
+ *         AZ_ERROR_EOF when the JSON object is incomplete.<br>
+ *         AZ_ERROR_UNEXPECTED_CHAR when an invalid character is detected, or \p json_buffer
+ *         doesn't contain an object.<br>
+ *         Any error of the `az_json_token_get_*` function matching the kind of a field, when the
+ *         value found at its path can't be stored.
+ *
+ * @remarks Property names are only compared against the fields which are still candidates at that
+ * depth of the document, comparing lengths before contents, and subtrees which no field leads into
+ * are skipped with #az_json_reader_skip_children. Paths can be up to 8 properties deep and can't
+ * lead into arrays. A `null` value is treated as absent, except for #AZ_JSON_EXTRACT_TOKEN fields.
+ * If a property appears more than once, the last value wins. When an error is returned, some of the
+ * output slots may have been written already.
+ */
+AZ_NODISCARD az_result az_json_extract(
+    az_span json_buffer,
+    az_json_extract_field const* fields,
+    int32_t fields_count,
+    void* destination,
+    uint32_t* out_found_fields);
+
 #include <azure/core/_az_cfg_suffix.h>
 
 #endif // _az_JSON_H
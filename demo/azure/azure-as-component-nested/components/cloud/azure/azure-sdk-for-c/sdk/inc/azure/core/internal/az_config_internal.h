@@ -16,6 +16,7 @@ enum
   _az_TIME_SECONDS_PER_MINUTE = 60,
   _az_TIME_MILLISECONDS_PER_SECOND = 1000,
   _az_TIME_MICROSECONDS_PER_MILLISECOND = 1000,
+  _az_TIME_NANOSECONDS_PER_MILLISECOND = 1000000,
 };
 
 /*
@@ -25,6 +25,14 @@ AZ_INLINE AZ_NODISCARD int32_t _az_span_diff(az_span sliced_span, az_span origin
   return answer;
 }
 
+/**
+ * @brief Calculates the exact number of bytes URL-encoding the \p source span takes.
+ *
+ * @param[in] source The #az_span containing the non-URL-encoded bytes.
+ * @return The size a \p destination passed to #_az_span_url_encode needs to have.
+ */
+AZ_NODISCARD int32_t _az_span_url_encode_calc_length(az_span source);
+
 /**
  * @brief Copies character from the \p source #az_span to the \p destination #az_span by
  * URL-encoding the \p source span characters.
@@ -131,6 +131,110 @@ AZ_NODISCARD az_result az_storage_blobs_blob_upload(
     az_storage_blobs_blob_upload_options* options,
     az_http_response* response);
 
+/**
+ * @brief Reads the next part of the content of a blob being uploaded in blocks.
+ *
+ * @param user_context The context passed to #az_storage_blobs_blob_upload_blocks().
+ * @param destination The buffer to read the content into.
+ * @param[out] out_size The number of bytes read into \p destination, or 0 once all the content has
+ * been read.
+ *
+ * @return An #az_result value indicating the result of the operation. Any failure stops the upload
+ * and is returned by #az_storage_blobs_blob_upload_blocks().
+ */
+typedef az_result (*az_storage_blobs_blob_read_callback)(
+    void* user_context,
+    az_span destination,
+    int32_t* out_size);
+
+/**
+ * @brief Uploads one block of a block blob, without committing it.
+ *
+ * @details Blocks are identified by their index, from 0 to one less than the number of blocks, and
+ * are made part of the blob by #az_storage_blobs_blob_put_block_list(). Each block is a separate
+ * request going through the client's retry policy, so a failed block is retried on its own. Blocks
+ * don't depend on each other: an application with several threads may upload different blocks
+ * with the same client concurrently, each with its own response.
+ *
+ * @param client A storage blobs client structure.
+ * @param context Supports cancelling long running operations.
+ * @param block_index The index of the block within the blob, from 0 to 49999.
+ * @param content The block content to upload.
+ * @param response A pre-allocated buffer where to write HTTP response into.
+ *
+ * @return An #az_result value indicating the result of the operation:
+ *         - #AZ_OK if successful
+ */
+AZ_NODISCARD az_result az_storage_blobs_blob_put_block(
+    az_storage_blobs_blob_client* client,
+    az_context* context,
+    int32_t block_index,
+    az_span content,
+    az_http_response* response);
+
+/**
+ * @brief Commits the blocks uploaded with #az_storage_blobs_blob_put_block() as the content of the
+ * blob.
+ *
+ * @param client A storage blobs client structure.
+ * @param context Supports cancelling long running operations.
+ * @param block_count The number of blocks, which make up the blob in the order of their index.
+ * @param buffer A buffer used to build the block list sent to the service, which needs 25 bytes for
+ * each block, plus 61 bytes.
+ * @param response A pre-allocated buffer where to write HTTP response into.
+ *
+ * @return An #az_result value indicating the result of the operation:
+ *         - #AZ_OK if successful
+ *         - #AZ_ERROR_INSUFFICIENT_SPAN_SIZE if \p buffer is too small for the block list
+ */
+AZ_NODISCARD az_result az_storage_blobs_blob_put_block_list(
+    az_storage_blobs_blob_client* client,
+    az_context* context,
+    int32_t block_count,
+    az_span buffer,
+    az_http_response* response);
+
+/**
+ * @brief Uploads content which doesn't fit in memory as a block blob, one block at a time.
+ *
+ * @details The content is read into \p block_buffer, which is uploaded as a block each time it is
+ * full. Once the content has all been read, the blocks are committed, building the block list in
+ * \p block_list_buffer. The list needs 25 bytes for each block, plus 61 bytes, so a blob can have
+ * at most (size - 61) / 25 blocks, where size is that of \p block_list_buffer: for example, an
+ * 8 KiB list buffer holds 325 blocks, over 10 MiB of content with a 32 KiB block buffer. Content
+ * longer than that fails before the block that wouldn't fit in the list is uploaded, so no block
+ * is uploaded that can't be committed.
+ *
+ * If the service doesn't accept a block (after the client's retry policy has given up), the upload
+ * stops and \p response holds the service's response to that block. Check its status code as for
+ * #az_storage_blobs_blob_upload(): 201 means the whole blob was committed.
+ *
+ * @param client A storage blobs client structure.
+ * @param context Supports cancelling long running operations.
+ * @param read_callback Called to read the content, until it reads 0 bytes.
+ * @param user_context Passed to \p read_callback.
+ * @param block_buffer The buffer each block is read into, which sets the block size.
+ * @param block_list_buffer The buffer the block list is built in, which sets the number of blocks.
+ * @param options __[nullable]__ A reference to an #az_storage_blobs_blob_upload_options
+ * structure which defines custom behavior for uploading the blob. If `NULL` is passed, the client
+ * will use the default options (i.e. #az_storage_blobs_blob_upload_options_default()).
+ * @param response A pre-allocated buffer where to write HTTP response into.
+ *
+ * @return An #az_result value indicating the result of the operation:
+ *         - #AZ_OK if successful
+ *         - #AZ_ERROR_INSUFFICIENT_SPAN_SIZE if the content needs more blocks of the size of
+ *           \p block_buffer than \p block_list_buffer can hold, or more than 50000
+ */
+AZ_NODISCARD az_result az_storage_blobs_blob_upload_blocks(
+    az_storage_blobs_blob_client* client,
+    az_context* context,
+    az_storage_blobs_blob_read_callback read_callback,
+    void* user_context,
+    az_span block_buffer,
+    az_span block_list_buffer,
+    az_storage_blobs_blob_upload_options* options,
+    az_http_response* response);
+
 #include <azure/core/_az_cfg_suffix.h>
 
 #endif // _az_STORAGE_BLOBS_H
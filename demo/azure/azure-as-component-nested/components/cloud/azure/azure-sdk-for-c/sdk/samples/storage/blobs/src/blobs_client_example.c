@@ -58,6 +58,8 @@ int main()
     }
     // Set up libcurl cleaning callback as to be called before ending program
     atexit(curl_global_cleanup);
+    // Registered last so that it runs first, releasing the SDK's curl handles before libcurl
+    atexit(az_http_client_cleanup);
   */
 
   // Uncomment below code to enable logging
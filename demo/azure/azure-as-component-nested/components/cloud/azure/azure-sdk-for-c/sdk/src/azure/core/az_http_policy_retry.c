@@ -105,38 +105,42 @@ AZ_INLINE AZ_NODISCARD az_result _az_http_policy_retry_get_retry_after(
     // Try to get the value of retry-after header, if there's one.
     *should_retry = true;
 
-    az_pair header = { 0 };
-    while (az_http_response_get_next_header(ref_response, &header) == AZ_OK)
+    // Parse the headers once for the several that may give the delay.
+    _az_http_response_header_index header_index;
+    AZ_RETURN_IF_FAILED(_az_http_response_header_index_init(ref_response, &header_index));
+
+    az_span value = AZ_SPAN_NULL;
+    if (az_succeeded(_az_http_response_header_index_find(
+            &header_index, AZ_SPAN_FROM_STR("retry-after-ms"), &value))
+        || az_succeeded(_az_http_response_header_index_find(
+            &header_index, AZ_SPAN_FROM_STR("x-ms-retry-after-ms"), &value)))
     {
-      if (az_span_is_content_equal_ignoring_case(header.key, AZ_SPAN_FROM_STR("retry-after-ms"))
-          || az_span_is_content_equal_ignoring_case(
-              header.key, AZ_SPAN_FROM_STR("x-ms-retry-after-ms")))
+      // The value is in milliseconds.
+      int32_t const msec = _az_uint32_span_to_int32(value);
+      if (msec >= 0) // int32_t max == ~24 days
       {
-        // The value is in milliseconds.
-        int32_t const msec = _az_uint32_span_to_int32(header.value);
-        if (msec >= 0) // int32_t max == ~24 days
-        {
-          *retry_after_msec = msec;
-          return AZ_OK;
-        }
+        *retry_after_msec = msec;
+        return AZ_OK;
       }
-      else if (az_span_is_content_equal_ignoring_case(header.key, AZ_SPAN_FROM_STR("Retry-After")))
+    }
+
+    if (az_succeeded(_az_http_response_header_index_find(
+            &header_index, AZ_SPAN_FROM_STR("Retry-After"), &value)))
+    {
+      // The vaule is either seconds or date.
+      int32_t const seconds = _az_uint32_span_to_int32(value);
+      if (seconds >= 0) // int32_t max == ~68 years
       {
-        // The vaule is either seconds or date.
-        int32_t const seconds = _az_uint32_span_to_int32(header.value);
-        if (seconds >= 0) // int32_t max == ~68 years
-        {
-          *retry_after_msec = (seconds <= (INT32_MAX / _az_TIME_MILLISECONDS_PER_SECOND))
-              ? seconds * _az_TIME_MILLISECONDS_PER_SECOND
-              : INT32_MAX;
-
-          return AZ_OK;
-        }
-
-        // TODO: Other possible value is HTTP Date. For that, we'll need to parse date, get
-        // current date, subtract one from another, get seconds. And the device should have a
-        // sense of calendar clock.
+        *retry_after_msec = (seconds <= (INT32_MAX / _az_TIME_MILLISECONDS_PER_SECOND))
+            ? seconds * _az_TIME_MILLISECONDS_PER_SECOND
+            : INT32_MAX;
+
+        return AZ_OK;
       }
+
+      // TODO: Other possible value is HTTP Date. For that, we'll need to parse date, get
+      // current date, subtract one from another, get seconds. And the device should have a
+      // sense of calendar clock.
     }
 
     *retry_after_msec = -1;
@@ -148,6 +152,17 @@ AZ_INLINE AZ_NODISCARD az_result _az_http_policy_retry_get_retry_after(
   return AZ_OK;
 }
 
+// Spreads the calculated delay over 80% to 120% of its value, up to the maximum delay, so that
+// clients which failed at the same time don't all retry at the same time. The low bits of the
+// millisecond clock are random enough for this.
+AZ_NODISCARD AZ_INLINE int32_t
+_az_http_policy_retry_add_jitter(int32_t delay_msec, int32_t max_delay_msec, int64_t now_msec)
+{
+  int64_t const percent = 80 + (now_msec % 41 + 41) % 41;
+  int64_t const jittered_msec = (int64_t)delay_msec * percent / 100;
+  return jittered_msec > max_delay_msec ? max_delay_msec : (int32_t)jittered_msec;
+}
+
 AZ_NODISCARD az_result az_http_pipeline_policy_retry(
     _az_http_policy* ref_policies,
     void* ref_options,
@@ -171,7 +186,7 @@ AZ_NODISCARD az_result az_http_pipeline_policy_retry(
   int16_t attempt = 1;
   while (true)
   {
-    AZ_RETURN_IF_FAILED(az_http_response_init(ref_response, ref_response->_internal.http_response));
+    _az_http_response_reset(ref_response);
     AZ_RETURN_IF_FAILED(_az_http_request_remove_retry_headers(ref_request));
 
     result = _az_http_pipeline_nextpolicy(ref_policies, ref_request, ref_response);
@@ -195,9 +210,23 @@ AZ_NODISCARD az_result az_http_pipeline_policy_retry(
 
     ++attempt;
 
+    // The clock is read once per retry, both to spread out the retries and to check them against
+    // the deadline.
+    int64_t const now_msec = az_platform_clock_msec();
+
     if (retry_after_msec < 0)
     { // there wasn't any kind of "retry-after" response header
-      retry_after_msec = _az_retry_calc_delay(attempt, retry_delay_msec, max_retry_delay_msec);
+      retry_after_msec = _az_http_policy_retry_add_jitter(
+          _az_retry_calc_delay(attempt, retry_delay_msec, max_retry_delay_msec),
+          max_retry_delay_msec,
+          now_msec);
+    }
+
+    // Don't sleep only to find the context expired when waking up: give up now if the retry
+    // wouldn't start before the deadline.
+    if (context != NULL && az_context_get_expiration(context) - now_msec < retry_after_msec)
+    {
+      return AZ_ERROR_CANCELED;
     }
 
     if (should_log)
@@ -206,11 +235,6 @@ AZ_NODISCARD az_result az_http_pipeline_policy_retry(
     }
 
     az_platform_sleep_msec(retry_after_msec);
-
-    if (context != NULL && az_context_has_expired(context, az_platform_clock_msec()))
-    {
-      return AZ_ERROR_CANCELED;
-    }
   }
 
   return result;
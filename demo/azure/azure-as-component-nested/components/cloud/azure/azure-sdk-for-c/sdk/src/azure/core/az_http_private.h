@@ -48,6 +48,63 @@ _az_http_request_remove_retry_headers(_az_http_request* ref_request)
  */
 void _az_http_response_reset(az_http_response* ref_response);
 
+enum
+{
+  // The number of response headers an index holds. Lookups of headers past these fall back to
+  // parsing the rest of the response.
+  _az_HTTP_RESPONSE_HEADER_INDEX_SIZE = 24,
+};
+
+/**
+ * @brief The headers of an HTTP response, parsed once so that several of them can be looked up
+ * without parsing the response again for each.
+ *
+ * @remarks The headers refer to the response buffer, which must outlive the index.
+ */
+typedef struct
+{
+  struct
+  {
+    // The response, positioned after the last header in the index.
+    az_http_response response;
+    int32_t headers_length;
+    uint32_t name_hashes[_az_HTTP_RESPONSE_HEADER_INDEX_SIZE];
+    az_pair headers[_az_HTTP_RESPONSE_HEADER_INDEX_SIZE];
+  } _internal;
+} _az_http_response_header_index;
+
+/**
+ * @brief Indexes the headers of an HTTP response.
+ *
+ * @param response HTTP response, whose status line has just been read by
+ * #az_http_response_get_status_line. It isn't modified.
+ * @param out_index The index to initialize.
+ *
+ * @return
+ *   - *`AZ_OK`* success.
+ *   - *`AZ_ERROR_HTTP_INVALID_STATE`* the status line of the response wasn't read.
+ */
+AZ_NODISCARD az_result _az_http_response_header_index_init(
+    az_http_response const* response,
+    _az_http_response_header_index* out_index);
+
+/**
+ * @brief Finds the value of the first header of a response with the given name, compared
+ * ignoring case.
+ *
+ * @param index The index of the response headers.
+ * @param name The header name.
+ * @param out_value The header value.
+ *
+ * @return
+ *   - *`AZ_OK`* success.
+ *   - *`AZ_ERROR_ITEM_NOT_FOUND`* the response has no such header.
+ */
+AZ_NODISCARD az_result _az_http_response_header_index_find(
+    _az_http_response_header_index const* index,
+    az_span name,
+    az_span* out_value);
+
 #include <azure/core/_az_cfg_suffix.h>
 
 #endif // _az_HTTP_PRIVATE_H
@@ -275,8 +275,10 @@ AZ_NODISCARD az_result az_http_response_get_body(az_http_response* ref_response,
     }
   }
 
-  // take all the remaining content from reader as body
-  *out_body = az_span_slice_to_end(ref_response->_internal.parser.remaining, 0);
+  // take all the remaining content from reader as body, unless it was given to the body callback
+  *out_body = ref_response->_internal.body.is_streaming
+      ? az_span_slice(ref_response->_internal.parser.remaining, 0, 0)
+      : az_span_slice_to_end(ref_response->_internal.parser.remaining, 0);
 
   ref_response->_internal.parser.next_kind = _az_HTTP_RESPONSE_KIND_EOF;
   return AZ_OK;
@@ -284,11 +286,118 @@ AZ_NODISCARD az_result az_http_response_get_body(az_http_response* ref_response,
 
 void _az_http_response_reset(az_http_response* ref_response)
 {
+  az_http_response_body_fn const body_callback = ref_response->_internal.body.callback;
+  void* const body_user_context = ref_response->_internal.body.user_context;
+
   // never fails, discard the result
   // init will set written to 0 and will use the same az_span. Internal parser's state is also
   // reset
   az_result result = az_http_response_init(ref_response, ref_response->_internal.http_response);
   (void)result;
+
+  // The body of the next response goes to the same callback.
+  ref_response->_internal.body.callback = body_callback;
+  ref_response->_internal.body.user_context = body_user_context;
+}
+
+AZ_NODISCARD az_result az_http_response_set_body_callback(
+    az_http_response* ref_response,
+    az_http_response_body_fn callback,
+    void* user_context)
+{
+  _az_PRECONDITION_NOT_NULL(ref_response);
+
+  ref_response->_internal.body.callback = callback;
+  ref_response->_internal.body.user_context = user_context;
+  return AZ_OK;
+}
+
+// FNV-1a of the header name with ASCII letters lowered, so that names differing only in case
+// hash the same.
+AZ_NODISCARD static uint32_t _az_http_response_header_name_hash(az_span name)
+{
+  uint8_t const* const name_ptr = az_span_ptr(name);
+  int32_t const name_size = az_span_size(name);
+
+  uint32_t hash = 2166136261U;
+  for (int32_t i = 0; i < name_size; i++)
+  {
+    uint8_t c = name_ptr[i];
+    if (c >= 'A' && c <= 'Z')
+    {
+      c = (uint8_t)(c | 0x20);
+    }
+    hash = (hash ^ c) * 16777619U;
+  }
+
+  return hash;
+}
+
+AZ_NODISCARD az_result _az_http_response_header_index_init(
+    az_http_response const* response,
+    _az_http_response_header_index* out_index)
+{
+  _az_PRECONDITION_NOT_NULL(response);
+  _az_PRECONDITION_NOT_NULL(out_index);
+
+  if (response->_internal.parser.next_kind != _az_HTTP_RESPONSE_KIND_HEADER)
+  {
+    return AZ_ERROR_HTTP_INVALID_STATE;
+  }
+
+  out_index->_internal.response = *response;
+  out_index->_internal.headers_length = 0;
+
+  while (out_index->_internal.headers_length < _az_HTTP_RESPONSE_HEADER_INDEX_SIZE)
+  {
+    int32_t const i = out_index->_internal.headers_length;
+    az_pair* const header = &out_index->_internal.headers[i];
+    if (az_failed(az_http_response_get_next_header(&out_index->_internal.response, header)))
+    {
+      // Like a scan of the headers, stop at the first one that can't be parsed.
+      out_index->_internal.response._internal.parser.next_kind = _az_HTTP_RESPONSE_KIND_BODY;
+      break;
+    }
+
+    out_index->_internal.name_hashes[i] = _az_http_response_header_name_hash(header->key);
+    out_index->_internal.headers_length++;
+  }
+
+  return AZ_OK;
+}
+
+AZ_NODISCARD az_result _az_http_response_header_index_find(
+    _az_http_response_header_index const* index,
+    az_span name,
+    az_span* out_value)
+{
+  _az_PRECONDITION_NOT_NULL(index);
+  _az_PRECONDITION_NOT_NULL(out_value);
+
+  uint32_t const name_hash = _az_http_response_header_name_hash(name);
+  for (int32_t i = 0; i < index->_internal.headers_length; i++)
+  {
+    if (index->_internal.name_hashes[i] == name_hash
+        && az_span_is_content_equal_ignoring_case(index->_internal.headers[i].key, name))
+    {
+      *out_value = index->_internal.headers[i].value;
+      return AZ_OK;
+    }
+  }
+
+  // The response has more headers than the index holds, so look through the rest of them.
+  az_http_response rest = index->_internal.response;
+  az_pair header = { 0 };
+  while (az_succeeded(az_http_response_get_next_header(&rest, &header)))
+  {
+    if (az_span_is_content_equal_ignoring_case(header.key, name))
+    {
+      *out_value = header.value;
+      return AZ_OK;
+    }
+  }
+
+  return AZ_ERROR_ITEM_NOT_FOUND;
 }
 
 // internal function to get az_http_response remainder
@@ -297,10 +406,9 @@ static az_span _az_http_response_get_remaining(az_http_response const* response)
   return az_span_slice_to_end(response->_internal.http_response, response->_internal.written);
 }
 
-AZ_NODISCARD az_result az_http_response_append(az_http_response* ref_response, az_span source)
+static AZ_NODISCARD az_result
+_az_http_response_write(az_http_response* ref_response, az_span source)
 {
-  _az_PRECONDITION_NOT_NULL(ref_response);
-
   az_span remaining = _az_http_response_get_remaining(ref_response);
   int32_t write_size = az_span_size(source);
   AZ_RETURN_IF_NOT_ENOUGH_SIZE(remaining, write_size);
@@ -310,3 +418,77 @@ AZ_NODISCARD az_result az_http_response_append(az_http_response* ref_response, a
 
   return AZ_OK;
 }
+
+enum
+{
+  // The size of the CRLF ending the last header, followed by the blank line ending the headers.
+  _az_HTTP_RESPONSE_END_OF_HEADERS_SIZE = 4,
+};
+
+// Returns how many bytes of source are left of the headers, up to and including the blank line
+// ending them, and updates how much of that blank line has been matched.
+static int32_t _az_http_response_scan_end_of_headers(az_span source, int32_t* ref_matched)
+{
+  static uint8_t const end_of_headers[_az_HTTP_RESPONSE_END_OF_HEADERS_SIZE]
+      = { '\r', '\n', '\r', '\n' };
+
+  uint8_t const* const source_ptr = az_span_ptr(source);
+  int32_t const source_size = az_span_size(source);
+
+  int32_t matched = *ref_matched;
+  int32_t i = 0;
+  while (i < source_size && matched < _az_HTTP_RESPONSE_END_OF_HEADERS_SIZE)
+  {
+    uint8_t const c = source_ptr[i];
+    i++;
+
+    // A mismatch can only restart the match at a '\r'.
+    matched = c == end_of_headers[matched] ? matched + 1 : (c == '\r' ? 1 : 0);
+  }
+
+  *ref_matched = matched;
+  return i;
+}
+
+static AZ_NODISCARD bool _az_http_response_is_successful(az_http_response const* response)
+{
+  az_http_response response_copy = *response;
+  az_http_response_status_line status_line = { 0 };
+  return az_succeeded(az_http_response_get_status_line(&response_copy, &status_line))
+      && status_line.status_code >= AZ_HTTP_STATUS_CODE_OK
+      && status_line.status_code < AZ_HTTP_STATUS_CODE_MULTIPLE_CHOICES;
+}
+
+AZ_NODISCARD az_result az_http_response_append(az_http_response* ref_response, az_span source)
+{
+  _az_PRECONDITION_NOT_NULL(ref_response);
+
+  if (ref_response->_internal.body.callback != NULL && !ref_response->_internal.body.is_streaming
+      && ref_response->_internal.body.end_of_headers_matched
+          < _az_HTTP_RESPONSE_END_OF_HEADERS_SIZE)
+  {
+    // Keep the status line and headers in the buffer, and look at the status once all of them
+    // arrived to know where the body goes.
+    int32_t matched = ref_response->_internal.body.end_of_headers_matched;
+    int32_t const headers_size = _az_http_response_scan_end_of_headers(source, &matched);
+    AZ_RETURN_IF_FAILED(
+        _az_http_response_write(ref_response, az_span_slice(source, 0, headers_size)));
+
+    ref_response->_internal.body.end_of_headers_matched = matched;
+    if (matched == _az_HTTP_RESPONSE_END_OF_HEADERS_SIZE)
+    {
+      ref_response->_internal.body.is_streaming = _az_http_response_is_successful(ref_response);
+    }
+
+    source = az_span_slice_to_end(source, headers_size);
+  }
+
+  if (ref_response->_internal.body.is_streaming)
+  {
+    return az_span_size(source) == 0
+        ? AZ_OK
+        : ref_response->_internal.body.callback(ref_response->_internal.body.user_context, source);
+  }
+
+  return _az_http_response_write(ref_response, source);
+}
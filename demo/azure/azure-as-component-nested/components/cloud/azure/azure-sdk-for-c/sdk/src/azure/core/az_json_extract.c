@@ -0,0 +1,241 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include "az_json_private.h"
+#include <azure/core/az_json.h>
+#include <azure/core/az_precondition.h>
+#include <azure/core/internal/az_precondition_internal.h>
+
+#include <azure/core/_az_cfg.h>
+
+enum
+{
+  // The maximum number of fields, one per bit of the masks tracking them.
+  _az_JSON_EXTRACT_MAX_FIELDS = 32,
+
+  // The maximum number of properties in a field path.
+  _az_JSON_EXTRACT_MAX_DEPTH = 8,
+};
+
+// Returns the property name at the given depth of a '/' separated path, or AZ_SPAN_NULL if the path
+// isn't that deep.
+AZ_NODISCARD static az_span _az_json_extract_path_segment(
+    az_span path,
+    int32_t depth,
+    bool* out_is_last)
+{
+  uint8_t const* const path_ptr = az_span_ptr(path);
+  int32_t const path_size = az_span_size(path);
+
+  int32_t start = 0;
+  for (int32_t i = 0; i < path_size && depth > 0; i++)
+  {
+    if (path_ptr[i] == '/')
+    {
+      depth--;
+      start = i + 1;
+    }
+  }
+
+  if (depth > 0)
+  {
+    return AZ_SPAN_NULL;
+  }
+
+  int32_t end = start;
+  while (end < path_size && path_ptr[end] != '/')
+  {
+    end++;
+  }
+
+  *out_is_last = end == path_size;
+  return az_span_slice(path, start, end);
+}
+
+#ifndef AZ_NO_PRECONDITION_CHECKING
+AZ_NODISCARD static bool _az_json_extract_is_valid_field(az_json_extract_field const* field)
+{
+  int32_t depth = 1;
+  uint8_t const* const path_ptr = az_span_ptr(field->path);
+  for (int32_t i = 0; i < az_span_size(field->path); i++)
+  {
+    if (path_ptr[i] == '/')
+    {
+      depth++;
+    }
+  }
+
+  if (az_span_size(field->path) < 1 || depth > _az_JSON_EXTRACT_MAX_DEPTH)
+  {
+    return false;
+  }
+
+  switch (field->kind)
+  {
+    case AZ_JSON_EXTRACT_BOOLEAN:
+      return field->size == (int32_t)sizeof(bool);
+    case AZ_JSON_EXTRACT_INT32:
+    case AZ_JSON_EXTRACT_UINT32:
+      return field->size == (int32_t)sizeof(int32_t);
+    case AZ_JSON_EXTRACT_INT64:
+    case AZ_JSON_EXTRACT_UINT64:
+      return field->size == (int32_t)sizeof(int64_t);
+    case AZ_JSON_EXTRACT_DOUBLE:
+      return field->size == (int32_t)sizeof(double);
+    case AZ_JSON_EXTRACT_STRING:
+      return field->size > 0;
+    case AZ_JSON_EXTRACT_TOKEN:
+      return field->size == (int32_t)sizeof(az_json_token);
+    default:
+      return false;
+  }
+}
+#endif // AZ_NO_PRECONDITION_CHECKING
+
+AZ_NODISCARD static az_result _az_json_extract_value(
+    az_json_token const* json_token,
+    az_json_extract_field const* field,
+    void* destination)
+{
+  void* const slot = (uint8_t*)destination + field->offset;
+
+  switch (field->kind)
+  {
+    case AZ_JSON_EXTRACT_BOOLEAN:
+      return az_json_token_get_boolean(json_token, (bool*)slot);
+    case AZ_JSON_EXTRACT_INT32:
+      return az_json_token_get_int32(json_token, (int32_t*)slot);
+    case AZ_JSON_EXTRACT_INT64:
+      return az_json_token_get_int64(json_token, (int64_t*)slot);
+    case AZ_JSON_EXTRACT_UINT32:
+      return az_json_token_get_uint32(json_token, (uint32_t*)slot);
+    case AZ_JSON_EXTRACT_UINT64:
+      return az_json_token_get_uint64(json_token, (uint64_t*)slot);
+    case AZ_JSON_EXTRACT_DOUBLE:
+      return az_json_token_get_double(json_token, (double*)slot);
+    case AZ_JSON_EXTRACT_STRING:
+      return az_json_token_get_string(json_token, (char*)slot, field->size, NULL);
+    case AZ_JSON_EXTRACT_TOKEN:
+      *(az_json_token*)slot = *json_token;
+      return AZ_OK;
+    default:
+      return AZ_ERROR_ARG;
+  }
+}
+
+// The reader reports running out of data as being done, even within an object, which for the
+// extractor means the JSON object is incomplete.
+AZ_NODISCARD AZ_INLINE az_result _az_json_extract_reader_result(az_result result)
+{
+  return result == AZ_ERROR_JSON_READER_DONE ? AZ_ERROR_EOF : result;
+}
+
+AZ_NODISCARD az_result az_json_extract(
+    az_span json_buffer,
+    az_json_extract_field const* fields,
+    int32_t fields_count,
+    void* destination,
+    uint32_t* out_found_fields)
+{
+  _az_PRECONDITION_NOT_NULL(fields);
+  _az_PRECONDITION_RANGE(1, fields_count, _az_JSON_EXTRACT_MAX_FIELDS);
+  _az_PRECONDITION_NOT_NULL(destination);
+  _az_PRECONDITION_NOT_NULL(out_found_fields);
+#ifndef AZ_NO_PRECONDITION_CHECKING
+  for (int32_t i = 0; i < fields_count; i++)
+  {
+    _az_PRECONDITION(_az_json_extract_is_valid_field(&fields[i]));
+  }
+#endif // AZ_NO_PRECONDITION_CHECKING
+
+  // For each level of nested objects being read, the fields whose path leads through all the
+  // enclosing property names, and so are still candidates for the properties at that level.
+  uint32_t candidates[_az_JSON_EXTRACT_MAX_DEPTH];
+  int32_t depth = 0;
+  uint32_t found = 0;
+
+  candidates[0] = fields_count == _az_JSON_EXTRACT_MAX_FIELDS ? UINT32_MAX
+                                                              : (UINT32_C(1) << fields_count) - 1;
+
+  az_json_reader json_reader = { 0 };
+  AZ_RETURN_IF_FAILED(az_json_reader_init(&json_reader, json_buffer, NULL));
+  AZ_RETURN_IF_FAILED(az_json_reader_next_token(&json_reader));
+  if (json_reader.token.kind != AZ_JSON_TOKEN_BEGIN_OBJECT)
+  {
+    return AZ_ERROR_UNEXPECTED_CHAR;
+  }
+
+  while (true)
+  {
+    AZ_RETURN_IF_FAILED(_az_json_extract_reader_result(az_json_reader_next_token(&json_reader)));
+
+    if (json_reader.token.kind == AZ_JSON_TOKEN_END_OBJECT)
+    {
+      if (depth == 0)
+      {
+        break;
+      }
+      depth--;
+      continue;
+    }
+
+    // Within an object, so this is a property name. Split the candidates matching it into the
+    // fields whose value this is, and those which lead further into it.
+    uint32_t leaves = 0;
+    uint32_t parents = 0;
+    for (int32_t i = 0; i < fields_count; i++)
+    {
+      uint32_t const field_bit = UINT32_C(1) << i;
+      if ((candidates[depth] & field_bit) == 0)
+      {
+        continue;
+      }
+
+      bool is_last = false;
+      az_span const segment = _az_json_extract_path_segment(fields[i].path, depth, &is_last);
+      if (az_json_token_is_text_equal(&json_reader.token, segment))
+      {
+        if (is_last)
+        {
+          leaves |= field_bit;
+        }
+        else
+        {
+          parents |= field_bit;
+        }
+      }
+    }
+
+    // Move to the property value.
+    AZ_RETURN_IF_FAILED(_az_json_extract_reader_result(az_json_reader_next_token(&json_reader)));
+
+    for (int32_t i = 0; leaves != 0 && i < fields_count; i++)
+    {
+      uint32_t const field_bit = UINT32_C(1) << i;
+      if ((leaves & field_bit) == 0
+          || (json_reader.token.kind == AZ_JSON_TOKEN_NULL
+              && fields[i].kind != AZ_JSON_EXTRACT_TOKEN))
+      {
+        continue;
+      }
+
+      AZ_RETURN_IF_FAILED(_az_json_extract_value(&json_reader.token, &fields[i], destination));
+      found |= field_bit;
+    }
+
+    if (parents != 0 && json_reader.token.kind == AZ_JSON_TOKEN_BEGIN_OBJECT
+        && depth + 1 < _az_JSON_EXTRACT_MAX_DEPTH)
+    {
+      depth++;
+      candidates[depth] = parents;
+    }
+    else
+    {
+      AZ_RETURN_IF_FAILED(
+          _az_json_extract_reader_result(az_json_reader_skip_children(&json_reader)));
+    }
+  }
+
+  *out_found_fields = found;
+  return AZ_OK;
+}
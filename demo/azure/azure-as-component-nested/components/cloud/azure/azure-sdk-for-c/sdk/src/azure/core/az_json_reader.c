@@ -7,6 +7,7 @@
 #include <azure/core/az_precondition.h>
 
 #include <ctype.h>
+#include <string.h>
 
 #include <azure/core/_az_cfg.h>
 
@@ -32,6 +33,44 @@ AZ_NODISCARD az_result az_json_reader_init(
       .is_complex_json = false,
       .bit_stack = { 0 },
       .options = options == NULL ? az_json_reader_options_default() : *options,
+      .json_buffers = NULL,
+      .number_of_buffers = 1,
+      .buffer_index = 0,
+      .token_buffer = AZ_SPAN_NULL,
+    },
+  };
+  return AZ_OK;
+}
+
+AZ_NODISCARD az_result az_json_reader_chunked_init(
+    az_json_reader* json_reader,
+    az_span json_buffers[],
+    int32_t number_of_buffers,
+    az_span token_buffer,
+    az_json_reader_options const* options)
+{
+  _az_PRECONDITION_NOT_NULL(json_reader);
+  _az_PRECONDITION_NOT_NULL(json_buffers);
+  _az_PRECONDITION(number_of_buffers >= 1);
+
+  *json_reader = (az_json_reader){
+    .token = (az_json_token){
+      .kind = AZ_JSON_TOKEN_NONE,
+      .slice = AZ_SPAN_NULL,
+      ._internal = {
+        .string_has_escaped_chars = false,
+      },
+    },
+    ._internal = {
+      .json_buffer = json_buffers[0],
+      .bytes_consumed = 0,
+      .is_complex_json = false,
+      .bit_stack = { 0 },
+      .options = options == NULL ? az_json_reader_options_default() : *options,
+      .json_buffers = json_buffers,
+      .number_of_buffers = number_of_buffers,
+      .buffer_index = 0,
+      .token_buffer = token_buffer,
     },
   };
   return AZ_OK;
@@ -56,13 +95,129 @@ static void _az_json_reader_update_state(
   json_reader->_internal.bytes_consumed += consumed;
 }
 
-AZ_NODISCARD static az_span _az_json_reader_skip_whitespace(az_json_reader* json_reader)
+// The scanners below examine eight bytes at a time, using the classic "has zero byte" bit trick:
+// (x - 0x01..01) & ~x & 0x80..80 is non-zero if and only if some byte of x is zero. They only ask
+// whether a word contains a byte of interest and then let the byte loop locate it, so the result
+// does not depend on the byte order of the platform.
+#define _az_JSON_WORD_ONES 0x0101010101010101ULL
+#define _az_JSON_WORD_HIGH_BITS 0x8080808080808080ULL
+#define _az_JSON_WORD_REPEAT(c) (_az_JSON_WORD_ONES * (uint8_t)(c))
+
+AZ_NODISCARD AZ_INLINE uint64_t _az_json_word_load(uint8_t const* ptr)
+{
+  uint64_t word;
+  memcpy(&word, ptr, sizeof(word));
+  return word;
+}
+
+AZ_NODISCARD AZ_INLINE bool _az_json_word_has_byte(uint64_t word, uint8_t c)
+{
+  uint64_t const x = word ^ _az_JSON_WORD_REPEAT(c);
+  return ((x - _az_JSON_WORD_ONES) & ~x & _az_JSON_WORD_HIGH_BITS) != 0;
+}
+
+AZ_NODISCARD AZ_INLINE bool _az_json_word_has_control_char(uint64_t word)
+{
+  // Detects any byte less than 0x20, i.e. a control character that must be escaped in a string.
+  return ((word - _az_JSON_WORD_REPEAT(0x20)) & ~word & _az_JSON_WORD_HIGH_BITS) != 0;
+}
+
+AZ_NODISCARD AZ_INLINE bool _az_json_is_white_space(uint8_t c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Returns the number of leading bytes that can be copied verbatim into a JSON string token, i.e.
+// bytes which are neither '"', '\\' nor a control character.
+AZ_NODISCARD static int32_t _az_json_reader_scan_string_run(uint8_t const* ptr, int32_t size)
+{
+  int32_t index = 0;
+
+  for (; size - index >= (int32_t)sizeof(uint64_t); index += (int32_t)sizeof(uint64_t))
+  {
+    uint64_t const word = _az_json_word_load(ptr + index);
+    if (_az_json_word_has_byte(word, '"') || _az_json_word_has_byte(word, '\\')
+        || _az_json_word_has_control_char(word))
+    {
+      break;
+    }
+  }
+
+  for (; index < size; index++)
+  {
+    uint8_t const next_byte = ptr[index];
+    if (next_byte == '"' || next_byte == '\\' || next_byte < 0x20)
+    {
+      break;
+    }
+  }
+
+  return index;
+}
+
+AZ_NODISCARD AZ_INLINE bool _az_json_reader_is_last_buffer(az_json_reader const* json_reader)
+{
+  return json_reader->_internal.buffer_index + 1 >= json_reader->_internal.number_of_buffers;
+}
+
+static void _az_json_reader_move_to_next_buffer(az_json_reader* json_reader)
+{
+  json_reader->_internal.buffer_index++;
+  json_reader->_internal.json_buffer
+      = json_reader->_internal.json_buffers[json_reader->_internal.buffer_index];
+  json_reader->_internal.bytes_consumed = 0;
+}
+
+// Moves the reader forward by count bytes, into the following buffers if need be.
+static void _az_json_reader_advance(az_json_reader* json_reader, int32_t count)
+{
+  while (count > az_span_size(json_reader->_internal.json_buffer)
+             - json_reader->_internal.bytes_consumed)
+  {
+    count -= az_span_size(json_reader->_internal.json_buffer)
+        - json_reader->_internal.bytes_consumed;
+    _az_json_reader_move_to_next_buffer(json_reader);
+  }
+  json_reader->_internal.bytes_consumed += count;
+}
+
+AZ_NODISCARD static az_span _az_json_reader_skip_whitespace_in_buffer(az_json_reader* json_reader)
 {
   az_span remaining = _get_remaining_json(json_reader);
-  az_span json = _az_span_trim_white_space_from_start(remaining);
+  uint8_t const* const remaining_ptr = az_span_ptr(remaining);
+  int32_t const remaining_size = az_span_size(remaining);
+  int32_t index = 0;
+
+  // Indentation in pretty-printed documents comes in long runs of spaces, skip those a word at a
+  // time before falling back to checking each byte.
+  for (; remaining_size - index >= (int32_t)sizeof(uint64_t); index += (int32_t)sizeof(uint64_t))
+  {
+    if (_az_json_word_load(remaining_ptr + index) != _az_JSON_WORD_REPEAT(' '))
+    {
+      break;
+    }
+  }
+
+  while (index < remaining_size && _az_json_is_white_space(remaining_ptr[index]))
+  {
+    index++;
+  }
+
+  json_reader->_internal.bytes_consumed += index;
 
-  // Find out how many whitespace characters were trimmed.
-  json_reader->_internal.bytes_consumed += az_span_size(remaining) - az_span_size(json);
+  return az_span_slice_to_end(remaining, index);
+}
+
+AZ_NODISCARD static az_span _az_json_reader_skip_whitespace(az_json_reader* json_reader)
+{
+  az_span json = _az_json_reader_skip_whitespace_in_buffer(json_reader);
+
+  // Whitespace, or nothing at all, may continue into the following buffers.
+  while (az_span_size(json) < 1 && !_az_json_reader_is_last_buffer(json_reader))
+  {
+    _az_json_reader_move_to_next_buffer(json_reader);
+    json = _az_json_reader_skip_whitespace_in_buffer(json_reader);
+  }
 
   return json;
 }
@@ -147,6 +302,12 @@ AZ_NODISCARD static az_result _az_json_reader_process_string(az_json_reader* jso
   uint8_t* const token_ptr = az_span_ptr(token);
   int32_t const remaining_size = az_span_size(token);
 
+  // The opening '"' was the last byte of the JSON text.
+  if (remaining_size < 1)
+  {
+    return AZ_ERROR_EOF;
+  }
+
   int32_t string_length = 0;
   uint8_t next_byte = token_ptr[0];
 
@@ -201,6 +362,11 @@ AZ_NODISCARD static az_result _az_json_reader_process_string(az_json_reader* jso
       {
         return AZ_ERROR_UNEXPECTED_CHAR;
       }
+
+      // Skip over the rest of the plain characters that follow, up to the next byte that needs
+      // special handling, without going through this loop for each one.
+      string_length += _az_json_reader_scan_string_run(
+          token_ptr + string_length + 1, remaining_size - string_length - 1);
     }
 
     string_length++;
@@ -218,32 +384,6 @@ AZ_NODISCARD static az_result _az_json_reader_process_string(az_json_reader* jso
   return AZ_OK;
 }
 
-AZ_NODISCARD static az_result _az_json_reader_process_property_name(az_json_reader* json_reader)
-{
-  AZ_RETURN_IF_FAILED(_az_json_reader_process_string(json_reader));
-
-  az_span json = _az_json_reader_skip_whitespace(json_reader);
-
-  // Expected a colon to indicate that a value will follow after the property name, but instead
-  // either reached end of data or some other character, which is invalid.
-  if (az_span_size(json) < 1)
-  {
-    return AZ_ERROR_EOF;
-  }
-  if (az_span_ptr(json)[0] != ':')
-  {
-    return AZ_ERROR_UNEXPECTED_CHAR;
-  }
-
-  // We don't need to set the json_reader->token.slice since that was already done
-  // in _az_json_reader_process_string when processing the string portion of the property name.
-  // Therefore, we don't call _az_json_reader_update_state here.
-  json_reader->token.kind = AZ_JSON_TOKEN_PROPERTY_NAME;
-  json_reader->_internal.bytes_consumed += 1; // For the name / value separator
-
-  return AZ_OK;
-}
-
 // Used to search for possible valid end of a number character, when we have complex JSON payloads
 // (i.e. not a single JSON value).
 // Whitespace characters, comma, or a container end character indicate the end of a JSON number.
@@ -330,7 +470,10 @@ AZ_NODISCARD static az_result _az_validate_next_byte_is_digit(az_span remaining_
   return AZ_OK;
 }
 
-AZ_NODISCARD static az_result _az_json_reader_process_number(az_json_reader* json_reader)
+AZ_NODISCARD static az_result _az_json_reader_scan_number(
+    az_json_reader* json_reader,
+    int32_t* out_fraction_index,
+    int32_t* out_exponent_index)
 {
   az_span token = _get_remaining_json(json_reader);
 
@@ -412,6 +555,7 @@ AZ_NODISCARD static az_result _az_json_reader_process_number(az_json_reader* jso
 
   if (next_byte == '.')
   {
+    *out_fraction_index = consumed_count;
     consumed_count++;
 
     // A decimal point must be followed by at least one digit.
@@ -447,6 +591,7 @@ AZ_NODISCARD static az_result _az_json_reader_process_number(az_json_reader* jso
   }
 
   // Move past 'e'/'E'
+  *out_exponent_index = consumed_count;
   consumed_count++;
 
   // The 'e'/'E' character must be followed by a sign or at least one digit.
@@ -491,6 +636,19 @@ AZ_NODISCARD static az_result _az_json_reader_process_number(az_json_reader* jso
   return AZ_OK;
 }
 
+AZ_NODISCARD static az_result _az_json_reader_process_number(az_json_reader* json_reader)
+{
+  int32_t fraction_index = 0;
+  int32_t exponent_index = 0;
+  AZ_RETURN_IF_FAILED(_az_json_reader_scan_number(json_reader, &fraction_index, &exponent_index));
+
+  // Remember the structure of the number, so that the token getters don't need to scan it again.
+  json_reader->token._internal.number_fraction_index = fraction_index;
+  json_reader->token._internal.number_exponent_index = exponent_index;
+
+  return AZ_OK;
+}
+
 AZ_NODISCARD static az_result _az_json_reader_process_literal(
     az_json_reader* json_reader,
     az_span literal,
@@ -516,12 +674,154 @@ AZ_NODISCARD static az_result _az_json_reader_process_literal(
   return AZ_ERROR_UNEXPECTED_CHAR;
 }
 
+AZ_NODISCARD static az_result _az_json_reader_process_scalar(
+    az_json_reader* json_reader,
+    az_json_token_kind token_kind)
+{
+  switch (token_kind)
+  {
+    case AZ_JSON_TOKEN_STRING:
+      return _az_json_reader_process_string(json_reader);
+    case AZ_JSON_TOKEN_NUMBER:
+      return _az_json_reader_process_number(json_reader);
+    case AZ_JSON_TOKEN_TRUE:
+      return _az_json_reader_process_literal(json_reader, AZ_SPAN_FROM_STR("true"), token_kind);
+    case AZ_JSON_TOKEN_FALSE:
+      return _az_json_reader_process_literal(json_reader, AZ_SPAN_FROM_STR("false"), token_kind);
+    case AZ_JSON_TOKEN_NULL:
+      return _az_json_reader_process_literal(json_reader, AZ_SPAN_FROM_STR("null"), token_kind);
+    default:
+      return AZ_ERROR_JSON_INVALID_STATE;
+  }
+}
+
+// Copies as much of the JSON text left to read as fits into the token buffer, without moving the
+// reader. Sets out_has_more_json if some of it didn't fit.
+AZ_NODISCARD static az_span _az_json_reader_copy_to_token_buffer(
+    az_json_reader const* json_reader,
+    bool* out_has_more_json)
+{
+  az_span remaining_buffer = json_reader->_internal.token_buffer;
+  az_span source = az_span_slice_to_end(
+      json_reader->_internal.json_buffer, json_reader->_internal.bytes_consumed);
+  int32_t buffer_index = json_reader->_internal.buffer_index;
+
+  *out_has_more_json = false;
+  while (true)
+  {
+    int32_t const source_size = az_span_size(source);
+    int32_t const copy_size = source_size < az_span_size(remaining_buffer)
+        ? source_size
+        : az_span_size(remaining_buffer);
+    if (copy_size > 0)
+    {
+      remaining_buffer = az_span_copy(remaining_buffer, az_span_slice(source, 0, copy_size));
+    }
+
+    if (copy_size < source_size)
+    {
+      *out_has_more_json = true;
+      break;
+    }
+
+    buffer_index++;
+    if (buffer_index >= json_reader->_internal.number_of_buffers)
+    {
+      break;
+    }
+    source = json_reader->_internal.json_buffers[buffer_index];
+  }
+
+  return az_span_slice(
+      json_reader->_internal.token_buffer,
+      0,
+      az_span_size(json_reader->_internal.token_buffer) - az_span_size(remaining_buffer));
+}
+
+// Reads a string, number or literal token. When the JSON text is split across buffers and the token
+// may continue into the next one, it is copied into the token buffer and read from there instead.
+AZ_NODISCARD static az_result _az_json_reader_process_scalar_chunked(
+    az_json_reader* json_reader,
+    az_json_token_kind token_kind)
+{
+  if (_az_json_reader_is_last_buffer(json_reader))
+  {
+    return _az_json_reader_process_scalar(json_reader, token_kind);
+  }
+
+  az_span const json_buffer = json_reader->_internal.json_buffer;
+  int32_t const bytes_consumed = json_reader->_internal.bytes_consumed;
+  bool const is_complex_json = json_reader->_internal.is_complex_json;
+
+  // Try reading the token in place first. Running out of data means it continues into the next
+  // buffer, even for a number that could otherwise be a complete single JSON value.
+  json_reader->_internal.is_complex_json = true;
+  az_result result = _az_json_reader_process_scalar(json_reader, token_kind);
+  json_reader->_internal.is_complex_json = is_complex_json;
+  if (result != AZ_ERROR_EOF)
+  {
+    return result;
+  }
+
+  // Start over from the beginning of the token, which the failed attempt may have moved past.
+  json_reader->_internal.bytes_consumed = bytes_consumed;
+
+  bool has_more_json = false;
+  json_reader->_internal.json_buffer
+      = _az_json_reader_copy_to_token_buffer(json_reader, &has_more_json);
+  json_reader->_internal.bytes_consumed = 0;
+  json_reader->_internal.is_complex_json = is_complex_json || has_more_json;
+
+  result = _az_json_reader_process_scalar(json_reader, token_kind);
+
+  int32_t const token_bytes_consumed = json_reader->_internal.bytes_consumed;
+  json_reader->_internal.json_buffer = json_buffer;
+  json_reader->_internal.bytes_consumed = bytes_consumed;
+  json_reader->_internal.is_complex_json = is_complex_json;
+
+  if (result == AZ_ERROR_EOF && has_more_json)
+  {
+    // The token didn't fit in the token buffer.
+    return AZ_ERROR_INSUFFICIENT_SPAN_SIZE;
+  }
+  AZ_RETURN_IF_FAILED(result);
+
+  _az_json_reader_advance(json_reader, token_bytes_consumed);
+  return AZ_OK;
+}
+
+AZ_NODISCARD static az_result _az_json_reader_process_property_name(az_json_reader* json_reader)
+{
+  AZ_RETURN_IF_FAILED(_az_json_reader_process_scalar_chunked(json_reader, AZ_JSON_TOKEN_STRING));
+
+  az_span json = _az_json_reader_skip_whitespace(json_reader);
+
+  // Expected a colon to indicate that a value will follow after the property name, but instead
+  // either reached end of data or some other character, which is invalid.
+  if (az_span_size(json) < 1)
+  {
+    return AZ_ERROR_EOF;
+  }
+  if (az_span_ptr(json)[0] != ':')
+  {
+    return AZ_ERROR_UNEXPECTED_CHAR;
+  }
+
+  // We don't need to set the json_reader->token.slice since that was already done
+  // in _az_json_reader_process_string when processing the string portion of the property name.
+  // Therefore, we don't call _az_json_reader_update_state here.
+  json_reader->token.kind = AZ_JSON_TOKEN_PROPERTY_NAME;
+  json_reader->_internal.bytes_consumed += 1; // For the name / value separator
+
+  return AZ_OK;
+}
+
 AZ_NODISCARD static az_result _az_json_reader_process_value(
     az_json_reader* json_reader,
     uint8_t const next_byte)
 {
   if (next_byte == '"')
-    return _az_json_reader_process_string(json_reader);
+    return _az_json_reader_process_scalar_chunked(json_reader, AZ_JSON_TOKEN_STRING);
   else if (next_byte == '{')
     return _az_json_reader_process_container_start(
         json_reader, AZ_JSON_TOKEN_BEGIN_OBJECT, _az_JSON_STACK_OBJECT);
@@ -529,16 +829,13 @@ AZ_NODISCARD static az_result _az_json_reader_process_value(
     return _az_json_reader_process_container_start(
         json_reader, AZ_JSON_TOKEN_BEGIN_ARRAY, _az_JSON_STACK_ARRAY);
   else if (isdigit(next_byte) || next_byte == '-')
-    return _az_json_reader_process_number(json_reader);
+    return _az_json_reader_process_scalar_chunked(json_reader, AZ_JSON_TOKEN_NUMBER);
   else if (next_byte == 'f')
-    return _az_json_reader_process_literal(
-        json_reader, AZ_SPAN_FROM_STR("false"), AZ_JSON_TOKEN_FALSE);
+    return _az_json_reader_process_scalar_chunked(json_reader, AZ_JSON_TOKEN_FALSE);
   else if (next_byte == 't')
-    return _az_json_reader_process_literal(
-        json_reader, AZ_SPAN_FROM_STR("true"), AZ_JSON_TOKEN_TRUE);
+    return _az_json_reader_process_scalar_chunked(json_reader, AZ_JSON_TOKEN_TRUE);
   else if (next_byte == 'n')
-    return _az_json_reader_process_literal(
-        json_reader, AZ_SPAN_FROM_STR("null"), AZ_JSON_TOKEN_NULL);
+    return _az_json_reader_process_scalar_chunked(json_reader, AZ_JSON_TOKEN_NULL);
   else
     return AZ_ERROR_UNEXPECTED_CHAR;
 }
@@ -638,7 +935,8 @@ AZ_NODISCARD az_result az_json_reader_next_token(az_json_reader* json_reader)
     return AZ_ERROR_JSON_READER_DONE;
   }
 
-  uint8_t const first_byte = az_span_ptr(json)[0];
+  // The last buffer of a chunked JSON payload may be empty, and so have no valid pointer.
+  uint8_t const first_byte = az_span_size(json) < 1 ? 0 : az_span_ptr(json)[0];
 
   switch (json_reader->token.kind)
   {
@@ -209,6 +209,16 @@ AZ_NODISCARD az_result az_json_token_get_string(
   return AZ_OK;
 }
 
+// A number token with a fraction or an exponent part can't be converted to an integer, so reject it
+// up front without handing it to the az_span conversion functions. This relies on az_json_reader
+// having set the indices while it read the number. For a token made any other way they are 0, and
+// it is az_span_atoi* and az_span_atou*, which reject '.' and 'e' themselves, that decide.
+AZ_NODISCARD AZ_INLINE bool _az_json_token_is_integer(az_json_token const* json_token)
+{
+  return json_token->_internal.number_fraction_index == 0
+      && json_token->_internal.number_exponent_index == 0;
+}
+
 AZ_NODISCARD az_result
 az_json_token_get_uint64(az_json_token const* json_token, uint64_t* out_value)
 {
@@ -220,6 +230,11 @@ az_json_token_get_uint64(az_json_token const* json_token, uint64_t* out_value)
     return AZ_ERROR_JSON_INVALID_STATE;
   }
 
+  if (!_az_json_token_is_integer(json_token))
+  {
+    return AZ_ERROR_UNEXPECTED_CHAR;
+  }
+
   return az_span_atou64(json_token->slice, out_value);
 }
 
@@ -234,6 +249,11 @@ az_json_token_get_uint32(az_json_token const* json_token, uint32_t* out_value)
     return AZ_ERROR_JSON_INVALID_STATE;
   }
 
+  if (!_az_json_token_is_integer(json_token))
+  {
+    return AZ_ERROR_UNEXPECTED_CHAR;
+  }
+
   return az_span_atou32(json_token->slice, out_value);
 }
 
@@ -247,6 +267,11 @@ AZ_NODISCARD az_result az_json_token_get_int64(az_json_token const* json_token,
     return AZ_ERROR_JSON_INVALID_STATE;
   }
 
+  if (!_az_json_token_is_integer(json_token))
+  {
+    return AZ_ERROR_UNEXPECTED_CHAR;
+  }
+
   return az_span_atoi64(json_token->slice, out_value);
 }
 
@@ -260,6 +285,11 @@ AZ_NODISCARD az_result az_json_token_get_int32(az_json_token const* json_token,
     return AZ_ERROR_JSON_INVALID_STATE;
   }
 
+  if (!_az_json_token_is_integer(json_token))
+  {
+    return AZ_ERROR_UNEXPECTED_CHAR;
+  }
+
   return az_span_atoi32(json_token->slice, out_value);
 }
 
@@ -33,13 +33,14 @@ void _az_spinlock_enter_writer(_az_spinlock* lock)
       return;
     }
 
-    // Otherwise, if no writer is waiting, try to set that a writer is waiting
-    // If we fail, we'll spin around and try again
+    // Otherwise, if no writer is waiting, try to set that a writer is waiting, which keeps new
+    // readers out. Either way, spin around until the lock is free: the writer only holds the lock
+    // once it has set the writer bit above.
     if ((state & _az_SPINLOCK_WRITER_WAITING_BIT) == 0
         && az_platform_atomic_compare_exchange(
             &lock->_internal.state, state, state | _az_SPINLOCK_WRITER_WAITING_BIT))
     {
-      return;
+      continue;
     }
   }
 }
@@ -1,10 +1,13 @@
 // Copyright (c) Microsoft Corporation. All rights reserved.
 // SPDX-License-Identifier: MIT
 
+#include "az_curl_private.h"
 #include <azure/core/az_http.h>
 #include <azure/core/az_http_transport.h>
 #include <azure/core/az_span.h>
+#include <azure/core/internal/az_spinlock_internal.h>
 
+#include <stdbool.h>
 #include <stdlib.h>
 
 #include <curl/curl.h>
@@ -72,22 +75,103 @@ static AZ_NODISCARD az_result _az_http_client_curl_code_to_result(CURLcode code)
 // returning AZ error on CURL Error
 #define AZ_RETURN_IF_CURL_FAILED(exp) AZ_RETURN_IF_FAILED(_az_http_client_curl_code_to_result(exp))
 
-AZ_NODISCARD AZ_INLINE az_result _az_http_client_curl_init(CURL** out)
+#if AZ_CURL_HANDLE_POOL_SIZE > 0
+// Idle handles, the most recently used last so that it, being the most likely to still have a live
+// connection, is reused first. Which host that connection is to isn't taken into account.
+static CURL* _az_http_client_curl_pool[AZ_CURL_HANDLE_POOL_SIZE];
+static int32_t _az_http_client_curl_pool_count = 0;
+static _az_spinlock _az_http_client_curl_pool_lock = { 0 };
+#endif // AZ_CURL_HANDLE_POOL_SIZE > 0
+
+AZ_NODISCARD az_result _az_http_client_curl_init(CURL** out)
 {
-  *out = curl_easy_init();
-  return AZ_OK;
+  *out = NULL;
+
+#if AZ_CURL_HANDLE_POOL_SIZE > 0
+  _az_spinlock_enter_writer(&_az_http_client_curl_pool_lock);
+  if (_az_http_client_curl_pool_count > 0)
+  {
+    _az_http_client_curl_pool_count--;
+    *out = _az_http_client_curl_pool[_az_http_client_curl_pool_count];
+  }
+  _az_spinlock_exit_writer(&_az_http_client_curl_pool_lock);
+#endif // AZ_CURL_HANDLE_POOL_SIZE > 0
+
+  if (*out == NULL)
+  {
+    *out = curl_easy_init();
+  }
+
+  return *out == NULL ? AZ_ERROR_OUT_OF_MEMORY : AZ_OK;
 }
 
-AZ_NODISCARD AZ_INLINE az_result _az_http_client_curl_done(CURL** pp)
+AZ_NODISCARD az_result _az_http_client_curl_done(CURL** pp, bool reuse)
 {
   _az_PRECONDITION_NOT_NULL(pp);
   _az_PRECONDITION_NOT_NULL(*pp);
 
-  curl_easy_cleanup(*pp);
-  *pp = NULL;
+#if AZ_CURL_HANDLE_POOL_SIZE > 0
+  if (reuse)
+  {
+    // Resetting clears the options set for the request, but keeps the connections, TLS sessions and
+    // DNS cache.
+    curl_easy_reset(*pp);
+
+    _az_spinlock_enter_writer(&_az_http_client_curl_pool_lock);
+    if (_az_http_client_curl_pool_count < AZ_CURL_HANDLE_POOL_SIZE)
+    {
+      _az_http_client_curl_pool[_az_http_client_curl_pool_count] = *pp;
+      _az_http_client_curl_pool_count++;
+      *pp = NULL;
+    }
+    _az_spinlock_exit_writer(&_az_http_client_curl_pool_lock);
+  }
+#else
+  (void)reuse;
+#endif // AZ_CURL_HANDLE_POOL_SIZE > 0
+
+  if (*pp != NULL)
+  {
+    curl_easy_cleanup(*pp);
+    *pp = NULL;
+  }
   return AZ_OK;
 }
 
+AZ_NODISCARD int32_t _az_http_client_curl_pool_count_get(void)
+{
+#if AZ_CURL_HANDLE_POOL_SIZE > 0
+  _az_spinlock_enter_reader(&_az_http_client_curl_pool_lock);
+  int32_t const count = _az_http_client_curl_pool_count;
+  _az_spinlock_exit_reader(&_az_http_client_curl_pool_lock);
+  return count;
+#else
+  return 0;
+#endif // AZ_CURL_HANDLE_POOL_SIZE > 0
+}
+
+void az_http_client_cleanup(void)
+{
+#if AZ_CURL_HANDLE_POOL_SIZE > 0
+  CURL* handles[AZ_CURL_HANDLE_POOL_SIZE];
+
+  // Empty the pool under the lock, and destroy the handles, closing their connections, after it.
+  _az_spinlock_enter_writer(&_az_http_client_curl_pool_lock);
+  int32_t const count = _az_http_client_curl_pool_count;
+  for (int32_t i = 0; i < count; i++)
+  {
+    handles[i] = _az_http_client_curl_pool[i];
+  }
+  _az_http_client_curl_pool_count = 0;
+  _az_spinlock_exit_writer(&_az_http_client_curl_pool_lock);
+
+  for (int32_t i = 0; i < count; i++)
+  {
+    curl_easy_cleanup(handles[i]);
+  }
+#endif // AZ_CURL_HANDLE_POOL_SIZE > 0
+}
+
 /**
  * @brief writes a header key and value to a buffer as a 0-terminated string and using a separator
  * span in between. Returns error as soon as any of the write operations fails
@@ -255,6 +339,16 @@ _az_http_client_curl_append_url(az_span writable_buffer, az_span url_from_reques
   return AZ_OK;
 }
 
+/**
+ * @brief Where curl writes the response, and why a write failed, which can be an error from the
+ * response body callback rather than the buffer being too small.
+ */
+typedef struct
+{
+  az_http_response* response;
+  az_result result;
+} _az_http_client_curl_write_context;
+
 /**
  * @brief This is the function that curl will use to write response into a user provider span
  * Function receives the size of the response and must return this same number, otherwise it is
@@ -263,7 +357,7 @@ _az_http_client_curl_append_url(az_span writable_buffer, az_span url_from_reques
  * @param contents response data from Curl response
  * @param size size of the curl response data
  * @param nmemb number of blocks in response
- * @param userp this represent a structure linked to response by us before
+ * @param userp the _az_http_client_curl_write_context of the request
  * @return int
  */
 static size_t _az_http_client_curl_write_to_span(
@@ -273,14 +367,16 @@ static size_t _az_http_client_curl_write_to_span(
     void* userp)
 {
   size_t const expected_size = size * nmemb;
-  az_http_response* response = (az_http_response*)userp;
+  _az_http_client_curl_write_context* write_context = (_az_http_client_curl_write_context*)userp;
 
   az_span const span_for_content = az_span_init((uint8_t*)contents, (int32_t)expected_size);
 
-  az_result write_response_result = az_http_response_append(response, span_for_content);
+  az_result write_response_result
+      = az_http_response_append(write_context->response, span_for_content);
 
   if (az_failed(write_response_result))
   {
+    write_context->result = write_response_result;
     return expected_size
         + 1; // Adding any constant to return value will tell curl that this function failed
   }
@@ -513,23 +609,24 @@ _az_http_client_curl_setup_url(CURL* ref_curl, _az_http_request const* request)
  * @brief set url the response redirection to user buffer
  *
  * @param ref_curl specific curl structure used to send http request
- * @param response an http response object which will hold all the HTTP response
+ * @param write_context where the HTTP response is written
  * @return az_result
  */
-static AZ_NODISCARD az_result
-_az_http_client_curl_setup_response_redirect(CURL* ref_curl, az_http_response* response)
+static AZ_NODISCARD az_result _az_http_client_curl_setup_response_redirect(
+    CURL* ref_curl,
+    _az_http_client_curl_write_context* write_context)
 {
   _az_PRECONDITION_NOT_NULL(ref_curl);
 
   AZ_RETURN_IF_CURL_FAILED(
       curl_easy_setopt(ref_curl, CURLOPT_HEADERFUNCTION, _az_http_client_curl_write_to_span));
 
-  AZ_RETURN_IF_CURL_FAILED(curl_easy_setopt(ref_curl, CURLOPT_HEADERDATA, (void*)response));
+  AZ_RETURN_IF_CURL_FAILED(curl_easy_setopt(ref_curl, CURLOPT_HEADERDATA, (void*)write_context));
 
   AZ_RETURN_IF_CURL_FAILED(
       curl_easy_setopt(ref_curl, CURLOPT_WRITEFUNCTION, _az_http_client_curl_write_to_span));
 
-  AZ_RETURN_IF_CURL_FAILED(curl_easy_setopt(ref_curl, CURLOPT_WRITEDATA, (void*)response));
+  AZ_RETURN_IF_CURL_FAILED(curl_easy_setopt(ref_curl, CURLOPT_WRITEDATA, (void*)write_context));
 
   return AZ_OK;
 }
@@ -559,7 +656,8 @@ static AZ_NODISCARD az_result _az_http_client_curl_send_request_impl_process(
 
   AZ_RETURN_IF_FAILED(_az_http_client_curl_setup_url(ref_curl, request));
 
-  AZ_RETURN_IF_FAILED(_az_http_client_curl_setup_response_redirect(ref_curl, ref_response));
+  _az_http_client_curl_write_context write_context = { .response = ref_response, .result = AZ_OK };
+  AZ_RETURN_IF_FAILED(_az_http_client_curl_setup_response_redirect(ref_curl, &write_context));
 
   az_http_method method;
   AZ_RETURN_IF_FAILED(az_http_request_get_method(request, &method));
@@ -592,6 +690,13 @@ static AZ_NODISCARD az_result _az_http_client_curl_send_request_impl_process(
   // Clean custom headers previously appended
   curl_slist_free_all(list);
 
+  // A write which failed makes curl fail with a generic write error, reported as the response
+  // overflowing its buffer. Report any other reason the write failed as it is.
+  if (az_failed(write_context.result) && write_context.result != AZ_ERROR_INSUFFICIENT_SPAN_SIZE)
+  {
+    result = write_context.result;
+  }
+
   return result;
 }
 
@@ -617,8 +722,9 @@ az_http_client_send_request(_az_http_request const* request, az_http_response* r
   az_result process_result
       = _az_http_client_curl_send_request_impl_process(curl, request, ref_response);
 
-  // no matter if error or not, call curl done before returning to let curl clean everything
-  AZ_RETURN_IF_FAILED(_az_http_client_curl_done(&curl));
+  // no matter if error or not, call curl done before returning to let curl clean everything. A
+  // handle which failed isn't reused, in case it was left with a broken connection.
+  AZ_RETURN_IF_FAILED(_az_http_client_curl_done(&curl, az_succeeded(process_result)));
 
   return process_result;
 }
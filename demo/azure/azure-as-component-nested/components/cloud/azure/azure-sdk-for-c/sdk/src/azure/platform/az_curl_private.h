@@ -0,0 +1,55 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef _az_CURL_PRIVATE_H
+#define _az_CURL_PRIVATE_H
+
+#include <azure/core/az_result.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <curl/curl.h>
+
+#include <azure/core/_az_cfg_prefix.h>
+
+/**
+ * The number of idle easy handles kept between requests. A handle keeps its open connections and
+ * TLS session cache when it is reset, so reusing one lets requests to a host it has already talked
+ * to skip the TCP and TLS handshakes. The pool isn't keyed by host, so the reuse is best-effort: when
+ * requests go to several hosts, a request may get a handle whose connections are to another host,
+ * and then opens a new one. Define as 0 to create and destroy a handle per request.
+ */
+#ifndef AZ_CURL_HANDLE_POOL_SIZE
+#define AZ_CURL_HANDLE_POOL_SIZE 4
+#endif
+
+/**
+ * @brief Takes the most recently used handle from the pool, or creates a new one when the pool is
+ * empty.
+ *
+ * @param[out] out The handle for the request.
+ *
+ * @return
+ *   - *`AZ_OK`* success.
+ *   - *`AZ_ERROR_OUT_OF_MEMORY`* a new handle couldn't be created.
+ */
+AZ_NODISCARD az_result _az_http_client_curl_init(CURL** out);
+
+/**
+ * @brief Returns the handle to the pool when it was used successfully and there is room for it, or
+ * destroys it otherwise.
+ *
+ * @param[in,out] pp The handle, set to _NULL_ on return.
+ * @param reuse Whether the request made with the handle succeeded.
+ */
+AZ_NODISCARD az_result _az_http_client_curl_done(CURL** pp, bool reuse);
+
+/**
+ * @brief Gets the number of idle handles in the pool.
+ */
+AZ_NODISCARD int32_t _az_http_client_curl_pool_count_get(void);
+
+#include <azure/core/_az_cfg_suffix.h>
+
+#endif // _az_CURL_PRIVATE_H
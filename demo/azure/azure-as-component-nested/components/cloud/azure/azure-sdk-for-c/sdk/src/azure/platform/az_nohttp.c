@@ -20,3 +20,10 @@ az_http_client_send_request(_az_http_request const* request, az_http_response* r
   (void)ref_response;
   return AZ_ERROR_NOT_IMPLEMENTED;
 }
+
+/**
+ * @brief Keeps nothing between requests, so has nothing to release.
+ */
+void az_http_client_cleanup(void)
+{
+}
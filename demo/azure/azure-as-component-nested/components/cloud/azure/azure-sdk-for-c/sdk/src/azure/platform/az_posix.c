@@ -12,7 +12,13 @@
 
 AZ_NODISCARD int64_t az_platform_clock_msec()
 {
-  return (int64_t)((clock() / CLOCKS_PER_SEC) * _az_TIME_MILLISECONDS_PER_SECOND);
+  // clock() measures the CPU time used by the process, which doesn't advance while sleeping or
+  // waiting on the network, so use the monotonic clock, which measures elapsed time and isn't
+  // affected by changes to the system time.
+  struct timespec now = { 0 };
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * _az_TIME_MILLISECONDS_PER_SECOND
+      + now.tv_nsec / _az_TIME_NANOSECONDS_PER_MILLISECOND;
 }
 
 void az_platform_sleep_msec(int32_t milliseconds)
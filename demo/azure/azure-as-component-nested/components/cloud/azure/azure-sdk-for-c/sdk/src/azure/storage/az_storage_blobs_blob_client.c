@@ -19,6 +19,14 @@
 enum
 {
   _az_STORAGE_HTTP_REQUEST_HEADER_BUF_SIZE = 10 * sizeof(az_pair),
+
+  // The most blocks the service allows a blob to have.
+  _az_STORAGE_BLOBS_MAX_BLOCKS = 50000,
+
+  // Block IDs are the base64 encoding of the block index written as 6 decimal digits. The IDs of a
+  // blob must all have the same length, and these need neither padding nor URL encoding.
+  _az_STORAGE_BLOBS_BLOCK_ID_DIGITS = 6,
+  _az_STORAGE_BLOBS_BLOCK_ID_SIZE = 8,
 };
 
 static az_span const AZ_STORAGE_BLOBS_BLOB_HEADER_X_MS_BLOB_TYPE
@@ -29,6 +37,12 @@ static az_span const AZ_STORAGE_BLOBS_BLOB_TYPE_BLOCKBLOB = AZ_SPAN_LITERAL_FROM
 static az_span const AZ_HTTP_HEADER_CONTENT_LENGTH = AZ_SPAN_LITERAL_FROM_STR("Content-Length");
 static az_span const AZ_HTTP_HEADER_CONTENT_TYPE = AZ_SPAN_LITERAL_FROM_STR("Content-Type");
 
+static az_span const AZ_STORAGE_BLOBS_BLOCK_LIST_BEGIN
+    = AZ_SPAN_LITERAL_FROM_STR("<?xml version=\"1.0\" encoding=\"utf-8\"?><BlockList>");
+static az_span const AZ_STORAGE_BLOBS_BLOCK_LIST_END = AZ_SPAN_LITERAL_FROM_STR("</BlockList>");
+static az_span const AZ_STORAGE_BLOBS_BLOCK_LIST_ENTRY_BEGIN = AZ_SPAN_LITERAL_FROM_STR("<Latest>");
+static az_span const AZ_STORAGE_BLOBS_BLOCK_LIST_ENTRY_END = AZ_SPAN_LITERAL_FROM_STR("</Latest>");
+
 AZ_NODISCARD az_storage_blobs_blob_client_options az_storage_blobs_blob_client_options_default()
 {
 
@@ -128,6 +142,38 @@ AZ_NODISCARD az_result az_storage_blobs_blob_client_init(
   return AZ_OK;
 }
 
+// Creates a request to the client's endpoint.
+static AZ_NODISCARD az_result _az_storage_blobs_request_init(
+    az_storage_blobs_blob_client* client,
+    az_context* context,
+    az_span url_buffer,
+    az_span headers_buffer,
+    az_span content,
+    _az_http_request* out_request)
+{
+  // copy url from client
+  int32_t uri_size = az_span_size(client->_internal.endpoint);
+  AZ_RETURN_IF_NOT_ENOUGH_SIZE(url_buffer, uri_size);
+  az_span_copy(url_buffer, client->_internal.endpoint);
+
+  return az_http_request_init(
+      out_request, context, az_http_method_put(), url_buffer, uri_size, headers_buffer, content);
+}
+
+// Adds the Content-Length header, written to the buffer, which must outlive the request.
+static AZ_NODISCARD az_result _az_storage_blobs_append_content_length(
+    _az_http_request* ref_request,
+    int32_t content_size,
+    az_span buffer)
+{
+  az_span remainder;
+  AZ_RETURN_IF_FAILED(az_span_i64toa(buffer, content_size, &remainder));
+  return az_http_request_append_header(
+      ref_request,
+      AZ_HTTP_HEADER_CONTENT_LENGTH,
+      az_span_slice(buffer, 0, _az_span_diff(remainder, buffer)));
+}
+
 AZ_NODISCARD az_result az_storage_blobs_blob_upload(
     az_storage_blobs_blob_client* client,
     az_context* context,
@@ -150,41 +196,26 @@ AZ_NODISCARD az_result az_storage_blobs_blob_upload(
   // Request buffer
   // create request buffer TODO: define size for a blob upload
   uint8_t url_buffer[AZ_HTTP_REQUEST_URL_BUF_SIZE];
-  az_span request_url_span = AZ_SPAN_FROM_BUFFER(url_buffer);
-  // copy url from client
-  int32_t uri_size = az_span_size(client->_internal.endpoint);
-  AZ_RETURN_IF_NOT_ENOUGH_SIZE(request_url_span, uri_size);
-  az_span_copy(request_url_span, client->_internal.endpoint);
-
   uint8_t headers_buffer[_az_STORAGE_HTTP_REQUEST_HEADER_BUF_SIZE];
-  az_span request_headers_span = AZ_SPAN_FROM_BUFFER(headers_buffer);
 
   // create request
   _az_http_request request;
-  AZ_RETURN_IF_FAILED(az_http_request_init(
-      &request,
+  AZ_RETURN_IF_FAILED(_az_storage_blobs_request_init(
+      client,
       context,
-      az_http_method_put(),
-      request_url_span,
-      uri_size,
-      request_headers_span,
-      content));
+      AZ_SPAN_FROM_BUFFER(url_buffer),
+      AZ_SPAN_FROM_BUFFER(headers_buffer),
+      content,
+      &request));
 
   // add blob type to request
   AZ_RETURN_IF_FAILED(az_http_request_append_header(
       &request, AZ_STORAGE_BLOBS_BLOB_HEADER_X_MS_BLOB_TYPE, AZ_STORAGE_BLOBS_BLOB_TYPE_BLOCKBLOB));
 
-  //
-  uint8_t content_length[_az_INT64_AS_STR_BUF_SIZE] = { 0 };
-  az_span content_length_span = AZ_SPAN_FROM_BUFFER(content_length);
-  az_span remainder;
-  AZ_RETURN_IF_FAILED(az_span_i64toa(content_length_span, az_span_size(content), &remainder));
-  content_length_span
-      = az_span_slice(content_length_span, 0, _az_span_diff(remainder, content_length_span));
-
   // add Content-Length to request
-  AZ_RETURN_IF_FAILED(
-      az_http_request_append_header(&request, AZ_HTTP_HEADER_CONTENT_LENGTH, content_length_span));
+  uint8_t content_length[_az_INT64_AS_STR_BUF_SIZE] = { 0 };
+  AZ_RETURN_IF_FAILED(_az_storage_blobs_append_content_length(
+      &request, az_span_size(content), AZ_SPAN_FROM_BUFFER(content_length)));
 
   // add blob type to request
   AZ_RETURN_IF_FAILED(az_http_request_append_header(
@@ -193,3 +224,199 @@ AZ_NODISCARD az_result az_storage_blobs_blob_upload(
   // start pipeline
   return az_http_pipeline_process(&client->_internal.pipeline, &request, response);
 }
+
+// Writes the ID of the block at the given index.
+static void _az_storage_blobs_block_id(
+    int32_t block_index,
+    uint8_t block_id[_az_STORAGE_BLOBS_BLOCK_ID_SIZE])
+{
+  static uint8_t const base64_digits[]
+      = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  uint8_t digits[_az_STORAGE_BLOBS_BLOCK_ID_DIGITS];
+  for (int32_t i = _az_STORAGE_BLOBS_BLOCK_ID_DIGITS - 1; i >= 0; i--)
+  {
+    digits[i] = (uint8_t)('0' + block_index % 10);
+    block_index /= 10;
+  }
+
+  // Each 3 bytes encode as 4 base64 digits of 6 bits each.
+  for (int32_t i = 0; i < _az_STORAGE_BLOBS_BLOCK_ID_DIGITS / 3; i++)
+  {
+    uint32_t const bits = ((uint32_t)digits[i * 3] << 16) | ((uint32_t)digits[i * 3 + 1] << 8)
+        | (uint32_t)digits[i * 3 + 2];
+    block_id[i * 4] = base64_digits[(bits >> 18) & 0x3F];
+    block_id[i * 4 + 1] = base64_digits[(bits >> 12) & 0x3F];
+    block_id[i * 4 + 2] = base64_digits[(bits >> 6) & 0x3F];
+    block_id[i * 4 + 3] = base64_digits[bits & 0x3F];
+  }
+}
+
+// Returns the size of the body of a Put Block List request for the given number of blocks.
+AZ_NODISCARD static int32_t _az_storage_blobs_block_list_size(int32_t block_count)
+{
+  int32_t const entry_size = az_span_size(AZ_STORAGE_BLOBS_BLOCK_LIST_ENTRY_BEGIN)
+      + _az_STORAGE_BLOBS_BLOCK_ID_SIZE + az_span_size(AZ_STORAGE_BLOBS_BLOCK_LIST_ENTRY_END);
+  return az_span_size(AZ_STORAGE_BLOBS_BLOCK_LIST_BEGIN) + block_count * entry_size
+      + az_span_size(AZ_STORAGE_BLOBS_BLOCK_LIST_END);
+}
+
+AZ_NODISCARD az_result az_storage_blobs_blob_put_block(
+    az_storage_blobs_blob_client* client,
+    az_context* context,
+    int32_t block_index,
+    az_span content,
+    az_http_response* response)
+{
+  _az_PRECONDITION_NOT_NULL(client);
+  _az_PRECONDITION_RANGE(0, block_index, _az_STORAGE_BLOBS_MAX_BLOCKS - 1);
+  _az_PRECONDITION_NOT_NULL(response);
+
+  uint8_t url_buffer[AZ_HTTP_REQUEST_URL_BUF_SIZE];
+  uint8_t headers_buffer[_az_STORAGE_HTTP_REQUEST_HEADER_BUF_SIZE];
+
+  _az_http_request request;
+  AZ_RETURN_IF_FAILED(_az_storage_blobs_request_init(
+      client,
+      context,
+      AZ_SPAN_FROM_BUFFER(url_buffer),
+      AZ_SPAN_FROM_BUFFER(headers_buffer),
+      content,
+      &request));
+
+  uint8_t block_id[_az_STORAGE_BLOBS_BLOCK_ID_SIZE];
+  _az_storage_blobs_block_id(block_index, block_id);
+  AZ_RETURN_IF_FAILED(az_http_request_set_query_parameter(
+      &request, AZ_SPAN_FROM_STR("comp"), AZ_SPAN_FROM_STR("block")));
+  AZ_RETURN_IF_FAILED(az_http_request_set_query_parameter(
+      &request, AZ_SPAN_FROM_STR("blockid"), AZ_SPAN_FROM_BUFFER(block_id)));
+
+  uint8_t content_length[_az_INT64_AS_STR_BUF_SIZE] = { 0 };
+  AZ_RETURN_IF_FAILED(_az_storage_blobs_append_content_length(
+      &request, az_span_size(content), AZ_SPAN_FROM_BUFFER(content_length)));
+
+  return az_http_pipeline_process(&client->_internal.pipeline, &request, response);
+}
+
+AZ_NODISCARD az_result az_storage_blobs_blob_put_block_list(
+    az_storage_blobs_blob_client* client,
+    az_context* context,
+    int32_t block_count,
+    az_span buffer,
+    az_http_response* response)
+{
+  _az_PRECONDITION_NOT_NULL(client);
+  _az_PRECONDITION_RANGE(0, block_count, _az_STORAGE_BLOBS_MAX_BLOCKS);
+  _az_PRECONDITION_NOT_NULL(response);
+
+  int32_t const body_size = _az_storage_blobs_block_list_size(block_count);
+  AZ_RETURN_IF_NOT_ENOUGH_SIZE(buffer, body_size);
+
+  az_span remainder = az_span_copy(buffer, AZ_STORAGE_BLOBS_BLOCK_LIST_BEGIN);
+  for (int32_t i = 0; i < block_count; i++)
+  {
+    uint8_t block_id[_az_STORAGE_BLOBS_BLOCK_ID_SIZE];
+    _az_storage_blobs_block_id(i, block_id);
+    remainder = az_span_copy(remainder, AZ_STORAGE_BLOBS_BLOCK_LIST_ENTRY_BEGIN);
+    remainder = az_span_copy(remainder, AZ_SPAN_FROM_BUFFER(block_id));
+    remainder = az_span_copy(remainder, AZ_STORAGE_BLOBS_BLOCK_LIST_ENTRY_END);
+  }
+  az_span_copy(remainder, AZ_STORAGE_BLOBS_BLOCK_LIST_END);
+  az_span const body = az_span_slice(buffer, 0, body_size);
+
+  uint8_t url_buffer[AZ_HTTP_REQUEST_URL_BUF_SIZE];
+  uint8_t headers_buffer[_az_STORAGE_HTTP_REQUEST_HEADER_BUF_SIZE];
+
+  _az_http_request request;
+  AZ_RETURN_IF_FAILED(_az_storage_blobs_request_init(
+      client,
+      context,
+      AZ_SPAN_FROM_BUFFER(url_buffer),
+      AZ_SPAN_FROM_BUFFER(headers_buffer),
+      body,
+      &request));
+
+  AZ_RETURN_IF_FAILED(az_http_request_set_query_parameter(
+      &request, AZ_SPAN_FROM_STR("comp"), AZ_SPAN_FROM_STR("blocklist")));
+
+  uint8_t content_length[_az_INT64_AS_STR_BUF_SIZE] = { 0 };
+  AZ_RETURN_IF_FAILED(_az_storage_blobs_append_content_length(
+      &request, body_size, AZ_SPAN_FROM_BUFFER(content_length)));
+
+  AZ_RETURN_IF_FAILED(az_http_request_append_header(
+      &request, AZ_HTTP_HEADER_CONTENT_TYPE, AZ_SPAN_FROM_STR("application/xml")));
+
+  return az_http_pipeline_process(&client->_internal.pipeline, &request, response);
+}
+
+AZ_NODISCARD az_result az_storage_blobs_blob_upload_blocks(
+    az_storage_blobs_blob_client* client,
+    az_context* context,
+    az_storage_blobs_blob_read_callback read_callback,
+    void* user_context,
+    az_span block_buffer,
+    az_span block_list_buffer,
+    az_storage_blobs_blob_upload_options* options,
+    az_http_response* response)
+{
+  _az_PRECONDITION_NOT_NULL(client);
+  _az_PRECONDITION_NOT_NULL(read_callback);
+  _az_PRECONDITION_VALID_SPAN(block_buffer, 1, false);
+  _az_PRECONDITION_VALID_SPAN(block_list_buffer, 1, false);
+  _az_PRECONDITION_NOT_NULL(response);
+
+  az_storage_blobs_blob_upload_options opt;
+  if (options == NULL)
+  {
+    opt = az_storage_blobs_blob_upload_options_default();
+  }
+  else
+  {
+    opt = *options;
+  }
+  (void)opt;
+
+  int32_t block_count = 0;
+  int32_t read_size = 0;
+  do
+  {
+    // Fill the buffer before uploading it, so that only the last block can be short.
+    int32_t block_size = 0;
+    do
+    {
+      AZ_RETURN_IF_FAILED(read_callback(
+          user_context, az_span_slice_to_end(block_buffer, block_size), &read_size));
+      block_size += read_size;
+    } while (read_size > 0 && block_size < az_span_size(block_buffer));
+
+    if (block_size == 0)
+    {
+      break;
+    }
+
+    // Don't upload a block that couldn't be committed: the block list built once all the blocks are
+    // uploaded must have room for this one too.
+    if (block_count == _az_STORAGE_BLOBS_MAX_BLOCKS
+        || _az_storage_blobs_block_list_size(block_count + 1) > az_span_size(block_list_buffer))
+    {
+      return AZ_ERROR_INSUFFICIENT_SPAN_SIZE;
+    }
+
+    AZ_RETURN_IF_FAILED(az_storage_blobs_blob_put_block(
+        client, context, block_count, az_span_slice(block_buffer, 0, block_size), response));
+
+    // Stop at the first block the service didn't accept, leaving its response for the caller.
+    az_http_response response_copy = *response;
+    az_http_response_status_line status_line = { 0 };
+    AZ_RETURN_IF_FAILED(az_http_response_get_status_line(&response_copy, &status_line));
+    if (status_line.status_code != AZ_HTTP_STATUS_CODE_CREATED)
+    {
+      return AZ_OK;
+    }
+
+    block_count++;
+  } while (read_size > 0);
+
+  return az_storage_blobs_blob_put_block_list(
+      client, context, block_count, block_list_buffer, response);
+}
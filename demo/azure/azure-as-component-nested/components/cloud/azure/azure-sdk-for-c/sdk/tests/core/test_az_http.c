@@ -15,6 +15,7 @@
 
 #include <setjmp.h>
 #include <stdarg.h>
+#include <string.h>
 
 #include <az_test_precondition.h>
 #include <cmocka.h>
@@ -576,6 +577,212 @@ static void test_http_response_append_overflow_on_second_call(void** state)
   }
 }
 
+#define FIVE_HEADERS(n) \
+  "Header" n "1: " n "1\r\n" \
+  "Header" n "2: " n "2\r\n" \
+  "Header" n "3: " n "3\r\n" \
+  "Header" n "4: " n "4\r\n" \
+  "Header" n "5: " n "5\r\n"
+
+static void test_http_response_header_index(void** state)
+{
+  (void)state;
+  {
+    // More headers than the index holds, with a repeated name past them.
+    az_http_response response = { 0 };
+    assert_return_code(
+        az_http_response_init(
+            &response,
+            AZ_SPAN_FROM_STR("HTTP/1.1 503 Service Unavailable\r\n"
+                             "Retry-After: 10\r\n" //
+                             FIVE_HEADERS("A") FIVE_HEADERS("B") FIVE_HEADERS("C")
+                                 FIVE_HEADERS("D") FIVE_HEADERS("E") //
+                             "x-ms-retry-after-ms: 250\r\n"
+                             "RETRY-AFTER: 20\r\n"
+                             "\r\n"
+                             "body")),
+        AZ_OK);
+
+    az_http_response_status_line status_line = { 0 };
+    assert_return_code(az_http_response_get_status_line(&response, &status_line), AZ_OK);
+
+    _az_http_response_header_index index = { 0 };
+    assert_return_code(_az_http_response_header_index_init(&response, &index), AZ_OK);
+
+    az_span value = AZ_SPAN_NULL;
+    assert_return_code(
+        _az_http_response_header_index_find(&index, AZ_SPAN_FROM_STR("retry-after"), &value),
+        AZ_OK);
+    assert_true(az_span_is_content_equal(value, AZ_SPAN_FROM_STR("10")));
+
+    assert_return_code(
+        _az_http_response_header_index_find(&index, AZ_SPAN_FROM_STR("headerc3"), &value), AZ_OK);
+    assert_true(az_span_is_content_equal(value, AZ_SPAN_FROM_STR("C3")));
+
+    assert_return_code(
+        _az_http_response_header_index_find(
+            &index, AZ_SPAN_FROM_STR("X-MS-Retry-After-MS"), &value),
+        AZ_OK);
+    assert_true(az_span_is_content_equal(value, AZ_SPAN_FROM_STR("250")));
+
+    assert_true(
+        _az_http_response_header_index_find(&index, AZ_SPAN_FROM_STR("retry-after-ms"), &value)
+        == AZ_ERROR_ITEM_NOT_FOUND);
+
+    // The response itself is left where it was, after the status line.
+    az_pair header = { 0 };
+    assert_return_code(az_http_response_get_next_header(&response, &header), AZ_OK);
+    assert_true(az_span_is_content_equal(header.key, AZ_SPAN_FROM_STR("Retry-After")));
+  }
+  {
+    // The status line must have been read first.
+    az_http_response response = { 0 };
+    assert_return_code(
+        az_http_response_init(&response, AZ_SPAN_FROM_STR("HTTP/1.1 200 OK\r\n\r\n")), AZ_OK);
+
+    _az_http_response_header_index index = { 0 };
+    assert_true(
+        _az_http_response_header_index_init(&response, &index) == AZ_ERROR_HTTP_INVALID_STATE);
+  }
+}
+
+typedef struct
+{
+  uint8_t buffer[32];
+  int32_t size;
+  int32_t calls;
+} body_sink;
+
+static az_result write_to_body_sink(void* user_context, az_span body_chunk)
+{
+  body_sink* const sink = (body_sink*)user_context;
+  if (sink->size + az_span_size(body_chunk) > (int32_t)sizeof(sink->buffer))
+  {
+    return AZ_ERROR_INSUFFICIENT_SPAN_SIZE;
+  }
+
+  memcpy(sink->buffer + sink->size, az_span_ptr(body_chunk), (size_t)az_span_size(body_chunk));
+  sink->size += az_span_size(body_chunk);
+  sink->calls++;
+  return AZ_OK;
+}
+
+static void test_http_response_body_callback(void** state)
+{
+  (void)state;
+  {
+    // The buffer only fits the status line and headers, which end in the middle of a chunk after
+    // the blank line ending them was split across chunks.
+    uint8_t buffer[sizeof("HTTP/1.1 200 OK\r\nContent-Length: 19\r\n\r\n") - 1];
+    body_sink sink = { 0 };
+    az_http_response response = { 0 };
+    assert_return_code(az_http_response_init(&response, AZ_SPAN_FROM_BUFFER(buffer)), AZ_OK);
+    assert_return_code(
+        az_http_response_set_body_callback(&response, write_to_body_sink, &sink), AZ_OK);
+
+    // Like the transport policy does before sending the request.
+    _az_http_response_reset(&response);
+
+    assert_return_code(
+        az_http_response_append(&response, AZ_SPAN_FROM_STR("HTTP/1.1 200 OK\r\n")), AZ_OK);
+    assert_return_code(
+        az_http_response_append(&response, AZ_SPAN_FROM_STR("Content-Length: 19\r\n\r")), AZ_OK);
+    assert_return_code(
+        az_http_response_append(&response, AZ_SPAN_FROM_STR("\nthe body, in ")), AZ_OK);
+    assert_return_code(az_http_response_append(&response, AZ_SPAN_FROM_STR("chunks")), AZ_OK);
+    assert_return_code(az_http_response_append(&response, AZ_SPAN_NULL), AZ_OK);
+
+    assert_int_equal(sink.calls, 2);
+    assert_true(az_span_is_content_equal(
+        az_span_init(sink.buffer, sink.size), AZ_SPAN_FROM_STR("the body, in chunks")));
+
+    az_http_response_status_line status_line = { 0 };
+    assert_return_code(az_http_response_get_status_line(&response, &status_line), AZ_OK);
+    assert_int_equal(status_line.status_code, AZ_HTTP_STATUS_CODE_OK);
+
+    az_pair header = { 0 };
+    assert_return_code(az_http_response_get_next_header(&response, &header), AZ_OK);
+    assert_true(az_span_is_content_equal(header.value, AZ_SPAN_FROM_STR("19")));
+
+    az_span body = AZ_SPAN_NULL;
+    assert_return_code(az_http_response_get_body(&response, &body), AZ_OK);
+    assert_int_equal(az_span_size(body), 0);
+
+    // The callback's error is returned.
+    assert_true(
+        az_http_response_append(&response, AZ_SPAN_FROM_STR("more than the sink can hold"))
+        == AZ_ERROR_INSUFFICIENT_SPAN_SIZE);
+  }
+  {
+    // The status line itself arrives split across chunks.
+    uint8_t buffer[sizeof("HTTP/1.1 200 OK\r\nContent-Length: 4\r\n\r\n") - 1];
+    body_sink sink = { 0 };
+    az_http_response response = { 0 };
+    assert_return_code(az_http_response_init(&response, AZ_SPAN_FROM_BUFFER(buffer)), AZ_OK);
+    assert_return_code(
+        az_http_response_set_body_callback(&response, write_to_body_sink, &sink), AZ_OK);
+    _az_http_response_reset(&response);
+
+    assert_return_code(az_http_response_append(&response, AZ_SPAN_FROM_STR("HT")), AZ_OK);
+    assert_return_code(az_http_response_append(&response, AZ_SPAN_FROM_STR("TP/1.1 20")), AZ_OK);
+    assert_return_code(az_http_response_append(&response, AZ_SPAN_FROM_STR("0 OK\r")), AZ_OK);
+    assert_return_code(
+        az_http_response_append(&response, AZ_SPAN_FROM_STR("\nContent-Length: 4\r\n\r\nbo")),
+        AZ_OK);
+    assert_return_code(az_http_response_append(&response, AZ_SPAN_FROM_STR("dy")), AZ_OK);
+
+    assert_int_equal(sink.calls, 2);
+    assert_true(
+        az_span_is_content_equal(az_span_init(sink.buffer, sink.size), AZ_SPAN_FROM_STR("body")));
+
+    az_http_response_status_line status_line = { 0 };
+    assert_return_code(az_http_response_get_status_line(&response, &status_line), AZ_OK);
+    assert_int_equal(status_line.status_code, AZ_HTTP_STATUS_CODE_OK);
+    assert_true(az_span_is_content_equal(status_line.reason_phrase, AZ_SPAN_FROM_STR("OK")));
+  }
+  {
+    // The body is streamed without resetting the response after setting the callback.
+    uint8_t buffer[sizeof("HTTP/1.1 200 OK\r\n\r\n") - 1];
+    body_sink sink = { 0 };
+    az_http_response response = { 0 };
+    assert_return_code(az_http_response_init(&response, AZ_SPAN_FROM_BUFFER(buffer)), AZ_OK);
+    assert_return_code(
+        az_http_response_set_body_callback(&response, write_to_body_sink, &sink), AZ_OK);
+
+    assert_return_code(
+        az_http_response_append(&response, AZ_SPAN_FROM_STR("HTTP/1.1 200 OK\r\n\r\nstreamed")),
+        AZ_OK);
+
+    assert_int_equal(sink.calls, 1);
+    assert_true(az_span_is_content_equal(
+        az_span_init(sink.buffer, sink.size), AZ_SPAN_FROM_STR("streamed")));
+
+    az_span body = AZ_SPAN_NULL;
+    assert_return_code(az_http_response_get_body(&response, &body), AZ_OK);
+    assert_int_equal(az_span_size(body), 0);
+  }
+  {
+    // The body of an error response is kept in the buffer.
+    uint8_t buffer[64];
+    body_sink sink = { 0 };
+    az_http_response response = { 0 };
+    assert_return_code(az_http_response_init(&response, AZ_SPAN_FROM_BUFFER(buffer)), AZ_OK);
+    assert_return_code(
+        az_http_response_set_body_callback(&response, write_to_body_sink, &sink), AZ_OK);
+
+    assert_return_code(
+        az_http_response_append(
+            &response, AZ_SPAN_FROM_STR("HTTP/1.1 404 Not Found\r\n\r\n{\"error\":1}")),
+        AZ_OK);
+    assert_int_equal(sink.calls, 0);
+
+    az_span body = AZ_SPAN_NULL;
+    assert_return_code(az_http_response_get_body(&response, &body), AZ_OK);
+    assert_true(
+        az_span_is_content_equal(az_span_slice(body, 0, 11), AZ_SPAN_FROM_STR("{\"error\":1}")));
+  }
+}
+
 int test_az_http()
 {
 #ifndef AZ_NO_PRECONDITION_CHECKING
@@ -598,6 +805,8 @@ int test_az_http()
     cmocka_unit_test(test_http_response_append_overflow),
     cmocka_unit_test(test_http_response_append),
     cmocka_unit_test(test_http_response_append_overflow_on_second_call),
+    cmocka_unit_test(test_http_response_header_index),
+    cmocka_unit_test(test_http_response_body_callback),
   };
   return cmocka_run_group_tests_name("az_core_http", tests, NULL, NULL);
 }
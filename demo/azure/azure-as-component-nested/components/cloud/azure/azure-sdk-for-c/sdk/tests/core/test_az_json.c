@@ -8,6 +8,8 @@
 #include <math.h>
 #include <setjmp.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <cmocka.h>
 
@@ -784,7 +786,7 @@ static void test_json_reader_invalid(void** state)
   test_json_reader_invalid_helper(AZ_SPAN_FROM_STR("trUe"), AZ_ERROR_UNEXPECTED_CHAR);
   test_json_reader_invalid_helper(AZ_SPAN_FROM_STR("False"), AZ_ERROR_UNEXPECTED_CHAR);
   test_json_reader_invalid_helper(AZ_SPAN_FROM_STR("age"), AZ_ERROR_UNEXPECTED_CHAR);
-  test_json_reader_invalid_helper(AZ_SPAN_FROM_STR("\""), AZ_ERROR_UNEXPECTED_CHAR);
+  test_json_reader_invalid_helper(AZ_SPAN_FROM_STR("\""), AZ_ERROR_EOF);
   test_json_reader_invalid_helper(AZ_SPAN_FROM_STR("\"age\":"), AZ_ERROR_UNEXPECTED_CHAR);
 
   // Invalid numbers
@@ -1033,11 +1035,401 @@ static void test_json_value(void** state)
   }
 }
 
+static void test_json_reader_number_parts(void** state)
+{
+  (void)state;
+
+  az_json_reader reader = { 0 };
+  TEST_EXPECT_SUCCESS(az_json_reader_init(
+      &reader, AZ_SPAN_FROM_STR("[-12, 3.25, 4e2, -5.5E-1, 9223372036854775808]"), NULL));
+  TEST_EXPECT_SUCCESS(az_json_reader_next_token(&reader));
+
+  int64_t int64_value = 0;
+  uint64_t uint64_value = 0;
+  double double_value = 0;
+
+  TEST_EXPECT_SUCCESS(az_json_reader_next_token(&reader));
+  assert_int_equal(reader.token._internal.number_fraction_index, 0);
+  assert_int_equal(reader.token._internal.number_exponent_index, 0);
+  TEST_EXPECT_SUCCESS(az_json_token_get_int64(&reader.token, &int64_value));
+  assert_int_equal(int64_value, -12);
+
+  TEST_EXPECT_SUCCESS(az_json_reader_next_token(&reader));
+  assert_int_equal(reader.token._internal.number_fraction_index, 1);
+  assert_int_equal(reader.token._internal.number_exponent_index, 0);
+  assert_int_equal(
+      az_json_token_get_int64(&reader.token, &int64_value), AZ_ERROR_UNEXPECTED_CHAR);
+  TEST_EXPECT_SUCCESS(az_json_token_get_double(&reader.token, &double_value));
+  assert_true(_is_double_equal(double_value, 3.25, 1e-9));
+
+  TEST_EXPECT_SUCCESS(az_json_reader_next_token(&reader));
+  assert_int_equal(reader.token._internal.number_fraction_index, 0);
+  assert_int_equal(reader.token._internal.number_exponent_index, 1);
+  assert_int_equal(
+      az_json_token_get_uint64(&reader.token, &uint64_value), AZ_ERROR_UNEXPECTED_CHAR);
+  TEST_EXPECT_SUCCESS(az_json_token_get_double(&reader.token, &double_value));
+  assert_true(_is_double_equal(double_value, 400, 1e-9));
+
+  TEST_EXPECT_SUCCESS(az_json_reader_next_token(&reader));
+  assert_int_equal(reader.token._internal.number_fraction_index, 2);
+  assert_int_equal(reader.token._internal.number_exponent_index, 4);
+  TEST_EXPECT_SUCCESS(az_json_token_get_double(&reader.token, &double_value));
+  assert_true(_is_double_equal(double_value, -0.55, 1e-9));
+
+  TEST_EXPECT_SUCCESS(az_json_reader_next_token(&reader));
+  assert_int_equal(
+      az_json_token_get_int64(&reader.token, &int64_value), AZ_ERROR_UNEXPECTED_CHAR);
+  TEST_EXPECT_SUCCESS(az_json_token_get_uint64(&reader.token, &uint64_value));
+  assert_true(uint64_value == 9223372036854775808ULL);
+
+  // A token not made by the reader has no number parts recorded, and is still rejected.
+  az_json_token token = { 0 };
+  token.kind = AZ_JSON_TOKEN_NUMBER;
+  token.slice = AZ_SPAN_FROM_STR("1.5");
+  assert_int_equal(az_json_token_get_int64(&token, &int64_value), AZ_ERROR_UNEXPECTED_CHAR);
+  token.slice = AZ_SPAN_FROM_STR("1e3");
+  assert_int_equal(az_json_token_get_uint64(&token, &uint64_value), AZ_ERROR_UNEXPECTED_CHAR);
+}
+
+static void test_json_reader_long_strings(void** state)
+{
+  (void)state;
+
+  // Place the byte that needs special handling at every offset across a few 8-byte words, so that
+  // both the word-at-a-time and the byte-at-a-time scanning paths see it.
+  for (int32_t offset = 0; offset < 24; offset++)
+  {
+    uint8_t buffer[40] = { 0 };
+    az_span const json = AZ_SPAN_FROM_BUFFER(buffer);
+
+    // Plain string, terminated at the offset.
+    memset(buffer, 'a', sizeof(buffer));
+    buffer[0] = '"';
+    buffer[offset + 1] = '"';
+    az_json_reader reader = { 0 };
+    TEST_EXPECT_SUCCESS(az_json_reader_init(&reader, az_span_slice(json, 0, offset + 2), NULL));
+    TEST_EXPECT_SUCCESS(az_json_reader_next_token(&reader));
+    assert_int_equal(reader.token.kind, AZ_JSON_TOKEN_STRING);
+    assert_int_equal(az_span_size(reader.token.slice), offset);
+    assert_false(reader.token._internal.string_has_escaped_chars);
+
+    // Escaped quote at the offset, the string continues past it.
+    memset(buffer, 'a', sizeof(buffer));
+    buffer[0] = '"';
+    buffer[offset + 1] = '\\';
+    buffer[offset + 2] = '"';
+    buffer[sizeof(buffer) - 1] = '"';
+    TEST_EXPECT_SUCCESS(az_json_reader_init(&reader, json, NULL));
+    TEST_EXPECT_SUCCESS(az_json_reader_next_token(&reader));
+    assert_int_equal(reader.token.kind, AZ_JSON_TOKEN_STRING);
+    assert_int_equal(az_span_size(reader.token.slice), (int32_t)sizeof(buffer) - 2);
+    assert_true(reader.token._internal.string_has_escaped_chars);
+
+    // Unescaped control character at the offset.
+    memset(buffer, 'a', sizeof(buffer));
+    buffer[0] = '"';
+    buffer[offset + 1] = '\n';
+    buffer[sizeof(buffer) - 1] = '"';
+    TEST_EXPECT_SUCCESS(az_json_reader_init(&reader, json, NULL));
+    assert_int_equal(az_json_reader_next_token(&reader), AZ_ERROR_UNEXPECTED_CHAR);
+
+    // Unterminated string.
+    memset(buffer, 'a', sizeof(buffer));
+    buffer[0] = '"';
+    TEST_EXPECT_SUCCESS(az_json_reader_init(&reader, az_span_slice(json, 0, offset + 2), NULL));
+    assert_int_equal(az_json_reader_next_token(&reader), AZ_ERROR_EOF);
+
+    // Whitespace run of varying length ending in a mix of whitespace kinds.
+    memset(buffer, ' ', sizeof(buffer));
+    buffer[offset] = '\t';
+    buffer[offset + 1] = '\r';
+    buffer[offset + 2] = '\n';
+    buffer[offset + 3] = '1';
+    TEST_EXPECT_SUCCESS(az_json_reader_init(&reader, json, NULL));
+    TEST_EXPECT_SUCCESS(az_json_reader_next_token(&reader));
+    assert_int_equal(reader.token.kind, AZ_JSON_TOKEN_NUMBER);
+    assert_int_equal(reader._internal.bytes_consumed, offset + 4);
+    assert_int_equal(az_json_reader_next_token(&reader), AZ_ERROR_JSON_READER_DONE);
+  }
+}
+
+// Copies a chunk of JSON into its own allocation of exactly its size, so that reading past the end
+// of the chunk is caught by the sanitizers rather than landing on the next chunk.
+static az_span test_json_reader_chunk_copy(az_span chunk)
+{
+  uint8_t* const chunk_ptr = malloc(az_span_size(chunk) > 0 ? (size_t)az_span_size(chunk) : 1);
+  assert_non_null(chunk_ptr);
+  az_span const copy = az_span_init(chunk_ptr, az_span_size(chunk));
+  az_span_copy(copy, chunk);
+  return copy;
+}
+
+// Reads json split into buffers at the given offsets and checks that the reader returns the same
+// tokens, and ends the same way, as when reading it from a single buffer.
+static void test_json_reader_chunked_helper(
+    az_span json,
+    int32_t const* splits,
+    int32_t split_count)
+{
+  az_span buffers[4] = { 0 };
+  int32_t start = 0;
+  for (int32_t i = 0; i < split_count; i++)
+  {
+    buffers[i] = test_json_reader_chunk_copy(az_span_slice(json, start, splits[i]));
+    start = splits[i];
+  }
+  buffers[split_count] = test_json_reader_chunk_copy(az_span_slice_to_end(json, start));
+
+  uint8_t token_buffer[32] = { 0 };
+  az_json_reader chunked_reader = { 0 };
+  TEST_EXPECT_SUCCESS(az_json_reader_chunked_init(
+      &chunked_reader, buffers, split_count + 1, AZ_SPAN_FROM_BUFFER(token_buffer), NULL));
+
+  az_json_reader reader = { 0 };
+  TEST_EXPECT_SUCCESS(az_json_reader_init(&reader, json, NULL));
+
+  az_result result = AZ_OK;
+  while (result == AZ_OK)
+  {
+    result = az_json_reader_next_token(&reader);
+    assert_int_equal(az_json_reader_next_token(&chunked_reader), result);
+    if (result == AZ_OK)
+    {
+      assert_int_equal(chunked_reader.token.kind, reader.token.kind);
+      assert_true(az_span_is_content_equal(chunked_reader.token.slice, reader.token.slice));
+      assert_int_equal(
+          chunked_reader.token._internal.string_has_escaped_chars,
+          reader.token._internal.string_has_escaped_chars);
+    }
+  }
+
+  for (int32_t i = 0; i <= split_count; i++)
+  {
+    free(az_span_ptr(buffers[i]));
+  }
+}
+
+static void test_json_reader_chunked(void** state)
+{
+  (void)state;
+
+  az_span const documents[] = {
+    AZ_SPAN_FROM_STR("{\"desired\":{\"name\":\"a\\\"b\\u0041\",\"count\":-12.5e+3,\"on\":true,"
+                     "\"off\":false,\"none\":null,\"list\":[1, 22 ,333]},\"$version\":7}"),
+    AZ_SPAN_FROM_STR("  [ \"abc\" , 0 , -0.25 , true , {} , [ ] ]  "),
+    AZ_SPAN_FROM_STR("12345"),
+    AZ_SPAN_FROM_STR("\"single\""),
+    AZ_SPAN_FROM_STR("{\"a\":\"xy\"}"),
+    AZ_SPAN_FROM_STR("{\"a\":\"\"}"),
+    AZ_SPAN_FROM_STR("[\"\",1]"),
+    AZ_SPAN_FROM_STR("\"\""),
+    AZ_SPAN_FROM_STR("{\"a\":tru}"),
+    AZ_SPAN_FROM_STR("{\"a\":12f}"),
+    AZ_SPAN_FROM_STR("{\"a\":\"unterminated"),
+  };
+
+  for (size_t d = 0; d < sizeof(documents) / sizeof(documents[0]); d++)
+  {
+    int32_t const size = az_span_size(documents[d]);
+
+    // Every split into two buffers, including empty ones.
+    for (int32_t i = 0; i <= size; i++)
+    {
+      int32_t const splits[] = { i };
+      test_json_reader_chunked_helper(documents[d], splits, 1);
+    }
+
+    // Every split into three buffers.
+    for (int32_t i = 0; i <= size; i++)
+    {
+      for (int32_t j = i; j <= size; j++)
+      {
+        int32_t const splits[] = { i, j };
+        test_json_reader_chunked_helper(documents[d], splits, 2);
+      }
+    }
+  }
+
+  // A token straddling two buffers which doesn't fit in the token buffer.
+  {
+    az_span buffers[] = { AZ_SPAN_FROM_STR("[\"0123456"), AZ_SPAN_FROM_STR("789\"]") };
+    uint8_t token_buffer[8] = { 0 };
+    az_json_reader reader = { 0 };
+    TEST_EXPECT_SUCCESS(
+        az_json_reader_chunked_init(&reader, buffers, 2, AZ_SPAN_FROM_BUFFER(token_buffer), NULL));
+    TEST_EXPECT_SUCCESS(az_json_reader_next_token(&reader));
+    assert_int_equal(az_json_reader_next_token(&reader), AZ_ERROR_INSUFFICIENT_SPAN_SIZE);
+  }
+
+  // The rest of the buffers are read in place, only the straddling token is copied.
+  {
+    az_span buffers[] = { AZ_SPAN_FROM_STR("[\"ab"), AZ_SPAN_FROM_STR("c\", \"def\"]") };
+    uint8_t token_buffer[8] = { 0 };
+    az_json_reader reader = { 0 };
+    TEST_EXPECT_SUCCESS(
+        az_json_reader_chunked_init(&reader, buffers, 2, AZ_SPAN_FROM_BUFFER(token_buffer), NULL));
+    TEST_EXPECT_SUCCESS(az_json_reader_next_token(&reader));
+    TEST_EXPECT_SUCCESS(az_json_reader_next_token(&reader));
+    assert_true(az_span_ptr(reader.token.slice) == token_buffer + 1);
+    assert_true(az_span_is_content_equal(reader.token.slice, AZ_SPAN_FROM_STR("abc")));
+    TEST_EXPECT_SUCCESS(az_json_reader_next_token(&reader));
+    assert_true(az_span_ptr(reader.token.slice) == az_span_ptr(buffers[1]) + 5);
+    TEST_EXPECT_SUCCESS(az_json_reader_next_token(&reader));
+    assert_int_equal(reader.token.kind, AZ_JSON_TOKEN_END_ARRAY);
+    assert_int_equal(az_json_reader_next_token(&reader), AZ_ERROR_JSON_READER_DONE);
+  }
+}
+
+typedef struct
+{
+  int64_t version;
+  double target_temperature;
+  bool enabled;
+  uint32_t interval;
+  char mode[8];
+  az_json_token schedule;
+  int32_t nested;
+  int32_t missing;
+} test_json_extract_twin;
+
+static az_json_extract_field const test_json_extract_twin_fields[] = {
+  AZ_JSON_EXTRACT_FIELD("$version", AZ_JSON_EXTRACT_INT64, test_json_extract_twin, version),
+  AZ_JSON_EXTRACT_FIELD(
+      "thermostat/targetTemperature",
+      AZ_JSON_EXTRACT_DOUBLE,
+      test_json_extract_twin,
+      target_temperature),
+  AZ_JSON_EXTRACT_FIELD(
+      "thermostat/enabled", AZ_JSON_EXTRACT_BOOLEAN, test_json_extract_twin, enabled),
+  AZ_JSON_EXTRACT_FIELD("interval", AZ_JSON_EXTRACT_UINT32, test_json_extract_twin, interval),
+  AZ_JSON_EXTRACT_FIELD("thermostat/mode", AZ_JSON_EXTRACT_STRING, test_json_extract_twin, mode),
+  AZ_JSON_EXTRACT_FIELD("schedule", AZ_JSON_EXTRACT_TOKEN, test_json_extract_twin, schedule),
+  AZ_JSON_EXTRACT_FIELD("a/b/c", AZ_JSON_EXTRACT_INT32, test_json_extract_twin, nested),
+  AZ_JSON_EXTRACT_FIELD(
+      "thermostat/missing", AZ_JSON_EXTRACT_INT32, test_json_extract_twin, missing),
+};
+
+static int32_t const test_json_extract_twin_fields_count
+    = (int32_t)(sizeof(test_json_extract_twin_fields) / sizeof(test_json_extract_twin_fields[0]));
+
+static void test_json_extract(void** state)
+{
+  (void)state;
+
+  // All fields, with unknown properties, arrays and objects to skip in between.
+  {
+    test_json_extract_twin twin = { 0 };
+    twin.missing = 7;
+    uint32_t found = 0;
+    TEST_EXPECT_SUCCESS(az_json_extract(
+        AZ_SPAN_FROM_STR("{\"unknown\":{\"mode\":\"x\",\"a\":[1,{\"b\":2}]},"
+                         "\"thermostat\":{\"mode\":\"heat\",\"targetTemperature\":21.5,"
+                         "\"extra\":[{\"enabled\":false}],\"enabled\":true},"
+                         "\"schedule\":[1,2,3],\"interval\":60,"
+                         "\"a\":{\"b\":{\"c\":-3,\"d\":4},\"c\":5},"
+                         "\"$version\":12}"),
+        test_json_extract_twin_fields,
+        test_json_extract_twin_fields_count,
+        &twin,
+        &found));
+
+    assert_int_equal(found, 0x7F);
+    assert_int_equal(twin.version, 12);
+    assert_true(_is_double_equal(twin.target_temperature, 21.5, 1e-9));
+    assert_true(twin.enabled);
+    assert_int_equal(twin.interval, 60);
+    assert_string_equal(twin.mode, "heat");
+    assert_int_equal(twin.schedule.kind, AZ_JSON_TOKEN_BEGIN_ARRAY);
+    assert_int_equal(twin.nested, -3);
+    assert_int_equal(twin.missing, 7);
+  }
+
+  // Null values are treated as absent, except for tokens.
+  {
+    test_json_extract_twin twin = { 0 };
+    uint32_t found = 0;
+    TEST_EXPECT_SUCCESS(az_json_extract(
+        AZ_SPAN_FROM_STR("{\"thermostat\":{\"enabled\":null},\"schedule\":null,"
+                         "\"a\":null,\"interval\":null}"),
+        test_json_extract_twin_fields,
+        test_json_extract_twin_fields_count,
+        &twin,
+        &found));
+
+    assert_int_equal(found, 0x20);
+    assert_int_equal(twin.schedule.kind, AZ_JSON_TOKEN_NULL);
+  }
+
+  // Property names only match at the depth of the path.
+  {
+    test_json_extract_twin twin = { 0 };
+    uint32_t found = 0;
+    TEST_EXPECT_SUCCESS(az_json_extract(
+        AZ_SPAN_FROM_STR("{\"enabled\":true,\"c\":1,\"b\":{\"c\":2},\"thermostat\":1}"),
+        test_json_extract_twin_fields,
+        test_json_extract_twin_fields_count,
+        &twin,
+        &found));
+
+    assert_int_equal(found, 0);
+  }
+
+  // Values which can't be stored, and invalid JSON.
+  {
+    test_json_extract_twin twin = { 0 };
+    uint32_t found = 0;
+    assert_int_equal(
+        az_json_extract(
+            AZ_SPAN_FROM_STR("{\"interval\":-1}"),
+            test_json_extract_twin_fields,
+            test_json_extract_twin_fields_count,
+            &twin,
+            &found),
+        AZ_ERROR_UNEXPECTED_CHAR);
+    assert_int_equal(
+        az_json_extract(
+            AZ_SPAN_FROM_STR("{\"thermostat\":{\"mode\":\"too long\"}}"),
+            test_json_extract_twin_fields,
+            test_json_extract_twin_fields_count,
+            &twin,
+            &found),
+        AZ_ERROR_INSUFFICIENT_SPAN_SIZE);
+    assert_int_equal(
+        az_json_extract(
+            AZ_SPAN_FROM_STR("{\"$version\":\"1\"}"),
+            test_json_extract_twin_fields,
+            test_json_extract_twin_fields_count,
+            &twin,
+            &found),
+        AZ_ERROR_JSON_INVALID_STATE);
+    assert_int_equal(
+        az_json_extract(
+            AZ_SPAN_FROM_STR("[1]"),
+            test_json_extract_twin_fields,
+            test_json_extract_twin_fields_count,
+            &twin,
+            &found),
+        AZ_ERROR_UNEXPECTED_CHAR);
+    assert_int_equal(
+        az_json_extract(
+            AZ_SPAN_FROM_STR("{\"a\":{\"b\":1}"),
+            test_json_extract_twin_fields,
+            test_json_extract_twin_fields_count,
+            &twin,
+            &found),
+        AZ_ERROR_EOF);
+  }
+}
+
 int test_az_json()
 {
   const struct CMUnitTest tests[]
       = { cmocka_unit_test(test_json_reader_init),   cmocka_unit_test(test_json_writer),
           cmocka_unit_test(test_json_reader),        cmocka_unit_test(test_json_reader_invalid),
-          cmocka_unit_test(test_json_skip_children), cmocka_unit_test(test_json_value) };
+          cmocka_unit_test(test_json_skip_children), cmocka_unit_test(test_json_value),
+          cmocka_unit_test(test_json_reader_number_parts),
+          cmocka_unit_test(test_json_reader_long_strings),
+          cmocka_unit_test(test_json_reader_chunked),
+          cmocka_unit_test(test_json_extract) };
   return cmocka_run_group_tests_name("az_core_json", tests, NULL, NULL);
 }
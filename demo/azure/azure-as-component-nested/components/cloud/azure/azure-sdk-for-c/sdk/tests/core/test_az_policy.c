@@ -37,6 +37,7 @@ void test_az_http_pipeline_policy_credential(void** state);
 void test_az_http_pipeline_policy_retry(void** state);
 void test_az_http_pipeline_policy_retry_with_header(void** state);
 void test_az_http_pipeline_policy_retry_with_header_2(void** state);
+void test_az_http_pipeline_policy_retry_with_deadline(void** state);
 #endif // _az_MOCK_ENABLED
 
 static az_result test_policy_transport(
@@ -328,6 +329,48 @@ void test_az_http_pipeline_policy_retry_with_header_2(void** state)
       az_http_pipeline_policy_retry(policies, &retry_options, &request, &response), AZ_OK);
 }
 
+void test_az_http_pipeline_policy_retry_with_deadline(void** state)
+{
+  (void)state;
+
+  uint8_t buf[100];
+  uint8_t header_buf[(2 * sizeof(az_pair))];
+  memset(buf, 0, sizeof(buf));
+  memset(header_buf, 0, sizeof(header_buf));
+
+  az_span url_span = AZ_SPAN_FROM_BUFFER(buf);
+  az_span remainder = az_span_copy(url_span, AZ_SPAN_FROM_STR("url"));
+  assert_int_equal(az_span_size(remainder), 97);
+  az_span header_span = AZ_SPAN_FROM_BUFFER(header_buf);
+  _az_http_request request;
+
+  // The first retry would be after at least 80% of 16 seconds, which is past the deadline.
+  az_context context = az_context_with_expiration(&az_context_app, 5000);
+  assert_return_code(
+      az_http_request_init(
+          &request, &context, az_http_method_get(), url_span, 3, header_span, AZ_SPAN_NULL),
+      AZ_OK);
+
+  az_http_policy_retry_options retry_options = _az_http_policy_retry_options_default();
+
+  _az_http_policy policies[1] = {
+            {
+              ._internal = {
+                .process = test_policy_transport_retry_response,
+                .options = NULL,
+              },
+            },
+        };
+
+  // The clock is read once, and the policy gives up without sleeping.
+  will_return(__wrap_az_platform_clock_msec, 0);
+
+  az_http_response response;
+  assert_true(
+      az_http_pipeline_policy_retry(policies, &retry_options, &request, &response)
+      == AZ_ERROR_CANCELED);
+}
+
 #endif // _az_MOCK_ENABLED
 
 int test_az_policy()
@@ -337,6 +380,7 @@ int test_az_policy()
     cmocka_unit_test(test_az_http_pipeline_policy_retry),
     cmocka_unit_test(test_az_http_pipeline_policy_retry_with_header),
     cmocka_unit_test(test_az_http_pipeline_policy_retry_with_header_2),
+    cmocka_unit_test(test_az_http_pipeline_policy_retry_with_deadline),
 #endif // _az_MOCK_ENABLED
     cmocka_unit_test(test_az_http_pipeline_policy_apiversion),
     cmocka_unit_test(test_az_http_pipeline_policy_telemetry),
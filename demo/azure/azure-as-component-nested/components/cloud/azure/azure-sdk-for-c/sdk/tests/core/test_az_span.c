@@ -14,6 +14,8 @@
 #include <math.h>
 #include <setjmp.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 #include <cmocka.h>
 
@@ -559,6 +561,47 @@ static void az_span_atod_test(void** state)
 #endif // _MSC_VER
 }
 
+static void az_span_atod_matches_strtod(void** state)
+{
+  (void)state;
+
+  // Inputs on both sides of the limits of the exact fast path, which must produce the same,
+  // correctly rounded, result as the general conversion.
+  char const* const inputs[] = {
+    "0.1",
+    "0.2",
+    "0.3",
+    "-0.0",
+    "3.141592653589793",
+    "2.718281828459045",
+    "22.5e-3",
+    "1e22",
+    "1e23",
+    "1e-22",
+    "1e-23",
+    "9007199254740992e22",
+    "9007199254740993e1",
+    "1234567890123456789",
+    "12345678901234567890",
+    "0.0000000000000000001",
+    "123456.789e-20",
+    "4.9406564584124654e-300",
+    "37.7749295",
+    "-122.4194155",
+    "1013.25",
+    "23.45E+2",
+    "23.45E-2",
+  };
+
+  for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++)
+  {
+    double value = 0;
+    assert_int_equal(az_span_atod(az_span_from_str((char*)inputs[i]), &value), AZ_OK);
+    assert_true(value == strtod(inputs[i], NULL));
+    assert_true(signbit(value) == signbit(strtod(inputs[i], NULL)));
+  }
+}
+
 #ifdef __GNUC__
 #pragma GCC diagnostic pop
 #endif // __GNUC__
@@ -855,6 +898,70 @@ static void az_span_find_overlapping_checks_success(void** state)
   assert_int_equal(az_span_find(source, az_span_slice(span, 2, 4)), 1);
 }
 
+static int32_t naive_find(az_span source, az_span target)
+{
+  for (int32_t i = 0; i + az_span_size(target) <= az_span_size(source); i++)
+  {
+    if (az_span_is_content_equal(az_span_slice(source, i, i + az_span_size(target)), target))
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void az_span_find_matches_naive_search(void** state)
+{
+  (void)state;
+
+  // A small alphabet produces many partial matches, and the long targets and sources take the
+  // skip table path, including targets longer than the largest skip.
+  uint8_t source_buffer[600];
+  uint8_t target_buffer[300];
+  uint32_t seed = 1;
+  for (int32_t round = 0; round < 2000; round++)
+  {
+    seed = seed * 1103515245 + 12345;
+    int32_t const source_size = (int32_t)((seed >> 8) % sizeof(source_buffer));
+    seed = seed * 1103515245 + 12345;
+    int32_t const target_size = (int32_t)((seed >> 8) % sizeof(target_buffer));
+
+    for (int32_t i = 0; i < source_size; i++)
+    {
+      seed = seed * 1103515245 + 12345;
+      source_buffer[i] = (uint8_t)('a' + ((seed >> 16) % 3));
+    }
+
+    az_span const source = az_span_init(source_buffer, source_size);
+    az_span target = az_span_init(target_buffer, target_size);
+
+    // Half of the time, take the target from the source so it is found.
+    seed = seed * 1103515245 + 12345;
+    if ((seed >> 16) % 2 == 0 && target_size <= source_size)
+    {
+      int32_t const start = (int32_t)((seed >> 8) % (uint32_t)(source_size - target_size + 1));
+      target = az_span_slice(source, start, start + target_size);
+    }
+    else
+    {
+      for (int32_t i = 0; i < target_size; i++)
+      {
+        seed = seed * 1103515245 + 12345;
+        target_buffer[i] = (uint8_t)('a' + ((seed >> 16) % 3));
+      }
+    }
+
+    assert_int_equal(az_span_find(source, target), naive_find(source, target));
+  }
+
+  az_span const topic = AZ_SPAN_FROM_STR(
+      "$iothub/twin/res/200/?$rid=1&$version=42&$content-type=application%2Fjson&$content-encoding="
+      "utf-8&iothub-connection-device-id=device-with-a-fairly-long-name");
+  assert_int_equal(az_span_find(topic, AZ_SPAN_FROM_STR("$iothub/twin/res/")), 0);
+  assert_int_equal(az_span_find(topic, AZ_SPAN_FROM_STR("device-with")), 126);
+  assert_int_equal(az_span_find(topic, AZ_SPAN_FROM_STR("$iothub/methods/POST/")), -1);
+}
+
 static void test_az_span_replace(void** state)
 {
   (void)state;
@@ -1343,6 +1450,59 @@ static void az_span_u32toa_overflow_fails(void** state)
   assert_true(az_span_u32toa(buffer, v, &out_span) == AZ_ERROR_INSUFFICIENT_SPAN_SIZE);
 }
 
+static void az_span_itoa_digit_count_boundaries(void** state)
+{
+  (void)state;
+  uint8_t raw_buffer[25];
+  char expected[25];
+  az_span out_span;
+
+  // Every power of ten, and one less, exercises each possible number of digits.
+  uint64_t power = 1;
+  for (int32_t i = 0; i < 20; i++)
+  {
+    uint64_t const values[] = { power - 1, power, power + 1 };
+    for (size_t v = 0; v < sizeof(values) / sizeof(values[0]); v++)
+    {
+      int32_t const size
+          = snprintf(expected, sizeof(expected), "%llu", (unsigned long long)values[v]);
+
+      // An exactly sized buffer is enough, one byte less isn't.
+      az_span buffer = az_span_init(raw_buffer, size);
+      assert_int_equal(az_span_u64toa(buffer, values[v], &out_span), AZ_OK);
+      assert_int_equal(az_span_size(out_span), 0);
+      assert_true(az_span_is_content_equal(buffer, az_span_init((uint8_t*)expected, size)));
+      assert_int_equal(
+          az_span_u64toa(az_span_init(raw_buffer, size - 1), values[v], &out_span),
+          AZ_ERROR_INSUFFICIENT_SPAN_SIZE);
+
+      if (values[v] <= UINT32_MAX)
+      {
+        assert_int_equal(az_span_u32toa(buffer, (uint32_t)values[v], &out_span), AZ_OK);
+        assert_int_equal(az_span_size(out_span), 0);
+        assert_true(az_span_is_content_equal(buffer, az_span_init((uint8_t*)expected, size)));
+      }
+    }
+    power *= 10;
+  }
+
+  az_span buffer = AZ_SPAN_FROM_BUFFER(raw_buffer);
+  assert_int_equal(az_span_u64toa(buffer, UINT64_MAX, &out_span), AZ_OK);
+  assert_true(az_span_is_content_equal(
+      az_span_slice(buffer, 0, _az_span_diff(out_span, buffer)),
+      AZ_SPAN_FROM_STR("18446744073709551615")));
+
+  assert_int_equal(az_span_i64toa(buffer, INT64_MIN, &out_span), AZ_OK);
+  assert_true(az_span_is_content_equal(
+      az_span_slice(buffer, 0, _az_span_diff(out_span, buffer)),
+      AZ_SPAN_FROM_STR("-9223372036854775808")));
+
+  assert_int_equal(az_span_i32toa(buffer, INT32_MIN, &out_span), AZ_OK);
+  assert_true(az_span_is_content_equal(
+      az_span_slice(buffer, 0, _az_span_diff(out_span, buffer)),
+      AZ_SPAN_FROM_STR("-2147483648")));
+}
+
 #define az_span_dtoa_succeeds_helper(v, fractional_digits, expected) \
   do \
   { \
@@ -1953,6 +2113,7 @@ int test_az_span()
     cmocka_unit_test(az_span_find_embedded_NULLs_success),
     cmocka_unit_test(az_span_find_capacity_checks_success),
     cmocka_unit_test(az_span_find_overlapping_checks_success),
+    cmocka_unit_test(az_span_find_matches_naive_search),
     cmocka_unit_test(test_az_span_replace),
     cmocka_unit_test(az_span_atox_return_errors),
     cmocka_unit_test(az_span_atou32_test),
@@ -1960,6 +2121,7 @@ int test_az_span()
     cmocka_unit_test(az_span_atou64_test),
     cmocka_unit_test(az_span_atoi64_test),
     cmocka_unit_test(az_span_atod_test),
+    cmocka_unit_test(az_span_atod_matches_strtod),
     cmocka_unit_test(az_span_ato_number_whitespace_or_invalid_not_allowed),
     cmocka_unit_test(az_span_ato_number_no_out_of_bounds_reads),
     cmocka_unit_test(az_span_i64toa_negative_number_test),
@@ -1976,6 +2138,7 @@ int test_az_span()
     cmocka_unit_test(az_span_u32toa_zero_succeeds),
     cmocka_unit_test(az_span_u32toa_max_uint_succeeds),
     cmocka_unit_test(az_span_u32toa_overflow_fails),
+    cmocka_unit_test(az_span_itoa_digit_count_boundaries),
     cmocka_unit_test(az_span_dtoa_succeeds),
     cmocka_unit_test(az_span_dtoa_overflow_fails),
     cmocka_unit_test(az_span_dtoa_too_large),
@@ -419,6 +419,81 @@ static void test_url_encode_full(void** state)
                        "****")));
 }
 
+static void test_url_encode_runs(void** state)
+{
+  (void)state;
+  {
+    // Unreserved runs that do and do not fill whole groups of four.
+    uint8_t buf[64] = { 0 };
+    az_span const buffer = AZ_SPAN_FROM_BUFFER(buf);
+    az_span const input = AZ_SPAN_FROM_STR("abcdefgh/ijklm nopq~rs.t-u_vwxyz0123456789/");
+
+    int32_t url_length = 0xFF;
+    assert_true(az_succeeded(_az_span_url_encode(buffer, input, &url_length)));
+
+    az_span const expected
+        = AZ_SPAN_FROM_STR("abcdefgh%2Fijklm%20nopq~rs.t-u_vwxyz0123456789%2F");
+    assert_int_equal(url_length, az_span_size(expected));
+    assert_true(az_span_is_content_equal(az_span_slice(buffer, 0, url_length), expected));
+  }
+  {
+    // Running out of space after a run was copied.
+    uint8_t buf20[20] = {
+      '*', '*', '*', '*', '*', '*', '*', '*', '*', '*',
+      '*', '*', '*', '*', '*', '*', '*', '*', '*', '*',
+    };
+
+    az_span const buffer11 = az_span_slice(AZ_SPAN_FROM_BUFFER(buf20), 0, 11);
+
+    int32_t url_length = 0xFF;
+    assert_true(
+        _az_span_url_encode(buffer11, AZ_SPAN_FROM_STR("abcdefgh//"), &url_length)
+        == AZ_ERROR_INSUFFICIENT_SPAN_SIZE);
+
+    assert_int_equal(url_length, 0);
+    assert_true(az_span_is_content_equal(
+        AZ_SPAN_FROM_BUFFER(buf20), AZ_SPAN_FROM_STR("abcdefgh************")));
+  }
+}
+
+static void test_url_encode_calc_length(void** state)
+{
+  (void)state;
+
+  assert_int_equal(_az_span_url_encode_calc_length(AZ_SPAN_NULL), 0);
+  assert_int_equal(_az_span_url_encode_calc_length(AZ_SPAN_FROM_STR("AbCdE")), 5);
+  assert_int_equal(_az_span_url_encode_calc_length(AZ_SPAN_FROM_STR("/")), 3);
+  assert_int_equal(
+      _az_span_url_encode_calc_length(AZ_SPAN_FROM_STR("https://vault.azure.net")),
+      sizeof("https%3A%2F%2Fvault.azure.net") - 1);
+
+  uint8_t values256[256] = { 0 };
+  for (size_t i = 0; i < _az_COUNTOF(values256); ++i)
+  {
+    values256[i] = (uint8_t)i;
+  }
+
+  // The calculated length is exactly what encoding writes.
+  uint8_t buf[256 * 3] = { 0 };
+  int32_t const calc_length = _az_span_url_encode_calc_length(AZ_SPAN_FROM_BUFFER(values256));
+
+  int32_t url_length = 0xFF;
+  assert_true(az_succeeded(_az_span_url_encode(
+      az_span_slice(AZ_SPAN_FROM_BUFFER(buf), 0, calc_length),
+      AZ_SPAN_FROM_BUFFER(values256),
+      &url_length)));
+  assert_int_equal(url_length, calc_length);
+
+  url_length = 0xFF;
+  assert_true(
+      _az_span_url_encode(
+          az_span_slice(AZ_SPAN_FROM_BUFFER(buf), 0, calc_length - 1),
+          AZ_SPAN_FROM_BUFFER(values256),
+          &url_length)
+      == AZ_ERROR_INSUFFICIENT_SPAN_SIZE);
+  assert_int_equal(url_length, 0);
+}
+
 int test_az_url_encode()
 {
   struct CMUnitTest const tests[] = {
@@ -426,6 +501,8 @@ int test_az_url_encode()
     cmocka_unit_test(test_url_encode_preconditions),
     cmocka_unit_test(test_url_encode_usage),
     cmocka_unit_test(test_url_encode_full),
+    cmocka_unit_test(test_url_encode_runs),
+    cmocka_unit_test(test_url_encode_calc_length),
   };
 
   return cmocka_run_group_tests_name("az_core_encode", tests, NULL, NULL);
@@ -0,0 +1,41 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cmocka.h>
+
+#include <azure/core/az_http_transport.h>
+
+#include <curl/curl.h>
+
+#include <azure/core/_az_cfg.h>
+
+void test_az_curl_handle_pool_reuses_handle(void** state);
+void test_az_curl_handle_pool_resets_handle(void** state);
+void test_az_curl_handle_pool_full(void** state);
+void test_az_curl_cleanup(void** state);
+
+int main(void)
+{
+  if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK)
+  {
+    return 1;
+  }
+
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_az_curl_handle_pool_reuses_handle),
+    cmocka_unit_test(test_az_curl_handle_pool_resets_handle),
+    cmocka_unit_test(test_az_curl_handle_pool_full),
+    cmocka_unit_test(test_az_curl_cleanup),
+  };
+
+  int const result = cmocka_run_group_tests_name("az_curl", tests, NULL, NULL);
+
+  az_http_client_cleanup();
+  curl_global_cleanup();
+  return result;
+}
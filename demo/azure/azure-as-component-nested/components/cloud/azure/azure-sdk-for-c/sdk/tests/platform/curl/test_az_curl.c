@@ -0,0 +1,99 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include "az_curl_private.h"
+#include <azure/core/az_http_transport.h>
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cmocka.h>
+
+#include <azure/core/_az_cfg.h>
+
+void test_az_curl_handle_pool_reuses_handle(void** state);
+void test_az_curl_handle_pool_reuses_handle(void** state)
+{
+  (void)state;
+  CURL* handle = NULL;
+  assert_int_equal(_az_http_client_curl_init(&handle), AZ_OK);
+  assert_non_null(handle);
+  CURL* const first = handle;
+
+  // A handle used successfully goes back to the pool, and is taken by the next request.
+  assert_int_equal(_az_http_client_curl_done(&handle, true), AZ_OK);
+  assert_null(handle);
+  assert_int_equal(_az_http_client_curl_pool_count_get(), 1);
+
+  assert_int_equal(_az_http_client_curl_init(&handle), AZ_OK);
+  assert_ptr_equal(handle, first);
+  assert_int_equal(_az_http_client_curl_pool_count_get(), 0);
+
+  // A handle whose request failed is destroyed rather than reused.
+  assert_int_equal(_az_http_client_curl_done(&handle, false), AZ_OK);
+  assert_null(handle);
+  assert_int_equal(_az_http_client_curl_pool_count_get(), 0);
+}
+
+void test_az_curl_handle_pool_resets_handle(void** state);
+void test_az_curl_handle_pool_resets_handle(void** state)
+{
+  (void)state;
+  static int request_context = 0;
+  CURL* handle = NULL;
+  assert_int_equal(_az_http_client_curl_init(&handle), AZ_OK);
+  assert_int_equal(curl_easy_setopt(handle, CURLOPT_PRIVATE, &request_context), CURLE_OK);
+  assert_int_equal(_az_http_client_curl_done(&handle, true), AZ_OK);
+
+  // The options set for the previous request don't carry over to the next one.
+  assert_int_equal(_az_http_client_curl_init(&handle), AZ_OK);
+  void* private_data = &request_context;
+  assert_int_equal(curl_easy_getinfo(handle, CURLINFO_PRIVATE, &private_data), CURLE_OK);
+  assert_null(private_data);
+
+  assert_int_equal(_az_http_client_curl_done(&handle, false), AZ_OK);
+}
+
+void test_az_curl_handle_pool_full(void** state);
+void test_az_curl_handle_pool_full(void** state)
+{
+  (void)state;
+  CURL* handles[AZ_CURL_HANDLE_POOL_SIZE + 1];
+  for (int32_t i = 0; i < AZ_CURL_HANDLE_POOL_SIZE + 1; i++)
+  {
+    assert_int_equal(_az_http_client_curl_init(&handles[i]), AZ_OK);
+  }
+
+  // The pool keeps as many handles as it has room for, and the one more is destroyed.
+  for (int32_t i = 0; i < AZ_CURL_HANDLE_POOL_SIZE + 1; i++)
+  {
+    assert_int_equal(_az_http_client_curl_done(&handles[i], true), AZ_OK);
+    assert_null(handles[i]);
+  }
+  assert_int_equal(_az_http_client_curl_pool_count_get(), AZ_CURL_HANDLE_POOL_SIZE);
+
+  az_http_client_cleanup();
+  assert_int_equal(_az_http_client_curl_pool_count_get(), 0);
+}
+
+void test_az_curl_cleanup(void** state);
+void test_az_curl_cleanup(void** state)
+{
+  (void)state;
+  CURL* handle = NULL;
+  assert_int_equal(_az_http_client_curl_init(&handle), AZ_OK);
+  assert_int_equal(_az_http_client_curl_done(&handle, true), AZ_OK);
+  assert_int_equal(_az_http_client_curl_pool_count_get(), 1);
+
+  az_http_client_cleanup();
+  assert_int_equal(_az_http_client_curl_pool_count_get(), 0);
+
+  // Cleaning up an empty pool does nothing, and requests after it create handles afresh.
+  az_http_client_cleanup();
+  assert_int_equal(_az_http_client_curl_pool_count_get(), 0);
+  assert_int_equal(_az_http_client_curl_init(&handle), AZ_OK);
+  assert_non_null(handle);
+  assert_int_equal(_az_http_client_curl_done(&handle, false), AZ_OK);
+}
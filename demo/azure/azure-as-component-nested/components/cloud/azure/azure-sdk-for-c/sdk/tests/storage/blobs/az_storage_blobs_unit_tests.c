@@ -24,3 +24,127 @@ void test_storage_blobs_init(void** state)
           &client, AZ_SPAN_FROM_STR("url"), AZ_CREDENTIAL_ANONYMOUS, &opts)
       == AZ_OK);
 }
+
+typedef struct
+{
+  az_span content;
+  int32_t read_size;
+  int32_t reads;
+} test_blob_reader;
+
+static az_result test_blob_read(void* user_context, az_span destination, int32_t* out_size)
+{
+  test_blob_reader* reader = (test_blob_reader*)user_context;
+  int32_t size = az_span_size(reader->content);
+  size = size < reader->read_size ? size : reader->read_size;
+  size = size < az_span_size(destination) ? size : az_span_size(destination);
+
+  az_span_copy(destination, az_span_slice(reader->content, 0, size));
+  reader->content = az_span_slice_to_end(reader->content, size);
+  reader->reads++;
+  *out_size = size;
+  return AZ_OK;
+}
+
+void test_storage_blobs_upload_blocks_fills_block(void** state);
+void test_storage_blobs_upload_blocks_fills_block(void** state)
+{
+  (void)state;
+  az_storage_blobs_blob_client client = { 0 };
+  az_storage_blobs_blob_client_options opts = az_storage_blobs_blob_client_options_default();
+  assert_true(
+      az_storage_blobs_blob_client_init(
+          &client, AZ_SPAN_FROM_STR("http://host/container/blob"), AZ_CREDENTIAL_ANONYMOUS, &opts)
+      == AZ_OK);
+
+  uint8_t response_buffer[64];
+  az_http_response response = { 0 };
+  assert_true(az_http_response_init(&response, AZ_SPAN_FROM_BUFFER(response_buffer)) == AZ_OK);
+
+  uint8_t content[100];
+  for (int32_t i = 0; i < (int32_t)sizeof(content); i++)
+  {
+    content[i] = (uint8_t)i;
+  }
+
+  // Reads of 50 bytes fill the 80 byte block in two reads, and only then is the block sent, which
+  // fails without an HTTP transport.
+  test_blob_reader reader = { .content = AZ_SPAN_FROM_BUFFER(content), .read_size = 50 };
+  uint8_t block_buffer[80];
+  uint8_t block_list_buffer[61 + 25];
+  assert_true(
+      az_storage_blobs_blob_upload_blocks(
+          &client,
+          &az_context_app,
+          test_blob_read,
+          &reader,
+          AZ_SPAN_FROM_BUFFER(block_buffer),
+          AZ_SPAN_FROM_BUFFER(block_list_buffer),
+          NULL,
+          &response)
+      == AZ_ERROR_NOT_IMPLEMENTED);
+  assert_int_equal(reader.reads, 2);
+  assert_int_equal(az_span_size(reader.content), 100 - 80);
+  assert_memory_equal(block_buffer, content, sizeof(block_buffer));
+}
+
+void test_storage_blobs_upload_blocks_list_too_small(void** state);
+void test_storage_blobs_upload_blocks_list_too_small(void** state)
+{
+  (void)state;
+  az_storage_blobs_blob_client client = { 0 };
+  az_storage_blobs_blob_client_options opts = az_storage_blobs_blob_client_options_default();
+  assert_true(
+      az_storage_blobs_blob_client_init(
+          &client, AZ_SPAN_FROM_STR("http://host/container/blob"), AZ_CREDENTIAL_ANONYMOUS, &opts)
+      == AZ_OK);
+
+  uint8_t response_buffer[64];
+  az_http_response response = { 0 };
+  assert_true(az_http_response_init(&response, AZ_SPAN_FROM_BUFFER(response_buffer)) == AZ_OK);
+
+  // A block list buffer one byte short of the block list for one block fails once the block is
+  // read, before sending it: without an HTTP transport, sending would fail differently.
+  test_blob_reader reader = { .content = AZ_SPAN_FROM_STR("0123456789"), .read_size = 10 };
+  uint8_t block_buffer[10];
+  uint8_t block_list_buffer[61 + 25 - 1];
+  assert_true(
+      az_storage_blobs_blob_upload_blocks(
+          &client,
+          &az_context_app,
+          test_blob_read,
+          &reader,
+          AZ_SPAN_FROM_BUFFER(block_buffer),
+          AZ_SPAN_FROM_BUFFER(block_list_buffer),
+          NULL,
+          &response)
+      == AZ_ERROR_INSUFFICIENT_SPAN_SIZE);
+  assert_int_equal(az_span_size(reader.content), 0);
+}
+
+void test_storage_blobs_put_block_list_buffer_too_small(void** state);
+void test_storage_blobs_put_block_list_buffer_too_small(void** state)
+{
+  (void)state;
+  az_storage_blobs_blob_client client = { 0 };
+  az_storage_blobs_blob_client_options opts = az_storage_blobs_blob_client_options_default();
+  assert_true(
+      az_storage_blobs_blob_client_init(
+          &client, AZ_SPAN_FROM_STR("http://host/container/blob"), AZ_CREDENTIAL_ANONYMOUS, &opts)
+      == AZ_OK);
+
+  uint8_t response_buffer[64];
+  az_http_response response = { 0 };
+  assert_true(az_http_response_init(&response, AZ_SPAN_FROM_BUFFER(response_buffer)) == AZ_OK);
+
+  // The XML declaration and BlockList element take 61 bytes, and each block 25 more.
+  uint8_t buffer[61 + 2 * 25];
+  assert_true(
+      az_storage_blobs_blob_put_block_list(
+          &client, &az_context_app, 3, AZ_SPAN_FROM_BUFFER(buffer), &response)
+      == AZ_ERROR_INSUFFICIENT_SPAN_SIZE);
+  assert_true(
+      az_storage_blobs_blob_put_block_list(
+          &client, &az_context_app, 2, AZ_SPAN_FROM_BUFFER(buffer), &response)
+      == AZ_ERROR_NOT_IMPLEMENTED);
+}
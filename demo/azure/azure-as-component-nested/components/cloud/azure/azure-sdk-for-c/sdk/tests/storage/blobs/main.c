@@ -11,11 +11,17 @@
 #include <azure/core/_az_cfg.h>
 
 void test_storage_blobs_init(void** state);
+void test_storage_blobs_upload_blocks_fills_block(void** state);
+void test_storage_blobs_upload_blocks_list_too_small(void** state);
+void test_storage_blobs_put_block_list_buffer_too_small(void** state);
 
 int main(void)
 {
   const struct CMUnitTest tests[] = {
     cmocka_unit_test(test_storage_blobs_init),
+    cmocka_unit_test(test_storage_blobs_upload_blocks_fills_block),
+    cmocka_unit_test(test_storage_blobs_upload_blocks_list_too_small),
+    cmocka_unit_test(test_storage_blobs_put_block_list_buffer_too_small),
   };
 
   return cmocka_run_group_tests_name("az_storage_blobs", tests, NULL, NULL);
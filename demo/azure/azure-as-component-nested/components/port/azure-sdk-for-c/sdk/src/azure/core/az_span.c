@@ -11,10 +11,12 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <float.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <azure/core/_az_cfg.h>
 
@@ -170,14 +172,90 @@ static void _az_span_ato_number_helper(
 #pragma warning(pop)
 #endif
 
+// Converts a span made up only of decimal digits into a number no larger than max_value, without
+// going through sscanf. Returns false, leaving the conversion to _az_span_ato_number_helper, if the
+// span contains anything else such as a sign or whitespace.
+AZ_NODISCARD static bool _az_span_digits_to_u64(
+    az_span source,
+    uint64_t max_value,
+    uint64_t* out_number,
+    bool* out_success)
+{
+  int32_t const size = az_span_size(source);
+  uint8_t const* const source_ptr = az_span_ptr(source);
+
+  if (size < 1)
+  {
+    return false;
+  }
+
+  uint64_t value = 0;
+  bool overflow = false;
+  for (int32_t i = 0; i < size; i++)
+  {
+    uint8_t const digit = (uint8_t)(source_ptr[i] - '0');
+    if (digit > 9)
+    {
+      return false;
+    }
+
+    // Keep going after an overflow, since a non-digit later on still means the fallback applies.
+    if (value > (max_value - digit) / 10)
+    {
+      overflow = true;
+    }
+    else
+    {
+      value = (value * 10) + digit;
+    }
+  }
+
+  if (!overflow)
+  {
+    *out_number = value;
+  }
+  *out_success = !overflow;
+  return true;
+}
+
+// Converts an optionally negative run of decimal digits into an int64_t, see
+// _az_span_digits_to_u64.
+AZ_NODISCARD static bool _az_span_digits_to_i64(
+    az_span source,
+    int64_t* out_number,
+    bool* out_success)
+{
+  bool const is_negative = az_span_size(source) > 0 && az_span_ptr(source)[0] == '-';
+  uint64_t const max_value = is_negative ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+
+  uint64_t value = 0;
+  if (!_az_span_digits_to_u64(
+          az_span_slice_to_end(source, is_negative ? 1 : 0), max_value, &value, out_success))
+  {
+    return false;
+  }
+
+  if (*out_success)
+  {
+    // Negate without overflowing on INT64_MIN, whose magnitude doesn't fit in an int64_t.
+    *out_number = is_negative ? (value == 0 ? 0 : -(int64_t)(value - 1) - 1) : (int64_t)value;
+  }
+  return true;
+}
+
 AZ_NODISCARD az_result az_span_atou64(az_span source, uint64_t* out_number)
 {
   _az_PRECONDITION_VALID_SPAN(source, 1, false);
   _az_PRECONDITION_NOT_NULL(out_number);
 
+  bool success = false;
+  if (_az_span_digits_to_u64(source, UINT64_MAX, out_number, &success))
+  {
+    return success ? AZ_OK : AZ_ERROR_UNEXPECTED_CHAR;
+  }
+
   // Stack based string to allow thread-safe mutation by _az_span_ato_number_helper
   char format_template[9] = "%00llu%n";
-  bool success = false;
   _az_span_ato_number_helper(source, false, format_template, out_number, &success);
 
   return success ? AZ_OK : AZ_ERROR_UNEXPECTED_CHAR;
@@ -188,16 +266,9 @@ AZ_NODISCARD az_result az_span_atou32(az_span source, uint32_t* out_number)
   _az_PRECONDITION_VALID_SPAN(source, 1, false);
   _az_PRECONDITION_NOT_NULL(out_number);
 
+  // Converting to a uint64_t to properly validate values that are out-of-range for uint32_t.
   uint64_t placeholder = 0;
-
-  // Stack based string to allow thread-safe mutation by _az_span_ato_number_helper
-  // Using a format string for uint64_t to properly validate values that are out-of-range for
-  // uint32_t.
-  char format_template[9] = "%00llu%n";
-  bool success = false;
-  _az_span_ato_number_helper(source, false, format_template, &placeholder, &success);
-
-  if (placeholder > UINT32_MAX || !success)
+  if (az_span_atou64(source, &placeholder) != AZ_OK || placeholder > UINT32_MAX)
   {
     return AZ_ERROR_UNEXPECTED_CHAR;
   }
@@ -211,9 +282,14 @@ AZ_NODISCARD az_result az_span_atoi64(az_span source, int64_t* out_number)
   _az_PRECONDITION_VALID_SPAN(source, 1, false);
   _az_PRECONDITION_NOT_NULL(out_number);
 
+  bool success = false;
+  if (_az_span_digits_to_i64(source, out_number, &success))
+  {
+    return success ? AZ_OK : AZ_ERROR_UNEXPECTED_CHAR;
+  }
+
   // Stack based string to allow thread-safe mutation by _az_span_ato_number_helper
   char format_template[9] = "%00lld%n";
-  bool success = false;
   _az_span_ato_number_helper(source, true, format_template, out_number, &success);
 
   return success ? AZ_OK : AZ_ERROR_UNEXPECTED_CHAR;
@@ -224,16 +300,10 @@ AZ_NODISCARD az_result az_span_atoi32(az_span source, int32_t* out_number)
   _az_PRECONDITION_VALID_SPAN(source, 1, false);
   _az_PRECONDITION_NOT_NULL(out_number);
 
+  // Converting to an int64_t to properly validate values that are out-of-range for int32_t.
   int64_t placeholder = 0;
-
-  // Stack based string to allow thread-safe mutation by _az_span_ato_number_helper
-  // Using a format string for int64_t to properly validate values that are out-of-range for
-  // int32_t.
-  char format_template[9] = "%00lld%n";
-  bool success = false;
-  _az_span_ato_number_helper(source, true, format_template, &placeholder, &success);
-
-  if (placeholder > INT32_MAX || placeholder < INT32_MIN || !success)
+  if (az_span_atoi64(source, &placeholder) != AZ_OK || placeholder > INT32_MAX
+      || placeholder < INT32_MIN)
   {
     return AZ_ERROR_UNEXPECTED_CHAR;
   }
@@ -242,11 +312,132 @@ AZ_NODISCARD az_result az_span_atoi32(az_span source, int32_t* out_number)
   return AZ_OK;
 }
 
+// The fast path relies on every double operation being rounded to double precision, which isn't
+// the case when intermediate results are kept in extended precision (such as on x87).
+#if !defined(FLT_EVAL_METHOD) || FLT_EVAL_METHOD == 0
+#define _az_SPAN_ATOD_FAST_PATH
+#endif
+
+#ifdef _az_SPAN_ATOD_FAST_PATH
+// Clinger's fast path: when the decimal significand is exactly representable as a double (at most
+// 2^53) and the power of ten is within [-22, 22] (all of which are exact doubles), a single
+// correctly rounded multiplication or division gives the correctly rounded result.
+// Returns false for anything else, including any syntax other than
+// [-]digits[.digits][e[+|-]digits], leaving the conversion to _az_span_ato_number_helper.
+AZ_NODISCARD static bool _az_span_atod_fast(az_span source, double* out_number)
+{
+  static double const exact_powers_of_ten[]
+      = { 1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+          1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+  int32_t const max_exact_power = 22;
+  // Any 19 digit decimal number fits in a uint64_t.
+  int32_t const max_significand_digits = 19;
+
+  int32_t const size = az_span_size(source);
+  uint8_t const* const source_ptr = az_span_ptr(source);
+  int32_t index = 0;
+
+  bool const is_negative = size > 0 && source_ptr[0] == '-';
+  if (is_negative)
+  {
+    index++;
+  }
+
+  uint64_t significand = 0;
+  int32_t significand_digits = 0;
+  int32_t exponent = 0;
+
+  int32_t const integer_start = index;
+  for (; index < size && isdigit(source_ptr[index]); index++)
+  {
+    if (++significand_digits > max_significand_digits)
+    {
+      return false;
+    }
+    significand = (significand * 10) + (uint64_t)(source_ptr[index] - '0');
+  }
+
+  if (index == integer_start)
+  {
+    return false;
+  }
+
+  if (index < size && source_ptr[index] == '.')
+  {
+    index++;
+    int32_t const fraction_start = index;
+    for (; index < size && isdigit(source_ptr[index]); index++)
+    {
+      if (++significand_digits > max_significand_digits)
+      {
+        return false;
+      }
+      significand = (significand * 10) + (uint64_t)(source_ptr[index] - '0');
+      exponent--;
+    }
+
+    if (index == fraction_start)
+    {
+      return false;
+    }
+  }
+
+  if (index < size && (source_ptr[index] == 'e' || source_ptr[index] == 'E'))
+  {
+    index++;
+    bool const is_exponent_negative = index < size && source_ptr[index] == '-';
+    if (index < size && (source_ptr[index] == '-' || source_ptr[index] == '+'))
+    {
+      index++;
+    }
+
+    int32_t const exponent_start = index;
+    int32_t explicit_exponent = 0;
+    for (; index < size && isdigit(source_ptr[index]); index++)
+    {
+      // Anything this large is out of range for the fast path, stop before it could overflow.
+      if (explicit_exponent > 1000)
+      {
+        return false;
+      }
+      explicit_exponent = (explicit_exponent * 10) + (source_ptr[index] - '0');
+    }
+
+    if (index == exponent_start)
+    {
+      return false;
+    }
+
+    exponent += is_exponent_negative ? -explicit_exponent : explicit_exponent;
+  }
+
+  if (index != size || significand > ((uint64_t)_az_MAX_SAFE_INTEGER + 1)
+      || exponent < -max_exact_power || exponent > max_exact_power)
+  {
+    return false;
+  }
+
+  double value = (double)significand;
+  value = exponent < 0 ? value / exact_powers_of_ten[-exponent]
+                       : value * exact_powers_of_ten[exponent];
+
+  *out_number = is_negative ? -value : value;
+  return true;
+}
+#endif // _az_SPAN_ATOD_FAST_PATH
+
 AZ_NODISCARD az_result az_span_atod(az_span source, double* out_number)
 {
   _az_PRECONDITION_VALID_SPAN(source, 1, false);
   _az_PRECONDITION_NOT_NULL(out_number);
 
+#ifdef _az_SPAN_ATOD_FAST_PATH
+  if (_az_span_atod_fast(source, out_number))
+  {
+    return AZ_OK;
+  }
+#endif // _az_SPAN_ATOD_FAST_PATH
+
   // Stack based string to allow thread-safe mutation by _az_span_ato_number_helper
   char format_template[8] = "%00lf%n";
   bool success = false;
@@ -255,28 +446,58 @@ AZ_NODISCARD az_result az_span_atod(az_span source, double* out_number)
   return success ? AZ_OK : AZ_ERROR_UNEXPECTED_CHAR;
 }
 
-AZ_NODISCARD int32_t az_span_find(az_span source, az_span target)
+enum
+{
+  // Needles at least this long are searched for with Boyer-Moore-Horspool, whose skips grow with
+  // the needle; shorter ones can't skip far enough to repay building the skip table.
+  _az_SPAN_FIND_HORSPOOL_MIN_TARGET_SIZE = 8,
+
+  // The haystack must be at least this many bytes longer than the needle for the skip table to pay
+  // for itself.
+  _az_SPAN_FIND_HORSPOOL_MIN_SLACK = 64,
+
+  // Skips are stored as bytes so the table takes 256 bytes of stack, never more. Clamping a skip
+  // only makes the search move more slowly, it can't make it miss a match.
+  _az_SPAN_FIND_MAX_SKIP = UINT8_MAX,
+};
+
+// Boyer-Moore-Horspool: compare the byte of `source` under the last byte of `target` and, on a
+// mismatch, skip ahead by how far that byte is from the end of `target`.
+AZ_NODISCARD static int32_t _az_span_find_horspool(
+    uint8_t const* source_ptr,
+    int32_t source_size,
+    uint8_t const* target_ptr,
+    int32_t target_size)
 {
-  /* This function implements the Naive string-search algorithm.
-   * The rationale to use this algorithm instead of other potentialy more
-   * performing ones (Rabin-Karp, e.g.) is due to no additional space needed.
-   * The logic:
-   * 1. The function will look into each position of `source` if it contains the same value as the
-   * first position of `target`.
-   * 2. If it does, it could be that the next bytes in `source` are a perfect match of the remaining
-   * bytes of `target`.
-   * 3. Being so, it loops through the remaining bytes of `target` and see if they match exactly the
-   * next bytes of `source`.
-   * 4. If the loop gets to the end (all bytes of `target` are evaluated), it means `target` indeed
-   * occurs in that position of `source`.
-   * 5. If the loop gets interrupted before cruising through the entire `target`, the function must
-   * go back to step 1. from  the next position in `source`.
-   *   The loop in 5. gets interrupted if
-   *     - a byte in `target` is different than `source`, in the expected corresponding position;
-   *     - the loop has reached the end of `source` (and there are still remaing bytes of `target`
-   *         to be checked).
-   */
+  uint8_t skip[UINT8_MAX + 1];
+  int32_t const last = target_size - 1;
+
+  int32_t const default_skip = target_size > _az_SPAN_FIND_MAX_SKIP ? _az_SPAN_FIND_MAX_SKIP
+                                                                   : target_size;
+  memset(skip, default_skip, sizeof(skip));
+  for (int32_t i = 0; i < last; i++)
+  {
+    int32_t const distance = last - i;
+    skip[target_ptr[i]]
+        = (uint8_t)(distance > _az_SPAN_FIND_MAX_SKIP ? _az_SPAN_FIND_MAX_SKIP : distance);
+  }
 
+  int32_t const last_start = source_size - target_size;
+  for (int32_t i = 0; i <= last_start;)
+  {
+    uint8_t const byte = source_ptr[i + last];
+    if (byte == target_ptr[last] && memcmp(source_ptr + i, target_ptr, (size_t)last) == 0)
+    {
+      return i;
+    }
+    i += skip[byte];
+  }
+
+  return -1;
+}
+
+AZ_NODISCARD int32_t az_span_find(az_span source, az_span target)
+{
   int32_t source_size = az_span_size(source);
   int32_t target_size = az_span_size(target);
   const int32_t target_not_found = -1;
@@ -285,49 +506,42 @@ AZ_NODISCARD int32_t az_span_find(az_span source, az_span target)
   {
     return 0;
   }
-  else if (source_size < target_size)
+
+  if (source_size < target_size)
   {
     return target_not_found;
   }
-  else
+
+  uint8_t const* source_ptr = az_span_ptr(source);
+  uint8_t const* target_ptr = az_span_ptr(target);
+
+  if (target_size >= _az_SPAN_FIND_HORSPOOL_MIN_TARGET_SIZE
+      && source_size - target_size >= _az_SPAN_FIND_HORSPOOL_MIN_SLACK)
   {
-    uint8_t* source_ptr = az_span_ptr(source);
-    uint8_t* target_ptr = az_span_ptr(target);
+    return _az_span_find_horspool(source_ptr, source_size, target_ptr, target_size);
+  }
 
-    // This loop traverses `source` position by position (step 1.)
-    for (int32_t i = 0; i < (source_size - target_size + 1); i++)
+  // For short needles, let memchr (which the C library typically vectorizes) find each candidate
+  // position for the first byte, then compare the rest of `target` there.
+  int32_t const last_start = source_size - target_size;
+  int32_t i = 0;
+  while (i <= last_start)
+  {
+    uint8_t const* candidate
+        = (uint8_t const*)memchr(source_ptr + i, target_ptr[0], (size_t)(last_start - i + 1));
+    if (candidate == NULL)
     {
-      // This is the check done in step 1. above.
-      if (source_ptr[i] == target_ptr[0])
-      {
-        // The condition in step 2. has been satisfied.
-        int32_t j;
-        // This is the loop defined in step 3.
-        // The loop must be broken if it reaches the ends of `target` (step 3.) OR `source`
-        // (step 5.).
-        for (j = 1; j < target_size && (i + j) < source_size; j++)
-        {
-          // Condition defined in step 5.
-          if (source_ptr[i + j] != target_ptr[j])
-          {
-            break;
-          }
-        }
-
-        if (j == target_size)
-        {
-          // All bytes in `target` have been checked and matched the corresponding bytes in `source`
-          // (from the start point `i`), so this is indeed an instance of `target` in that position
-          // of `source` (step 4.).
+      break;
+    }
 
-          return i;
-        }
-      }
+    i = (int32_t)(candidate - source_ptr);
+    if (memcmp(candidate + 1, target_ptr + 1, (size_t)target_size - 1) == 0)
+    {
+      return i;
     }
+    i++;
   }
 
-  // If the function hasn't returned before, all positions
-  // of `source` have been evaluated but `target` could not be found.
   return target_not_found;
 }
 
@@ -475,38 +689,77 @@ AZ_NODISCARD az_result _az_span_replace(
   return AZ_OK;
 }
 
-AZ_INLINE uint8_t _az_decimal_to_ascii(uint8_t d) { return (uint8_t)(('0' + d) & 0xFF); }
+// The two digit decimal representations of 0 through 99, so that formatting a number takes one
+// division per pair of digits rather than one per digit.
+static char const _az_decimal_digit_pairs[] = "0001020304050607080910111213141516171819"
+                                               "2021222324252627282930313233343536373839"
+                                               "4041424344454647484950515253545556575859"
+                                               "6061626364656667686970717273747576777879"
+                                               "8081828384858687888990919293949596979899";
 
-static AZ_NODISCARD az_result _az_span_builder_append_uint64(az_span* ref_span, uint64_t n)
+AZ_NODISCARD static int32_t _az_decimal_digit_count(uint64_t n)
 {
-  AZ_RETURN_IF_NOT_ENOUGH_SIZE(*ref_span, 1);
+  int32_t digit_count = 1;
+  while (n >= 10000)
+  {
+    n /= 10000;
+    digit_count += 4;
+  }
 
-  if (n == 0)
+  if (n >= 1000)
   {
-    *ref_span = az_span_copy_u8(*ref_span, '0');
-    return AZ_OK;
+    return digit_count + 3;
   }
+  if (n >= 100)
+  {
+    return digit_count + 2;
+  }
+  return n >= 10 ? digit_count + 1 : digit_count;
+}
 
-  uint64_t div = 10000000000000000000ull;
-  uint64_t nn = n;
-  int32_t digit_count = 20;
-  while (nn / div == 0)
+// Writes the digits backwards from the end of the buffer, two at a time, switching to 32-bit
+// arithmetic once the remaining value fits, since 64-bit division is a library call on the 32-bit
+// targets this commonly runs on.
+static void _az_write_decimal_digits(uint8_t* end, uint64_t n)
+{
+  while (n > UINT32_MAX)
   {
-    div /= 10;
-    digit_count--;
+    uint32_t const pair = (uint32_t)(n % 100);
+    n /= 100;
+    end -= 2;
+    end[0] = (uint8_t)_az_decimal_digit_pairs[pair * 2];
+    end[1] = (uint8_t)_az_decimal_digit_pairs[pair * 2 + 1];
   }
 
-  AZ_RETURN_IF_NOT_ENOUGH_SIZE(*ref_span, digit_count);
+  uint32_t nn = (uint32_t)n;
+  while (nn >= 100)
+  {
+    uint32_t const pair = nn % 100;
+    nn /= 100;
+    end -= 2;
+    end[0] = (uint8_t)_az_decimal_digit_pairs[pair * 2];
+    end[1] = (uint8_t)_az_decimal_digit_pairs[pair * 2 + 1];
+  }
 
-  while (div > 1)
+  if (nn >= 10)
+  {
+    end -= 2;
+    end[0] = (uint8_t)_az_decimal_digit_pairs[nn * 2];
+    end[1] = (uint8_t)_az_decimal_digit_pairs[nn * 2 + 1];
+  }
+  else
   {
-    uint8_t value_to_append = _az_decimal_to_ascii((uint8_t)(nn / div));
-    *ref_span = az_span_copy_u8(*ref_span, value_to_append);
-    nn %= div;
-    div /= 10;
+    end[-1] = (uint8_t)('0' + nn);
   }
-  uint8_t value_to_append = _az_decimal_to_ascii((uint8_t)nn);
-  *ref_span = az_span_copy_u8(*ref_span, value_to_append);
+}
+
+static AZ_NODISCARD az_result _az_span_builder_append_uint64(az_span* ref_span, uint64_t n)
+{
+  int32_t const digit_count = _az_decimal_digit_count(n);
+  AZ_RETURN_IF_NOT_ENOUGH_SIZE(*ref_span, digit_count);
+
+  _az_write_decimal_digits(az_span_ptr(*ref_span) + digit_count, n);
+  *ref_span = az_span_slice_to_end(*ref_span, digit_count);
   return AZ_OK;
 }
 
@@ -528,7 +781,8 @@ AZ_NODISCARD az_result az_span_i64toa(az_span destination, int64_t source, az_sp
   {
     AZ_RETURN_IF_NOT_ENOUGH_SIZE(destination, 1);
     *out_span = az_span_copy_u8(destination, '-');
-    return _az_span_builder_append_uint64(out_span, (uint64_t)-source);
+    // Negate in unsigned arithmetic so that INT64_MIN doesn't overflow.
+    return _az_span_builder_append_uint64(out_span, 0 - (uint64_t)source);
   }
 
   // make out_span point to destination before trying to write on it (might be an empty az_span or
@@ -540,38 +794,8 @@ AZ_NODISCARD az_result az_span_i64toa(az_span destination, int64_t source, az_sp
 static AZ_NODISCARD az_result
 _az_span_builder_append_u32toa(az_span destination, uint32_t n, az_span* out_span)
 {
-  AZ_RETURN_IF_NOT_ENOUGH_SIZE(destination, 1);
-
-  if (n == 0)
-  {
-    *out_span = az_span_copy_u8(destination, '0');
-    return AZ_OK;
-  }
-
-  uint32_t div = 1000000000;
-  uint32_t nn = n;
-  int32_t digit_count = 10;
-  while (nn / div == 0)
-  {
-    div /= 10;
-    digit_count--;
-  }
-
-  AZ_RETURN_IF_NOT_ENOUGH_SIZE(destination, digit_count);
-
+  AZ_RETURN_IF_FAILED(_az_span_builder_append_uint64(&destination, n));
   *out_span = destination;
-
-  while (div > 1)
-  {
-    uint8_t value_to_append = _az_decimal_to_ascii((uint8_t)(nn / div));
-    *out_span = az_span_copy_u8(*out_span, value_to_append);
-
-    nn %= div;
-    div /= 10;
-  }
-
-  uint8_t value_to_append = _az_decimal_to_ascii((uint8_t)nn);
-  *out_span = az_span_copy_u8(*out_span, value_to_append);
   return AZ_OK;
 }
 
@@ -589,14 +813,16 @@ AZ_NODISCARD az_result az_span_i32toa(az_span destination, int32_t source, az_sp
 
   *out_span = destination;
 
+  uint32_t magnitude = (uint32_t)source;
   if (source < 0)
   {
     AZ_RETURN_IF_NOT_ENOUGH_SIZE(*out_span, 1);
     *out_span = az_span_copy_u8(*out_span, '-');
-    source = -source;
+    // Negate in unsigned arithmetic so that INT32_MIN doesn't overflow.
+    magnitude = 0 - magnitude;
   }
 
-  return _az_span_builder_append_u32toa(*out_span, (uint32_t)source, out_span);
+  return _az_span_builder_append_u32toa(*out_span, magnitude, out_span);
 }
 
 AZ_NODISCARD az_result
@@ -653,9 +879,9 @@ az_span_dtoa(az_span destination, double source, int32_t fractional_digits, az_s
   // Append the integer part.
   AZ_RETURN_IF_FAILED(_az_span_builder_append_uint64(out_span, (uint64_t)integer_part));
 
-  // Only print decimal digits if the user asked for at least one to be printed.
-  // Or if the decimal part is non-zero.
-  if (fractional_digits <= 0)
+  // Only print decimal digits if the user asked for at least one to be printed, and the decimal
+  // part is non-zero.
+  if (fractional_digits <= 0 || after_decimal_part <= 0)
   {
     return AZ_OK;
   }
@@ -844,19 +1070,42 @@ AZ_NODISCARD az_span _az_span_trim_white_space_from_end(az_span source)
   return _az_span_trim_side(source, RIGHT);
 }
 
-AZ_NODISCARD AZ_INLINE bool _az_span_url_should_encode(uint8_t c)
+// Bytes that are copied through as-is by the URL encoder, all others are percent-encoded.
+// '%' is kept so already encoded input passes through unchanged.
+static uint8_t const _az_span_url_unreserved[256] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x00
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x10
+  0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, // 0x20
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, // 0x30
+  0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x40
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1, // 0x50
+  0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x60
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 0, // 0x70
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x80
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x90
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0xA0
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0xB0
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0xC0
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0xD0
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0xE0
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0xF0
+};
+
+AZ_NODISCARD int32_t _az_span_url_encode_calc_length(az_span source)
 {
-  switch (c)
+  _az_PRECONDITION_VALID_SPAN(source, 0, true);
+
+  int32_t const source_size = az_span_size(source);
+  uint8_t const* const src_ptr = az_span_ptr(source);
+
+  int32_t encoded_count = 0;
+  for (int32_t src_idx = 0; src_idx < source_size; ++src_idx)
   {
-    case '-':
-    case '_':
-    case '.':
-    case '~':
-    case '%':
-      return false;
-    default:
-      return !(('0' <= c && c <= '9') || ('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z'));
+    encoded_count += 1 - _az_span_url_unreserved[src_ptr[src_idx]];
   }
+
+  // Each encoded byte takes 2 more characters ('/' => "%2F").
+  return source_size + (encoded_count * 2);
 }
 
 AZ_NODISCARD az_result _az_span_url_encode(az_span destination, az_span source, int32_t* out_length)
@@ -882,52 +1131,53 @@ AZ_NODISCARD az_result _az_span_url_encode(az_span destination, az_span source,
     return AZ_ERROR_INSUFFICIENT_SPAN_SIZE;
   }
 
+  // Space only needs checking while encoding when the destination can't hold the encoded source,
+  // which is counted only if it can't hold every source byte encoded either.
+  bool const check_space = destination_size / 3 < source_size
+      && _az_span_url_encode_calc_length(source) > destination_size;
+
   // "Extra space" is measured in units of 2 additional characters
   // per single source character ('/' => "%2F").
   int32_t const extra_space_have = (destination_size - source_size) / 2;
+  int32_t extra_space_used = 0;
 
   uint8_t* const dest_begin = az_span_ptr(destination);
 
   uint8_t* const src_ptr = az_span_ptr(source);
   uint8_t* dest_ptr = dest_begin;
 
-  if (extra_space_have >= source_size)
+  int32_t src_idx = 0;
+  do
   {
-    // We know that there's enough space even if every character gets encoded.
-    int32_t src_idx = 0;
-    do
+    // Runs of unreserved bytes are classified four at a time and copied straight through.
+    while (src_idx + 4 <= source_size
+           && (_az_span_url_unreserved[src_ptr[src_idx]]
+               & _az_span_url_unreserved[src_ptr[src_idx + 1]]
+               & _az_span_url_unreserved[src_ptr[src_idx + 2]]
+               & _az_span_url_unreserved[src_ptr[src_idx + 3]]))
     {
-      uint8_t c = src_ptr[src_idx];
-      if (!_az_span_url_should_encode(c))
-      {
-        *dest_ptr = c;
-        ++dest_ptr;
-      }
-      else
-      {
-        dest_ptr[0] = '%';
-        dest_ptr[1] = _az_number_to_upper_hex(c >> 4);
-        dest_ptr[2] = _az_number_to_upper_hex(c & 0x0F);
-        dest_ptr += 3;
-      }
+      dest_ptr[0] = src_ptr[src_idx];
+      dest_ptr[1] = src_ptr[src_idx + 1];
+      dest_ptr[2] = src_ptr[src_idx + 2];
+      dest_ptr[3] = src_ptr[src_idx + 3];
+      dest_ptr += 4;
+      src_idx += 4;
+    }
 
-      ++src_idx;
-    } while (src_idx < source_size);
-  }
-  else
-  {
-    // We may or may not have enough space, given whether the input needs much encoding or not.
-    int32_t extra_space_used = 0;
-    int32_t src_idx = 0;
-    do
+    if (src_idx == source_size)
     {
-      uint8_t c = src_ptr[src_idx];
-      if (!_az_span_url_should_encode(c))
-      {
-        *dest_ptr = c;
-        ++dest_ptr;
-      }
-      else
+      break;
+    }
+
+    uint8_t c = src_ptr[src_idx];
+    if (_az_span_url_unreserved[c])
+    {
+      *dest_ptr = c;
+      ++dest_ptr;
+    }
+    else
+    {
+      if (check_space)
       {
         ++extra_space_used;
         if (extra_space_used > extra_space_have)
@@ -935,16 +1185,16 @@ AZ_NODISCARD az_result _az_span_url_encode(az_span destination, az_span source,
           *out_length = 0;
           return AZ_ERROR_INSUFFICIENT_SPAN_SIZE;
         }
-
-        dest_ptr[0] = '%';
-        dest_ptr[1] = _az_number_to_upper_hex(c >> 4);
-        dest_ptr[2] = _az_number_to_upper_hex(c & 0x0F);
-        dest_ptr += 3;
       }
 
-      ++src_idx;
-    } while (src_idx < source_size);
-  }
+      dest_ptr[0] = '%';
+      dest_ptr[1] = _az_number_to_upper_hex(c >> 4);
+      dest_ptr[2] = _az_number_to_upper_hex(c & 0x0F);
+      dest_ptr += 3;
+    }
+
+    ++src_idx;
+  } while (src_idx < source_size);
 
   *out_length = (int32_t)(dest_ptr - dest_begin);
   return AZ_OK;
@@ -20,6 +20,7 @@ extern   "C" {
 #endif
 
 #include "esp_azure_iot_mqtt_client.h"
+#include "mbedtls/md.h"
 
 /* Define the LOG LEVEL.  */
 #ifndef ESP_AZURE_IOT_LOG_LEVEL
@@ -61,6 +62,7 @@ extern   "C" {
 #define ESP_AZURE_IOT_PROVISIONING_CLIENT_REQUEST_EVENT    ((size_t)0x00000008)       /* Provisioning Client Request event */
 #define ESP_AZURE_IOT_PROVISIONING_CLIENT_RESPONSE_EVENT   ((size_t)0x00000010)       /* Provisioning Client Response event */
 #define ESP_AZURE_IOT_PROVISIONING_CLIENT_DISCONNECT_EVENT ((size_t)0x00000020)       /* Provisioning Client Disconnect event */
+#define ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_FLUSH_EVENT     ((size_t)0x00000040)       /* IoT Hub Client telemetry batch flush event */
 
 /* API return values.  */
 #define ESP_AZURE_IOT_SUCCESS                              0x0 /**< The operation was successful. */
@@ -90,6 +92,13 @@ extern   "C" {
 
 /* Define the common events for all modules.  */
 #define ESP_AZURE_IOT_EVENT_COMMON_PERIODIC_EVENT                  0x00000001u     /* Periodic event, 1s           */
+#define ESP_AZURE_IOT_EVENT_COMMON_TIMER_EVENT                     0x00000002u     /* Module timer expired         */
+
+/* Define the period of the periodic event in ticks. The internal thread sleeps until the next
+   periodic event or module timer, so idle modules do not keep the CPU awake.  */
+#ifndef ESP_AZURE_IOT_EVENT_PERIODIC_INTERVAL
+#define ESP_AZURE_IOT_EVENT_PERIODIC_INTERVAL                      pdMS_TO_TICKS(1000)
+#endif /* ESP_AZURE_IOT_EVENT_PERIODIC_INTERVAL */
 
 /* Define the module events.  */
 #define ESP_AZURE_IOT_EVENT_GROUP_MQTT_EVENT                      0x00010000u     /* MQTT event                   */
@@ -107,6 +116,47 @@ extern   "C" {
 #define ESP_AZURE_IOT_MQTT_KEEP_ALIVE                      (60 * 4)
 #endif /* ESP_AZURE_IOT_MQTT_KEEP_ALIVE */
 
+/* Define the maximum size in bytes of a decoded HMAC-SHA256 key, one SHA-256 block.  */
+#ifndef ESP_AZURE_IOT_HMAC_SHA256_KEY_MAX
+#define ESP_AZURE_IOT_HMAC_SHA256_KEY_MAX                  (64)
+#endif /* ESP_AZURE_IOT_HMAC_SHA256_KEY_MAX */
+
+/* Define the HMAC-SHA256 backend key states are bound to, unless another is set at run time.  */
+#ifndef ESP_AZURE_IOT_HMAC_SHA256_DEFAULT_BACKEND
+#define ESP_AZURE_IOT_HMAC_SHA256_DEFAULT_BACKEND          esp_azure_iot_hmac_sha256_mbedtls
+#endif /* ESP_AZURE_IOT_HMAC_SHA256_DEFAULT_BACKEND */
+
+/**
+ * @brief HMAC-SHA256 key state
+ * @details Prepared once from a decoded key by the backend it is bound to, and reused
+ *          for every signature made with that key.
+ */
+typedef struct ESP_AZURE_IOT_HMAC_SHA256_STRUCT
+{
+    const struct ESP_AZURE_IOT_HMAC_SHA256_BACKEND_STRUCT  *esp_hmac_sha256_backend;
+    mbedtls_md_context_t                                    esp_hmac_sha256_md_context;
+    uint8_t                                                 esp_hmac_sha256_key[ESP_AZURE_IOT_HMAC_SHA256_KEY_MAX];
+    uint32_t                                                esp_hmac_sha256_key_size;
+} ESP_AZURE_IOT_HMAC_SHA256;
+
+/**
+ * @brief HMAC-SHA256 backend
+ * 
+ */
+typedef struct ESP_AZURE_IOT_HMAC_SHA256_BACKEND_STRUCT
+{
+    uint32_t                                    (*esp_hmac_sha256_key_set)(ESP_AZURE_IOT_HMAC_SHA256 *hmac_ptr, uint8_t *key_ptr, uint32_t key_size);
+    uint32_t                                    (*esp_hmac_sha256_calculate)(ESP_AZURE_IOT_HMAC_SHA256 *hmac_ptr, uint8_t *message_ptr,
+                                                                             uint32_t message_size, uint8_t *output_ptr);
+    void                                        (*esp_hmac_sha256_key_clear)(ESP_AZURE_IOT_HMAC_SHA256 *hmac_ptr);
+} ESP_AZURE_IOT_HMAC_SHA256_BACKEND;
+
+/* mbedTLS backend: the padded key blocks are derived once, the SHA accelerator is used when mbedTLS is built with it.  */
+extern const ESP_AZURE_IOT_HMAC_SHA256_BACKEND esp_azure_iot_hmac_sha256_mbedtls;
+
+/* Software reference backend: keeps the key and runs the plain hmac_sha256() on every signature.  */
+extern const ESP_AZURE_IOT_HMAC_SHA256_BACKEND esp_azure_iot_hmac_sha256_software;
+
 /**
  * @brief Resource struct
  * 
@@ -155,7 +205,8 @@ typedef struct ESP_AZURE_IOT_STRUCT
  * @details This routine creates the Azure IoT subsystem. An internal thread is created to
  *          manage activities related to Azure IoT services. Only one ESP_AZURE_IOT instance
  *          is needed to manage instances for Azure IoT hub, IoT Central, Device Provisioning
- *          Services (DPS), and Azure Security Center (ASC).
+ *          Services (DPS), and Azure Security Center (ASC). Several instances can coexist, each
+ *          with its own thread; the packet pool is shared between them.
  * 
  * @param[in] esp_azure_iot_ptr A pointer to a #ESP_AZURE_IOT
  * @param[in] name_ptr A pointer to a NULL-terminated string indicating the name of the Azure IoT instance.
@@ -211,6 +262,34 @@ uint32_t esp_azure_iot_buffer_allocate(ESP_AZURE_IOT *esp_azure_iot_ptr, uint8_t
  */
 uint32_t esp_azure_iot_buffer_free(void *buffer_context);
 
+/**
+ * @brief Set the HMAC-SHA256 backend new key states are bound to.
+ * @details Key states already set keep the backend they were set with.
+ * 
+ * @param[in] backend_ptr A pointer to a #ESP_AZURE_IOT_HMAC_SHA256_BACKEND.
+ * @return A `uint32_t` with the result of the API.
+ *  @retval #ESP_AZURE_IOT_SUCCESS Successfully set the backend.
+ */
+uint32_t esp_azure_iot_hmac_sha256_backend_set(const ESP_AZURE_IOT_HMAC_SHA256_BACKEND *backend_ptr);
+
+/**
+ * @brief Prepare a HMAC-SHA256 key state from a decoded key.
+ * 
+ * @param[in] hmac_ptr A pointer to a zero initialized or cleared #ESP_AZURE_IOT_HMAC_SHA256.
+ * @param[in] key_ptr A pointer to the decoded key.
+ * @param[in] key_size Size of the key, at most #ESP_AZURE_IOT_HMAC_SHA256_KEY_MAX.
+ * @return A `uint32_t` with the result of the API.
+ *  @retval #ESP_AZURE_IOT_SUCCESS Successfully prepared the key state.
+ */
+uint32_t esp_azure_iot_hmac_sha256_key_set(ESP_AZURE_IOT_HMAC_SHA256 *hmac_ptr, uint8_t *key_ptr, uint32_t key_size);
+
+/**
+ * @brief Release a HMAC-SHA256 key state and wipe the key from it.
+ * 
+ * @param[in] hmac_ptr A pointer to a #ESP_AZURE_IOT_HMAC_SHA256.
+ */
+void esp_azure_iot_hmac_sha256_key_clear(ESP_AZURE_IOT_HMAC_SHA256 *hmac_ptr);
+
 /* Internal APIs. */
 uint32_t esp_azure_iot_resource_add(ESP_AZURE_IOT *esp_azure_iot_ptr, ESP_AZURE_IOT_RESOURCE *resource);
 uint32_t esp_azure_iot_resource_remove(ESP_AZURE_IOT *esp_azure_iot_ptr, ESP_AZURE_IOT_RESOURCE *resource);
@@ -223,6 +302,12 @@ uint32_t esp_azure_iot_url_encoded_hmac_sha256_calculate(ESP_AZURE_IOT_RESOURCE
                                                     uint8_t *message_ptr, uint32_t message_size,
                                                     uint8_t *buffer_ptr, uint32_t buffer_len,
                                                     uint8_t **output_ptr, uint32_t *output_len);
+uint32_t esp_azure_iot_url_encoded_hmac_sha256_keyed_calculate(ESP_AZURE_IOT_HMAC_SHA256 *hmac_ptr,
+                                                                uint8_t *message_ptr, uint32_t message_size,
+                                                                uint8_t *buffer_ptr, uint32_t buffer_len,
+                                                                uint8_t **output_ptr, uint32_t *output_len);
+uint32_t esp_azure_iot_base64_key_decode(uint8_t *key_ptr, uint32_t key_size,
+                                    uint8_t *buffer_ptr, uint32_t buffer_len, uint32_t *bytes_copied);
 
 int esp_azure_iot_time_init(void);
 
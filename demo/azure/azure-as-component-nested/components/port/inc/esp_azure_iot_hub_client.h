@@ -40,6 +40,46 @@ extern   "C" {
 #define ESP_AZURE_IOT_HUB_CLIENT_TOKEN_EXPIRY            (3600)
 #endif /* ESP_AZURE_IOT_HUB_CLIENT_TOKEN_EXPIRY */
 
+/* Set how many secs before expiry the token is renewed at the latest.  */
+#ifndef ESP_AZURE_IOT_HUB_CLIENT_TOKEN_RENEW_MARGIN
+#define ESP_AZURE_IOT_HUB_CLIENT_TOKEN_RENEW_MARGIN      (300)
+#endif /* ESP_AZURE_IOT_HUB_CLIENT_TOKEN_RENEW_MARGIN */
+
+/* Set the timeout in ticks for the session to come back up after a token renewal.  */
+#ifndef ESP_AZURE_IOT_HUB_CLIENT_TOKEN_RENEW_RECONNECT_TIMEOUT
+#define ESP_AZURE_IOT_HUB_CLIENT_TOKEN_RENEW_RECONNECT_TIMEOUT   (10 * 100)
+#endif /* ESP_AZURE_IOT_HUB_CLIENT_TOKEN_RENEW_RECONNECT_TIMEOUT */
+
+/* Set the range in secs the renewal is randomly moved earlier by, so devices do not renew together.  */
+#ifndef ESP_AZURE_IOT_HUB_CLIENT_TOKEN_RENEW_JITTER
+#define ESP_AZURE_IOT_HUB_CLIENT_TOKEN_RENEW_JITTER      (600)
+#endif /* ESP_AZURE_IOT_HUB_CLIENT_TOKEN_RENEW_JITTER */
+
+/* Set the delay in secs before a failed renewal is retried.  */
+#ifndef ESP_AZURE_IOT_HUB_CLIENT_TOKEN_RENEW_RETRY
+#define ESP_AZURE_IOT_HUB_CLIENT_TOKEN_RENEW_RETRY       (30)
+#endif /* ESP_AZURE_IOT_HUB_CLIENT_TOKEN_RENEW_RETRY */
+
+/* Set the maximum number of telemetry messages coalesced into one batch.  */
+#ifndef ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_MAX_MESSAGES
+#define ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_MAX_MESSAGES    (16)
+#endif /* ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_MAX_MESSAGES */
+
+/* Set the maximum number of device twin requests awaiting their response at the same time.  */
+#ifndef ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST_MAX
+#define ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST_MAX             (8)
+#endif /* ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST_MAX */
+
+/* Set the size in bytes of the buffer pending reported properties patches are merged in.  */
+#ifndef ESP_AZURE_IOT_HUB_CLIENT_REPORTED_PROPERTIES_MERGE_SIZE
+#define ESP_AZURE_IOT_HUB_CLIENT_REPORTED_PROPERTIES_MERGE_SIZE  (512)
+#endif /* ESP_AZURE_IOT_HUB_CLIENT_REPORTED_PROPERTIES_MERGE_SIZE */
+
+/* Set the maximum number of handlers registered for custom topics.  */
+#ifndef ESP_AZURE_IOT_HUB_CLIENT_TOPIC_HANDLER_MAX
+#define ESP_AZURE_IOT_HUB_CLIENT_TOPIC_HANDLER_MAX               (4)
+#endif /* ESP_AZURE_IOT_HUB_CLIENT_TOPIC_HANDLER_MAX */
+
 /* Define AZ IoT Hub Client state.  */
 #define ESP_AZURE_IOT_HUB_CLIENT_STATUS_NOT_CONNECTED    0 /**< The client is not connected */
 #define ESP_AZURE_IOT_HUB_CLIENT_STATUS_CONNECTING       1 /**< The client is connecting */
@@ -52,7 +92,6 @@ typedef struct ESP_AZURE_IOT_THREAD_LIST_STRUCT
     struct ESP_AZURE_IOT_THREAD_LIST_STRUCT     *esp_azure_iot_thread_next;
 
     uint32_t                                    esp_azure_iot_thread_message_type;
-    uint32_t                                    esp_azure_iot_thread_expected_id;     /* Used by device twin. */
     uint32_t                                    esp_azure_iot_thread_response_status; /* Used by device twin. */
     ESP_PACKET                                  *esp_azure_iot_thread_received_message;
 } ESP_AZURE_IOT_THREAD_LIST;
@@ -68,8 +107,105 @@ typedef struct ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA_STRUCT
     void        *esp_azure_iot_hub_client_message_callback_args;
     uint32_t    (*esp_azure_iot_hub_client_message_process)(struct ESP_AZURE_IOT_HUB_CLIENT_STRUCT *hub_client_ptr,
                                                     ESP_PACKET *packet_ptr, size_t topic_offset, uint16_t topic_length);
+
+    /* Define the mutex guarding the queue and the waiters of this message type only.  */
+    SemaphoreHandle_t           esp_azure_iot_hub_client_message_mutex_ptr;
+    ESP_AZURE_IOT_THREAD_LIST   *esp_azure_iot_hub_client_message_thread_suspended;
 } ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA;
 
+typedef struct ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST_STRUCT
+{
+    /* Define the $rid of the request, zero marks a free entry.  */
+    uint32_t                    esp_pending_request_id;
+    uint32_t                    esp_pending_request_message_type;
+
+    /* Define the tick the request expires at when it has a timeout.  */
+    uint32_t                    esp_pending_request_timeout;
+    uint32_t                    esp_pending_request_deadline;
+
+    /* Define the thread blocked on the response, or the callback completing the request.  */
+    ESP_AZURE_IOT_THREAD_LIST   *esp_pending_request_thread_list_ptr;
+    void                        (*esp_pending_request_callback)(struct ESP_AZURE_IOT_HUB_CLIENT_STRUCT *hub_client_ptr,
+                                                                uint32_t request_id, uint32_t status,
+                                                                uint32_t response_status, ESP_PACKET *packet_ptr,
+                                                                void *args);
+    void                        *esp_pending_request_callback_args;
+} ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST;
+
+typedef struct ESP_AZURE_IOT_HUB_CLIENT_TOPIC_HANDLER_STRUCT
+{
+    /* Define the topic prefix routed to the handler, a NULL prefix marks a free entry.  */
+    const uint8_t   *esp_topic_handler_prefix;
+    uint32_t        esp_topic_handler_prefix_length;
+
+    uint32_t        (*esp_topic_handler_process)(struct ESP_AZURE_IOT_HUB_CLIENT_STRUCT *hub_client_ptr,
+                                                 ESP_PACKET *packet_ptr, size_t topic_offset, uint16_t topic_length,
+                                                 void *args);
+    void            *esp_topic_handler_args;
+} ESP_AZURE_IOT_HUB_CLIENT_TOPIC_HANDLER;
+
+typedef struct ESP_AZURE_IOT_HUB_CLIENT_REPORTED_PROPERTIES_MERGE_STRUCT
+{
+    /* Define the ticks patches are collected before they are published, zero when merging is disabled.  */
+    uint32_t    esp_reported_merge_window;
+
+    /* Define the $rid shared by the merged patches, zero when none is pending, and when the first was merged.  */
+    uint32_t    esp_reported_merge_request_id;
+    uint32_t    esp_reported_merge_first_tick;
+
+    /* Define the merged patch, built alternately in one buffer from the content of the other.  */
+    uint32_t    esp_reported_merge_index;
+    uint32_t    esp_reported_merge_length;
+    uint8_t     esp_reported_merge_buffer[2][ESP_AZURE_IOT_HUB_CLIENT_REPORTED_PROPERTIES_MERGE_SIZE];
+} ESP_AZURE_IOT_HUB_CLIENT_REPORTED_PROPERTIES_MERGE;
+
+typedef struct ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_STATS_STRUCT
+{
+    /* Define the number of messages published as part of a batch.  */
+    uint32_t    esp_telemetry_batch_messages_sent;
+
+    /* Define the number of queued messages whose batch failed to publish.  */
+    uint32_t    esp_telemetry_batch_messages_failed;
+
+    /* Define the number of batches published.  */
+    uint32_t    esp_telemetry_batch_batches_sent;
+
+    /* Define the number of payload bytes published in batches.  */
+    uint32_t    esp_telemetry_batch_bytes_sent;
+
+    /* Define the longest time in ticks a message waited in the queue before its batch was published.  */
+    uint32_t    esp_telemetry_batch_latency_max;
+} ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_STATS;
+
+typedef struct ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_STRUCT
+{
+    uint32_t                                        esp_telemetry_batch_enabled;
+
+    /* Define the mutex guarding the batch, taken after the instance mutex when both are held.  */
+    SemaphoreHandle_t                               esp_telemetry_batch_mutex_ptr;
+
+    /* Define the flush thresholds.  */
+    uint32_t                                        esp_telemetry_batch_max_count;
+    uint32_t                                        esp_telemetry_batch_max_bytes;
+    uint32_t                                        esp_telemetry_batch_max_latency;
+
+    /* Define the packet the pending batch is built in, its payload start and its byte budget.  */
+    ESP_PACKET                                      *esp_telemetry_batch_packet;
+    uint8_t                                         *esp_telemetry_batch_payload_ptr;
+    uint32_t                                        esp_telemetry_batch_limit;
+
+    /* Define the queued messages.  */
+    uint32_t                                        esp_telemetry_batch_count;
+    uint32_t                                        esp_telemetry_batch_first_tick;
+    void                                            *esp_telemetry_batch_contexts[ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_MAX_MESSAGES];
+
+    void                                            (*esp_telemetry_batch_callback)(struct ESP_AZURE_IOT_HUB_CLIENT_STRUCT *hub_client_ptr,
+                                                                                    void *message_context, uint32_t status, void *args);
+    void                                            *esp_telemetry_batch_callback_args;
+
+    ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_STATS  esp_telemetry_batch_stats;
+} ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH;
+
 /**
  * @brief Azure IoT Hub Client struct
  * 
@@ -78,7 +214,6 @@ typedef struct ESP_AZURE_IOT_HUB_CLIENT_STRUCT
 {
     ESP_AZURE_IOT                                       *esp_azure_iot_ptr;
     uint32_t                                            esp_azure_iot_hub_client_state;
-    ESP_AZURE_IOT_THREAD_LIST                           *esp_azure_iot_hub_client_thread_suspended;
     ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA   esp_azure_iot_hub_client_c2d_message_metadata;
     ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA   esp_azure_iot_hub_client_device_twin_metadata;
     ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA   esp_azure_iot_hub_client_device_twin_desired_properties_metadata;
@@ -95,9 +230,22 @@ typedef struct ESP_AZURE_IOT_HUB_CLIENT_STRUCT
 
     uint32_t                                            esp_azure_iot_hub_client_mqtt_subscribed_flags;
     uint32_t                                            esp_azure_iot_hub_client_request_id;
+
+    /* Device twin requests awaiting a response, indexed by $rid and guarded by the device twin mutex.  */
+    ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST            esp_azure_iot_hub_client_pending_requests[ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST_MAX];
+    ESP_AZURE_IOT_HUB_CLIENT_REPORTED_PROPERTIES_MERGE  esp_azure_iot_hub_client_reported_properties_merge;
+
+    /* Handlers of custom topics, guarded by the MQTT client mutex the receive path runs under.  */
+    ESP_AZURE_IOT_HUB_CLIENT_TOPIC_HANDLER              esp_azure_iot_hub_client_topic_handlers[ESP_AZURE_IOT_HUB_CLIENT_TOPIC_HANDLER_MAX];
     uint8_t                                             *esp_azure_iot_hub_client_symmetric_key;
     uint32_t                                            esp_azure_iot_hub_client_symmetric_key_length;
+
+    /* Key state prepared once when the symmetric key is set, and the unix time the current token is renewed at.  */
+    ESP_AZURE_IOT_HMAC_SHA256                           esp_azure_iot_hub_client_symmetric_key_hmac;
+    size_t                                              esp_azure_iot_hub_client_token_expiry;
+    size_t                                              esp_azure_iot_hub_client_token_renew_time;
     ESP_AZURE_IOT_RESOURCE                              esp_azure_iot_hub_client_resource;
+    ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH            esp_azure_iot_hub_client_telemetry_batch;
 
     az_iot_hub_client                                   iot_hub_client_core;
 } ESP_AZURE_IOT_HUB_CLIENT;
@@ -146,12 +294,17 @@ uint32_t esp_azure_iot_hub_client_device_cert_set(ESP_AZURE_IOT_HUB_CLIENT *hub_
 
 /**
  * @brief Set symmetric key in the IoT Hub client.
+ * @details The base64 key is decoded and its HMAC-SHA256 state prepared once here. Once connected, the SAS token is renewed
+ *          between #ESP_AZURE_IOT_HUB_CLIENT_TOKEN_RENEW_MARGIN and that plus
+ *          #ESP_AZURE_IOT_HUB_CLIENT_TOKEN_RENEW_JITTER secs before it expires, and the MQTT
+ *          session logs in again with the new token.
  * 
  * @param[in] hub_client_ptr A pointer to a #ESP_AZURE_IOT_HUB_CLIENT.
  * @param[in] symmetric_key A pointer to a symmetric key.
  * @param[in] symmetric_key_length Length of `symmetric_key`.
  * @return A `uint32_t` with the result of the API.
  *   @retval #ESP_AZURE_IOT_SUCCESS Successfully set symmetric key to IoTHub client.
+ *   @retval #ESP_AZURE_IOT_INVALID_PARAMETER The key is not valid base64 or decodes to more than #ESP_AZURE_IOT_HMAC_SHA256_KEY_MAX bytes.
  */
 uint32_t esp_azure_iot_hub_client_symmetric_key_set(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
                                                uint8_t *symmetric_key, uint32_t symmetric_key_length);
@@ -296,6 +449,93 @@ uint32_t esp_azure_iot_hub_client_telemetry_property_add(ESP_PACKET *packet_ptr,
 uint32_t esp_azure_iot_hub_client_telemetry_send(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr, ESP_PACKET *packet_ptr,
                                             uint8_t *telemetry_data, uint32_t data_size, uint32_t wait_option);
 
+/**
+ * @brief Enable batched telemetry.
+ * @details This routine turns on coalescing for messages queued with
+ *          esp_azure_iot_hub_client_telemetry_batch_send(). Queued messages are published together
+ *          as one JSON array on the telemetry topic once `max_count` messages are queued, once the
+ *          payload reaches `max_bytes`, or once the oldest message has waited `max_latency` ticks,
+ *          whichever comes first. The deadline is a timer of the Azure IoT internal thread, which
+ *          publishes the batch when it expires.
+ *
+ * @param[in] hub_client_ptr A pointer to a #ESP_AZURE_IOT_HUB_CLIENT.
+ * @param[in] max_count Messages per batch, at most #ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_MAX_MESSAGES.
+ *                      `0` selects the maximum.
+ * @param[in] max_bytes Payload size of a batch in bytes. `0`, or a value larger than a packet can hold,
+ *                      selects the packet capacity.
+ * @param[in] max_latency Ticks the oldest queued message may wait before its batch is published.
+ * @param[in] callback Pointer to a callback function invoked once per queued message when its batch
+ *                     is published or dropped. Can be `NULL`.
+ * @param[in] callback_args Pointer to an argument passed to callback function.
+ * @return A `uint32_t` with the result of the API.
+ *   @retval #ESP_AZURE_IOT_SUCCESS Successful if batching is enabled.
+ *   @retval #ESP_AZURE_IOT_WRONG_STATE Fail to enable batching while a batch is still pending.
+ */
+uint32_t esp_azure_iot_hub_client_telemetry_batch_enable(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                    uint32_t max_count, uint32_t max_bytes, uint32_t max_latency,
+                                                    void (*callback)(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                     void *message_context, uint32_t status, void *args),
+                                                    void *callback_args);
+
+/**
+ * @brief Disable batched telemetry.
+ * @details Any pending batch is published before batching is turned off.
+ *
+ * @param[in] hub_client_ptr A pointer to a #ESP_AZURE_IOT_HUB_CLIENT.
+ * @param[in] wait_option Ticks to wait for the pending batch to be sent.
+ * @return A `uint32_t` with the result of the API.
+ *   @retval #ESP_AZURE_IOT_SUCCESS Successful if batching is disabled and the pending batch is sent.
+ */
+uint32_t esp_azure_iot_hub_client_telemetry_batch_disable(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr, uint32_t wait_option);
+
+/**
+ * @brief Queue a telemetry message for batched sending.
+ * @details The message is copied into the pending batch, so `telemetry_data` can be reused as soon as
+ *          this routine returns. It must be a single complete JSON value, as it becomes one element
+ *          of the published array; anything else is rejected. A batch is published with the topic
+ *          of esp_azure_iot_hub_client_telemetry_message_create() alone, so batched messages carry
+ *          no message properties: send messages that need properties with
+ *          esp_azure_iot_hub_client_telemetry_send(). If the message does not fit in the pending
+ *          batch, that batch is published on the caller's thread first. The completion of each
+ *          message is reported through the callback given to
+ *          esp_azure_iot_hub_client_telemetry_batch_enable().
+ *
+ * @param[in] hub_client_ptr A pointer to a #ESP_AZURE_IOT_HUB_CLIENT.
+ * @param[in] telemetry_data Pointer to telemetry data.
+ * @param[in] data_size Size of telemetry data.
+ * @param[in] message_context Pointer passed back to the callback for this message.
+ * @param[in] wait_option Ticks to wait for a packet or for a full batch to be sent.
+ * @return A `uint32_t` with the result of the API.
+ *   @retval #ESP_AZURE_IOT_SUCCESS Successful if the message is queued.
+ *   @retval #ESP_AZURE_IOT_INVALID_PARAMETER Fail to queue the message as it is not a single JSON value.
+ *   @retval #ESP_AZURE_IOT_NOT_ENABLED Fail to queue the message as batching is not enabled.
+ *   @retval #ESP_AZURE_IOT_MESSAGE_TOO_LONG Fail to queue the message as it does not fit in an empty batch.
+ */
+uint32_t esp_azure_iot_hub_client_telemetry_batch_send(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                  uint8_t *telemetry_data, uint32_t data_size,
+                                                  void *message_context, uint32_t wait_option);
+
+/**
+ * @brief Publish the pending telemetry batch now.
+ *
+ * @param[in] hub_client_ptr A pointer to a #ESP_AZURE_IOT_HUB_CLIENT.
+ * @param[in] wait_option Ticks to wait for the batch to be sent.
+ * @return A `uint32_t` with the result of the API.
+ *   @retval #ESP_AZURE_IOT_SUCCESS Successful if the pending batch is sent or there is none.
+ */
+uint32_t esp_azure_iot_hub_client_telemetry_batch_flush(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr, uint32_t wait_option);
+
+/**
+ * @brief Get the telemetry batching statistics.
+ *
+ * @param[in] hub_client_ptr A pointer to a #ESP_AZURE_IOT_HUB_CLIENT.
+ * @param[out] stats_ptr Pointer to a #ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_STATS to fill.
+ * @return A `uint32_t` with the result of the API.
+ *   @retval #ESP_AZURE_IOT_SUCCESS Successful if the statistics are returned.
+ */
+uint32_t esp_azure_iot_hub_client_telemetry_batch_stats_get(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                       ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_STATS *stats_ptr);
+
 /**
  * @brief Enable receiving C2D message from IoTHub.
  * 
@@ -325,6 +565,7 @@ uint32_t esp_azure_iot_hub_client_cloud_message_disable(ESP_AZURE_IOT_HUB_CLIENT
  * @param[in] wait_option Ticks to wait for message to arrive.
  * @return A `uint32_t` with the result of the API.
  *   @retval #ESP_AZURE_IOT_SUCCESS  Successful if C2D message is received.
+ *   @retval #ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE Fail if #ESP_AZURE_IOT_THREAD_POOL_COUNT tasks are already waiting.
  */
 uint32_t esp_azure_iot_hub_client_cloud_message_receive(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr, ESP_PACKET **packet_pptr, uint32_t wait_option);
 
@@ -398,12 +639,92 @@ uint32_t esp_azure_iot_hub_client_report_properties_response_callback_set(ESP_AZ
  * @param[in] wait_option Ticks to wait for message to send.
  * @return A `uint32_t` with the result of the API.
  *   @retval #ESP_AZURE_IOT_SUCCESS Successful if device twin reported properties is sent successfully.
+ *   @retval #ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE Fail if #ESP_AZURE_IOT_THREAD_POOL_COUNT tasks are already waiting.
  */
 uint32_t esp_azure_iot_hub_client_device_twin_reported_properties_send(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
                                                                   uint8_t *message_buffer, uint32_t message_length,
                                                                   uint32_t *request_id_ptr, uint32_t *response_status_ptr,
                                                                   uint32_t wait_option);
 
+/**
+ * @brief Send device twin reported properties to IoT Hub without waiting for the response
+ * @details This routine publishes device twin reported properties and returns once the request is sent.
+ *          The response is delivered to the callback function from the MQTT or internal thread, so several
+ *          reported properties patches can be in flight at the same time. The callback is invoked exactly
+ *          once per accepted request with status #ESP_AZURE_IOT_SUCCESS and the response status when the
+ *          response arrives, #ESP_AZURE_IOT_NO_PACKET when timeout expired first or
+ *          #ESP_AZURE_IOT_DISCONNECTED when the client disconnected first.
+ *          When merging is enabled with esp_azure_iot_hub_client_device_twin_reported_properties_merge_enable(),
+ *          the patch is merged into the pending one instead of being published right away. All patches merged
+ *          together share one Request Id and complete with the response to the merged patch, or with the
+ *          publish error if it could not be sent.
+ *
+ * @param[in] hub_client_ptr A pointer to a #ESP_AZURE_IOT_HUB_CLIENT.
+ * @param[in] message_buffer JSON document containing the reported properties.
+ * @param[in] message_length Length of JSON document.
+ * @param[in] timeout Ticks to wait for the response, 0 waits until the client disconnects. Time spent in the
+ *            merge window counts towards it.
+ * @param[in] callback_ptr Pointer to a callback function invoked on completion. The packet passed to it is
+ *            `NULL` for reported properties and is released after the callback returns.
+ * @param[in] callback_args Pointer to an argument passed to callback function.
+ * @param[out] request_id_ptr Request Id assigned to the request, may be `NULL`.
+ * @param[in] wait_option Ticks to wait for message to send.
+ * @return A `uint32_t` with the result of the API.
+ *   @retval #ESP_AZURE_IOT_SUCCESS Successful if device twin reported properties is sent successfully.
+ *   @retval #ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE Fail if #ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST_MAX requests are pending.
+ *   @retval #ESP_AZURE_IOT_INVALID_PARAMETER Fail to merge a patch that is not a JSON object.
+ *   @retval #ESP_AZURE_IOT_MESSAGE_TOO_LONG Fail to merge a patch larger than #ESP_AZURE_IOT_HUB_CLIENT_REPORTED_PROPERTIES_MERGE_SIZE.
+ */
+uint32_t esp_azure_iot_hub_client_device_twin_reported_properties_send_async(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                        uint8_t *message_buffer, uint32_t message_length,
+                                                                        uint32_t timeout,
+                                                                        void (*callback_ptr)(
+                                                                              ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                              uint32_t request_id, uint32_t status,
+                                                                              uint32_t response_status, ESP_PACKET *packet_ptr,
+                                                                              void *args),
+                                                                        void *callback_args, uint32_t *request_id_ptr,
+                                                                        uint32_t wait_option);
+
+/**
+ * @brief Enable merging of asynchronous reported properties patches.
+ * @details Patches sent with esp_azure_iot_hub_client_device_twin_reported_properties_send_async() within
+ *          `window` ticks of the first pending one are merged into a single JSON merge patch and published
+ *          together when the window expires. Later values win, and nested objects are merged member by member,
+ *          so the twin ends up as if the patches had been applied one after the other. A patch that does not fit
+ *          next to the pending ones publishes them first.
+ *
+ * @param[in] hub_client_ptr A pointer to a #ESP_AZURE_IOT_HUB_CLIENT.
+ * @param[in] window Ticks patches are collected before they are published, must not be `0`.
+ * @return A `uint32_t` with the result of the API.
+ *   @retval #ESP_AZURE_IOT_SUCCESS Successful if merging is enabled.
+ */
+uint32_t esp_azure_iot_hub_client_device_twin_reported_properties_merge_enable(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                          uint32_t window);
+
+/**
+ * @brief Disable merging of asynchronous reported properties patches.
+ * @details Any pending merged patch is published before merging is turned off.
+ *
+ * @param[in] hub_client_ptr A pointer to a #ESP_AZURE_IOT_HUB_CLIENT.
+ * @param[in] wait_option Ticks to wait for the pending patch to be sent.
+ * @return A `uint32_t` with the result of the API.
+ *   @retval #ESP_AZURE_IOT_SUCCESS Successful if merging is disabled and the pending patch is sent.
+ */
+uint32_t esp_azure_iot_hub_client_device_twin_reported_properties_merge_disable(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                           uint32_t wait_option);
+
+/**
+ * @brief Publish the pending merged reported properties patch now.
+ *
+ * @param[in] hub_client_ptr A pointer to a #ESP_AZURE_IOT_HUB_CLIENT.
+ * @param[in] wait_option Ticks to wait for the patch to be sent.
+ * @return A `uint32_t` with the result of the API.
+ *   @retval #ESP_AZURE_IOT_SUCCESS Successful if the pending patch is sent or there is none.
+ */
+uint32_t esp_azure_iot_hub_client_device_twin_reported_properties_merge_flush(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                         uint32_t wait_option);
+
 /**
  * @brief Request complete device twin properties
  * @details This routine requests complete device twin properties.
@@ -416,6 +737,34 @@ uint32_t esp_azure_iot_hub_client_device_twin_reported_properties_send(ESP_AZURE
 uint32_t esp_azure_iot_hub_client_device_twin_properties_request(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
                                                             uint32_t wait_option);
 
+/**
+ * @brief Request complete device twin properties and receive them through a callback
+ * @details This routine requests complete device twin properties and returns once the request is sent.
+ *          The twin document is delivered to the callback function instead of
+ *          esp_azure_iot_hub_client_device_twin_properties_receive(). Completion statuses are the same as for
+ *          esp_azure_iot_hub_client_device_twin_reported_properties_send_async().
+ *
+ * @param[in] hub_client_ptr A pointer to a #ESP_AZURE_IOT_HUB_CLIENT.
+ * @param[in] timeout Ticks to wait for the response, 0 waits until the client disconnects.
+ * @param[in] callback_ptr Pointer to a callback function invoked on completion. The packet passed to it holds
+ *            the twin document on success, `NULL` otherwise, and is released after the callback returns.
+ * @param[in] callback_args Pointer to an argument passed to callback function.
+ * @param[out] request_id_ptr Request Id assigned to the request, may be `NULL`.
+ * @param[in] wait_option Ticks to wait for sending request.
+ * @return A `uint32_t` with the result of the API.
+ *   @retval #ESP_AZURE_IOT_SUCCESS Successful if device twin properties is requested successfully.
+ *   @retval #ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE Fail if #ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST_MAX requests are pending.
+ */
+uint32_t esp_azure_iot_hub_client_device_twin_properties_request_async(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                  uint32_t timeout,
+                                                                  void (*callback_ptr)(
+                                                                        ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                        uint32_t request_id, uint32_t status,
+                                                                        uint32_t response_status, ESP_PACKET *packet_ptr,
+                                                                        void *args),
+                                                                  void *callback_args, uint32_t *request_id_ptr,
+                                                                  uint32_t wait_option);
+
 /**
  * @brief Receive complete device twin properties
  * @details This routine receives complete device twin properties.
@@ -425,6 +774,7 @@ uint32_t esp_azure_iot_hub_client_device_twin_properties_request(ESP_AZURE_IOT_H
  * @param[in] wait_option Ticks to wait for message to receive.
  * @return A `uint32_t` with the result of the API.
  *   @retval #ESP_AZURE_IOT_SUCCESS Successful if device twin properties is received successfully.
+ *   @retval #ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE Fail if #ESP_AZURE_IOT_THREAD_POOL_COUNT tasks are already waiting.
  */
 uint32_t esp_azure_iot_hub_client_device_twin_properties_receive(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
                                                             ESP_PACKET **packet_pptr, uint32_t wait_option);
@@ -438,6 +788,7 @@ uint32_t esp_azure_iot_hub_client_device_twin_properties_receive(ESP_AZURE_IOT_H
  * @param[in] wait_option Ticks to wait for message to receive.
  * @return A `uint32_t` with the result of the API.
  *   @retval #ESP_AZURE_IOT_SUCCESS Successful if desired properties is received successfully.
+ *   @retval #ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE Fail if #ESP_AZURE_IOT_THREAD_POOL_COUNT tasks are already waiting.
  */
 uint32_t esp_azure_iot_hub_client_device_twin_desired_properties_receive(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
                                                                     ESP_PACKET **packet_pptr, uint32_t wait_option);
@@ -475,6 +826,7 @@ uint32_t esp_azure_iot_hub_client_direct_method_disable(ESP_AZURE_IOT_HUB_CLIENT
  * @param[in] wait_option Ticks to wait for message to arrive.
  * @return A `uint32_t` with the result of the API.
  *   @retval #ESP_AZURE_IOT_SUCCESS  Successful if direct method message is received.
+ *   @retval #ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE Fail if #ESP_AZURE_IOT_THREAD_POOL_COUNT tasks are already waiting.
  */
 uint32_t esp_azure_iot_hub_client_direct_method_message_receive(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
                                                            uint8_t **method_name_pptr, uint16_t *method_name_length_ptr,
@@ -499,6 +851,44 @@ uint32_t esp_azure_iot_hub_client_direct_method_message_receive(ESP_AZURE_IOT_HU
 uint32_t esp_azure_iot_hub_client_direct_method_message_response(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
                                                             uint32_t status_code, void *context_ptr, uint16_t context_length,
                                                             uint8_t *payload, uint32_t payload_length, uint32_t wait_option);
+
+/**
+ * @brief Register a handler for messages on a custom topic
+ * @details Inbound messages are routed by topic prefix. Messages whose topic starts with `prefix` and that
+ *          are not direct method, cloud to device or device twin messages are passed to `handler`. The
+ *          handler is called from the MQTT thread without any mutex held, so it may call back into the
+ *          client. A message being dispatched while its handler is deregistered may still reach it. It returns
+ *          #ESP_AZURE_IOT_SUCCESS when it takes ownership of the packet, otherwise the packet is released.
+ *          Subscribing to the topic is left to the caller.
+ *
+ * @param[in] hub_client_ptr A pointer to a #ESP_AZURE_IOT_HUB_CLIENT.
+ * @param[in] prefix Topic prefix, must stay valid until the handler is deregistered.
+ * @param[in] prefix_length Length of `prefix`.
+ * @param[in] handler Pointer to the function processing the message.
+ * @param[in] handler_args Pointer to an argument passed to `handler`.
+ * @return A `uint32_t` with the result of the API.
+ *   @retval #ESP_AZURE_IOT_SUCCESS Successful if the handler is registered.
+ *   @retval #ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE Fail if #ESP_AZURE_IOT_HUB_CLIENT_TOPIC_HANDLER_MAX handlers are registered.
+ */
+uint32_t esp_azure_iot_hub_client_topic_handler_register(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                    const uint8_t *prefix, uint32_t prefix_length,
+                                                    uint32_t (*handler)(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                        ESP_PACKET *packet_ptr, size_t topic_offset,
+                                                                        uint16_t topic_length, void *args),
+                                                    void *handler_args);
+
+/**
+ * @brief Deregister the handler of a custom topic
+ *
+ * @param[in] hub_client_ptr A pointer to a #ESP_AZURE_IOT_HUB_CLIENT.
+ * @param[in] prefix Topic prefix given to esp_azure_iot_hub_client_topic_handler_register().
+ * @param[in] prefix_length Length of `prefix`.
+ * @return A `uint32_t` with the result of the API.
+ *   @retval #ESP_AZURE_IOT_SUCCESS Successful if the handler is deregistered.
+ *   @retval #ESP_AZURE_IOT_NOT_FOUND Fail if no handler is registered for `prefix`.
+ */
+uint32_t esp_azure_iot_hub_client_topic_handler_deregister(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                      const uint8_t *prefix, uint32_t prefix_length);
 #ifdef __cplusplus
 }
 #endif
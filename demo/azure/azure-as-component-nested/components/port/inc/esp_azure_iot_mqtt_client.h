@@ -26,16 +26,32 @@ extern   "C" {
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
-#include "freertos/ringbuf.h"
 #include "freertos/event_groups.h"
 
 /* Define the default MQTT TLS (secure) port number */
 #define ESP_AZURE_IOT_MQTT_TLS_PORT                                    8883
 #define ESP_AZURE_IOT_MQTT_SUCCESS                                     0
 
+/* Define the number of packets preallocated in the packet pool.  */
+#ifndef ESP_AZURE_IOT_PACKET_POOL_BLOCK_COUNT
+#define ESP_AZURE_IOT_PACKET_POOL_BLOCK_COUNT                          8
+#endif /* ESP_AZURE_IOT_PACKET_POOL_BLOCK_COUNT */
+
+/* Define the data area size of each packet in the packet pool.  */
+#ifndef ESP_AZURE_IOT_PACKET_POOL_BLOCK_SIZE
+#define ESP_AZURE_IOT_PACKET_POOL_BLOCK_SIZE                           1536
+#endif /* ESP_AZURE_IOT_PACKET_POOL_BLOCK_SIZE */
+
+/* Define the number of waiters preallocated for threads blocked in the clients.  */
+#ifndef ESP_AZURE_IOT_THREAD_POOL_COUNT
+#define ESP_AZURE_IOT_THREAD_POOL_COUNT                                8
+#endif /* ESP_AZURE_IOT_THREAD_POOL_COUNT */
+
 typedef struct ESP_THREAD_STRUCT 
 {
     SemaphoreHandle_t            esp_thread_semaphore;
+    StaticSemaphore_t            esp_thread_semaphore_buffer;
+    struct ESP_THREAD_STRUCT     *esp_thread_next;
 } ESP_THRAED;
 
 typedef struct ESP_PACKET_STRUCT
@@ -45,10 +61,30 @@ typedef struct ESP_PACKET_STRUCT
     uint8_t                     *esp_packet_data_start;
     uint8_t                     *esp_packet_data_end;
     size_t                      esp_packet_length;
-    RingbufHandle_t             esp_packet_append_buf;
     struct ESP_PACKET_STRUCT    *esp_packet_next;
 } ESP_PACKET;
 
+typedef struct ESP_PACKET_POOL_STATS_STRUCT
+{
+    /* Define the number of packets owned by the pool.  */
+    uint32_t                    esp_packet_pool_total;
+
+    /* Define the number of packets currently available.  */
+    uint32_t                    esp_packet_pool_free;
+
+    /* Define the lowest number of available packets seen since creation.  */
+    uint32_t                    esp_packet_pool_free_min;
+
+    /* Define the number of successful allocations.  */
+    uint32_t                    esp_packet_pool_allocations;
+
+    /* Define the number of allocations that found the pool empty.  */
+    uint32_t                    esp_packet_pool_empty_requests;
+
+    /* Define the number of allocations that timed out on an empty pool.  */
+    uint32_t                    esp_packet_pool_failures;
+} ESP_PACKET_POOL_STATS;
+
 typedef struct ESP_AZURE_IOT_EVENT_GROUP_STRUCT
 {
 
@@ -63,6 +99,13 @@ typedef struct ESP_AZURE_IOT_EVENT_GROUP_STRUCT
        in module processing routine.  */
     size_t                                      esp_event_group_own_events;
 
+    /* Define the pending common events for this module.  */
+    size_t                                      esp_event_group_common_events;
+
+    /* Define the tick at which the module timer expires, valid while armed.  */
+    TickType_t                                  esp_event_group_timer_deadline;
+    uint32_t                                    esp_event_group_timer_armed;
+
     /* Define the module processing routine.  */
     void                                        (*esp_event_group_process)(void *module_context, size_t common_events, size_t module_own_events);
 
@@ -98,26 +141,45 @@ typedef struct ESP_AZURE_IOT_EVENT_STRUCT
     /* Define the number of created module instances.  */
     size_t                        esp_event_groups_count;
 
+    /* Define the module whose events were dispatched last, where the next scan for
+       pending events resumes.  */
+    ESP_AZURE_IOT_EVENT_GROUP     *esp_event_group_last_served;
+
+    /* Define the lock protecting the module list and pending events, which
+       are also touched from the event helper thread without the mutex.  */
+    portMUX_TYPE                  esp_event_lock;
+
+    /* Define the event helper thread.  */
+    TaskHandle_t                  esp_event_thread;
+
+    /* Define the tick of the next periodic event.  */
+    TickType_t                    esp_event_periodic_deadline;
+
 } ESP_AZURE_IOT_EVENT;
 
 typedef struct ESP_MQTT_CLIENT_STRUCT {
     char                     *esp_mqtt_client_id;
     size_t                   esp_mqtt_client_id_length;
-    char                     *esp_mqtt_username;
+    char                     *esp_mqtt_username;                  /* Login copied by esp_azure_iot_mqtt_client_login_set, owned by the client.  */
     size_t                   esp_mqtt_username_length;
     char                     *esp_mqtt_password;
     size_t                   esp_mqtt_password_length;
+    uint32_t                 esp_mqtt_keepalive;                 /* Session settings of the last connect, kept for login updates.  */
+    uint32_t                 esp_mqtt_clean_session;
     esp_mqtt_client_handle_t esp_mqtt_client_handle;
     SemaphoreHandle_t        esp_mqtt_client_mutex_ptr;
     EventGroupHandle_t       esp_mqtt_client_event_ptr;
     ESP_PACKET               *message_receive_queue_head;
     ESP_PACKET               *message_receive_queue_tail;
     uint32_t                 message_receive_queue_depth;
+    ESP_PACKET               *esp_mqtt_client_receive_packet;     /* Message being reassembled from MQTT_EVENT_DATA fragments.  */
+    size_t                   esp_mqtt_client_receive_remaining;  /* Payload bytes of that message still to come.  */
     void                     (*esp_mqtt_client_receive_notify)(struct ESP_MQTT_CLIENT_STRUCT *client_ptr, uint32_t message_count);
     void                     (*esp_mqtt_connect_notify)(struct ESP_MQTT_CLIENT_STRUCT *client_ptr, uint32_t status, void *context);
     void                     (*esp_mqtt_disconnect_notify)(struct ESP_MQTT_CLIENT_STRUCT *client_ptr);
     uint32_t                 (*esp_mqtt_packet_receive_notify)(struct ESP_MQTT_CLIENT_STRUCT *client_ptr, ESP_PACKET *packet_ptr, void *context);
     void                     *esp_mqtt_connect_context;
+    void                     *esp_mqtt_client_resource_ptr;     /* Owning ESP_AZURE_IOT_RESOURCE, set while linked.  */
 } ESP_MQTT_CLIENT;
 
 uint32_t esp_azure_iot_mqtt_client_create(ESP_MQTT_CLIENT *client_ptr, char *client_name, char *client_id, uint32_t client_id_length, ESP_AZURE_IOT_EVENT *event_ptr);
@@ -129,24 +191,30 @@ uint32_t esp_azure_iot_mqtt_client_publish(ESP_MQTT_CLIENT *client_ptr, char *to
 uint32_t esp_azure_iot_mqtt_client_connect(ESP_MQTT_CLIENT *client_ptr, size_t *server_ip, uint32_t server_port, uint32_t keepalive, uint32_t clean_session, size_t wait_option);
 uint32_t esp_azure_iot_mqtt_client_secure_connect(ESP_MQTT_CLIENT *client_ptr, size_t *server_ip, uint32_t server_port, uint32_t keepalive, uint32_t clean_session, size_t wait_option);
 uint32_t esp_azure_iot_mqtt_client_login_set(ESP_MQTT_CLIENT *client_ptr, char *username, uint32_t username_length, char *password, uint32_t password_length);
+uint32_t esp_azure_iot_mqtt_client_login_update(ESP_MQTT_CLIENT *client_ptr, size_t wait_option);
 uint32_t esp_azure_iot_mqtt_client_disconnect(ESP_MQTT_CLIENT *client_ptr);
 uint32_t esp_azure_iot_mqtt_client_publish_packet(ESP_MQTT_CLIENT *client_ptr, ESP_PACKET *packet_ptr, uint32_t QoS, size_t wait_option);
 uint32_t esp_azure_iot_mqtt_client_packet_process(ESP_PACKET *packet_ptr, size_t *topic_offset, uint16_t *topic_length, size_t *message_offset, size_t *message_length);
 uint32_t esp_azure_iot_mqtt_client_send_event(ESP_MQTT_CLIENT *client_ptr, void *msg);
 uint32_t esp_azure_iot_mqtt_client_disconnect_notify_set(ESP_MQTT_CLIENT *client_ptr, void (*disconnect_notify)(ESP_MQTT_CLIENT *));
 
+uint32_t esp_azure_iot_packet_pool_create(void);
+uint32_t esp_azure_iot_packet_pool_stats_get(ESP_PACKET_POOL_STATS *stats_ptr);
 uint32_t esp_azure_iot_packet_allocate(ESP_PACKET **packet_ptr, size_t packet_type, size_t wait_option);
 uint32_t esp_azure_iot_packet_release(ESP_PACKET *packet_ptr_ptr);
 uint32_t esp_azure_iot_packet_append(ESP_PACKET *packet_ptr, void *data_start, size_t data_size, size_t wait_option);
+uint32_t esp_azure_iot_packet_topic_append(ESP_PACKET *packet_ptr, void *data_start, size_t data_size);
 
 uint32_t esp_azure_iot_event_group_set(ESP_AZURE_IOT_EVENT_GROUP *event_group_ptr, size_t group_own_event);
 uint32_t esp_azure_iot_event_group_register(ESP_AZURE_IOT_EVENT *event_ptr, ESP_AZURE_IOT_EVENT_GROUP *event_group_ptr, const char *group_name, size_t group_event,
                               void (*group_process)(void* group_context, size_t common_events, size_t group_own_events), void *group_context);
 uint32_t esp_azure_iot_event_group_deregister(ESP_AZURE_IOT_EVENT *event_ptr, ESP_AZURE_IOT_EVENT_GROUP *event_group_ptr);
+uint32_t esp_azure_iot_event_group_timer_set(ESP_AZURE_IOT_EVENT_GROUP *event_group_ptr, TickType_t ticks);
 
 uint32_t esp_azure_iot_event_create(ESP_AZURE_IOT_EVENT *event_ptr, const char *event_name, void *memory_ptr, size_t memory_size, uint32_t priority);
 uint32_t esp_azure_iot_event_delete(ESP_AZURE_IOT_EVENT *event_ptr);
 
+uint32_t esp_azure_iot_thread_pool_create(void);
 uint32_t esp_azure_iot_thread_sleep(ESP_THRAED *thread_ptr, size_t wait_option);
 uint32_t esp_azure_iot_thread_wait_abort(ESP_THRAED *thread_ptr);
 ESP_THRAED *esp_azure_iot_thread_identify(void);
@@ -165,6 +165,7 @@ uint32_t esp_azure_iot_provisioning_client_symmetric_key_set(ESP_AZURE_IOT_PROVI
  * @return A `uint32_t` with the result of the API.
  *  @retval #ESP_AZURE_IOT_SUCCESS Successfully register device to AZ IoT Provisioning.
  *  @retval #ESP_AZURE_IOT_PENDING Successfully started registration of device but not yet completed.
+ *  @retval #ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE Fail if #ESP_AZURE_IOT_THREAD_POOL_COUNT tasks are already waiting.
  */
 uint32_t esp_azure_iot_provisioning_client_register(ESP_AZURE_IOT_PROVISIONING_CLIENT *prov_client_ptr, uint32_t wait_option);
 
@@ -13,57 +13,34 @@
 // limitations under the License.
 
 #include "esp_azure_iot.h"
+#include "azure/core/internal/az_span_internal.h"
 
 #ifndef ESP_AZURE_IOT_WAIT_OPTION
 #define ESP_AZURE_IOT_WAIT_OPTION ((size_t)0xFFFFFFFF)
 #endif /* ESP_AZURE_IOT_WAIT_OPTION */
 
-/* Convert number to upper hex */
-#define ESP_AZURE_IOT_NUMBER_TO_UPPER_HEX(number)    (char)(number + (number < 10 ? '0' : 'A' - 10))
-                                                    
-/* Define the prototypes for Azure RTOS IoT.  */
-ESP_AZURE_IOT *_esp_azure_iot_created_ptr;
-
 extern void esp_azure_iot_hub_client_event_process(ESP_AZURE_IOT *esp_azure_iot_ptr,
                                                   size_t common_events, size_t module_own_events);
 
+/* Encode through the table-driven encoder shared with sdk-core.  */
 static uint32_t esp_azure_iot_url_encode(char *src_ptr, uint32_t src_len,
                                     char *dest_ptr, uint32_t dest_len, uint32_t *bytes_copied)
 {
-    uint32_t dest_index;
-    uint32_t src_index;
-    char ch;
+    az_span source = az_span_init((uint8_t *)src_ptr, (int32_t)src_len);
+    int32_t length;
 
-    for (src_index = 0, dest_index = 0; src_index < src_len; src_index++)
+    /* Size the output once up front.  */
+    if (_az_span_url_encode_calc_length(source) > (int32_t)dest_len)
     {
-        ch = src_ptr[src_index];
-
-        /* Check if encoding is required.
-           copied from sdk-core */
-        if ((('0' <= ch) && (ch <= '9')) ||
-            (('a' <= (ch | 0x20)) && ((ch | 0x20) <= 'z')))
-        {
-            if (dest_index >= dest_len)
-            {
-                return ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE;
-            }
+        return ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE;
+    }
 
-            dest_ptr[dest_index++] = ch;
-        }
-        else
-        {
-            if ((dest_index + 2) >= dest_len)
-            {
-                return ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE;
-            }
-
-            dest_ptr[dest_index++] = '%';
-            dest_ptr[dest_index++] = ESP_AZURE_IOT_NUMBER_TO_UPPER_HEX((ch >> 4));
-            dest_ptr[dest_index++] = ESP_AZURE_IOT_NUMBER_TO_UPPER_HEX((ch & 0x0F));
-        }
+    if (az_failed(_az_span_url_encode(az_span_init((uint8_t *)dest_ptr, (int32_t)dest_len), source, &length)))
+    {
+        return ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE;
     }
-    
-    *bytes_copied = dest_index;
+
+    *bytes_copied = (uint32_t)length;
 
     return ESP_AZURE_IOT_SUCCESS ;
 }
@@ -84,26 +61,14 @@ static void esp_azure_iot_event_process(void *esp_azure_iot, size_t common_event
 
 ESP_AZURE_IOT_RESOURCE *esp_azure_iot_resource_search(ESP_MQTT_CLIENT *client_ptr)
 {
-    ESP_AZURE_IOT_RESOURCE *resource_ptr;
 
-    /* Check if created Azure RTOS IoT.  */
-    if ((_esp_azure_iot_created_ptr == NULL) || (client_ptr == NULL))
+    /* Each MQTT client points back at the resource it is linked into.  */
+    if (client_ptr == NULL)
     {
         return(NULL);
     }
 
-    /* Loop to find the resource associated with current MQTT client. */
-    for (resource_ptr = _esp_azure_iot_created_ptr -> esp_azure_iot_resource_list_header;
-         resource_ptr; resource_ptr = resource_ptr -> esp_azure_iot_resource_next)
-    {
-
-        if (&(resource_ptr -> esp_azure_iot_mqtt) == client_ptr)
-        {
-            return(resource_ptr);
-        }
-    }
-
-    return(NULL);
+    return((ESP_AZURE_IOT_RESOURCE *)client_ptr -> esp_mqtt_client_resource_ptr);
 }
 
 uint32_t esp_azure_iot_resource_add(ESP_AZURE_IOT *esp_azure_iot_ptr, ESP_AZURE_IOT_RESOURCE *resource_ptr)
@@ -111,6 +76,7 @@ uint32_t esp_azure_iot_resource_add(ESP_AZURE_IOT *esp_azure_iot_ptr, ESP_AZURE_
 
     resource_ptr -> esp_azure_iot_resource_next = esp_azure_iot_ptr -> esp_azure_iot_resource_list_header;
     esp_azure_iot_ptr -> esp_azure_iot_resource_list_header = resource_ptr;
+    resource_ptr -> esp_azure_iot_mqtt.esp_mqtt_client_resource_ptr = (void *)resource_ptr;
 
     return(ESP_AZURE_IOT_SUCCESS );
 }
@@ -128,6 +94,7 @@ uint32_t esp_azure_iot_resource_remove(ESP_AZURE_IOT *esp_azure_iot_ptr, ESP_AZU
     if (esp_azure_iot_ptr -> esp_azure_iot_resource_list_header == resource_ptr)
     {
         esp_azure_iot_ptr -> esp_azure_iot_resource_list_header = esp_azure_iot_ptr -> esp_azure_iot_resource_list_header -> esp_azure_iot_resource_next;
+        resource_ptr -> esp_azure_iot_mqtt.esp_mqtt_client_resource_ptr = NULL;
         return(ESP_AZURE_IOT_SUCCESS);
     }
 
@@ -138,6 +105,7 @@ uint32_t esp_azure_iot_resource_remove(ESP_AZURE_IOT *esp_azure_iot_ptr, ESP_AZU
         if (resource_previous -> esp_azure_iot_resource_next == resource_ptr)
         {
             resource_previous -> esp_azure_iot_resource_next = resource_previous -> esp_azure_iot_resource_next -> esp_azure_iot_resource_next;
+            resource_ptr -> esp_azure_iot_mqtt.esp_mqtt_client_resource_ptr = NULL;
             return(ESP_AZURE_IOT_SUCCESS);
         }
     }
@@ -159,6 +127,22 @@ uint32_t esp_azure_iot_create(ESP_AZURE_IOT *esp_azure_iot_ptr, uint8_t *name_pt
     esp_azure_iot_ptr -> esp_azure_iot_name = name_ptr;
     esp_azure_iot_ptr -> esp_azure_iot_unix_time_get = unix_time_callback;
 
+    /* Preallocate packets shared by all clients.  */
+    status = esp_azure_iot_packet_pool_create();
+    if (status)
+    {
+        LogError("IoT create fail: PACKET POOL CREATE FAIL: 0x%02x", status);
+        return(status);
+    }
+
+    /* Preallocate waiters shared by all clients.  */
+    status = esp_azure_iot_thread_pool_create();
+    if (status)
+    {
+        LogError("IoT create fail: THREAD POOL CREATE FAIL: 0x%02x", status);
+        return(status);
+    }
+
     status = esp_azure_iot_event_create(&esp_azure_iot_ptr -> esp_azure_iot_event, (char *)name_ptr, NULL,
                              stack_memory_size, priority);
     if (status)
@@ -180,10 +164,6 @@ uint32_t esp_azure_iot_create(ESP_AZURE_IOT *esp_azure_iot_ptr, uint8_t *name_pt
     /* Set the mutex.  */
     esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr = esp_azure_iot_ptr->esp_azure_iot_event.esp_event_mutex;
 
-    /* Set created IoT pointer.  */
-    _esp_azure_iot_created_ptr = esp_azure_iot_ptr;
-    
-
     return(ESP_AZURE_IOT_SUCCESS );
 }
 
@@ -214,8 +194,6 @@ uint32_t esp_azure_iot_delete(ESP_AZURE_IOT *esp_azure_iot_ptr)
         return(status);
     }
 
-    _esp_azure_iot_created_ptr = NULL;
-
     return(ESP_AZURE_IOT_SUCCESS );
 }
 
@@ -373,13 +351,137 @@ static uint32_t esp_azure_iot_base64_encode(uint8_t *name, uint32_t length, char
     return (ret == ESP_AZURE_IOT_SUCCESS) ? (ESP_AZURE_IOT_SUCCESS) : (ESP_AZURE_IOT_INVALID_PARAMETER);
 }
 
+static uint32_t esp_azure_iot_hmac_sha256_mbedtls_key_set(ESP_AZURE_IOT_HMAC_SHA256 *hmac_ptr, uint8_t *key_ptr, uint32_t key_size)
+{
+    mbedtls_md_init(&(hmac_ptr -> esp_hmac_sha256_md_context));
+
+    /* Derive the inner and outer padded key blocks once, each signature only resets to them.  */
+    if (mbedtls_md_setup(&(hmac_ptr -> esp_hmac_sha256_md_context), mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1) ||
+        mbedtls_md_hmac_starts(&(hmac_ptr -> esp_hmac_sha256_md_context), key_ptr, key_size))
+    {
+        mbedtls_md_free(&(hmac_ptr -> esp_hmac_sha256_md_context));
+        return(ESP_AZURE_IOT_INVALID_PARAMETER);
+    }
+
+    return(ESP_AZURE_IOT_SUCCESS);
+}
+
+static uint32_t esp_azure_iot_hmac_sha256_mbedtls_calculate(ESP_AZURE_IOT_HMAC_SHA256 *hmac_ptr, uint8_t *message_ptr,
+                                                       uint32_t message_size, uint8_t *output_ptr)
+{
+    if (mbedtls_md_hmac_reset(&(hmac_ptr -> esp_hmac_sha256_md_context)) ||
+        mbedtls_md_hmac_update(&(hmac_ptr -> esp_hmac_sha256_md_context), message_ptr, message_size) ||
+        mbedtls_md_hmac_finish(&(hmac_ptr -> esp_hmac_sha256_md_context), output_ptr))
+    {
+        return(ESP_AZURE_IOT_INVALID_PARAMETER);
+    }
+
+    return(ESP_AZURE_IOT_SUCCESS);
+}
+
+static void esp_azure_iot_hmac_sha256_mbedtls_key_clear(ESP_AZURE_IOT_HMAC_SHA256 *hmac_ptr)
+{
+    mbedtls_md_free(&(hmac_ptr -> esp_hmac_sha256_md_context));
+}
+
+const ESP_AZURE_IOT_HMAC_SHA256_BACKEND esp_azure_iot_hmac_sha256_mbedtls =
+{
+    esp_azure_iot_hmac_sha256_mbedtls_key_set,
+    esp_azure_iot_hmac_sha256_mbedtls_calculate,
+    esp_azure_iot_hmac_sha256_mbedtls_key_clear
+};
+
+static uint32_t esp_azure_iot_hmac_sha256_software_key_set(ESP_AZURE_IOT_HMAC_SHA256 *hmac_ptr, uint8_t *key_ptr, uint32_t key_size)
+{
+    memcpy(hmac_ptr -> esp_hmac_sha256_key, key_ptr, key_size);
+    hmac_ptr -> esp_hmac_sha256_key_size = key_size;
+
+    return(ESP_AZURE_IOT_SUCCESS);
+}
+
 /* HMAC-SHA256(master key, message ) */
-static uint32_t esp_azure_iot_hmac_sha256_calculate(ESP_AZURE_IOT_RESOURCE *resource_ptr, uint8_t *key, uint32_t key_size,
-                                               uint8_t *message, uint32_t message_size, uint8_t *output)
+static uint32_t esp_azure_iot_hmac_sha256_software_calculate(ESP_AZURE_IOT_HMAC_SHA256 *hmac_ptr, uint8_t *message_ptr,
+                                                        uint32_t message_size, uint8_t *output_ptr)
 {
-    hmac_sha256(key, key_size, message, message_size, output);
-    
-    return(ESP_AZURE_IOT_SUCCESS );
+    hmac_sha256(hmac_ptr -> esp_hmac_sha256_key, hmac_ptr -> esp_hmac_sha256_key_size, message_ptr, message_size, output_ptr);
+
+    return(ESP_AZURE_IOT_SUCCESS);
+}
+
+static void esp_azure_iot_hmac_sha256_software_key_clear(ESP_AZURE_IOT_HMAC_SHA256 *hmac_ptr)
+{
+    ESP_PARAMETER_NOT_USED(hmac_ptr);
+}
+
+const ESP_AZURE_IOT_HMAC_SHA256_BACKEND esp_azure_iot_hmac_sha256_software =
+{
+    esp_azure_iot_hmac_sha256_software_key_set,
+    esp_azure_iot_hmac_sha256_software_calculate,
+    esp_azure_iot_hmac_sha256_software_key_clear
+};
+
+static const ESP_AZURE_IOT_HMAC_SHA256_BACKEND *esp_azure_iot_hmac_sha256_backend = &ESP_AZURE_IOT_HMAC_SHA256_DEFAULT_BACKEND;
+
+uint32_t esp_azure_iot_hmac_sha256_backend_set(const ESP_AZURE_IOT_HMAC_SHA256_BACKEND *backend_ptr)
+{
+    if ((backend_ptr == NULL) || (backend_ptr -> esp_hmac_sha256_key_set == NULL) ||
+        (backend_ptr -> esp_hmac_sha256_calculate == NULL) || (backend_ptr -> esp_hmac_sha256_key_clear == NULL))
+    {
+        LogError("HMAC-SHA256 backend set fail: INVALID POINTER");
+        return(ESP_AZURE_IOT_INVALID_PARAMETER);
+    }
+
+    esp_azure_iot_hmac_sha256_backend = backend_ptr;
+
+    return(ESP_AZURE_IOT_SUCCESS);
+}
+
+uint32_t esp_azure_iot_hmac_sha256_key_set(ESP_AZURE_IOT_HMAC_SHA256 *hmac_ptr, uint8_t *key_ptr, uint32_t key_size)
+{
+uint32_t status;
+
+    if ((hmac_ptr == NULL) || (key_ptr == NULL) || (key_size == 0) ||
+        (key_size > ESP_AZURE_IOT_HMAC_SHA256_KEY_MAX))
+    {
+        LogError("HMAC-SHA256 key set fail: INVALID PARAMETER");
+        return(ESP_AZURE_IOT_INVALID_PARAMETER);
+    }
+
+    /* Drop the state of a previous key.  */
+    esp_azure_iot_hmac_sha256_key_clear(hmac_ptr);
+
+    status = esp_azure_iot_hmac_sha256_backend -> esp_hmac_sha256_key_set(hmac_ptr, key_ptr, key_size);
+    if (status)
+    {
+        LogError("HMAC-SHA256 key set fail: 0x%02x", status);
+        esp_azure_iot_hmac_sha256_key_clear(hmac_ptr);
+        return(status);
+    }
+
+    hmac_ptr -> esp_hmac_sha256_backend = esp_azure_iot_hmac_sha256_backend;
+
+    return(ESP_AZURE_IOT_SUCCESS);
+}
+
+void esp_azure_iot_hmac_sha256_key_clear(ESP_AZURE_IOT_HMAC_SHA256 *hmac_ptr)
+{
+    if (hmac_ptr == NULL)
+    {
+        return;
+    }
+
+    if (hmac_ptr -> esp_hmac_sha256_backend)
+    {
+        hmac_ptr -> esp_hmac_sha256_backend -> esp_hmac_sha256_key_clear(hmac_ptr);
+    }
+
+    memset(hmac_ptr, 0, sizeof(ESP_AZURE_IOT_HMAC_SHA256));
+}
+
+uint32_t esp_azure_iot_base64_key_decode(uint8_t *key_ptr, uint32_t key_size,
+                                    uint8_t *buffer_ptr, uint32_t buffer_len, uint32_t *bytes_copied)
+{
+    return(esp_azure_iot_base64_decode((char *)key_ptr, key_size, buffer_ptr, buffer_len, bytes_copied));
 }
 
 uint32_t esp_azure_iot_url_encoded_hmac_sha256_calculate(ESP_AZURE_IOT_RESOURCE *resource_ptr,
@@ -389,11 +491,10 @@ uint32_t esp_azure_iot_url_encoded_hmac_sha256_calculate(ESP_AZURE_IOT_RESOURCE
                                                     uint8_t **output_pptr, uint32_t *output_len)
 {
     uint32_t status;
-    uint8_t *hash_buf;
-    uint32_t hash_buf_size = 33;
-    char *encoded_hash_buf;
-    uint32_t encoded_hash_buf_size = 48;
     uint32_t binary_key_buf_size;
+    ESP_AZURE_IOT_HMAC_SHA256 hmac;
+
+    ESP_PARAMETER_NOT_USED(resource_ptr);
 
     binary_key_buf_size = buffer_len;
     status = esp_azure_iot_base64_decode((char *)key_ptr, key_size,
@@ -404,16 +505,49 @@ uint32_t esp_azure_iot_url_encoded_hmac_sha256_calculate(ESP_AZURE_IOT_RESOURCE
         return(status);
     }
 
-    buffer_len -= binary_key_buf_size;
+    /* One-off signature, the key state is not kept.  */
+    memset(&hmac, 0, sizeof(hmac));
+    status = esp_azure_iot_hmac_sha256_key_set(&hmac, buffer_ptr, binary_key_buf_size);
+    memset(buffer_ptr, 0, binary_key_buf_size);
+    if (status)
+    {
+        return(status);
+    }
+
+    status = esp_azure_iot_url_encoded_hmac_sha256_keyed_calculate(&hmac, message_ptr, message_size,
+                                                                  buffer_ptr, buffer_len,
+                                                                  output_pptr, output_len);
+    esp_azure_iot_hmac_sha256_key_clear(&hmac);
+
+    return(status);
+}
+
+uint32_t esp_azure_iot_url_encoded_hmac_sha256_keyed_calculate(ESP_AZURE_IOT_HMAC_SHA256 *hmac_ptr,
+                                                                uint8_t *message_ptr, uint32_t message_size,
+                                                                uint8_t *buffer_ptr, uint32_t buffer_len,
+                                                                uint8_t **output_pptr, uint32_t *output_len)
+{
+    uint32_t status;
+    uint8_t *hash_buf;
+    uint32_t hash_buf_size = 33;
+    char *encoded_hash_buf;
+    uint32_t encoded_hash_buf_size = 48;
+
     if ((hash_buf_size + encoded_hash_buf_size) > buffer_len)
     {
         LogError("Failed to not enough memory");
         return(ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE);
     }
 
-    hash_buf = buffer_ptr + binary_key_buf_size;
-    status = esp_azure_iot_hmac_sha256_calculate(resource_ptr, buffer_ptr, binary_key_buf_size,
-                                                message_ptr, (uint32_t)message_size, hash_buf);
+    if ((hmac_ptr == NULL) || (hmac_ptr -> esp_hmac_sha256_backend == NULL))
+    {
+        LogError("Failed to no key set");
+        return(ESP_AZURE_IOT_INVALID_PARAMETER);
+    }
+
+    hash_buf = buffer_ptr;
+    status = hmac_ptr -> esp_hmac_sha256_backend -> esp_hmac_sha256_calculate(hmac_ptr, message_ptr,
+                                                                           (uint32_t)message_size, hash_buf);
     if (status)
     {
         LogError("Failed to get hash256");
@@ -13,22 +13,125 @@
 // limitations under the License.
 
 #include "esp_azure_iot_hub_client.h"
+#include "azure/core/az_json.h"
+#include "esp_system.h"
 
 #define ESP_AZURE_IOT_HUB_CLIENT_EMPTY_JSON                      "{}"
 #define ESP_AZURE_IOT_HUB_CLIENT_USER_AGENT                      "os=azure_rtos"
 
+/* Topic prefixes inbound messages are routed by.  */
+#define ESP_AZURE_IOT_HUB_CLIENT_METHODS_TOPIC_PREFIX            "$iothub/methods/"
+#define ESP_AZURE_IOT_HUB_CLIENT_TWIN_TOPIC_PREFIX               "$iothub/twin/"
+#define ESP_AZURE_IOT_HUB_CLIENT_C2D_TOPIC_PREFIX                "devices/"
+
+/* Scratch space for the signature hash, its base64 and URL encoded forms.  */
+#define ESP_AZURE_IOT_HUB_CLIENT_SAS_SCRATCH_SIZE                (256)
+
 static void esp_azure_iot_hub_client_received_message_cleanup(ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA *message);
 static uint32_t esp_azure_iot_hub_client_cloud_message_sub_unsub(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr, uint32_t is_subscribe);
 static void esp_azure_iot_hub_client_mqtt_receive_callback(ESP_MQTT_CLIENT* client_ptr, uint32_t number_of_messages);
 static uint32_t esp_azure_iot_hub_client_c2d_process(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr, ESP_PACKET *packet_ptr, size_t topic_offset, uint16_t topic_length);
 static uint32_t esp_azure_iot_hub_client_device_twin_process(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr, ESP_PACKET *packet_ptr, size_t topic_offset, uint16_t topic_length);
 static void esp_azure_iot_hub_client_mqtt_connect_notify(ESP_MQTT_CLIENT *client_ptr, uint32_t status, void *context);
+static uint32_t esp_azure_iot_hub_client_topic_dispatch(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr, ESP_PACKET *packet_ptr,
+                                                   size_t topic_offset, uint16_t topic_length);
 static void esp_azure_iot_hub_client_mqtt_disconnect_notify(ESP_MQTT_CLIENT *client_ptr);
 void esp_azure_iot_hub_client_event_process(ESP_AZURE_IOT *esp_azure_iot_ptr, size_t common_events, size_t module_own_events);
-static void esp_azure_iot_hub_client_thread_dequeue(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr, ESP_AZURE_IOT_THREAD_LIST *thread_list_ptr);
+static void esp_azure_iot_hub_client_thread_dequeue(ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA *metadata, ESP_AZURE_IOT_THREAD_LIST *thread_list_ptr);
+static uint32_t esp_azure_iot_hub_client_receive_thread_find(ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA *metadata,
+                                                        ESP_PACKET *packet_ptr, uint32_t message_type,
+                                                        uint32_t response_status);
+static void esp_azure_iot_hub_client_message_notify(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                   ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA *metadata,
+                                                   ESP_PACKET *packet_ptr, uint32_t message_type,
+                                                   uint32_t response_status);
+static uint32_t esp_azure_iot_hub_client_request_id_next(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr, uint32_t odd);
+static uint32_t esp_azure_iot_hub_client_device_twin_request_send(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                             uint32_t request_id, uint8_t *message_buffer,
+                                                             uint32_t message_length, uint32_t wait_option);
+static uint32_t esp_azure_iot_hub_client_device_twin_request_async(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                              uint32_t request_id, uint32_t message_type,
+                                                              uint8_t *message_buffer, uint32_t message_length,
+                                                              uint32_t timeout,
+                                                              void (*callback_ptr)(
+                                                                    ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                    uint32_t request_id, uint32_t status,
+                                                                    uint32_t response_status, ESP_PACKET *packet_ptr,
+                                                                    void *args),
+                                                              void *callback_args, uint32_t *request_id_ptr,
+                                                              uint32_t wait_option);
+static uint32_t esp_azure_iot_hub_client_pending_request_add(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                        uint32_t request_id, uint32_t message_type,
+                                                        uint32_t timeout, ESP_AZURE_IOT_THREAD_LIST *thread_list_ptr,
+                                                        void (*callback_ptr)(
+                                                              ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                              uint32_t request_id, uint32_t status,
+                                                              uint32_t response_status, ESP_PACKET *packet_ptr,
+                                                              void *args),
+                                                        void *callback_args);
+static ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST *esp_azure_iot_hub_client_pending_request_find(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                                         uint32_t request_id);
+static void esp_azure_iot_hub_client_pending_request_remove(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr, uint32_t request_id);
+static void esp_azure_iot_hub_client_pending_request_complete(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                             ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST *request_ptr,
+                                                             uint32_t status, uint32_t response_status,
+                                                             ESP_PACKET *packet_ptr);
+static void esp_azure_iot_hub_client_pending_request_sweep(ESP_AZURE_IOT *esp_azure_iot_ptr);
+static void esp_azure_iot_hub_client_pending_request_abort(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr);
+static uint32_t esp_azure_iot_hub_client_pending_request_take(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                         uint32_t request_id, uint32_t message_type,
+                                                         ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST *requests);
+static void esp_azure_iot_hub_client_pending_request_fail(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                         uint32_t request_id, uint32_t status);
+static uint32_t esp_azure_iot_hub_client_reported_properties_merge(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                              uint8_t *message_buffer, uint32_t message_length,
+                                                              uint32_t timeout,
+                                                              void (*callback_ptr)(
+                                                                    ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                    uint32_t request_id, uint32_t status,
+                                                                    uint32_t response_status, ESP_PACKET *packet_ptr,
+                                                                    void *args),
+                                                              void *callback_args, uint32_t *request_id_ptr,
+                                                              uint32_t wait_option);
+static uint32_t esp_azure_iot_hub_client_reported_properties_merge_detach(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                     uint8_t *buffer_ptr, uint32_t buffer_size,
+                                                                     uint32_t *length_ptr);
+static uint32_t esp_azure_iot_hub_client_reported_properties_merge_publish(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                      uint32_t request_id, uint8_t *buffer_ptr,
+                                                                      uint32_t length, void *buffer_context,
+                                                                      uint32_t wait_option);
+static void esp_azure_iot_hub_client_reported_properties_merge_process(ESP_AZURE_IOT *esp_azure_iot_ptr);
+static az_result esp_azure_iot_hub_client_json_merge(az_span pending, az_span patch, az_span *destination_ptr);
+static uint32_t esp_azure_iot_hub_client_mutexes_create(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr);
+static void esp_azure_iot_hub_client_mutexes_delete(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr);
 static uint32_t esp_azure_iot_hub_client_sas_token_get(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
                                                   size_t expiry_time_secs, uint8_t *key, uint32_t key_len,
                                                   uint8_t *sas_buffer, uint32_t sas_buffer_len, uint32_t *sas_length);
+static void esp_azure_iot_hub_client_token_renew_schedule(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr);
+static void esp_azure_iot_hub_client_token_renew_timer_set(ESP_AZURE_IOT *esp_azure_iot_ptr, size_t seconds);
+static void esp_azure_iot_hub_client_token_renew_process(ESP_AZURE_IOT *esp_azure_iot_ptr);
+static void esp_azure_iot_hub_client_token_renew(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr, size_t current_time);
+static uint32_t esp_azure_iot_hub_client_subscriptions_restore(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr);
+
+/* Batch taken out of the hub client to be published without holding the mutex.  */
+typedef struct ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_FLIGHT_STRUCT
+{
+    ESP_PACKET  *esp_telemetry_batch_packet;
+    uint32_t    esp_telemetry_batch_count;
+    uint32_t    esp_telemetry_batch_first_tick;
+    void        *esp_telemetry_batch_contexts[ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_MAX_MESSAGES];
+} ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_FLIGHT;
+
+static uint32_t esp_azure_iot_hub_client_telemetry_batch_full(ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH *batch_ptr);
+static void esp_azure_iot_hub_client_telemetry_batch_detach(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                           ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_FLIGHT *flight_ptr);
+static uint32_t esp_azure_iot_hub_client_telemetry_batch_publish(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                            ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_FLIGHT *flight_ptr,
+                                                            uint32_t wait_option);
+static void esp_azure_iot_hub_client_telemetry_batch_complete(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                             ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_FLIGHT *flight_ptr,
+                                                             uint32_t status);
+static uint32_t esp_azure_iot_hub_client_telemetry_batch_is_json(uint8_t *telemetry_data, uint32_t data_size);
 
 uint32_t esp_azure_iot_hub_client_initialize(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
                                         ESP_AZURE_IOT *esp_azure_iot_ptr,
@@ -66,6 +169,14 @@ uint32_t esp_azure_iot_hub_client_initialize(ESP_AZURE_IOT_HUB_CLIENT *hub_clien
         return(ESP_AZURE_IOT_SDK_CORE_ERROR);
     }
 
+    /* Create the telemetry and per message type mutexes.  */
+    status = esp_azure_iot_hub_client_mutexes_create(hub_client_ptr);
+    if (status)
+    {
+        LogError("IoTHub client create fail: MUTEX CREATE FAIL");
+        return(status);
+    }
+
     /* Set resource pointer.  */
     resource_ptr = &(hub_client_ptr -> esp_azure_iot_hub_client_resource);
 
@@ -77,6 +188,7 @@ uint32_t esp_azure_iot_hub_client_initialize(ESP_AZURE_IOT_HUB_CLIENT *hub_clien
     if (status)
     {
         LogError("IoTHub client create fail: MQTT CLIENT CREATE FAIL: 0x%02x", status);
+        esp_azure_iot_hub_client_mutexes_delete(hub_client_ptr);
         return(status);
     }
 
@@ -87,6 +199,7 @@ uint32_t esp_azure_iot_hub_client_initialize(ESP_AZURE_IOT_HUB_CLIENT *hub_clien
     {
         LogError("IoTHub client set message callback: 0x%02x", status);
         esp_azure_iot_mqtt_client_delete(&(resource_ptr -> esp_azure_iot_mqtt));
+        esp_azure_iot_hub_client_mutexes_delete(hub_client_ptr);
         return(status);
     }
 
@@ -263,10 +376,13 @@ uint32_t esp_azure_iot_hub_client_connect(ESP_AZURE_IOT_HUB_CLIENT *hub_client_p
             LogError("IoTHub client connect fail: Token generation failed: 0x%02x", status);
             return(status);
         }
+
+        hub_client_ptr -> esp_azure_iot_hub_client_token_expiry = expiry_time_secs;
     }
     else
     {
         resource_ptr ->  esp_azure_iot_mqtt_sas_token_length = 0;
+        hub_client_ptr -> esp_azure_iot_hub_client_token_expiry = 0;
     }
 
     /* Set azure IoT and MQTT client.  */
@@ -343,6 +459,7 @@ uint32_t esp_azure_iot_hub_client_connect(ESP_AZURE_IOT_HUB_CLIENT *hub_client_p
 
         /* Connected to IoT Hub.  */
         hub_client_ptr -> esp_azure_iot_hub_client_state = ESP_AZURE_IOT_HUB_CLIENT_STATUS_CONNECTED;
+        esp_azure_iot_hub_client_token_renew_schedule(hub_client_ptr);
     }
 
     /* Call connection notify if it is set.  */
@@ -379,6 +496,7 @@ void esp_azure_iot_hub_client_mqtt_connect_notify(ESP_MQTT_CLIENT *client_ptr, u
     if (status == MQTT_EVENT_CONNECTED)
     {
         iot_hub_client -> esp_azure_iot_hub_client_state = ESP_AZURE_IOT_HUB_CLIENT_STATUS_CONNECTED;
+        esp_azure_iot_hub_client_token_renew_schedule(iot_hub_client);
     }
     else
     {
@@ -419,20 +537,127 @@ ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr = NULL;
 void esp_azure_iot_hub_client_event_process(ESP_AZURE_IOT *esp_azure_iot_ptr,
                                            size_t common_events, size_t module_own_events) 
 {
+ESP_AZURE_IOT_RESOURCE *resource_ptr;
+ESP_AZURE_IOT_RESOURCE *start_ptr;
+ESP_AZURE_IOT_RESOURCE *last_served_ptr = NULL;
+ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr = NULL;
+ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH *batch_ptr;
+ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_FLIGHT flight;
+uint32_t current_tick;
+uint32_t elapsed;
+uint32_t next_deadline;
+
+    /* Expire twin requests whose response did not arrive in time.  */
+    if (common_events & ESP_AZURE_IOT_EVENT_COMMON_TIMER_EVENT)
+    {
+        esp_azure_iot_hub_client_pending_request_sweep(esp_azure_iot_ptr);
+        esp_azure_iot_hub_client_reported_properties_merge_process(esp_azure_iot_ptr);
+        esp_azure_iot_hub_client_token_renew_process(esp_azure_iot_ptr);
+    }
+
+    /* Telemetry batches are only due on their timer or when a sender marked one full.  */
+    if (((common_events & ESP_AZURE_IOT_EVENT_COMMON_TIMER_EVENT) == 0) &&
+        ((module_own_events & ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_FLUSH_EVENT) == 0))
+    {
+        return;
+    }
+
+    do
+    {
+        flight.esp_telemetry_batch_packet = NULL;
+        next_deadline = 0;
+        current_tick = (uint32_t)xTaskGetTickCount();
+
+        /* Obtain the mutex.  */
+        xSemaphoreTake(esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr, ESP_WAIT_FOREVER);
+
+        /* Take out the next due batch. The scan resumes after the client served last and wraps
+           around, so that a client refilling its batch quickly can't starve the ones after it.  */
+        start_ptr = esp_azure_iot_ptr -> esp_azure_iot_resource_list_header;
+        for (resource_ptr = start_ptr; resource_ptr && last_served_ptr;
+             resource_ptr = resource_ptr -> esp_azure_iot_resource_next)
+        {
+            if (resource_ptr == last_served_ptr)
+            {
+                if (resource_ptr -> esp_azure_iot_resource_next)
+                {
+                    start_ptr = resource_ptr -> esp_azure_iot_resource_next;
+                }
+                break;
+            }
+        }
+
+        resource_ptr = start_ptr;
+        while (resource_ptr)
+        {
+            if (resource_ptr -> esp_azure_iot_resource_type == ESP_AZURE_IOT_RESOURCE_IOT_HUB)
+            {
+                hub_client_ptr = (ESP_AZURE_IOT_HUB_CLIENT *)resource_ptr -> esp_azure_iot_resource_data_ptr;
+                batch_ptr = &(hub_client_ptr -> esp_azure_iot_hub_client_telemetry_batch);
+
+                /* Obtain the batch mutex.  */
+                xSemaphoreTake(batch_ptr -> esp_telemetry_batch_mutex_ptr, ESP_WAIT_FOREVER);
+
+                if (batch_ptr -> esp_telemetry_batch_count)
+                {
+                    elapsed = current_tick - batch_ptr -> esp_telemetry_batch_first_tick;
+                    if (esp_azure_iot_hub_client_telemetry_batch_full(batch_ptr) ||
+                        (elapsed >= batch_ptr -> esp_telemetry_batch_max_latency))
+                    {
+                        esp_azure_iot_hub_client_telemetry_batch_detach(hub_client_ptr, &flight);
+                    }
+
+                    /* Remember the closest deadline still ahead.  */
+                    else if ((next_deadline == 0) || ((batch_ptr -> esp_telemetry_batch_max_latency - elapsed) < next_deadline))
+                    {
+                        next_deadline = batch_ptr -> esp_telemetry_batch_max_latency - elapsed;
+                    }
+                }
+
+                /* Release the batch mutex.  */
+                xSemaphoreGive(batch_ptr -> esp_telemetry_batch_mutex_ptr);
+
+                if (flight.esp_telemetry_batch_packet)
+                {
+                    last_served_ptr = resource_ptr;
+                    break;
+                }
+            }
 
-    ESP_PARAMETER_NOT_USED(esp_azure_iot_ptr);
+            resource_ptr = resource_ptr -> esp_azure_iot_resource_next;
+            if (resource_ptr == NULL)
+            {
+                resource_ptr = esp_azure_iot_ptr -> esp_azure_iot_resource_list_header;
+            }
+
+            if (resource_ptr == start_ptr)
+            {
+                break;
+            }
+        }
+
+        /* Release the mutex.  */
+        xSemaphoreGive(esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr);
 
-    /* Process common events.  */
-    ESP_PARAMETER_NOT_USED(common_events);
+        /* Re-arm the timer for batches that are not due yet, once no batch is left to publish.  */
+        if ((flight.esp_telemetry_batch_packet == NULL) && next_deadline)
+        {
+            esp_azure_iot_event_group_timer_set(&(esp_azure_iot_ptr -> esp_azure_iot_event_group), next_deadline);
+        }
 
-    /* Process module own events.  */
-    ESP_PARAMETER_NOT_USED(module_own_events);
+        if (flight.esp_telemetry_batch_packet)
+        {
+            esp_azure_iot_hub_client_telemetry_batch_publish(hub_client_ptr, &flight, ESP_NO_WAIT);
+        }
+    } while (flight.esp_telemetry_batch_packet);
 }
                                            
 uint32_t esp_azure_iot_hub_client_disconnect(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr)
 {
 uint32_t status;
 ESP_AZURE_IOT_THREAD_LIST *thread_list_ptr;
+ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA *metadata[4];
+uint32_t i;
 
 
     /* Check for invalid input pointers.  */
@@ -442,6 +667,11 @@ ESP_AZURE_IOT_THREAD_LIST *thread_list_ptr;
         return(ESP_AZURE_IOT_INVALID_PARAMETER);
     }
 
+    metadata[0] = &(hub_client_ptr -> esp_azure_iot_hub_client_c2d_message_metadata);
+    metadata[1] = &(hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata);
+    metadata[2] = &(hub_client_ptr -> esp_azure_iot_hub_client_device_twin_desired_properties_metadata);
+    metadata[3] = &(hub_client_ptr -> esp_azure_iot_hub_client_direct_method_metadata);
+
     /* Disconnect.  */
     status = esp_azure_iot_mqtt_client_disconnect(&hub_client_ptr -> esp_azure_iot_hub_client_resource.esp_azure_iot_mqtt);
     if (status)
@@ -460,23 +690,36 @@ ESP_AZURE_IOT_THREAD_LIST *thread_list_ptr;
         hub_client_ptr -> esp_azure_iot_hub_client_resource.esp_azure_iot_mqtt_buffer_context = NULL;
     }
 
-    /* Wakeup all suspend threads.  */
-    for (thread_list_ptr = hub_client_ptr -> esp_azure_iot_hub_client_thread_suspended;
-         thread_list_ptr;
-         thread_list_ptr = thread_list_ptr -> esp_azure_iot_thread_next)
-    {
-        esp_azure_iot_thread_wait_abort(thread_list_ptr -> esp_azure_iot_thread_ptr);
-    }
-
-    /* Cleanup received messages. */
-    esp_azure_iot_hub_client_received_message_cleanup(&(hub_client_ptr -> esp_azure_iot_hub_client_c2d_message_metadata));
-    esp_azure_iot_hub_client_received_message_cleanup(&(hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata));
-    esp_azure_iot_hub_client_received_message_cleanup(&(hub_client_ptr -> esp_azure_iot_hub_client_device_twin_desired_properties_metadata));
-    esp_azure_iot_hub_client_received_message_cleanup(&(hub_client_ptr -> esp_azure_iot_hub_client_direct_method_metadata));
+    /* No token is renewed for a disconnected session.  */
+    hub_client_ptr -> esp_azure_iot_hub_client_token_renew_time = 0;
 
     /* Release the mutex.  */
     xSemaphoreGive(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr);
 
+    for (i = 0; i < sizeof(metadata) / sizeof(metadata[0]); i++)
+    {
+
+        /* Obtain the message type mutex.  */
+        xSemaphoreTake(metadata[i] -> esp_azure_iot_hub_client_message_mutex_ptr, portMAX_DELAY);
+
+        /* Wakeup all suspend threads.  */
+        for (thread_list_ptr = metadata[i] -> esp_azure_iot_hub_client_message_thread_suspended;
+             thread_list_ptr;
+             thread_list_ptr = thread_list_ptr -> esp_azure_iot_thread_next)
+        {
+            esp_azure_iot_thread_wait_abort(thread_list_ptr -> esp_azure_iot_thread_ptr);
+        }
+
+        /* Cleanup received messages. */
+        esp_azure_iot_hub_client_received_message_cleanup(metadata[i]);
+
+        /* Release the message type mutex.  */
+        xSemaphoreGive(metadata[i] -> esp_azure_iot_hub_client_message_mutex_ptr);
+    }
+
+    /* Fail the twin requests still waiting for a response.  */
+    esp_azure_iot_hub_client_pending_request_abort(hub_client_ptr);
+
     return(ESP_AZURE_IOT_SUCCESS );
 }
 
@@ -504,6 +747,8 @@ ESP_PACKET *next_ptr = NULL;
 uint32_t esp_azure_iot_hub_client_deinitialize(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr)
 {
 uint32_t status;
+ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_FLIGHT flight;
+ESP_PACKET *packet_ptr;
 
 
     /* Check for invalid input pointers.  */
@@ -515,6 +760,19 @@ uint32_t status;
 
     esp_azure_iot_hub_client_disconnect(hub_client_ptr);
 
+    /* Drop the pending telemetry batch.  */
+    xSemaphoreTake(hub_client_ptr -> esp_azure_iot_hub_client_telemetry_batch.esp_telemetry_batch_mutex_ptr, portMAX_DELAY);
+    hub_client_ptr -> esp_azure_iot_hub_client_telemetry_batch.esp_telemetry_batch_enabled = 0;
+    esp_azure_iot_hub_client_telemetry_batch_detach(hub_client_ptr, &flight);
+    packet_ptr = hub_client_ptr -> esp_azure_iot_hub_client_telemetry_batch.esp_telemetry_batch_packet;
+    hub_client_ptr -> esp_azure_iot_hub_client_telemetry_batch.esp_telemetry_batch_packet = NULL;
+    xSemaphoreGive(hub_client_ptr -> esp_azure_iot_hub_client_telemetry_batch.esp_telemetry_batch_mutex_ptr);
+    if (packet_ptr)
+    {
+        esp_azure_iot_packet_release(packet_ptr);
+    }
+    esp_azure_iot_hub_client_telemetry_batch_complete(hub_client_ptr, &flight, ESP_AZURE_IOT_DISCONNECTED);
+
     status = esp_azure_iot_mqtt_client_delete(&(hub_client_ptr -> esp_azure_iot_hub_client_resource.esp_azure_iot_mqtt));
     if (status)
     {
@@ -539,6 +797,10 @@ uint32_t status;
     /* Release the mutex.  */
     xSemaphoreGive(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr);
 
+    /* Unlinked from the instance, no other thread can reach the client mutexes any more.  */
+    esp_azure_iot_hub_client_mutexes_delete(hub_client_ptr);
+    esp_azure_iot_hmac_sha256_key_clear(&(hub_client_ptr -> esp_azure_iot_hub_client_symmetric_key_hmac));
+
     return(ESP_AZURE_IOT_SUCCESS );
 }
 
@@ -565,6 +827,10 @@ uint32_t esp_azure_iot_hub_client_device_cert_set(ESP_AZURE_IOT_HUB_CLIENT *hub_
 uint32_t esp_azure_iot_hub_client_symmetric_key_set(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
                                                uint8_t *symmetric_key, uint32_t symmetric_key_length)
 {
+    uint32_t status;
+    uint8_t key_decoded[ESP_AZURE_IOT_HMAC_SHA256_KEY_MAX];
+    uint32_t key_decoded_length;
+
     if ((hub_client_ptr == NULL)  || (hub_client_ptr -> esp_azure_iot_ptr == NULL) ||
         (symmetric_key == NULL) || (symmetric_key_length == 0))
     {
@@ -575,6 +841,24 @@ uint32_t esp_azure_iot_hub_client_symmetric_key_set(ESP_AZURE_IOT_HUB_CLIENT *hu
     /* Obtain the mutex.  */
     xSemaphoreTake(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr, portMAX_DELAY);
 
+    /* Decode the key once, every token is signed with the key state prepared from it.  */
+    status = esp_azure_iot_base64_key_decode(symmetric_key, symmetric_key_length,
+                                            key_decoded, sizeof(key_decoded), &key_decoded_length);
+    if (status == ESP_AZURE_IOT_SUCCESS)
+    {
+        status = esp_azure_iot_hmac_sha256_key_set(&(hub_client_ptr -> esp_azure_iot_hub_client_symmetric_key_hmac),
+                                                   key_decoded, key_decoded_length);
+    }
+    memset(key_decoded, 0, sizeof(key_decoded));
+    if (status)
+    {
+
+        /* Release the mutex.  */
+        xSemaphoreGive(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr);
+        LogError("IoTHub client symmetric key fail: key decode failed");
+        return(ESP_AZURE_IOT_INVALID_PARAMETER);
+    }
+
     hub_client_ptr -> esp_azure_iot_hub_client_symmetric_key = symmetric_key;
     hub_client_ptr -> esp_azure_iot_hub_client_symmetric_key_length = symmetric_key_length;
 
@@ -642,7 +926,8 @@ az_result core_result;
         return(ESP_AZURE_IOT_SDK_CORE_ERROR);
     }
 
-    packet_ptr -> esp_packet_append_ptr = packet_ptr -> esp_packet_prepend_ptr + topic_length;
+    /* Properties extend the topic in place; keep its NULL terminator inside the packet.  */
+    packet_ptr -> esp_packet_append_ptr = packet_ptr -> esp_packet_prepend_ptr + topic_length + 1;
     packet_ptr -> esp_packet_length = topic_length;
     *packet_pptr = packet_ptr;
 
@@ -671,34 +956,36 @@ uint32_t esp_azure_iot_hub_client_telemetry_property_add(ESP_PACKET *packet_ptr,
         return(ESP_AZURE_IOT_INVALID_PARAMETER);
     }
 
-    if (*(packet_ptr -> esp_packet_append_ptr - 1) != '/')
+    ESP_PARAMETER_NOT_USED(wait_option);
+
+    if (packet_ptr -> esp_packet_prepend_ptr[packet_ptr -> esp_packet_length - 1] != '/')
     {
-        status = esp_azure_iot_packet_append(packet_ptr, "&", 1, wait_option);
+        status = esp_azure_iot_packet_topic_append(packet_ptr, "&", 1);
         if (status)
         {
-            LogError("Telemetry data append fail");
+            LogError("Telemetry property append fail");
             return(status);
         }
     }
 
-    status = esp_azure_iot_packet_append(packet_ptr, property_name, (uint32_t)property_name_length, wait_option);
+    status = esp_azure_iot_packet_topic_append(packet_ptr, property_name, (uint32_t)property_name_length);
     if (status)
     {
-        LogError("Telemetry data append fail");
+        LogError("Telemetry property append fail");
         return(status);
     }
 
-    status = esp_azure_iot_packet_append(packet_ptr, "=", 1, wait_option);
+    status = esp_azure_iot_packet_topic_append(packet_ptr, "=", 1);
     if (status)
     {
-        LogError("Telemetry data append fail");
+        LogError("Telemetry property append fail");
         return(status);
     }
 
-    status = esp_azure_iot_packet_append(packet_ptr, property_value, (uint32_t)property_value_length, wait_option);
+    status = esp_azure_iot_packet_topic_append(packet_ptr, property_value, (uint32_t)property_value_length);
     if (status)
     {
-        LogError("Telemetry data append fail");
+        LogError("Telemetry property append fail");
         return(status);
     }
 
@@ -717,21 +1004,11 @@ uint32_t esp_azure_iot_hub_client_telemetry_send(ESP_AZURE_IOT_HUB_CLIENT *hub_c
         return(ESP_AZURE_IOT_INVALID_PARAMETER);
     }
 
-    if (telemetry_data && (data_size != 0))
-    {
-
-        /* Append payload. */
-        status = esp_azure_iot_packet_append(packet_ptr, telemetry_data, data_size, 
-                                       wait_option);
-        if (status)
-        {
-            LogError("Telemetry data append fail");
-            return(status);
-        }
-    }
-
-    status = esp_azure_iot_publish_mqtt_packet(&(hub_client_ptr -> esp_azure_iot_hub_client_resource.esp_azure_iot_mqtt),
-                                              packet_ptr, ESP_AZURE_IOT_MQTT_QOS_1, wait_option);
+    /* Topic and properties come from the packet, payload is published straight from the caller's buffer. */
+    status = esp_azure_iot_mqtt_client_publish(&(hub_client_ptr -> esp_azure_iot_hub_client_resource.esp_azure_iot_mqtt),
+                                               (char *)packet_ptr -> esp_packet_prepend_ptr, packet_ptr -> esp_packet_length,
+                                               (char *)telemetry_data, telemetry_data ? data_size : 0, 0,
+                                               ESP_AZURE_IOT_MQTT_QOS_1, wait_option);
     if (status)
     {
         LogError("IoTHub client send fail: PUBLISH FAIL: 0x%02x", status);
@@ -742,168 +1019,592 @@ uint32_t esp_azure_iot_hub_client_telemetry_send(ESP_AZURE_IOT_HUB_CLIENT *hub_c
     return(ESP_AZURE_IOT_SUCCESS );
 }
                                             
-uint32_t esp_azure_iot_hub_client_receive_callback_set(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
-                                                  uint32_t message_type,
-                                                  void (*callback_ptr)(
-                                                        ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
-                                                        void *args),
-                                                  void *callback_args)
+uint32_t esp_azure_iot_hub_client_telemetry_batch_enable(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                    uint32_t max_count, uint32_t max_bytes, uint32_t max_latency,
+                                                    void (*callback)(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                     void *message_context, uint32_t status, void *args),
+                                                    void *callback_args)
 {
-    if ((hub_client_ptr == NULL) || (hub_client_ptr -> esp_azure_iot_ptr == NULL))
+ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH *batch_ptr;
+
+    if ((hub_client_ptr == NULL) || (hub_client_ptr -> esp_azure_iot_ptr == NULL) ||
+        (max_count > ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_MAX_MESSAGES))
     {
-        LogError("IoTHub receive callback set fail: INVALID POINTER");
+        LogError("IoTHub telemetry batch enable fail: INVALID PARAMETER");
         return(ESP_AZURE_IOT_INVALID_PARAMETER);
     }
 
+    batch_ptr = &(hub_client_ptr -> esp_azure_iot_hub_client_telemetry_batch);
+
     /* Obtain the mutex.  */
-    xSemaphoreTake(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr, portMAX_DELAY);
+    xSemaphoreTake(batch_ptr -> esp_telemetry_batch_mutex_ptr, portMAX_DELAY);
 
-    if (message_type == ESP_AZURE_IOT_HUB_CLOUD_TO_DEVICE_MESSAGE)
-    {
-        hub_client_ptr -> esp_azure_iot_hub_client_c2d_message_metadata.esp_azure_iot_hub_client_message_callback = callback_ptr;
-        hub_client_ptr -> esp_azure_iot_hub_client_c2d_message_metadata.esp_azure_iot_hub_client_message_callback_args = callback_args;
-    }
-    else if (message_type == ESP_AZURE_IOT_HUB_DEVICE_TWIN_PROPERTIES)
+    if (batch_ptr -> esp_telemetry_batch_count)
     {
-        hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata.esp_azure_iot_hub_client_message_callback = callback_ptr;
-        hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata.esp_azure_iot_hub_client_message_callback_args = callback_args;
+
+        /* Release the mutex.  */
+        xSemaphoreGive(batch_ptr -> esp_telemetry_batch_mutex_ptr);
+        LogError("IoTHub telemetry batch enable fail: batch pending");
+        return(ESP_AZURE_IOT_WRONG_STATE);
     }
-    else if (message_type == ESP_AZURE_IOT_HUB_DEVICE_TWIN_DESIRED_PROPERTIES)
+
+    batch_ptr -> esp_telemetry_batch_max_count = max_count ? max_count : ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_MAX_MESSAGES;
+    batch_ptr -> esp_telemetry_batch_max_bytes = max_bytes;
+    batch_ptr -> esp_telemetry_batch_max_latency = max_latency;
+    batch_ptr -> esp_telemetry_batch_callback = callback;
+    batch_ptr -> esp_telemetry_batch_callback_args = callback_args;
+    batch_ptr -> esp_telemetry_batch_enabled = 1;
+
+    /* Byte budget of an already allocated empty packet follows the new setting.  */
+    if (batch_ptr -> esp_telemetry_batch_packet)
     {
-        hub_client_ptr -> esp_azure_iot_hub_client_device_twin_desired_properties_metadata.esp_azure_iot_hub_client_message_callback = callback_ptr;
-        hub_client_ptr -> esp_azure_iot_hub_client_device_twin_desired_properties_metadata.esp_azure_iot_hub_client_message_callback_args = callback_args;
+        batch_ptr -> esp_telemetry_batch_limit = (uint32_t)(batch_ptr -> esp_telemetry_batch_packet -> esp_packet_data_end -
+                                                            batch_ptr -> esp_telemetry_batch_payload_ptr);
+        if (max_bytes && (max_bytes < batch_ptr -> esp_telemetry_batch_limit))
+        {
+            batch_ptr -> esp_telemetry_batch_limit = max_bytes;
+        }
     }
-    else if (message_type == ESP_AZURE_IOT_HUB_DIRECT_METHOD)
+
+    /* Release the mutex.  */
+    xSemaphoreGive(batch_ptr -> esp_telemetry_batch_mutex_ptr);
+
+    return(ESP_AZURE_IOT_SUCCESS);
+}
+
+uint32_t esp_azure_iot_hub_client_telemetry_batch_disable(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr, uint32_t wait_option)
+{
+ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_FLIGHT flight;
+ESP_PACKET *packet_ptr;
+
+    if ((hub_client_ptr == NULL) || (hub_client_ptr -> esp_azure_iot_ptr == NULL))
     {
-        hub_client_ptr -> esp_azure_iot_hub_client_direct_method_metadata.esp_azure_iot_hub_client_message_callback = callback_ptr;
-        hub_client_ptr -> esp_azure_iot_hub_client_direct_method_metadata.esp_azure_iot_hub_client_message_callback_args = callback_args;
+        LogError("IoTHub telemetry batch disable fail: INVALID POINTER");
+        return(ESP_AZURE_IOT_INVALID_PARAMETER);
     }
-    else
-    {
 
-        /* Release the mutex.  */
-        xSemaphoreGive(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr);
-        return(ESP_AZURE_IOT_NOT_SUPPORTED);
-    }
+    /* Obtain the mutex.  */
+    xSemaphoreTake(hub_client_ptr -> esp_azure_iot_hub_client_telemetry_batch.esp_telemetry_batch_mutex_ptr, portMAX_DELAY);
+
+    hub_client_ptr -> esp_azure_iot_hub_client_telemetry_batch.esp_telemetry_batch_enabled = 0;
+    esp_azure_iot_hub_client_telemetry_batch_detach(hub_client_ptr, &flight);
+
+    /* Give back the packet kept for the next batch.  */
+    packet_ptr = hub_client_ptr -> esp_azure_iot_hub_client_telemetry_batch.esp_telemetry_batch_packet;
+    hub_client_ptr -> esp_azure_iot_hub_client_telemetry_batch.esp_telemetry_batch_packet = NULL;
 
     /* Release the mutex.  */
-    xSemaphoreGive(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr);
+    xSemaphoreGive(hub_client_ptr -> esp_azure_iot_hub_client_telemetry_batch.esp_telemetry_batch_mutex_ptr);
 
-    return(ESP_AZURE_IOT_SUCCESS );
-}
-                                                  
-uint32_t esp_azure_iot_hub_client_cloud_message_enable(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr)
-{
-    return(esp_azure_iot_hub_client_cloud_message_sub_unsub(hub_client_ptr, true));
+    if (packet_ptr)
+    {
+        esp_azure_iot_packet_release(packet_ptr);
+    }
+
+    return(esp_azure_iot_hub_client_telemetry_batch_publish(hub_client_ptr, &flight, wait_option));
 }
 
-uint32_t esp_azure_iot_hub_client_cloud_message_disable(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr)
+/* Check that the message is exactly one JSON value, as it is copied into the batch array as is.  */
+static uint32_t esp_azure_iot_hub_client_telemetry_batch_is_json(uint8_t *telemetry_data, uint32_t data_size)
 {
-    return(esp_azure_iot_hub_client_cloud_message_sub_unsub(hub_client_ptr, false));
+az_json_reader reader;
+
+    if (az_failed(az_json_reader_init(&reader, az_span_init(telemetry_data, (int32_t)data_size), NULL)) ||
+        az_failed(az_json_reader_next_token(&reader)) ||
+        az_failed(az_json_reader_skip_children(&reader)))
+    {
+        return(0);
+    }
+
+    return(az_json_reader_next_token(&reader) == AZ_ERROR_JSON_READER_DONE);
 }
 
-static uint32_t esp_azure_iot_hub_client_message_receive(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr, uint32_t message_type,
-                                                    ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA *metadata,
-                                                    ESP_PACKET **packet_pptr, uint32_t wait_option)
+uint32_t esp_azure_iot_hub_client_telemetry_batch_send(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                  uint8_t *telemetry_data, uint32_t data_size,
+                                                  void *message_context, uint32_t wait_option)
 {
-    ESP_PACKET *packet_ptr = NULL;
-    ESP_AZURE_IOT_THREAD_LIST thread_list;
+ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH *batch_ptr;
+ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_FLIGHT flight;
+ESP_PACKET *spare_packet_ptr = NULL;
+ESP_PACKET *packet_ptr;
+uint32_t payload_length;
+uint32_t flush = 0;
+uint32_t arm_timer = 0;
+uint32_t status;
 
-    if ((hub_client_ptr == NULL) || (hub_client_ptr -> esp_azure_iot_ptr == NULL) || (packet_pptr == NULL))
+    if ((hub_client_ptr == NULL) || (hub_client_ptr -> esp_azure_iot_ptr == NULL) ||
+        (telemetry_data == NULL) || (data_size == 0))
     {
-        LogError("IoTHub message receive fail: INVALID POINTER");
+        LogError("IoTHub telemetry batch send fail: INVALID PARAMETER");
         return(ESP_AZURE_IOT_INVALID_PARAMETER);
     }
 
-    if (metadata -> esp_azure_iot_hub_client_message_process == NULL)
+    /* Anything else would corrupt the whole batch.  */
+    if (!esp_azure_iot_hub_client_telemetry_batch_is_json(telemetry_data, data_size))
     {
-        LogError("IoTHub message receive fail: NOT ENABLED");
-        return(ESP_AZURE_IOT_NOT_ENABLED);
+        LogError("IoTHub telemetry batch send fail: message is not a JSON value");
+        return(ESP_AZURE_IOT_INVALID_PARAMETER);
     }
 
+    batch_ptr = &(hub_client_ptr -> esp_azure_iot_hub_client_telemetry_batch);
+
     /* Obtain the mutex.  */
-    xSemaphoreTake(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr, portMAX_DELAY);
+    xSemaphoreTake(batch_ptr -> esp_telemetry_batch_mutex_ptr, portMAX_DELAY);
 
-    if (metadata -> esp_azure_iot_hub_client_message_head)
+    for (;;)
     {
-        packet_ptr = metadata -> esp_azure_iot_hub_client_message_head;
-        if (metadata -> esp_azure_iot_hub_client_message_tail == packet_ptr)
+        if (!batch_ptr -> esp_telemetry_batch_enabled)
         {
-            metadata -> esp_azure_iot_hub_client_message_tail = NULL;
+            status = ESP_AZURE_IOT_NOT_ENABLED;
+            break;
         }
-        metadata -> esp_azure_iot_hub_client_message_head = packet_ptr -> esp_packet_next;
-    } else if (wait_option) {
-        thread_list.esp_azure_iot_thread_message_type = message_type;
-        thread_list.esp_azure_iot_thread_ptr = esp_azure_iot_thread_identify();
-        thread_list.esp_azure_iot_thread_received_message = NULL;
-        thread_list.esp_azure_iot_thread_expected_id = 0;
-        thread_list.esp_azure_iot_thread_next = hub_client_ptr -> esp_azure_iot_hub_client_thread_suspended;
-        hub_client_ptr -> esp_azure_iot_hub_client_thread_suspended = &thread_list;
 
-        /* Release the mutex.  */
-        xSemaphoreGive(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr);
+        packet_ptr = batch_ptr -> esp_telemetry_batch_packet;
+        if (packet_ptr == NULL)
+        {
+            if (spare_packet_ptr == NULL)
+            {
 
-        esp_azure_iot_thread_sleep(thread_list.esp_azure_iot_thread_ptr, wait_option);
+                /* Release the mutex while waiting for a packet.  */
+                xSemaphoreGive(batch_ptr -> esp_telemetry_batch_mutex_ptr);
+                status = esp_azure_iot_hub_client_telemetry_message_create(hub_client_ptr, &spare_packet_ptr, wait_option);
+                if (status == ESP_AZURE_IOT_SUCCESS)
+                {
+                    status = esp_azure_iot_packet_append(spare_packet_ptr, "[", 1, wait_option);
+                    if (status)
+                    {
+                        esp_azure_iot_packet_release(spare_packet_ptr);
+                    }
+                }
+
+                if (status)
+                {
+                    LogError("IoTHub telemetry batch send fail: PACKET CREATE FAIL: 0x%02x", status);
+                    return(status);
+                }
+
+                /* Obtain the mutex.  */
+                xSemaphoreTake(batch_ptr -> esp_telemetry_batch_mutex_ptr, portMAX_DELAY);
+                continue;
+            }
 
-        /* Obtain the mutex.  */
-        xSemaphoreTake(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr, ESP_WAIT_FOREVER);
+            /* Start a new batch.  */
+            packet_ptr = spare_packet_ptr;
+            spare_packet_ptr = NULL;
+            batch_ptr -> esp_telemetry_batch_packet = packet_ptr;
+            batch_ptr -> esp_telemetry_batch_payload_ptr = packet_ptr -> esp_packet_prepend_ptr + packet_ptr -> esp_packet_length + 1;
+            batch_ptr -> esp_telemetry_batch_limit = (uint32_t)(packet_ptr -> esp_packet_data_end - batch_ptr -> esp_telemetry_batch_payload_ptr);
+            if (batch_ptr -> esp_telemetry_batch_max_bytes &&
+                (batch_ptr -> esp_telemetry_batch_max_bytes < batch_ptr -> esp_telemetry_batch_limit))
+            {
+                batch_ptr -> esp_telemetry_batch_limit = batch_ptr -> esp_telemetry_batch_max_bytes;
+            }
+        }
+
+        /* Room for the separator, the message and the closing bracket.  */
+        payload_length = (uint32_t)(packet_ptr -> esp_packet_append_ptr - batch_ptr -> esp_telemetry_batch_payload_ptr);
+        if ((batch_ptr -> esp_telemetry_batch_count < batch_ptr -> esp_telemetry_batch_max_count) &&
+            ((payload_length + (batch_ptr -> esp_telemetry_batch_count ? 1 : 0) + data_size + 1) <= batch_ptr -> esp_telemetry_batch_limit))
+        {
+            if (batch_ptr -> esp_telemetry_batch_count)
+            {
+                esp_azure_iot_packet_append(packet_ptr, ",", 1, wait_option);
+            }
+            else
+            {
+                batch_ptr -> esp_telemetry_batch_first_tick = (uint32_t)xTaskGetTickCount();
+                arm_timer = 1;
+            }
 
-        esp_azure_iot_hub_client_thread_dequeue(hub_client_ptr, &thread_list);
+            esp_azure_iot_packet_append(packet_ptr, telemetry_data, data_size, wait_option);
+            batch_ptr -> esp_telemetry_batch_contexts[batch_ptr -> esp_telemetry_batch_count++] = message_context;
 
-        /* Restore preemption. */
-        esp_azure_iot_thread_preemption(thread_list.esp_azure_iot_thread_ptr);
-        packet_ptr = thread_list.esp_azure_iot_thread_received_message;
+            /* Let the internal thread publish a full batch.  */
+            flush = esp_azure_iot_hub_client_telemetry_batch_full(batch_ptr);
+            status = ESP_AZURE_IOT_SUCCESS;
+            break;
+        }
+
+        if (batch_ptr -> esp_telemetry_batch_count == 0)
+        {
+            LogError("IoTHub telemetry batch send fail: message of %u bytes exceeds batch limit", data_size);
+            status = ESP_AZURE_IOT_MESSAGE_TOO_LONG;
+            break;
+        }
+
+        /* Pending batch is full, publish it on the caller's thread.  */
+        esp_azure_iot_hub_client_telemetry_batch_detach(hub_client_ptr, &flight);
+
+        /* Release the mutex.  */
+        xSemaphoreGive(batch_ptr -> esp_telemetry_batch_mutex_ptr);
+
+        status = esp_azure_iot_hub_client_telemetry_batch_publish(hub_client_ptr, &flight, wait_option);
+        if (status)
+        {
+            if (spare_packet_ptr)
+            {
+                esp_azure_iot_packet_release(spare_packet_ptr);
+            }
+            return(status);
+        }
+
+        /* Obtain the mutex.  */
+        xSemaphoreTake(batch_ptr -> esp_telemetry_batch_mutex_ptr, portMAX_DELAY);
     }
 
     /* Release the mutex.  */
-    xSemaphoreGive(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr);
+    xSemaphoreGive(batch_ptr -> esp_telemetry_batch_mutex_ptr);
 
-    if (packet_ptr == NULL)
+    /* Another sender started a batch while this one waited for a packet.  */
+    if (spare_packet_ptr)
     {
-        return(ESP_AZURE_IOT_NO_PACKET);
+        esp_azure_iot_packet_release(spare_packet_ptr);
     }
 
-    *packet_pptr = packet_ptr;
+    if (flush)
+    {
+        esp_azure_iot_event_group_set(&(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_event_group),
+                                      ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_FLUSH_EVENT);
+    }
+    else if (arm_timer)
+    {
 
-    return(ESP_AZURE_IOT_SUCCESS );
+        /* Wake the internal thread when the first message of the batch reaches its deadline.  */
+        esp_azure_iot_event_group_timer_set(&(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_event_group),
+                                            batch_ptr -> esp_telemetry_batch_max_latency);
+    }
+
+    return(status);
 }
 
-static uint32_t esp_azure_iot_hub_client_adjust_payload(ESP_PACKET *packet_ptr)
+uint32_t esp_azure_iot_hub_client_telemetry_batch_flush(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr, uint32_t wait_option)
 {
-uint32_t status;
-size_t topic_offset;
-uint16_t topic_length;
-size_t message_offset;
-size_t message_length;
+ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_FLIGHT flight;
 
-    status = esp_azure_iot_mqtt_client_packet_process(packet_ptr, &topic_offset,
-                                              &topic_length, &message_offset,
-                                              &message_length);
-    if (status)
+    if ((hub_client_ptr == NULL) || (hub_client_ptr -> esp_azure_iot_ptr == NULL))
     {
-        esp_azure_iot_packet_release(packet_ptr);
-        return(status);
+        LogError("IoTHub telemetry batch flush fail: INVALID POINTER");
+        return(ESP_AZURE_IOT_INVALID_PARAMETER);
     }
 
-    packet_ptr -> esp_packet_length = message_length;
+    /* Obtain the mutex.  */
+    xSemaphoreTake(hub_client_ptr -> esp_azure_iot_hub_client_telemetry_batch.esp_telemetry_batch_mutex_ptr, portMAX_DELAY);
 
-    /* Adjust packet to pointer to message payload. */
-    while (packet_ptr)
-    {
-        if ((size_t)(packet_ptr -> esp_packet_append_ptr - packet_ptr -> esp_packet_prepend_ptr) > message_offset)
-        {
+    esp_azure_iot_hub_client_telemetry_batch_detach(hub_client_ptr, &flight);
 
-            /* This packet contains message payload. */
-            packet_ptr -> esp_packet_prepend_ptr = packet_ptr -> esp_packet_prepend_ptr + message_offset;
-            break;
-        }
+    /* Release the mutex.  */
+    xSemaphoreGive(hub_client_ptr -> esp_azure_iot_hub_client_telemetry_batch.esp_telemetry_batch_mutex_ptr);
 
-        message_offset -= (size_t)(packet_ptr -> esp_packet_append_ptr - packet_ptr -> esp_packet_prepend_ptr);
+    return(esp_azure_iot_hub_client_telemetry_batch_publish(hub_client_ptr, &flight, wait_option));
+}
 
-        /* Set current packet to empty. */
-        packet_ptr -> esp_packet_prepend_ptr = packet_ptr -> esp_packet_append_ptr;
+uint32_t esp_azure_iot_hub_client_telemetry_batch_stats_get(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                       ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_STATS *stats_ptr)
+{
+ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_STATS *batch_stats_ptr;
 
-        /* Move to next packet. */
+    if ((hub_client_ptr == NULL) || (hub_client_ptr -> esp_azure_iot_ptr == NULL) || (stats_ptr == NULL))
+    {
+        LogError("IoTHub telemetry batch stats get fail: INVALID POINTER");
+        return(ESP_AZURE_IOT_INVALID_PARAMETER);
+    }
+
+    /* Counters are updated lock-free, read each one atomically.  */
+    batch_stats_ptr = &(hub_client_ptr -> esp_azure_iot_hub_client_telemetry_batch.esp_telemetry_batch_stats);
+    stats_ptr -> esp_telemetry_batch_messages_sent = __atomic_load_n(&(batch_stats_ptr -> esp_telemetry_batch_messages_sent), __ATOMIC_RELAXED);
+    stats_ptr -> esp_telemetry_batch_messages_failed = __atomic_load_n(&(batch_stats_ptr -> esp_telemetry_batch_messages_failed), __ATOMIC_RELAXED);
+    stats_ptr -> esp_telemetry_batch_batches_sent = __atomic_load_n(&(batch_stats_ptr -> esp_telemetry_batch_batches_sent), __ATOMIC_RELAXED);
+    stats_ptr -> esp_telemetry_batch_bytes_sent = __atomic_load_n(&(batch_stats_ptr -> esp_telemetry_batch_bytes_sent), __ATOMIC_RELAXED);
+    stats_ptr -> esp_telemetry_batch_latency_max = __atomic_load_n(&(batch_stats_ptr -> esp_telemetry_batch_latency_max), __ATOMIC_RELAXED);
+
+    return(ESP_AZURE_IOT_SUCCESS);
+}
+
+/* A batch is full when it reached its message count or cannot take even a one byte message.  */
+static uint32_t esp_azure_iot_hub_client_telemetry_batch_full(ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH *batch_ptr)
+{
+uint32_t payload_length;
+
+    payload_length = (uint32_t)(batch_ptr -> esp_telemetry_batch_packet -> esp_packet_append_ptr -
+                                batch_ptr -> esp_telemetry_batch_payload_ptr);
+
+    return((batch_ptr -> esp_telemetry_batch_count >= batch_ptr -> esp_telemetry_batch_max_count) ||
+           ((payload_length + 3) > batch_ptr -> esp_telemetry_batch_limit));
+}
+
+/* Must be called with the batch mutex held.  */
+static void esp_azure_iot_hub_client_telemetry_batch_detach(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                           ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_FLIGHT *flight_ptr)
+{
+ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH *batch_ptr = &(hub_client_ptr -> esp_azure_iot_hub_client_telemetry_batch);
+
+    flight_ptr -> esp_telemetry_batch_packet = NULL;
+    flight_ptr -> esp_telemetry_batch_count = batch_ptr -> esp_telemetry_batch_count;
+    if (flight_ptr -> esp_telemetry_batch_count == 0)
+    {
+        return;
+    }
+
+    /* Close the array, the closing bracket always has room reserved.  */
+    esp_azure_iot_packet_append(batch_ptr -> esp_telemetry_batch_packet, "]", 1, ESP_NO_WAIT);
+
+    flight_ptr -> esp_telemetry_batch_packet = batch_ptr -> esp_telemetry_batch_packet;
+    flight_ptr -> esp_telemetry_batch_first_tick = batch_ptr -> esp_telemetry_batch_first_tick;
+    memcpy(flight_ptr -> esp_telemetry_batch_contexts, batch_ptr -> esp_telemetry_batch_contexts,
+           flight_ptr -> esp_telemetry_batch_count * sizeof(void *));
+
+    batch_ptr -> esp_telemetry_batch_packet = NULL;
+    batch_ptr -> esp_telemetry_batch_count = 0;
+}
+
+static uint32_t esp_azure_iot_hub_client_telemetry_batch_publish(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                            ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_FLIGHT *flight_ptr,
+                                                            uint32_t wait_option)
+{
+ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_STATS *stats_ptr;
+uint32_t status;
+uint32_t latency;
+uint32_t latency_max;
+uint32_t payload_length;
+
+    if (flight_ptr -> esp_telemetry_batch_packet == NULL)
+    {
+        return(ESP_AZURE_IOT_SUCCESS);
+    }
+
+    payload_length = (uint32_t)(flight_ptr -> esp_telemetry_batch_packet -> esp_packet_append_ptr -
+                                flight_ptr -> esp_telemetry_batch_packet -> esp_packet_prepend_ptr) -
+                     (uint32_t)(flight_ptr -> esp_telemetry_batch_packet -> esp_packet_length + 1);
+
+    status = esp_azure_iot_publish_mqtt_packet(&(hub_client_ptr -> esp_azure_iot_hub_client_resource.esp_azure_iot_mqtt),
+                                               flight_ptr -> esp_telemetry_batch_packet, ESP_AZURE_IOT_MQTT_QOS_1, wait_option);
+    if (status)
+    {
+        LogError("IoTHub telemetry batch send fail: PUBLISH FAIL: 0x%02x", status);
+    }
+
+    latency = (uint32_t)xTaskGetTickCount() - flight_ptr -> esp_telemetry_batch_first_tick;
+    stats_ptr = &(hub_client_ptr -> esp_azure_iot_hub_client_telemetry_batch.esp_telemetry_batch_stats);
+
+    /* Update the counters without taking the batch mutex.  */
+    if (status)
+    {
+        __atomic_fetch_add(&(stats_ptr -> esp_telemetry_batch_messages_failed), flight_ptr -> esp_telemetry_batch_count, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_fetch_add(&(stats_ptr -> esp_telemetry_batch_messages_sent), flight_ptr -> esp_telemetry_batch_count, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&(stats_ptr -> esp_telemetry_batch_batches_sent), 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&(stats_ptr -> esp_telemetry_batch_bytes_sent), payload_length, __ATOMIC_RELAXED);
+
+        latency_max = __atomic_load_n(&(stats_ptr -> esp_telemetry_batch_latency_max), __ATOMIC_RELAXED);
+        while ((latency > latency_max) &&
+               !__atomic_compare_exchange_n(&(stats_ptr -> esp_telemetry_batch_latency_max), &latency_max, latency,
+                                            false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+        }
+    }
+
+    esp_azure_iot_hub_client_telemetry_batch_complete(hub_client_ptr, flight_ptr, status);
+
+    return(status);
+}
+
+static void esp_azure_iot_hub_client_telemetry_batch_complete(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                             ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH_FLIGHT *flight_ptr,
+                                                             uint32_t status)
+{
+ESP_AZURE_IOT_HUB_CLIENT_TELEMETRY_BATCH *batch_ptr = &(hub_client_ptr -> esp_azure_iot_hub_client_telemetry_batch);
+uint32_t i;
+
+    if (flight_ptr -> esp_telemetry_batch_packet == NULL)
+    {
+        return;
+    }
+
+    esp_azure_iot_packet_release(flight_ptr -> esp_telemetry_batch_packet);
+    flight_ptr -> esp_telemetry_batch_packet = NULL;
+
+    if (batch_ptr -> esp_telemetry_batch_callback == NULL)
+    {
+        return;
+    }
+
+    for (i = 0; i < flight_ptr -> esp_telemetry_batch_count; i++)
+    {
+        batch_ptr -> esp_telemetry_batch_callback(hub_client_ptr, flight_ptr -> esp_telemetry_batch_contexts[i],
+                                                  status, batch_ptr -> esp_telemetry_batch_callback_args);
+    }
+}
+
+uint32_t esp_azure_iot_hub_client_receive_callback_set(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                  uint32_t message_type,
+                                                  void (*callback_ptr)(
+                                                        ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                        void *args),
+                                                  void *callback_args)
+{
+ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA *metadata;
+
+    if ((hub_client_ptr == NULL) || (hub_client_ptr -> esp_azure_iot_ptr == NULL))
+    {
+        LogError("IoTHub receive callback set fail: INVALID POINTER");
+        return(ESP_AZURE_IOT_INVALID_PARAMETER);
+    }
+
+    if (message_type == ESP_AZURE_IOT_HUB_CLOUD_TO_DEVICE_MESSAGE)
+    {
+        metadata = &(hub_client_ptr -> esp_azure_iot_hub_client_c2d_message_metadata);
+    }
+    else if (message_type == ESP_AZURE_IOT_HUB_DEVICE_TWIN_PROPERTIES)
+    {
+        metadata = &(hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata);
+    }
+    else if (message_type == ESP_AZURE_IOT_HUB_DEVICE_TWIN_DESIRED_PROPERTIES)
+    {
+        metadata = &(hub_client_ptr -> esp_azure_iot_hub_client_device_twin_desired_properties_metadata);
+    }
+    else if (message_type == ESP_AZURE_IOT_HUB_DIRECT_METHOD)
+    {
+        metadata = &(hub_client_ptr -> esp_azure_iot_hub_client_direct_method_metadata);
+    }
+    else
+    {
+        return(ESP_AZURE_IOT_NOT_SUPPORTED);
+    }
+
+    /* Obtain the message type mutex.  */
+    xSemaphoreTake(metadata -> esp_azure_iot_hub_client_message_mutex_ptr, portMAX_DELAY);
+
+    metadata -> esp_azure_iot_hub_client_message_callback = callback_ptr;
+    metadata -> esp_azure_iot_hub_client_message_callback_args = callback_args;
+
+    /* Release the message type mutex.  */
+    xSemaphoreGive(metadata -> esp_azure_iot_hub_client_message_mutex_ptr);
+
+    return(ESP_AZURE_IOT_SUCCESS );
+}
+                                                  
+uint32_t esp_azure_iot_hub_client_cloud_message_enable(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr)
+{
+    return(esp_azure_iot_hub_client_cloud_message_sub_unsub(hub_client_ptr, true));
+}
+
+uint32_t esp_azure_iot_hub_client_cloud_message_disable(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr)
+{
+    return(esp_azure_iot_hub_client_cloud_message_sub_unsub(hub_client_ptr, false));
+}
+
+static uint32_t esp_azure_iot_hub_client_message_receive(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr, uint32_t message_type,
+                                                    ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA *metadata,
+                                                    ESP_PACKET **packet_pptr, uint32_t wait_option)
+{
+    ESP_PACKET *packet_ptr = NULL;
+    ESP_AZURE_IOT_THREAD_LIST thread_list;
+
+    if ((hub_client_ptr == NULL) || (hub_client_ptr -> esp_azure_iot_ptr == NULL) || (packet_pptr == NULL))
+    {
+        LogError("IoTHub message receive fail: INVALID POINTER");
+        return(ESP_AZURE_IOT_INVALID_PARAMETER);
+    }
+
+    if (metadata -> esp_azure_iot_hub_client_message_process == NULL)
+    {
+        LogError("IoTHub message receive fail: NOT ENABLED");
+        return(ESP_AZURE_IOT_NOT_ENABLED);
+    }
+
+    /* Obtain the message type mutex.  */
+    xSemaphoreTake(metadata -> esp_azure_iot_hub_client_message_mutex_ptr, portMAX_DELAY);
+
+    if (metadata -> esp_azure_iot_hub_client_message_head)
+    {
+        packet_ptr = metadata -> esp_azure_iot_hub_client_message_head;
+        if (metadata -> esp_azure_iot_hub_client_message_tail == packet_ptr)
+        {
+            metadata -> esp_azure_iot_hub_client_message_tail = NULL;
+        }
+        metadata -> esp_azure_iot_hub_client_message_head = packet_ptr -> esp_packet_next;
+    } else if (wait_option) {
+        thread_list.esp_azure_iot_thread_ptr = esp_azure_iot_thread_identify();
+        if (thread_list.esp_azure_iot_thread_ptr == NULL)
+        {
+
+            /* Release the message type mutex.  */
+            xSemaphoreGive(metadata -> esp_azure_iot_hub_client_message_mutex_ptr);
+            LogError("IoTHub message receive fail: NO WAITER AVAILABLE");
+            return(ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE);
+        }
+
+        thread_list.esp_azure_iot_thread_message_type = message_type;
+        thread_list.esp_azure_iot_thread_received_message = NULL;
+        thread_list.esp_azure_iot_thread_next = metadata -> esp_azure_iot_hub_client_message_thread_suspended;
+        metadata -> esp_azure_iot_hub_client_message_thread_suspended = &thread_list;
+
+        /* Release the message type mutex.  */
+        xSemaphoreGive(metadata -> esp_azure_iot_hub_client_message_mutex_ptr);
+
+        esp_azure_iot_thread_sleep(thread_list.esp_azure_iot_thread_ptr, wait_option);
+
+        /* Obtain the message type mutex.  */
+        xSemaphoreTake(metadata -> esp_azure_iot_hub_client_message_mutex_ptr, ESP_WAIT_FOREVER);
+
+        esp_azure_iot_hub_client_thread_dequeue(metadata, &thread_list);
+
+        /* Restore preemption. */
+        esp_azure_iot_thread_preemption(thread_list.esp_azure_iot_thread_ptr);
+        packet_ptr = thread_list.esp_azure_iot_thread_received_message;
+    }
+
+    /* Release the message type mutex.  */
+    xSemaphoreGive(metadata -> esp_azure_iot_hub_client_message_mutex_ptr);
+
+    if (packet_ptr == NULL)
+    {
+        return(ESP_AZURE_IOT_NO_PACKET);
+    }
+
+    *packet_pptr = packet_ptr;
+
+    return(ESP_AZURE_IOT_SUCCESS );
+}
+
+static uint32_t esp_azure_iot_hub_client_adjust_payload(ESP_PACKET *packet_ptr)
+{
+uint32_t status;
+size_t topic_offset;
+uint16_t topic_length;
+size_t message_offset;
+size_t message_length;
+
+    status = esp_azure_iot_mqtt_client_packet_process(packet_ptr, &topic_offset,
+                                              &topic_length, &message_offset,
+                                              &message_length);
+    if (status)
+    {
+        esp_azure_iot_packet_release(packet_ptr);
+        return(status);
+    }
+
+    packet_ptr -> esp_packet_length = message_length;
+
+    /* Adjust packet to pointer to message payload. */
+    while (packet_ptr)
+    {
+        if ((size_t)(packet_ptr -> esp_packet_append_ptr - packet_ptr -> esp_packet_prepend_ptr) > message_offset)
+        {
+
+            /* This packet contains message payload. */
+            packet_ptr -> esp_packet_prepend_ptr = packet_ptr -> esp_packet_prepend_ptr + message_offset;
+            break;
+        }
+
+        message_offset -= (size_t)(packet_ptr -> esp_packet_append_ptr - packet_ptr -> esp_packet_prepend_ptr);
+
+        /* Set current packet to empty. */
+        packet_ptr -> esp_packet_prepend_ptr = packet_ptr -> esp_packet_append_ptr;
+
+        /* Move to next packet. */
         packet_ptr = packet_ptr -> esp_packet_next;
     }
 
@@ -1099,16 +1800,10 @@ uint32_t esp_azure_iot_hub_client_device_twin_reported_properties_send(ESP_AZURE
                                                                   uint32_t wait_option)
 {
 uint32_t status;
-uint8_t *buffer_ptr;
-uint32_t buffer_size;
-void *buffer_context;
 ESP_PACKET *packet_ptr;
-az_span topic_span;
-uint32_t topic_length;
 uint32_t request_id;
-az_span request_id_span;
 ESP_AZURE_IOT_THREAD_LIST thread_list;
-az_result core_result;
+ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA *metadata;
 
     if (hub_client_ptr == NULL)
     {
@@ -1121,86 +1816,58 @@ az_result core_result;
      * 2. Wait for the response if required.
      * 3. Return result if present.
      * */
-    if (hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata.esp_azure_iot_hub_client_message_process == NULL)
+    metadata = &(hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata);
+    if (metadata -> esp_azure_iot_hub_client_message_process == NULL)
     {
         LogError("IoTHub client device twin receive fail: NOT ENABLED");
         return(ESP_AZURE_IOT_NOT_ENABLED);
     }
 
-    status = esp_azure_iot_buffer_allocate(hub_client_ptr -> esp_azure_iot_ptr, &buffer_ptr,
-                                          &buffer_size, &buffer_context);
-    if (status)
-    {
-        LogError("IoTHub client device twin fail: BUFFER ALLOCATE FAIL");
-        return(status);
-    }
-
-    /* Obtain the mutex.  */
-    xSemaphoreTake(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr, portMAX_DELAY);
-
     /* Generate odd request id for reported properties send */
-    if ((hub_client_ptr -> esp_azure_iot_hub_client_request_id & 0x1))
-    {
-        hub_client_ptr -> esp_azure_iot_hub_client_request_id += 2;
-    }
-    else
-    {
-        hub_client_ptr -> esp_azure_iot_hub_client_request_id += 1;
-    }
-
-    request_id = hub_client_ptr -> esp_azure_iot_hub_client_request_id;
-    topic_span = az_span_init(buffer_ptr, (int16_t)buffer_size);
-    core_result = az_span_u32toa(topic_span, request_id, &topic_span);
-    if (az_failed(core_result))
-    {
-        /* Release the mutex.  */
-        xSemaphoreGive(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr);
-        LogError("IoTHub client device failed to u32toa");
-        esp_azure_iot_buffer_free(buffer_context);
-        return(ESP_AZURE_IOT_SDK_CORE_ERROR);
-    }
+    request_id = esp_azure_iot_hub_client_request_id_next(hub_client_ptr, 1);
 
-    request_id_span = az_span_init(buffer_ptr, (int16_t)(buffer_size - (uint32_t)az_span_size(topic_span)));
-    core_result = az_iot_hub_client_twin_patch_get_publish_topic(&(hub_client_ptr -> iot_hub_client_core),
-                                                                 request_id_span, (char *)az_span_ptr(topic_span),
-                                                                 (uint32_t)az_span_size(topic_span), &topic_length);
-    if (az_failed(core_result))
+    thread_list.esp_azure_iot_thread_ptr = esp_azure_iot_thread_identify();
+    if (thread_list.esp_azure_iot_thread_ptr == NULL)
     {
-        /* Release the mutex.  */
-        xSemaphoreGive(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr);
-        LogError("IoTHub client device twin subscribe fail: ESP_AZURE_IOT_HUB_CLIENT_TOPIC_SIZE is too small.");
-        esp_azure_iot_buffer_free(buffer_context);
+        LogError("IoTHub client reported state send fail: NO WAITER AVAILABLE");
         return(ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE);
     }
 
     thread_list.esp_azure_iot_thread_message_type = ESP_AZURE_IOT_HUB_DEVICE_TWIN_REPORTED_PROPERTIES_RESPONSE;
-    thread_list.esp_azure_iot_thread_ptr = esp_azure_iot_thread_identify();
-    thread_list.esp_azure_iot_thread_expected_id = request_id;
     thread_list.esp_azure_iot_thread_received_message = NULL;
     thread_list.esp_azure_iot_thread_response_status = 0;
-    thread_list.esp_azure_iot_thread_next = hub_client_ptr -> esp_azure_iot_hub_client_thread_suspended;
-    hub_client_ptr -> esp_azure_iot_hub_client_thread_suspended = &thread_list;
+    thread_list.esp_azure_iot_thread_next = NULL;
 
-    /* Release the mutex.  */
-    xSemaphoreGive(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr);
+    /* Obtain the message type mutex.  */
+    xSemaphoreTake(metadata -> esp_azure_iot_hub_client_message_mutex_ptr, portMAX_DELAY);
 
-    status = esp_azure_iot_mqtt_client_publish(&(hub_client_ptr -> esp_azure_iot_hub_client_resource.esp_azure_iot_mqtt),
-                                     (char *)az_span_ptr(topic_span), topic_length,
-                                     (char *)message_buffer, message_length, 0,
-                                     ESP_AZURE_IOT_MQTT_QOS_0, wait_option);
-    esp_azure_iot_buffer_free(buffer_context);
+    status = esp_azure_iot_hub_client_pending_request_add(hub_client_ptr, request_id,
+                                                         ESP_AZURE_IOT_HUB_DEVICE_TWIN_REPORTED_PROPERTIES_RESPONSE,
+                                                         0, &thread_list, NULL, NULL);
+
+    /* Release the message type mutex.  */
+    xSemaphoreGive(metadata -> esp_azure_iot_hub_client_message_mutex_ptr);
 
     if (status)
     {
-        /* remove thread from waiting suspend queue.  */
-        xSemaphoreTake(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr, portMAX_DELAY);
-        esp_azure_iot_hub_client_thread_dequeue(hub_client_ptr, &thread_list);
-        
-        /* Restore preemption. */
         esp_azure_iot_thread_preemption(thread_list.esp_azure_iot_thread_ptr);
-        xSemaphoreGive(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr);
-
-        LogError("IoTHub client reported state send: PUBLISH FAIL: 0x%02x", status);
+        LogError("IoTHub client reported state send: TOO MANY PENDING REQUESTS");
+        return(status);
+    }
+
+    status = esp_azure_iot_hub_client_device_twin_request_send(hub_client_ptr, request_id,
+                                                              message_buffer, message_length, wait_option);
+    if (status)
+    {
+        /* remove request from pending table.  */
+        xSemaphoreTake(metadata -> esp_azure_iot_hub_client_message_mutex_ptr, portMAX_DELAY);
+        esp_azure_iot_hub_client_pending_request_remove(hub_client_ptr, request_id);
+
+        /* Restore preemption. */
+        esp_azure_iot_thread_preemption(thread_list.esp_azure_iot_thread_ptr);
+        xSemaphoreGive(metadata -> esp_azure_iot_hub_client_message_mutex_ptr);
+
+        LogError("IoTHub client reported state send: PUBLISH FAIL: 0x%02x", status);
         return(status);
     }
     LogDebug("[%s]request_id: %u", __func__, request_id);
@@ -1210,17 +1877,17 @@ az_result core_result;
         esp_azure_iot_thread_sleep(thread_list.esp_azure_iot_thread_ptr, wait_option);
     }
 
-    /* Obtain the mutex.  */
-    xSemaphoreTake(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr, portMAX_DELAY);
+    /* Obtain the message type mutex.  */
+    xSemaphoreTake(metadata -> esp_azure_iot_hub_client_message_mutex_ptr, portMAX_DELAY);
 
-    esp_azure_iot_hub_client_thread_dequeue(hub_client_ptr, &thread_list);
+    esp_azure_iot_hub_client_pending_request_remove(hub_client_ptr, request_id);
 
     /* Restore preemption. */
     esp_azure_iot_thread_preemption(thread_list.esp_azure_iot_thread_ptr);
     packet_ptr = thread_list.esp_azure_iot_thread_received_message;
 
-    /* Release the mutex.  */
-    xSemaphoreGive(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr);
+    /* Release the message type mutex.  */
+    xSemaphoreGive(metadata -> esp_azure_iot_hub_client_message_mutex_ptr);
 
     if (packet_ptr == NULL)
     {
@@ -1244,86 +1911,158 @@ az_result core_result;
     return(ESP_AZURE_IOT_SUCCESS);
 }
 
-uint32_t esp_azure_iot_hub_client_device_twin_properties_request(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
-                                                            uint32_t wait_option)
+uint32_t esp_azure_iot_hub_client_device_twin_reported_properties_send_async(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                        uint8_t *message_buffer, uint32_t message_length,
+                                                                        uint32_t timeout,
+                                                                        void (*callback_ptr)(
+                                                                              ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                              uint32_t request_id, uint32_t status,
+                                                                              uint32_t response_status, ESP_PACKET *packet_ptr,
+                                                                              void *args),
+                                                                        void *callback_args, uint32_t *request_id_ptr,
+                                                                        uint32_t wait_option)
+{
+    if ((hub_client_ptr == NULL) || (callback_ptr == NULL))
+    {
+        LogError("IoTHub client device twin async send fail: INVALID POINTER");
+        return(ESP_AZURE_IOT_INVALID_PARAMETER);
+    }
+
+    /* Merge into the pending patch when merging is enabled, the window is checked again under the mutex.  */
+    if (hub_client_ptr -> esp_azure_iot_hub_client_reported_properties_merge.esp_reported_merge_window)
+    {
+        return(esp_azure_iot_hub_client_reported_properties_merge(hub_client_ptr, message_buffer, message_length,
+                                                                 timeout, callback_ptr, callback_args,
+                                                                 request_id_ptr, wait_option));
+    }
+
+    /* Generate odd request id for reported properties send */
+    return(esp_azure_iot_hub_client_device_twin_request_async(hub_client_ptr,
+                                                             esp_azure_iot_hub_client_request_id_next(hub_client_ptr, 1),
+                                                             ESP_AZURE_IOT_HUB_DEVICE_TWIN_REPORTED_PROPERTIES_RESPONSE,
+                                                             message_buffer, message_length, timeout,
+                                                             callback_ptr, callback_args, request_id_ptr, wait_option));
+}
+
+uint32_t esp_azure_iot_hub_client_device_twin_reported_properties_merge_enable(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                          uint32_t window)
+{
+ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA *metadata;
+
+    if ((hub_client_ptr == NULL) || (window == 0))
+    {
+        LogError("IoTHub client reported properties merge enable fail: INVALID PARAMETER");
+        return(ESP_AZURE_IOT_INVALID_PARAMETER);
+    }
+
+    metadata = &(hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata);
+
+    /* Obtain the message type mutex.  */
+    xSemaphoreTake(metadata -> esp_azure_iot_hub_client_message_mutex_ptr, portMAX_DELAY);
+
+    hub_client_ptr -> esp_azure_iot_hub_client_reported_properties_merge.esp_reported_merge_window = window;
+
+    /* Release the message type mutex.  */
+    xSemaphoreGive(metadata -> esp_azure_iot_hub_client_message_mutex_ptr);
+
+    return(ESP_AZURE_IOT_SUCCESS);
+}
+
+uint32_t esp_azure_iot_hub_client_device_twin_reported_properties_merge_disable(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                           uint32_t wait_option)
+{
+ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA *metadata;
+
+    if (hub_client_ptr == NULL)
+    {
+        LogError("IoTHub client reported properties merge disable fail: INVALID POINTER");
+        return(ESP_AZURE_IOT_INVALID_PARAMETER);
+    }
+
+    metadata = &(hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata);
+
+    /* Obtain the message type mutex.  */
+    xSemaphoreTake(metadata -> esp_azure_iot_hub_client_message_mutex_ptr, portMAX_DELAY);
+
+    hub_client_ptr -> esp_azure_iot_hub_client_reported_properties_merge.esp_reported_merge_window = 0;
+
+    /* Release the message type mutex.  */
+    xSemaphoreGive(metadata -> esp_azure_iot_hub_client_message_mutex_ptr);
+
+    return(esp_azure_iot_hub_client_device_twin_reported_properties_merge_flush(hub_client_ptr, wait_option));
+}
+
+uint32_t esp_azure_iot_hub_client_device_twin_reported_properties_merge_flush(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                         uint32_t wait_option)
 {
+ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA *metadata;
 uint32_t status;
-uint32_t topic_length;
+uint32_t request_id;
+uint32_t length;
 uint8_t *buffer_ptr;
 uint32_t buffer_size;
 void *buffer_context;
-az_span request_id_span;
-az_span topic_span;
-az_result core_result;
 
     if (hub_client_ptr == NULL)
     {
-        LogError("IoTHub client device twin publish fail: INVALID POINTER");
+        LogError("IoTHub client reported properties merge flush fail: INVALID POINTER");
         return(ESP_AZURE_IOT_INVALID_PARAMETER);
     }
 
-    /* Steps.
-     * 1. Publish message to topic "$iothub/twin/GET/?$rid={request id}"
-     * */
+    metadata = &(hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata);
+
+    /* Nothing to do if no patch is pending.  */
+    if (hub_client_ptr -> esp_azure_iot_hub_client_reported_properties_merge.esp_reported_merge_request_id == 0)
+    {
+        return(ESP_AZURE_IOT_SUCCESS);
+    }
+
+    /* Allocate the payload before any mutex is taken.  */
     status = esp_azure_iot_buffer_allocate(hub_client_ptr -> esp_azure_iot_ptr, &buffer_ptr,
                                           &buffer_size, &buffer_context);
     if (status)
     {
-        LogError("IoTHub client device twin publish fail: BUFFER ALLOCATE FAIL");
+        LogError("IoTHub client reported properties merge flush fail: BUFFER ALLOCATE FAIL");
         return(status);
     }
 
-    /* Obtain the mutex.  */
-    xSemaphoreTake(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr, portMAX_DELAY);
+    /* Obtain the message type mutex.  */
+    xSemaphoreTake(metadata -> esp_azure_iot_hub_client_message_mutex_ptr, portMAX_DELAY);
 
-    /* Generate even request id for twin properties request */
-    if ((hub_client_ptr -> esp_azure_iot_hub_client_request_id & 0x1) == 0)
-    {
-        hub_client_ptr -> esp_azure_iot_hub_client_request_id += 2;
-    }
-    else
-    {
-        hub_client_ptr -> esp_azure_iot_hub_client_request_id += 1;
-    }
+    request_id = esp_azure_iot_hub_client_reported_properties_merge_detach(hub_client_ptr, buffer_ptr,
+                                                                          buffer_size, &length);
 
-    if (hub_client_ptr -> esp_azure_iot_hub_client_request_id == 0)
-    {
-        hub_client_ptr -> esp_azure_iot_hub_client_request_id = 2;
-    }
+    /* Release the message type mutex.  */
+    xSemaphoreGive(metadata -> esp_azure_iot_hub_client_message_mutex_ptr);
 
-    topic_span = az_span_init(buffer_ptr, (int16_t)buffer_size);
-    core_result = az_span_u32toa(topic_span, hub_client_ptr -> esp_azure_iot_hub_client_request_id, &topic_span);
-    if (az_failed(core_result))
+    if (request_id == 0)
     {
-
-        /* Release the mutex.  */
-        xSemaphoreGive(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr);
-        LogError("IoTHub client device failed to u32toa");
         esp_azure_iot_buffer_free(buffer_context);
-        return(ESP_AZURE_IOT_SDK_CORE_ERROR);
+        return(ESP_AZURE_IOT_SUCCESS);
     }
 
-    request_id_span = az_span_init(buffer_ptr, (int16_t)(buffer_size - (uint32_t)az_span_size(topic_span)));
-    core_result = az_iot_hub_client_twin_document_get_publish_topic(&(hub_client_ptr -> iot_hub_client_core),
-                                                                    request_id_span, (char *)az_span_ptr(topic_span),
-                                                                    (uint32_t)az_span_size(topic_span), &topic_length);
-    if (az_failed(core_result))
+    return(esp_azure_iot_hub_client_reported_properties_merge_publish(hub_client_ptr, request_id, buffer_ptr,
+                                                                     length, buffer_context, wait_option));
+}
+
+uint32_t esp_azure_iot_hub_client_device_twin_properties_request(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                            uint32_t wait_option)
+{
+uint32_t status;
+
+    if (hub_client_ptr == NULL)
     {
-        /* Release the mutex.  */
-        xSemaphoreGive(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr);
-        LogError("IoTHub client device twin get topic fail.");
-        esp_azure_iot_buffer_free(buffer_context);
-        return(ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE);
+        LogError("IoTHub client device twin publish fail: INVALID POINTER");
+        return(ESP_AZURE_IOT_INVALID_PARAMETER);
     }
 
-    /* Release the mutex.  */
-    xSemaphoreGive(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr);
-
-    status = esp_azure_iot_mqtt_client_publish(&(hub_client_ptr -> esp_azure_iot_hub_client_resource.esp_azure_iot_mqtt),
-                                     (char *)az_span_ptr(topic_span),
-                                     topic_length, NULL, 0, 0,
-                                     ESP_AZURE_IOT_MQTT_QOS_0, wait_option);
-    esp_azure_iot_buffer_free(buffer_context);
+    /* Steps.
+     * 1. Publish message to topic "$iothub/twin/GET/?$rid={request id}"
+     * */
+    /* Generate even request id for twin properties request */
+    status = esp_azure_iot_hub_client_device_twin_request_send(hub_client_ptr,
+                                                              esp_azure_iot_hub_client_request_id_next(hub_client_ptr, 0),
+                                                              NULL, 0, wait_option);
     if (status)
     {
         LogError("IoTHub client device twin: PUBLISH FAIL: 0x%02x", status);
@@ -1333,6 +2072,30 @@ az_result core_result;
     return(ESP_AZURE_IOT_SUCCESS);
 }
 
+uint32_t esp_azure_iot_hub_client_device_twin_properties_request_async(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                  uint32_t timeout,
+                                                                  void (*callback_ptr)(
+                                                                        ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                        uint32_t request_id, uint32_t status,
+                                                                        uint32_t response_status, ESP_PACKET *packet_ptr,
+                                                                        void *args),
+                                                                  void *callback_args, uint32_t *request_id_ptr,
+                                                                  uint32_t wait_option)
+{
+    if ((hub_client_ptr == NULL) || (callback_ptr == NULL))
+    {
+        LogError("IoTHub client device twin async request fail: INVALID POINTER");
+        return(ESP_AZURE_IOT_INVALID_PARAMETER);
+    }
+
+    /* Generate even request id for twin properties request */
+    return(esp_azure_iot_hub_client_device_twin_request_async(hub_client_ptr,
+                                                             esp_azure_iot_hub_client_request_id_next(hub_client_ptr, 0),
+                                                             ESP_AZURE_IOT_HUB_DEVICE_TWIN_PROPERTIES,
+                                                             NULL, 0, timeout,
+                                                             callback_ptr, callback_args, request_id_ptr, wait_option));
+}
+
 uint32_t esp_azure_iot_hub_client_device_twin_properties_receive(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
                                                             ESP_PACKET **packet_pptr, uint32_t wait_option)
 {
@@ -1478,7 +2241,7 @@ uint16_t topic_length;
 size_t message_offset;
 size_t message_length;
 
-    /* This function is protected by MQTT mutex. */
+    /* This function runs in the MQTT thread, without the MQTT mutex held. */
 
     ESP_PARAMETER_NOT_USED(number_of_messages);
 
@@ -1517,33 +2280,9 @@ size_t message_length;
                                          topic_offset) & 0xFFFF);
             }
 
-            if (hub_client_ptr -> esp_azure_iot_hub_client_direct_method_metadata.esp_azure_iot_hub_client_message_process &&
-                (hub_client_ptr -> esp_azure_iot_hub_client_direct_method_metadata.esp_azure_iot_hub_client_message_process(hub_client_ptr, packet_ptr,
-                                                                                                                          topic_offset,
-                                                                                                                          topic_length) == ESP_AZURE_IOT_SUCCESS))
-            {
-
-                /* Direct method message is processed. */
-                continue;
-            }
-
-            if (hub_client_ptr -> esp_azure_iot_hub_client_c2d_message_metadata.esp_azure_iot_hub_client_message_process &&
-                (hub_client_ptr -> esp_azure_iot_hub_client_c2d_message_metadata.esp_azure_iot_hub_client_message_process(hub_client_ptr, packet_ptr,
-                                                                                                                        topic_offset,
-                                                                                                                        topic_length) == ESP_AZURE_IOT_SUCCESS))
-            {
-
-                /* Could to Device message is processed. */
-                continue;
-            }
-
-            if ((hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata.esp_azure_iot_hub_client_message_process) &&
-                (hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata.esp_azure_iot_hub_client_message_process(hub_client_ptr,
-                                                                                               packet_ptr, topic_offset,
-                                                                                               topic_length) == ESP_AZURE_IOT_SUCCESS))
+            /* Route by topic prefix, so only the processor of the message type parses the topic.  */
+            if (esp_azure_iot_hub_client_topic_dispatch(hub_client_ptr, packet_ptr, topic_offset, topic_length) == ESP_AZURE_IOT_SUCCESS)
             {
-
-                /* Device Twin message is processed. */
                 continue;
             }
 
@@ -1558,24 +2297,109 @@ size_t message_length;
     }
     
 }
+
+static uint32_t esp_azure_iot_hub_client_topic_prefix_match(uint8_t *topic_ptr, uint16_t topic_length,
+                                                       const uint8_t *prefix, uint32_t prefix_length)
+{
+    return((topic_length >= prefix_length) && (memcmp(topic_ptr, prefix, prefix_length) == 0));
+}
+
+static uint32_t esp_azure_iot_hub_client_topic_dispatch(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr, ESP_PACKET *packet_ptr,
+                                                   size_t topic_offset, uint16_t topic_length)
+{
+ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA *metadata = NULL;
+ESP_AZURE_IOT_HUB_CLIENT_TOPIC_HANDLER *handler_ptr;
+ESP_MQTT_CLIENT *client_ptr = &(hub_client_ptr -> esp_azure_iot_hub_client_resource.esp_azure_iot_mqtt);
+uint32_t (*process)(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr, ESP_PACKET *packet_ptr,
+                    size_t topic_offset, uint16_t topic_length, void *args) = NULL;
+void *process_args = NULL;
+uint8_t *topic_ptr = &(packet_ptr -> esp_packet_prepend_ptr[topic_offset]);
+uint32_t i;
+
+    /* This function runs in the MQTT thread, without the MQTT mutex held. */
+
+    if (esp_azure_iot_hub_client_topic_prefix_match(topic_ptr, topic_length,
+                                                   (const uint8_t *)ESP_AZURE_IOT_HUB_CLIENT_TWIN_TOPIC_PREFIX,
+                                                   sizeof(ESP_AZURE_IOT_HUB_CLIENT_TWIN_TOPIC_PREFIX) - 1))
+    {
+        metadata = &(hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata);
+    }
+    else if (esp_azure_iot_hub_client_topic_prefix_match(topic_ptr, topic_length,
+                                                        (const uint8_t *)ESP_AZURE_IOT_HUB_CLIENT_METHODS_TOPIC_PREFIX,
+                                                        sizeof(ESP_AZURE_IOT_HUB_CLIENT_METHODS_TOPIC_PREFIX) - 1))
+    {
+        metadata = &(hub_client_ptr -> esp_azure_iot_hub_client_direct_method_metadata);
+    }
+    else if (esp_azure_iot_hub_client_topic_prefix_match(topic_ptr, topic_length,
+                                                        (const uint8_t *)ESP_AZURE_IOT_HUB_CLIENT_C2D_TOPIC_PREFIX,
+                                                        sizeof(ESP_AZURE_IOT_HUB_CLIENT_C2D_TOPIC_PREFIX) - 1))
+    {
+        metadata = &(hub_client_ptr -> esp_azure_iot_hub_client_c2d_message_metadata);
+    }
+
+    if (metadata && metadata -> esp_azure_iot_hub_client_message_process &&
+        (metadata -> esp_azure_iot_hub_client_message_process(hub_client_ptr, packet_ptr,
+                                                             topic_offset, topic_length) == ESP_AZURE_IOT_SUCCESS))
+    {
+        return(ESP_AZURE_IOT_SUCCESS);
+    }
+
+    /* Custom topics, the handler table is guarded by the MQTT client mutex.  */
+    xSemaphoreTake(client_ptr -> esp_mqtt_client_mutex_ptr, portMAX_DELAY);
+    for (i = 0; i < ESP_AZURE_IOT_HUB_CLIENT_TOPIC_HANDLER_MAX; i++)
+    {
+        handler_ptr = &(hub_client_ptr -> esp_azure_iot_hub_client_topic_handlers[i]);
+        if (handler_ptr -> esp_topic_handler_prefix &&
+            esp_azure_iot_hub_client_topic_prefix_match(topic_ptr, topic_length,
+                                                        handler_ptr -> esp_topic_handler_prefix,
+                                                        handler_ptr -> esp_topic_handler_prefix_length))
+        {
+            process = handler_ptr -> esp_topic_handler_process;
+            process_args = handler_ptr -> esp_topic_handler_args;
+            break;
+        }
+    }
+    xSemaphoreGive(client_ptr -> esp_mqtt_client_mutex_ptr);
+
+    /* Call the handler without the mutex, so it can call back into the client.  */
+    if (process)
+    {
+        return(process(hub_client_ptr, packet_ptr, topic_offset, topic_length, process_args));
+    }
+
+    return(ESP_AZURE_IOT_NOT_FOUND);
+}
                                                           
 static void esp_azure_iot_hub_client_message_notify(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
                                                    ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA *metadata,
-                                                   ESP_PACKET *packet_ptr)
+                                                   ESP_PACKET *packet_ptr, uint32_t message_type,
+                                                   uint32_t response_status)
 {
+uint32_t status;
 
-    if (metadata -> esp_azure_iot_hub_client_message_tail)
-    {
-        metadata -> esp_azure_iot_hub_client_message_tail -> esp_packet_next = packet_ptr;
-    }
-    else
+    /* Obtain the message type mutex.  */
+    xSemaphoreTake(metadata -> esp_azure_iot_hub_client_message_mutex_ptr, portMAX_DELAY);
+
+    /* Hand the message to a waiting thread first.  */
+    status = esp_azure_iot_hub_client_receive_thread_find(metadata, packet_ptr, message_type, response_status);
+    if (status != ESP_AZURE_IOT_SUCCESS)
     {
-        metadata -> esp_azure_iot_hub_client_message_head = packet_ptr;
+        if (metadata -> esp_azure_iot_hub_client_message_tail)
+        {
+            metadata -> esp_azure_iot_hub_client_message_tail -> esp_packet_next = packet_ptr;
+        }
+        else
+        {
+            metadata -> esp_azure_iot_hub_client_message_head = packet_ptr;
+        }
+        metadata -> esp_azure_iot_hub_client_message_tail = packet_ptr;
     }
-    metadata -> esp_azure_iot_hub_client_message_tail = packet_ptr;
 
-    /* Check for user callback function. */
-    if (metadata -> esp_azure_iot_hub_client_message_callback)
+    /* Release the message type mutex.  */
+    xSemaphoreGive(metadata -> esp_azure_iot_hub_client_message_mutex_ptr);
+
+    /* Check for user callback function, called without the mutex so it can receive the message. */
+    if ((status != ESP_AZURE_IOT_SUCCESS) && metadata -> esp_azure_iot_hub_client_message_callback)
     {
         metadata -> esp_azure_iot_hub_client_message_callback(hub_client_ptr,
                                                              metadata -> esp_azure_iot_hub_client_message_callback_args);
@@ -1583,33 +2407,34 @@ static void esp_azure_iot_hub_client_message_notify(ESP_AZURE_IOT_HUB_CLIENT *hu
     
 }
 
-static uint32_t esp_azure_iot_hub_client_receive_thread_find(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+/* Must be called with the message type mutex held, the waiter is woken before the mutex is released.  */
+static uint32_t esp_azure_iot_hub_client_receive_thread_find(ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA *metadata,
                                                         ESP_PACKET *packet_ptr, uint32_t message_type,
-                                                        uint32_t request_id, ESP_AZURE_IOT_THREAD_LIST **thread_list_pptr)
+                                                        uint32_t response_status)
 {
 ESP_AZURE_IOT_THREAD_LIST *thread_list_prev = NULL;
 ESP_AZURE_IOT_THREAD_LIST *thread_list_ptr;
 
     /* Search thread waiting for message type. */
-    for (thread_list_ptr = hub_client_ptr -> esp_azure_iot_hub_client_thread_suspended;
+    for (thread_list_ptr = metadata -> esp_azure_iot_hub_client_message_thread_suspended;
          thread_list_ptr;
          thread_list_ptr = thread_list_ptr -> esp_azure_iot_thread_next)
     {
-        if ((thread_list_ptr -> esp_azure_iot_thread_message_type == message_type) &&
-            (request_id == thread_list_ptr -> esp_azure_iot_thread_expected_id))
+        if (thread_list_ptr -> esp_azure_iot_thread_message_type == message_type)
         {
 
             /* Found a thread waiting for message type. */
             if (thread_list_prev == NULL)
             {
-                hub_client_ptr -> esp_azure_iot_hub_client_thread_suspended = thread_list_ptr -> esp_azure_iot_thread_next;
+                metadata -> esp_azure_iot_hub_client_message_thread_suspended = thread_list_ptr -> esp_azure_iot_thread_next;
             }
             else
             {
                 thread_list_prev -> esp_azure_iot_thread_next = thread_list_ptr -> esp_azure_iot_thread_next;
             }
             thread_list_ptr -> esp_azure_iot_thread_received_message = packet_ptr;
-            *thread_list_pptr =  thread_list_ptr;
+            thread_list_ptr -> esp_azure_iot_thread_response_status = response_status;
+            esp_azure_iot_thread_wait_abort(thread_list_ptr -> esp_azure_iot_thread_ptr);
             return(ESP_AZURE_IOT_SUCCESS);
         }
 
@@ -1628,10 +2453,8 @@ static uint32_t esp_azure_iot_hub_client_c2d_process(ESP_AZURE_IOT_HUB_CLIENT *h
     az_iot_hub_client_c2d_request request;
     az_span receive_topic;
     az_result core_result;
-    uint32_t status;
-    ESP_AZURE_IOT_THREAD_LIST *thread_list_ptr;
 
-    /* This function is protected by MQTT mutex. */
+    /* This function runs in the MQTT thread, without the MQTT mutex held. */
 
     /* Check message type first. */
     topic_name = &(packet_ptr -> esp_packet_prepend_ptr[topic_offset]);
@@ -1653,20 +2476,10 @@ static uint32_t esp_azure_iot_hub_client_c2d_process(ESP_AZURE_IOT_HUB_CLIENT *h
         return(ESP_AZURE_IOT_NOT_FOUND);
     }
 
-    status = esp_azure_iot_hub_client_receive_thread_find(hub_client_ptr,
-                                                         packet_ptr,
-                                                         ESP_AZURE_IOT_HUB_CLOUD_TO_DEVICE_MESSAGE,
-                                                         0, &thread_list_ptr);
-    if (status == ESP_AZURE_IOT_SUCCESS)
-    {
-        esp_azure_iot_thread_wait_abort(thread_list_ptr -> esp_azure_iot_thread_ptr);
-        return(ESP_AZURE_IOT_SUCCESS);
-    }
-
-    /* No thread is waiting for C2D message yet. */
+    /* Wake a waiting thread or queue the message. */
     esp_azure_iot_hub_client_message_notify(hub_client_ptr,
                                            &(hub_client_ptr -> esp_azure_iot_hub_client_c2d_message_metadata),
-                                           packet_ptr);    
+                                           packet_ptr, ESP_AZURE_IOT_HUB_CLOUD_TO_DEVICE_MESSAGE, 0);
 
     return(ESP_AZURE_IOT_SUCCESS );
 }
@@ -1680,10 +2493,8 @@ static uint32_t esp_azure_iot_hub_client_direct_method_process(ESP_AZURE_IOT_HUB
     az_iot_hub_client_method_request request;
     az_span receive_topic;
     az_result core_result;
-    uint32_t status;
-    ESP_AZURE_IOT_THREAD_LIST *thread_list_ptr;
 
-    /* This function is protected by MQTT mutex. */
+    /* This function runs in the MQTT thread, without the MQTT mutex held. */
 
     /* Check message type first. */
     topic_name = &(packet_ptr -> esp_packet_prepend_ptr[topic_offset]);
@@ -1701,244 +2512,1438 @@ static uint32_t esp_azure_iot_hub_client_direct_method_process(ESP_AZURE_IOT_HUB
     if (az_failed(core_result))
     {
 
-        /* Topic name does not match direct method format. */
-        return(ESP_AZURE_IOT_NOT_FOUND);
+        /* Topic name does not match direct method format. */
+        return(ESP_AZURE_IOT_NOT_FOUND);
+    }
+    
+    /* Wake a waiting thread or queue the message. */
+    esp_azure_iot_hub_client_message_notify(hub_client_ptr,
+                                           &(hub_client_ptr -> esp_azure_iot_hub_client_direct_method_metadata),
+                                           packet_ptr, ESP_AZURE_IOT_HUB_DIRECT_METHOD, 0);
+
+    return(ESP_AZURE_IOT_SUCCESS );
+}
+
+static uint32_t esp_azure_iot_hub_client_device_twin_message_type_get(az_iot_hub_client_twin_response *out_twin_response_ptr,
+                                                                 uint32_t request_id)
+{
+uint32_t mesg_type;
+
+    switch (out_twin_response_ptr -> response_type)
+    {
+        case AZ_IOT_CLIENT_TWIN_RESPONSE_TYPE_GET :
+        /* fall through */
+        case AZ_IOT_CLIENT_TWIN_RESPONSE_TYPE_REPORTED_PROPERTIES :
+        {
+            /* odd requests are of reported properties and even of twin properties*/
+            mesg_type = request_id % 2 == 0 ? ESP_AZURE_IOT_HUB_DEVICE_TWIN_PROPERTIES :
+                        ESP_AZURE_IOT_HUB_DEVICE_TWIN_REPORTED_PROPERTIES_RESPONSE;
+        }
+        break;
+
+        case AZ_IOT_CLIENT_TWIN_RESPONSE_TYPE_DESIRED_PROPERTIES :
+        {
+            mesg_type = ESP_AZURE_IOT_HUB_DEVICE_TWIN_DESIRED_PROPERTIES;
+        }
+        break;
+
+        default :
+        {
+            mesg_type = ESP_AZURE_IOT_HUB_NONE;
+        }
+    }
+
+    return mesg_type;
+}
+
+static uint32_t esp_azure_iot_hub_client_device_twin_process(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                        ESP_PACKET *packet_ptr,
+                                                        size_t topic_offset,
+                                                        uint16_t topic_length)
+{
+ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA *metadata = &(hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata);
+ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST requests[ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST_MAX];
+ESP_AZURE_IOT_THREAD_LIST *thread_list_ptr;
+uint32_t count;
+uint32_t i;
+uint32_t message_type;
+uint32_t request_id = 0;
+az_result core_result;
+az_span topic_span;
+az_iot_hub_client_twin_response out_twin_response;
+
+    /* This function runs in the MQTT thread, without the MQTT mutex held. */
+
+    /* Check message type first. */
+    topic_span = az_span_init(&(packet_ptr -> esp_packet_prepend_ptr[topic_offset]), (int16_t)topic_length);
+    core_result = az_iot_hub_client_twin_parse_received_topic(&(hub_client_ptr -> iot_hub_client_core),
+                                                              topic_span, &out_twin_response);
+    if (az_failed(core_result))
+    {
+        /* Topic name does not match device twin format. */
+            return(ESP_AZURE_IOT_NOT_FOUND);
+    }
+
+    if (az_span_ptr(out_twin_response.request_id)) {
+        core_result = az_span_atou32(out_twin_response.request_id, &request_id);
+        if (az_failed(core_result))
+        {
+            /* Topic name does not match device twin format. */
+            return(ESP_AZURE_IOT_NOT_FOUND);
+        }
+    }
+
+    message_type = esp_azure_iot_hub_client_device_twin_message_type_get(&out_twin_response, request_id);
+
+    /* Responses to our own requests go straight to the requester.  */
+    if (request_id && ((message_type == ESP_AZURE_IOT_HUB_DEVICE_TWIN_REPORTED_PROPERTIES_RESPONSE) ||
+                       (message_type == ESP_AZURE_IOT_HUB_DEVICE_TWIN_PROPERTIES)))
+    {
+
+        /* Obtain the message type mutex.  */
+        xSemaphoreTake(metadata -> esp_azure_iot_hub_client_message_mutex_ptr, portMAX_DELAY);
+
+        count = esp_azure_iot_hub_client_pending_request_take(hub_client_ptr, request_id, message_type, requests);
+        thread_list_ptr = count ? requests[0].esp_pending_request_thread_list_ptr : NULL;
+        if (thread_list_ptr)
+        {
+            thread_list_ptr -> esp_azure_iot_thread_received_message = packet_ptr;
+            thread_list_ptr -> esp_azure_iot_thread_response_status = (uint32_t)out_twin_response.status;
+            esp_azure_iot_thread_wait_abort(thread_list_ptr -> esp_azure_iot_thread_ptr);
+        }
+
+        /* Release the message type mutex.  */
+        xSemaphoreGive(metadata -> esp_azure_iot_hub_client_message_mutex_ptr);
+
+        if (count)
+        {
+            if (thread_list_ptr == NULL)
+            {
+
+                /* Merged reported properties patches share one response, which has no payload.  */
+                if (count > 1)
+                {
+                    esp_azure_iot_packet_release(packet_ptr);
+                    packet_ptr = NULL;
+                }
+
+                for (i = 0; i < count; i++)
+                {
+                    esp_azure_iot_hub_client_pending_request_complete(hub_client_ptr, &requests[i], ESP_AZURE_IOT_SUCCESS,
+                                                                     (uint32_t)out_twin_response.status, packet_ptr);
+                }
+            }
+
+            return(ESP_AZURE_IOT_SUCCESS);
+        }
+    }
+
+    switch(message_type)
+    {
+        case ESP_AZURE_IOT_HUB_DEVICE_TWIN_REPORTED_PROPERTIES_RESPONSE :
+        {
+            if (hub_client_ptr -> esp_azure_iot_hub_client_report_properties_response_callback)
+            {
+                hub_client_ptr -> esp_azure_iot_hub_client_report_properties_response_callback(hub_client_ptr,
+                                                                                              request_id,
+                                                                                              out_twin_response.status,
+                                                                                              hub_client_ptr -> esp_azure_iot_hub_client_report_properties_response_callback_args);
+            }
+
+            esp_azure_iot_packet_release(packet_ptr);
+        }
+        break;
+
+        case ESP_AZURE_IOT_HUB_DEVICE_TWIN_PROPERTIES :
+        {
+
+            /* any thread can be woken*/
+            esp_azure_iot_hub_client_message_notify(hub_client_ptr, metadata, packet_ptr, message_type,
+                                                   (uint32_t)out_twin_response.status);
+        }
+        break;
+
+        case ESP_AZURE_IOT_HUB_DEVICE_TWIN_DESIRED_PROPERTIES :
+        {
+            /* any thread can be woken*/
+            esp_azure_iot_hub_client_message_notify(hub_client_ptr,
+                                                   &(hub_client_ptr -> esp_azure_iot_hub_client_device_twin_desired_properties_metadata),
+                                                   packet_ptr, message_type, (uint32_t)out_twin_response.status);
+        }
+        break;
+
+        default :
+            esp_azure_iot_packet_release(packet_ptr);
+    }
+
+    return(ESP_AZURE_IOT_SUCCESS);
+}
+
+static void esp_azure_iot_hub_client_thread_dequeue(ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA *metadata,
+                                                   ESP_AZURE_IOT_THREAD_LIST *thread_list_ptr)
+{
+    ESP_AZURE_IOT_THREAD_LIST *thread_list_prev = NULL;
+    ESP_AZURE_IOT_THREAD_LIST *thread_list_current;
+
+    for (thread_list_current = metadata -> esp_azure_iot_hub_client_message_thread_suspended;
+         thread_list_current;
+         thread_list_current = thread_list_current -> esp_azure_iot_thread_next)
+    {
+        if (thread_list_current == thread_list_ptr)
+        {
+
+            /* Found the thread to dequeue. */
+            if (thread_list_prev == NULL)
+            {
+                metadata -> esp_azure_iot_hub_client_message_thread_suspended = thread_list_current -> esp_azure_iot_thread_next;
+            }
+            else
+            {
+                thread_list_prev -> esp_azure_iot_thread_next = thread_list_current -> esp_azure_iot_thread_next;
+            }
+            break;
+        }
+
+        thread_list_prev = thread_list_current;
+    }
+}   
+
+/* Request ids are taken lock-free, odd for reported properties and even (never zero) for twin requests.  */
+static uint32_t esp_azure_iot_hub_client_request_id_next(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr, uint32_t odd)
+{
+uint32_t current;
+uint32_t next;
+
+    current = __atomic_load_n(&(hub_client_ptr -> esp_azure_iot_hub_client_request_id), __ATOMIC_RELAXED);
+    do
+    {
+        next = current + (((current & 0x1) == odd) ? 2 : 1);
+        if (next == 0)
+        {
+            next = 2;
+        }
+    } while (!__atomic_compare_exchange_n(&(hub_client_ptr -> esp_azure_iot_hub_client_request_id), &current, next,
+                                          false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return(next);
+}
+
+static uint32_t esp_azure_iot_hub_client_mutexes_create(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr)
+{
+    hub_client_ptr -> esp_azure_iot_hub_client_telemetry_batch.esp_telemetry_batch_mutex_ptr = xSemaphoreCreateMutex();
+    hub_client_ptr -> esp_azure_iot_hub_client_c2d_message_metadata.esp_azure_iot_hub_client_message_mutex_ptr = xSemaphoreCreateMutex();
+    hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata.esp_azure_iot_hub_client_message_mutex_ptr = xSemaphoreCreateMutex();
+    hub_client_ptr -> esp_azure_iot_hub_client_device_twin_desired_properties_metadata.esp_azure_iot_hub_client_message_mutex_ptr = xSemaphoreCreateMutex();
+    hub_client_ptr -> esp_azure_iot_hub_client_direct_method_metadata.esp_azure_iot_hub_client_message_mutex_ptr = xSemaphoreCreateMutex();
+
+    if ((hub_client_ptr -> esp_azure_iot_hub_client_telemetry_batch.esp_telemetry_batch_mutex_ptr == NULL) ||
+        (hub_client_ptr -> esp_azure_iot_hub_client_c2d_message_metadata.esp_azure_iot_hub_client_message_mutex_ptr == NULL) ||
+        (hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata.esp_azure_iot_hub_client_message_mutex_ptr == NULL) ||
+        (hub_client_ptr -> esp_azure_iot_hub_client_device_twin_desired_properties_metadata.esp_azure_iot_hub_client_message_mutex_ptr == NULL) ||
+        (hub_client_ptr -> esp_azure_iot_hub_client_direct_method_metadata.esp_azure_iot_hub_client_message_mutex_ptr == NULL))
+    {
+        esp_azure_iot_hub_client_mutexes_delete(hub_client_ptr);
+        return(ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE);
+    }
+
+    return(ESP_AZURE_IOT_SUCCESS);
+}
+
+static void esp_azure_iot_hub_client_mutexes_delete(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr)
+{
+SemaphoreHandle_t *mutex_pptr[5];
+uint32_t i;
+
+    mutex_pptr[0] = &(hub_client_ptr -> esp_azure_iot_hub_client_telemetry_batch.esp_telemetry_batch_mutex_ptr);
+    mutex_pptr[1] = &(hub_client_ptr -> esp_azure_iot_hub_client_c2d_message_metadata.esp_azure_iot_hub_client_message_mutex_ptr);
+    mutex_pptr[2] = &(hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata.esp_azure_iot_hub_client_message_mutex_ptr);
+    mutex_pptr[3] = &(hub_client_ptr -> esp_azure_iot_hub_client_device_twin_desired_properties_metadata.esp_azure_iot_hub_client_message_mutex_ptr);
+    mutex_pptr[4] = &(hub_client_ptr -> esp_azure_iot_hub_client_direct_method_metadata.esp_azure_iot_hub_client_message_mutex_ptr);
+
+    for (i = 0; i < sizeof(mutex_pptr) / sizeof(mutex_pptr[0]); i++)
+    {
+        if (*mutex_pptr[i])
+        {
+            vSemaphoreDelete(*mutex_pptr[i]);
+            *mutex_pptr[i] = NULL;
+        }
+    }
+}
+
+/* Publish a twin request, a reported properties patch when message_buffer is set and a GET otherwise.  */
+static uint32_t esp_azure_iot_hub_client_device_twin_request_send(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                             uint32_t request_id, uint8_t *message_buffer,
+                                                             uint32_t message_length, uint32_t wait_option)
+{
+uint32_t status;
+uint32_t topic_length;
+uint8_t *buffer_ptr;
+uint32_t buffer_size;
+void *buffer_context;
+az_span request_id_span;
+az_span topic_span;
+az_result core_result;
+
+    status = esp_azure_iot_buffer_allocate(hub_client_ptr -> esp_azure_iot_ptr, &buffer_ptr,
+                                          &buffer_size, &buffer_context);
+    if (status)
+    {
+        LogError("IoTHub client device twin publish fail: BUFFER ALLOCATE FAIL");
+        return(status);
+    }
+
+    topic_span = az_span_init(buffer_ptr, (int16_t)buffer_size);
+    core_result = az_span_u32toa(topic_span, request_id, &topic_span);
+    if (az_failed(core_result))
+    {
+        LogError("IoTHub client device failed to u32toa");
+        esp_azure_iot_buffer_free(buffer_context);
+        return(ESP_AZURE_IOT_SDK_CORE_ERROR);
+    }
+
+    request_id_span = az_span_init(buffer_ptr, (int16_t)(buffer_size - (uint32_t)az_span_size(topic_span)));
+    if (message_buffer)
+    {
+        core_result = az_iot_hub_client_twin_patch_get_publish_topic(&(hub_client_ptr -> iot_hub_client_core),
+                                                                     request_id_span, (char *)az_span_ptr(topic_span),
+                                                                     (uint32_t)az_span_size(topic_span), &topic_length);
+    }
+    else
+    {
+        core_result = az_iot_hub_client_twin_document_get_publish_topic(&(hub_client_ptr -> iot_hub_client_core),
+                                                                        request_id_span, (char *)az_span_ptr(topic_span),
+                                                                        (uint32_t)az_span_size(topic_span), &topic_length);
+    }
+    if (az_failed(core_result))
+    {
+        LogError("IoTHub client device twin get topic fail: ESP_AZURE_IOT_HUB_CLIENT_TOPIC_SIZE is too small.");
+        esp_azure_iot_buffer_free(buffer_context);
+        return(ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE);
+    }
+
+    status = esp_azure_iot_mqtt_client_publish(&(hub_client_ptr -> esp_azure_iot_hub_client_resource.esp_azure_iot_mqtt),
+                                     (char *)az_span_ptr(topic_span), topic_length,
+                                     (char *)message_buffer, message_buffer ? message_length : 0, 0,
+                                     ESP_AZURE_IOT_MQTT_QOS_0, wait_option);
+    esp_azure_iot_buffer_free(buffer_context);
+
+    return(status);
+}
+
+static uint32_t esp_azure_iot_hub_client_device_twin_request_async(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                              uint32_t request_id, uint32_t message_type,
+                                                              uint8_t *message_buffer, uint32_t message_length,
+                                                              uint32_t timeout,
+                                                              void (*callback_ptr)(
+                                                                    ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                    uint32_t request_id, uint32_t status,
+                                                                    uint32_t response_status, ESP_PACKET *packet_ptr,
+                                                                    void *args),
+                                                              void *callback_args, uint32_t *request_id_ptr,
+                                                              uint32_t wait_option)
+{
+uint32_t status;
+ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA *metadata = &(hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata);
+
+    if (metadata -> esp_azure_iot_hub_client_message_process == NULL)
+    {
+        LogError("IoTHub client device twin async request fail: NOT ENABLED");
+        return(ESP_AZURE_IOT_NOT_ENABLED);
+    }
+
+    /* Obtain the message type mutex.  */
+    xSemaphoreTake(metadata -> esp_azure_iot_hub_client_message_mutex_ptr, portMAX_DELAY);
+
+    status = esp_azure_iot_hub_client_pending_request_add(hub_client_ptr, request_id, message_type, timeout,
+                                                         NULL, callback_ptr, callback_args);
+
+    /* Release the message type mutex.  */
+    xSemaphoreGive(metadata -> esp_azure_iot_hub_client_message_mutex_ptr);
+
+    if (status)
+    {
+        LogError("IoTHub client device twin async request fail: TOO MANY PENDING REQUESTS");
+        return(status);
+    }
+
+    /* Report the id before the response can complete the request.  */
+    if (request_id_ptr)
+    {
+        *request_id_ptr = request_id;
+    }
+
+    /* Wake the internal thread when the request expires.  */
+    if (timeout)
+    {
+        esp_azure_iot_event_group_timer_set(&(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_event_group), timeout);
+    }
+
+    status = esp_azure_iot_hub_client_device_twin_request_send(hub_client_ptr, request_id,
+                                                              message_buffer, message_length, wait_option);
+    if (status)
+    {
+
+        /* The request never left, no callback is invoked for it.  */
+        xSemaphoreTake(metadata -> esp_azure_iot_hub_client_message_mutex_ptr, portMAX_DELAY);
+        esp_azure_iot_hub_client_pending_request_remove(hub_client_ptr, request_id);
+        xSemaphoreGive(metadata -> esp_azure_iot_hub_client_message_mutex_ptr);
+
+        LogError("IoTHub client device twin async request: PUBLISH FAIL: 0x%02x", status);
+        return(status);
+    }
+
+    return(ESP_AZURE_IOT_SUCCESS);
+}
+
+/* Pending request table. Entries live at their $rid modulo the table size or the next free slot after it,
+   so a lookup touches at most ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST_MAX entries. All of these must be
+   called with the device twin mutex held.  */
+static uint32_t esp_azure_iot_hub_client_pending_request_add(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                        uint32_t request_id, uint32_t message_type,
+                                                        uint32_t timeout, ESP_AZURE_IOT_THREAD_LIST *thread_list_ptr,
+                                                        void (*callback_ptr)(
+                                                              ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                              uint32_t request_id, uint32_t status,
+                                                              uint32_t response_status, ESP_PACKET *packet_ptr,
+                                                              void *args),
+                                                        void *callback_args)
+{
+ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST *request_ptr;
+uint32_t i;
+
+    for (i = 0; i < ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST_MAX; i++)
+    {
+        request_ptr = &(hub_client_ptr -> esp_azure_iot_hub_client_pending_requests[(request_id + i) % ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST_MAX]);
+        if (request_ptr -> esp_pending_request_id == 0)
+        {
+            request_ptr -> esp_pending_request_id = request_id;
+            request_ptr -> esp_pending_request_message_type = message_type;
+            request_ptr -> esp_pending_request_timeout = timeout;
+            request_ptr -> esp_pending_request_deadline = (uint32_t)xTaskGetTickCount() + timeout;
+            request_ptr -> esp_pending_request_thread_list_ptr = thread_list_ptr;
+            request_ptr -> esp_pending_request_callback = callback_ptr;
+            request_ptr -> esp_pending_request_callback_args = callback_args;
+            return(ESP_AZURE_IOT_SUCCESS);
+        }
+    }
+
+    return(ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE);
+}
+
+static ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST *esp_azure_iot_hub_client_pending_request_find(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                                         uint32_t request_id)
+{
+ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST *request_ptr;
+uint32_t i;
+
+    for (i = 0; i < ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST_MAX; i++)
+    {
+        request_ptr = &(hub_client_ptr -> esp_azure_iot_hub_client_pending_requests[(request_id + i) % ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST_MAX]);
+        if (request_ptr -> esp_pending_request_id == request_id)
+        {
+            return(request_ptr);
+        }
+    }
+
+    return(NULL);
+}
+
+static void esp_azure_iot_hub_client_pending_request_remove(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr, uint32_t request_id)
+{
+ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST *request_ptr;
+
+    request_ptr = esp_azure_iot_hub_client_pending_request_find(hub_client_ptr, request_id);
+    if (request_ptr)
+    {
+        request_ptr -> esp_pending_request_id = 0;
+    }
+}
+
+/* Invoke the callback of a request taken out of the table, must be called without any mutex held.  */
+static void esp_azure_iot_hub_client_pending_request_complete(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                             ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST *request_ptr,
+                                                             uint32_t status, uint32_t response_status,
+                                                             ESP_PACKET *packet_ptr)
+{
+
+    /* Only the twin document is handed over, the reported properties response has no payload.  */
+    if (packet_ptr && (request_ptr -> esp_pending_request_message_type != ESP_AZURE_IOT_HUB_DEVICE_TWIN_PROPERTIES))
+    {
+        esp_azure_iot_packet_release(packet_ptr);
+        packet_ptr = NULL;
+    }
+    else if (packet_ptr && esp_azure_iot_hub_client_adjust_payload(packet_ptr))
+    {
+
+        /* Packet is released on failure.  */
+        packet_ptr = NULL;
+        status = ESP_AZURE_IOT_INVALID_PACKET;
+    }
+
+    request_ptr -> esp_pending_request_callback(hub_client_ptr, request_ptr -> esp_pending_request_id, status,
+                                                response_status, packet_ptr,
+                                                request_ptr -> esp_pending_request_callback_args);
+
+    if (packet_ptr)
+    {
+        esp_azure_iot_packet_release(packet_ptr);
+    }
+}
+
+/* Expire requests whose response did not arrive in time and re-arm the timer for the rest.  */
+static void esp_azure_iot_hub_client_pending_request_sweep(ESP_AZURE_IOT *esp_azure_iot_ptr)
+{
+ESP_AZURE_IOT_RESOURCE *resource_ptr;
+ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr = NULL;
+ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA *metadata;
+ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST *request_ptr;
+ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST expired[ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST_MAX];
+uint32_t expired_count;
+uint32_t current_tick;
+uint32_t remaining;
+uint32_t next_deadline;
+uint32_t i;
+
+    do
+    {
+        expired_count = 0;
+        next_deadline = 0;
+        current_tick = (uint32_t)xTaskGetTickCount();
+
+        /* Obtain the mutex.  */
+        xSemaphoreTake(esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr, ESP_WAIT_FOREVER);
+
+        /* Take out the expired requests of the first client that has any.  */
+        for (resource_ptr = esp_azure_iot_ptr -> esp_azure_iot_resource_list_header; resource_ptr;
+             resource_ptr = resource_ptr -> esp_azure_iot_resource_next)
+        {
+            if (resource_ptr -> esp_azure_iot_resource_type != ESP_AZURE_IOT_RESOURCE_IOT_HUB)
+            {
+                continue;
+            }
+
+            hub_client_ptr = (ESP_AZURE_IOT_HUB_CLIENT *)resource_ptr -> esp_azure_iot_resource_data_ptr;
+            metadata = &(hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata);
+
+            /* Obtain the message type mutex.  */
+            xSemaphoreTake(metadata -> esp_azure_iot_hub_client_message_mutex_ptr, ESP_WAIT_FOREVER);
+
+            for (i = 0; i < ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST_MAX; i++)
+            {
+                request_ptr = &(hub_client_ptr -> esp_azure_iot_hub_client_pending_requests[i]);
+                if ((request_ptr -> esp_pending_request_id == 0) || (request_ptr -> esp_pending_request_timeout == 0))
+                {
+                    continue;
+                }
+
+                remaining = request_ptr -> esp_pending_request_deadline - current_tick;
+                if ((remaining == 0) || (remaining > request_ptr -> esp_pending_request_timeout))
+                {
+
+                    /* Deadline passed.  */
+                    expired[expired_count++] = *request_ptr;
+                    request_ptr -> esp_pending_request_id = 0;
+                }
+                else if ((next_deadline == 0) || (remaining < next_deadline))
+                {
+
+                    /* Remember the closest deadline still ahead.  */
+                    next_deadline = remaining;
+                }
+            }
+
+            /* Release the message type mutex.  */
+            xSemaphoreGive(metadata -> esp_azure_iot_hub_client_message_mutex_ptr);
+
+            if (expired_count)
+            {
+                break;
+            }
+        }
+
+        /* Release the mutex.  */
+        xSemaphoreGive(esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr);
+
+        for (i = 0; i < expired_count; i++)
+        {
+            esp_azure_iot_hub_client_pending_request_complete(hub_client_ptr, &expired[i], ESP_AZURE_IOT_NO_PACKET, 0, NULL);
+        }
+    } while (expired_count);
+
+    if (next_deadline)
+    {
+        esp_azure_iot_event_group_timer_set(&(esp_azure_iot_ptr -> esp_azure_iot_event_group), next_deadline);
+    }
+}
+
+/* Fail every pending request, waiting threads are woken and remove their own entry.  */
+static void esp_azure_iot_hub_client_pending_request_abort(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr)
+{
+ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA *metadata = &(hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata);
+ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST *request_ptr;
+ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST aborted[ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST_MAX];
+uint32_t aborted_count = 0;
+uint32_t i;
+
+    /* Obtain the message type mutex.  */
+    xSemaphoreTake(metadata -> esp_azure_iot_hub_client_message_mutex_ptr, portMAX_DELAY);
+
+    for (i = 0; i < ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST_MAX; i++)
+    {
+        request_ptr = &(hub_client_ptr -> esp_azure_iot_hub_client_pending_requests[i]);
+        if (request_ptr -> esp_pending_request_id == 0)
+        {
+            continue;
+        }
+
+        if (request_ptr -> esp_pending_request_thread_list_ptr)
+        {
+            esp_azure_iot_thread_wait_abort(request_ptr -> esp_pending_request_thread_list_ptr -> esp_azure_iot_thread_ptr);
+        }
+        else
+        {
+            aborted[aborted_count++] = *request_ptr;
+            request_ptr -> esp_pending_request_id = 0;
+        }
+    }
+
+    /* Patches being merged are failed along with their entries.  */
+    hub_client_ptr -> esp_azure_iot_hub_client_reported_properties_merge.esp_reported_merge_request_id = 0;
+    hub_client_ptr -> esp_azure_iot_hub_client_reported_properties_merge.esp_reported_merge_length = 0;
+
+    /* Release the message type mutex.  */
+    xSemaphoreGive(metadata -> esp_azure_iot_hub_client_message_mutex_ptr);
+
+    for (i = 0; i < aborted_count; i++)
+    {
+        esp_azure_iot_hub_client_pending_request_complete(hub_client_ptr, &aborted[i], ESP_AZURE_IOT_DISCONNECTED, 0, NULL);
+    }
+}
+
+/* Take every entry of a request out of the table, patches merged together share their $rid.  */
+static uint32_t esp_azure_iot_hub_client_pending_request_take(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                         uint32_t request_id, uint32_t message_type,
+                                                         ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST *requests)
+{
+ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST *request_ptr;
+uint32_t count = 0;
+uint32_t i;
+
+    for (i = 0; i < ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST_MAX; i++)
+    {
+        request_ptr = &(hub_client_ptr -> esp_azure_iot_hub_client_pending_requests[(request_id + i) % ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST_MAX]);
+        if ((request_ptr -> esp_pending_request_id == request_id) &&
+            (request_ptr -> esp_pending_request_message_type == message_type))
+        {
+            requests[count++] = *request_ptr;
+            request_ptr -> esp_pending_request_id = 0;
+        }
+    }
+
+    return(count);
+}
+
+/* Complete every callback of a request that could not be sent, must be called without any mutex held.  */
+static void esp_azure_iot_hub_client_pending_request_fail(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                         uint32_t request_id, uint32_t status)
+{
+ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA *metadata = &(hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata);
+ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST requests[ESP_AZURE_IOT_HUB_CLIENT_PENDING_REQUEST_MAX];
+uint32_t count;
+uint32_t i;
+
+    /* Obtain the message type mutex.  */
+    xSemaphoreTake(metadata -> esp_azure_iot_hub_client_message_mutex_ptr, portMAX_DELAY);
+
+    count = esp_azure_iot_hub_client_pending_request_take(hub_client_ptr, request_id,
+                                                         ESP_AZURE_IOT_HUB_DEVICE_TWIN_REPORTED_PROPERTIES_RESPONSE,
+                                                         requests);
+
+    /* Release the message type mutex.  */
+    xSemaphoreGive(metadata -> esp_azure_iot_hub_client_message_mutex_ptr);
+
+    for (i = 0; i < count; i++)
+    {
+        esp_azure_iot_hub_client_pending_request_complete(hub_client_ptr, &requests[i], status, 0, NULL);
+    }
+}
+
+/* Merge a reported properties patch into the pending one, publishing that first when both do not fit together.  */
+static uint32_t esp_azure_iot_hub_client_reported_properties_merge(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                              uint8_t *message_buffer, uint32_t message_length,
+                                                              uint32_t timeout,
+                                                              void (*callback_ptr)(
+                                                                    ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                    uint32_t request_id, uint32_t status,
+                                                                    uint32_t response_status, ESP_PACKET *packet_ptr,
+                                                                    void *args),
+                                                              void *callback_args, uint32_t *request_id_ptr,
+                                                              uint32_t wait_option)
+{
+ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA *metadata = &(hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata);
+ESP_AZURE_IOT_HUB_CLIENT_REPORTED_PROPERTIES_MERGE *merge_ptr = &(hub_client_ptr -> esp_azure_iot_hub_client_reported_properties_merge);
+uint32_t status;
+uint32_t request_id;
+uint32_t window;
+uint32_t pending_length;
+az_span pending_span;
+az_span merged_span;
+az_result core_result;
+
+    if (metadata -> esp_azure_iot_hub_client_message_process == NULL)
+    {
+        LogError("IoTHub client reported properties merge fail: NOT ENABLED");
+        return(ESP_AZURE_IOT_NOT_ENABLED);
+    }
+
+    for (;;)
+    {
+        window = 0;
+
+        /* Obtain the message type mutex.  */
+        xSemaphoreTake(metadata -> esp_azure_iot_hub_client_message_mutex_ptr, portMAX_DELAY);
+
+        if (merge_ptr -> esp_reported_merge_window == 0)
+        {
+
+            /* Merging was disabled meanwhile.  */
+            xSemaphoreGive(metadata -> esp_azure_iot_hub_client_message_mutex_ptr);
+            return(esp_azure_iot_hub_client_device_twin_request_async(hub_client_ptr,
+                                                                     esp_azure_iot_hub_client_request_id_next(hub_client_ptr, 1),
+                                                                     ESP_AZURE_IOT_HUB_DEVICE_TWIN_REPORTED_PROPERTIES_RESPONSE,
+                                                                     message_buffer, message_length, timeout,
+                                                                     callback_ptr, callback_args, request_id_ptr, wait_option));
+        }
+
+        /* Build the merged patch in the spare buffer, so a failed merge leaves the pending one intact.  */
+        if (merge_ptr -> esp_reported_merge_length)
+        {
+            pending_span = az_span_init(merge_ptr -> esp_reported_merge_buffer[merge_ptr -> esp_reported_merge_index],
+                                        (int32_t)merge_ptr -> esp_reported_merge_length);
+        }
+        else
+        {
+            pending_span = AZ_SPAN_FROM_STR(ESP_AZURE_IOT_HUB_CLIENT_EMPTY_JSON);
+        }
+        merged_span = az_span_init(merge_ptr -> esp_reported_merge_buffer[merge_ptr -> esp_reported_merge_index ^ 1],
+                                   ESP_AZURE_IOT_HUB_CLIENT_REPORTED_PROPERTIES_MERGE_SIZE);
+        core_result = esp_azure_iot_hub_client_json_merge(pending_span,
+                                                         az_span_init(message_buffer, (int32_t)message_length),
+                                                         &merged_span);
+        if (az_succeeded(core_result))
+        {
+            request_id = merge_ptr -> esp_reported_merge_request_id;
+            if (request_id == 0)
+            {
+
+                /* Generate odd request id for reported properties send */
+                request_id = esp_azure_iot_hub_client_request_id_next(hub_client_ptr, 1);
+            }
+
+            status = esp_azure_iot_hub_client_pending_request_add(hub_client_ptr, request_id,
+                                                                 ESP_AZURE_IOT_HUB_DEVICE_TWIN_REPORTED_PROPERTIES_RESPONSE,
+                                                                 timeout, NULL, callback_ptr, callback_args);
+            if (status == ESP_AZURE_IOT_SUCCESS)
+            {
+                if (merge_ptr -> esp_reported_merge_request_id == 0)
+                {
+
+                    /* First patch of the window.  */
+                    merge_ptr -> esp_reported_merge_request_id = request_id;
+                    merge_ptr -> esp_reported_merge_first_tick = (uint32_t)xTaskGetTickCount();
+                    window = merge_ptr -> esp_reported_merge_window;
+                }
+
+                merge_ptr -> esp_reported_merge_index ^= 1;
+                merge_ptr -> esp_reported_merge_length = ESP_AZURE_IOT_HUB_CLIENT_REPORTED_PROPERTIES_MERGE_SIZE -
+                                                         (uint32_t)az_span_size(merged_span);
+            }
+
+            /* Release the message type mutex.  */
+            xSemaphoreGive(metadata -> esp_azure_iot_hub_client_message_mutex_ptr);
+
+            if (status)
+            {
+                LogError("IoTHub client reported properties merge fail: TOO MANY PENDING REQUESTS");
+                return(status);
+            }
+
+            /* Wake the internal thread when the window expires.  */
+            if (window)
+            {
+                esp_azure_iot_event_group_timer_set(&(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_event_group), window);
+            }
+
+            if (request_id_ptr)
+            {
+                *request_id_ptr = request_id;
+            }
+
+            return(ESP_AZURE_IOT_SUCCESS);
+        }
+
+        pending_length = merge_ptr -> esp_reported_merge_length;
+
+        /* Release the message type mutex.  */
+        xSemaphoreGive(metadata -> esp_azure_iot_hub_client_message_mutex_ptr);
+
+        if (core_result != AZ_ERROR_INSUFFICIENT_SPAN_SIZE)
+        {
+            LogError("IoTHub client reported properties merge fail: INVALID JSON OBJECT");
+            return(ESP_AZURE_IOT_INVALID_PARAMETER);
+        }
+
+        if (pending_length == 0)
+        {
+            LogError("IoTHub client reported properties merge fail: MESSAGE TOO LONG");
+            return(ESP_AZURE_IOT_MESSAGE_TOO_LONG);
+        }
+
+        /* The patch does not fit next to the pending ones, publish those first.  */
+        status = esp_azure_iot_hub_client_device_twin_reported_properties_merge_flush(hub_client_ptr, wait_option);
+        if (status)
+        {
+            return(status);
+        }
+    }
+}
+
+/* Take the pending merged patch out into buffer_ptr, must be called with the device twin mutex held.
+   Returns its $rid, or zero when no patch is pending.  */
+static uint32_t esp_azure_iot_hub_client_reported_properties_merge_detach(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                     uint8_t *buffer_ptr, uint32_t buffer_size,
+                                                                     uint32_t *length_ptr)
+{
+ESP_AZURE_IOT_HUB_CLIENT_REPORTED_PROPERTIES_MERGE *merge_ptr = &(hub_client_ptr -> esp_azure_iot_hub_client_reported_properties_merge);
+uint32_t request_id = merge_ptr -> esp_reported_merge_request_id;
+
+    if (request_id == 0)
+    {
+        return(0);
+    }
+
+    /* A patch larger than the buffer is reported by the publish.  */
+    *length_ptr = merge_ptr -> esp_reported_merge_length;
+    if (*length_ptr <= buffer_size)
+    {
+        memcpy(buffer_ptr, merge_ptr -> esp_reported_merge_buffer[merge_ptr -> esp_reported_merge_index], *length_ptr);
+    }
+
+    merge_ptr -> esp_reported_merge_request_id = 0;
+    merge_ptr -> esp_reported_merge_length = 0;
+
+    return(request_id);
+}
+
+/* Publish a detached merged patch and release its buffer, failing its callbacks if it could not be sent.  */
+static uint32_t esp_azure_iot_hub_client_reported_properties_merge_publish(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                      uint32_t request_id, uint8_t *buffer_ptr,
+                                                                      uint32_t length, void *buffer_context,
+                                                                      uint32_t wait_option)
+{
+uint32_t status;
+uint32_t buffer_size = (uint32_t)(((ESP_PACKET *)buffer_context) -> esp_packet_data_end - buffer_ptr);
+
+    if (length > buffer_size)
+    {
+        status = ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE;
+    }
+    else
+    {
+        status = esp_azure_iot_hub_client_device_twin_request_send(hub_client_ptr, request_id,
+                                                                  buffer_ptr, length, wait_option);
+    }
+    esp_azure_iot_buffer_free(buffer_context);
+
+    if (status)
+    {
+        LogError("IoTHub client reported properties merge publish fail: 0x%02x", status);
+        esp_azure_iot_hub_client_pending_request_fail(hub_client_ptr, request_id, status);
+    }
+
+    return(status);
+}
+
+/* Publish the merged patches whose window expired and re-arm the timer for the rest.  */
+static void esp_azure_iot_hub_client_reported_properties_merge_process(ESP_AZURE_IOT *esp_azure_iot_ptr)
+{
+ESP_AZURE_IOT_RESOURCE *resource_ptr;
+ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr;
+ESP_AZURE_IOT_HUB_CLIENT *due_hub_client_ptr;
+ESP_AZURE_IOT_HUB_CLIENT_RECEIVE_MESSAGE_METADATA *metadata;
+ESP_AZURE_IOT_HUB_CLIENT_REPORTED_PROPERTIES_MERGE *merge_ptr;
+uint32_t current_tick;
+uint32_t elapsed;
+uint32_t next_deadline;
+uint32_t request_id;
+uint32_t length;
+uint8_t *buffer_ptr;
+uint32_t buffer_size;
+void *buffer_context;
+
+    for (;;)
+    {
+        due_hub_client_ptr = NULL;
+        next_deadline = 0;
+        current_tick = (uint32_t)xTaskGetTickCount();
+
+        /* Obtain the mutex.  */
+        xSemaphoreTake(esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr, ESP_WAIT_FOREVER);
+
+        for (resource_ptr = esp_azure_iot_ptr -> esp_azure_iot_resource_list_header; resource_ptr;
+             resource_ptr = resource_ptr -> esp_azure_iot_resource_next)
+        {
+            if (resource_ptr -> esp_azure_iot_resource_type != ESP_AZURE_IOT_RESOURCE_IOT_HUB)
+            {
+                continue;
+            }
+
+            hub_client_ptr = (ESP_AZURE_IOT_HUB_CLIENT *)resource_ptr -> esp_azure_iot_resource_data_ptr;
+            metadata = &(hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata);
+            merge_ptr = &(hub_client_ptr -> esp_azure_iot_hub_client_reported_properties_merge);
+
+            /* Obtain the message type mutex.  */
+            xSemaphoreTake(metadata -> esp_azure_iot_hub_client_message_mutex_ptr, ESP_WAIT_FOREVER);
+
+            if (merge_ptr -> esp_reported_merge_request_id)
+            {
+                elapsed = current_tick - merge_ptr -> esp_reported_merge_first_tick;
+                if (elapsed >= merge_ptr -> esp_reported_merge_window)
+                {
+                    due_hub_client_ptr = hub_client_ptr;
+                }
+                else if ((next_deadline == 0) || ((merge_ptr -> esp_reported_merge_window - elapsed) < next_deadline))
+                {
+                    next_deadline = merge_ptr -> esp_reported_merge_window - elapsed;
+                }
+            }
+
+            /* Release the message type mutex.  */
+            xSemaphoreGive(metadata -> esp_azure_iot_hub_client_message_mutex_ptr);
+
+            if (due_hub_client_ptr)
+            {
+                break;
+            }
+        }
+
+        /* Release the mutex.  */
+        xSemaphoreGive(esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr);
+
+        if (due_hub_client_ptr == NULL)
+        {
+            break;
+        }
+
+        /* Allocate the payload without holding any mutex, then take the patch out.  */
+        if (esp_azure_iot_buffer_allocate(esp_azure_iot_ptr, &buffer_ptr, &buffer_size, &buffer_context))
+        {
+            LogError("IoTHub client reported properties merge publish fail: BUFFER ALLOCATE FAIL");
+            next_deadline = due_hub_client_ptr -> esp_azure_iot_hub_client_reported_properties_merge.esp_reported_merge_window;
+            break;
+        }
+
+        metadata = &(due_hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata);
+        xSemaphoreTake(metadata -> esp_azure_iot_hub_client_message_mutex_ptr, ESP_WAIT_FOREVER);
+        request_id = esp_azure_iot_hub_client_reported_properties_merge_detach(due_hub_client_ptr, buffer_ptr,
+                                                                              buffer_size, &length);
+        xSemaphoreGive(metadata -> esp_azure_iot_hub_client_message_mutex_ptr);
+
+        if (request_id == 0)
+        {
+            esp_azure_iot_buffer_free(buffer_context);
+            continue;
+        }
+
+        esp_azure_iot_hub_client_reported_properties_merge_publish(due_hub_client_ptr, request_id, buffer_ptr,
+                                                                  length, buffer_context, ESP_NO_WAIT);
+    }
+
+    if (next_deadline)
+    {
+        esp_azure_iot_event_group_timer_set(&(esp_azure_iot_ptr -> esp_azure_iot_event_group), next_deadline);
+    }
+}
+
+/* Return the raw text of the value the reader is on, moving the reader to its end.  */
+static az_result esp_azure_iot_hub_client_json_value_get(az_json_reader *reader_ptr, az_span *value_ptr)
+{
+uint8_t *start_ptr = az_span_ptr(reader_ptr -> token.slice);
+uint8_t *end_ptr;
+
+    /* String slices exclude their quotes.  */
+    if (reader_ptr -> token.kind == AZ_JSON_TOKEN_STRING)
+    {
+        start_ptr--;
+    }
+
+    AZ_RETURN_IF_FAILED(az_json_reader_skip_children(reader_ptr));
+
+    end_ptr = az_span_ptr(reader_ptr -> token.slice) + az_span_size(reader_ptr -> token.slice);
+    if (reader_ptr -> token.kind == AZ_JSON_TOKEN_STRING)
+    {
+        end_ptr++;
+    }
+
+    *value_ptr = az_span_init(start_ptr, (int32_t)(end_ptr - start_ptr));
+    return(AZ_OK);
+}
+
+/* Find the raw value of member name in a JSON object.  */
+static az_result esp_azure_iot_hub_client_json_member_find(az_span object, az_span name, az_span *value_ptr)
+{
+az_json_reader reader;
+uint32_t found;
+
+    AZ_RETURN_IF_FAILED(az_json_reader_init(&reader, object, NULL));
+    AZ_RETURN_IF_FAILED(az_json_reader_next_token(&reader));
+    if (reader.token.kind != AZ_JSON_TOKEN_BEGIN_OBJECT)
+    {
+        return(AZ_ERROR_UNEXPECTED_CHAR);
+    }
+
+    for (;;)
+    {
+        AZ_RETURN_IF_FAILED(az_json_reader_next_token(&reader));
+        if (reader.token.kind == AZ_JSON_TOKEN_END_OBJECT)
+        {
+            return(AZ_ERROR_ITEM_NOT_FOUND);
+        }
+
+        found = az_span_is_content_equal(reader.token.slice, name);
+        AZ_RETURN_IF_FAILED(az_json_reader_next_token(&reader));
+        AZ_RETURN_IF_FAILED(esp_azure_iot_hub_client_json_value_get(&reader, value_ptr));
+        if (found)
+        {
+            return(AZ_OK);
+        }
+    }
+}
+
+static az_result esp_azure_iot_hub_client_json_append(az_span *destination_ptr, az_span source)
+{
+    if (az_span_size(*destination_ptr) < az_span_size(source))
+    {
+        return(AZ_ERROR_INSUFFICIENT_SPAN_SIZE);
+    }
+
+    *destination_ptr = az_span_copy(*destination_ptr, source);
+    return(AZ_OK);
+}
+
+/* Write the JSON merge patch equivalent to applying patch after pending into destination_ptr, which is
+   advanced past the written text. Members of both are merged recursively when both values are objects,
+   otherwise the member of patch wins. Values are copied verbatim so escaped strings are kept as they are.  */
+static az_result esp_azure_iot_hub_client_json_merge(az_span pending, az_span patch, az_span *destination_ptr)
+{
+az_json_reader reader;
+az_span name;
+az_span value;
+az_span patch_value;
+az_result result;
+uint32_t first = 1;
+
+    AZ_RETURN_IF_FAILED(esp_azure_iot_hub_client_json_append(destination_ptr, AZ_SPAN_FROM_STR("{")));
+
+    /* Members of the pending patch, overridden or merged with those of the new one.  */
+    AZ_RETURN_IF_FAILED(az_json_reader_init(&reader, pending, NULL));
+    AZ_RETURN_IF_FAILED(az_json_reader_next_token(&reader));
+    for (;;)
+    {
+        AZ_RETURN_IF_FAILED(az_json_reader_next_token(&reader));
+        if (reader.token.kind == AZ_JSON_TOKEN_END_OBJECT)
+        {
+            break;
+        }
+
+        /* Keep the quotes around the name.  */
+        name = az_span_init(az_span_ptr(reader.token.slice) - 1, az_span_size(reader.token.slice) + 2);
+        AZ_RETURN_IF_FAILED(az_json_reader_next_token(&reader));
+        AZ_RETURN_IF_FAILED(esp_azure_iot_hub_client_json_value_get(&reader, &value));
+
+        if (!first)
+        {
+            AZ_RETURN_IF_FAILED(esp_azure_iot_hub_client_json_append(destination_ptr, AZ_SPAN_FROM_STR(",")));
+        }
+        first = 0;
+        AZ_RETURN_IF_FAILED(esp_azure_iot_hub_client_json_append(destination_ptr, name));
+        AZ_RETURN_IF_FAILED(esp_azure_iot_hub_client_json_append(destination_ptr, AZ_SPAN_FROM_STR(":")));
+
+        result = esp_azure_iot_hub_client_json_member_find(patch, az_span_slice(name, 1, az_span_size(name) - 1),
+                                                           &patch_value);
+        if (result == AZ_ERROR_ITEM_NOT_FOUND)
+        {
+            AZ_RETURN_IF_FAILED(esp_azure_iot_hub_client_json_append(destination_ptr, value));
+        }
+        else if (az_failed(result))
+        {
+            return(result);
+        }
+        else if ((az_span_ptr(value)[0] == '{') && (az_span_ptr(patch_value)[0] == '{'))
+        {
+            AZ_RETURN_IF_FAILED(esp_azure_iot_hub_client_json_merge(value, patch_value, destination_ptr));
+        }
+        else
+        {
+            AZ_RETURN_IF_FAILED(esp_azure_iot_hub_client_json_append(destination_ptr, patch_value));
+        }
+    }
+
+    /* Members only the new patch has.  */
+    AZ_RETURN_IF_FAILED(az_json_reader_init(&reader, patch, NULL));
+    AZ_RETURN_IF_FAILED(az_json_reader_next_token(&reader));
+    if (reader.token.kind != AZ_JSON_TOKEN_BEGIN_OBJECT)
+    {
+        return(AZ_ERROR_UNEXPECTED_CHAR);
+    }
+
+    for (;;)
+    {
+        AZ_RETURN_IF_FAILED(az_json_reader_next_token(&reader));
+        if (reader.token.kind == AZ_JSON_TOKEN_END_OBJECT)
+        {
+            break;
+        }
+
+        name = az_span_init(az_span_ptr(reader.token.slice) - 1, az_span_size(reader.token.slice) + 2);
+        AZ_RETURN_IF_FAILED(az_json_reader_next_token(&reader));
+        AZ_RETURN_IF_FAILED(esp_azure_iot_hub_client_json_value_get(&reader, &patch_value));
+
+        result = esp_azure_iot_hub_client_json_member_find(pending, az_span_slice(name, 1, az_span_size(name) - 1),
+                                                           &value);
+        if (az_succeeded(result))
+        {
+            continue;
+        }
+        else if (result != AZ_ERROR_ITEM_NOT_FOUND)
+        {
+            return(result);
+        }
+
+        if (!first)
+        {
+            AZ_RETURN_IF_FAILED(esp_azure_iot_hub_client_json_append(destination_ptr, AZ_SPAN_FROM_STR(",")));
+        }
+        first = 0;
+        AZ_RETURN_IF_FAILED(esp_azure_iot_hub_client_json_append(destination_ptr, name));
+        AZ_RETURN_IF_FAILED(esp_azure_iot_hub_client_json_append(destination_ptr, AZ_SPAN_FROM_STR(":")));
+        AZ_RETURN_IF_FAILED(esp_azure_iot_hub_client_json_append(destination_ptr, patch_value));
+    }
+
+    return(esp_azure_iot_hub_client_json_append(destination_ptr, AZ_SPAN_FROM_STR("}")));
+}
+
+static uint32_t esp_azure_iot_hub_client_sas_token_get(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                  size_t expiry_time_secs, uint8_t *key, uint32_t key_len,
+                                                  uint8_t *sas_buffer, uint32_t sas_buffer_len, uint32_t *sas_length)
+{
+    uint8_t buffer[ESP_AZURE_IOT_HUB_CLIENT_SAS_SCRATCH_SIZE];
+    az_span span = az_span_init(sas_buffer, (int16_t)sas_buffer_len);
+    az_span buffer_span;
+    uint32_t status;
+    uint8_t *output_ptr;
+    uint32_t output_len;
+    az_result core_result;
+
+    /* The key state was prepared when the key was set.  */
+    ESP_PARAMETER_NOT_USED(key);
+    ESP_PARAMETER_NOT_USED(key_len);
+
+    core_result = az_iot_hub_client_sas_get_signature(&(hub_client_ptr -> iot_hub_client_core),
+                                                      expiry_time_secs, span, &span);
+    if (az_failed(core_result))
+    {
+        LogError("IoTHub failed failed to get signature with error : 0x%08x", core_result);
+        return(ESP_AZURE_IOT_SDK_CORE_ERROR);
+    }
+
+    status = esp_azure_iot_url_encoded_hmac_sha256_keyed_calculate(&(hub_client_ptr -> esp_azure_iot_hub_client_symmetric_key_hmac),
+                                                                  az_span_ptr(span), (uint32_t)az_span_size(span),
+                                                                  buffer, sizeof(buffer), &output_ptr, &output_len);
+    if (status)
+    {
+        LogError("IoTHub failed to encoded hash");
+        return(status);
+    }
+
+    buffer_span = az_span_init(output_ptr, (int16_t)output_len);
+    core_result= az_iot_hub_client_sas_get_password(&(hub_client_ptr -> iot_hub_client_core),
+                                                    buffer_span, expiry_time_secs, AZ_SPAN_NULL,
+                                                    (char *)sas_buffer, sas_buffer_len, &sas_buffer_len);
+    if (az_failed(core_result))
+    {
+        LogError("IoTHub failed to generate token with error : 0x%08x", core_result);
+        return(ESP_AZURE_IOT_SDK_CORE_ERROR);
+    }
+
+    *sas_length = sas_buffer_len;
+
+    return(ESP_AZURE_IOT_SUCCESS );
+}
+
+/* Pick the unix time the current token is renewed at. Must be called with the instance mutex held.  */
+static void esp_azure_iot_hub_client_token_renew_schedule(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr)
+{
+size_t issue_time;
+size_t lifetime;
+size_t renew_after;
+
+    /* Only tokens the client generated itself can be renewed.  */
+    if ((hub_client_ptr -> esp_azure_iot_hub_client_token_refresh == NULL) ||
+        (hub_client_ptr -> esp_azure_iot_hub_client_token_expiry == 0))
+    {
+        hub_client_ptr -> esp_azure_iot_hub_client_token_renew_time = 0;
+        return;
+    }
+
+    lifetime = ESP_AZURE_IOT_HUB_CLIENT_TOKEN_EXPIRY;
+    issue_time = hub_client_ptr -> esp_azure_iot_hub_client_token_expiry - lifetime;
+
+    /* Renew ahead of the margin, moved earlier by a random share of the jitter so a fleet
+       connected at the same moment does not renew at the same moment.  */
+    if (lifetime > (ESP_AZURE_IOT_HUB_CLIENT_TOKEN_RENEW_MARGIN + ESP_AZURE_IOT_HUB_CLIENT_TOKEN_RENEW_JITTER))
+    {
+        renew_after = lifetime - ESP_AZURE_IOT_HUB_CLIENT_TOKEN_RENEW_MARGIN -
+                      (esp_random() % (ESP_AZURE_IOT_HUB_CLIENT_TOKEN_RENEW_JITTER + 1));
     }
-    
-    status = esp_azure_iot_hub_client_receive_thread_find(hub_client_ptr,
-                                                         packet_ptr,
-                                                         ESP_AZURE_IOT_HUB_DIRECT_METHOD,
-                                                         0, &thread_list_ptr);
-    if (status == ESP_AZURE_IOT_SUCCESS)
+    else
     {
-        esp_azure_iot_thread_wait_abort(thread_list_ptr -> esp_azure_iot_thread_ptr);
-        return(ESP_AZURE_IOT_SUCCESS);
+        renew_after = lifetime / 2;
     }
 
-    /* No thread is waiting for direct method message yet. */
-    esp_azure_iot_hub_client_message_notify(hub_client_ptr,
-                                           &(hub_client_ptr -> esp_azure_iot_hub_client_direct_method_metadata),
-                                           packet_ptr);
+    hub_client_ptr -> esp_azure_iot_hub_client_token_renew_time = issue_time + renew_after;
+    esp_azure_iot_hub_client_token_renew_timer_set(hub_client_ptr -> esp_azure_iot_ptr, renew_after);
+}
 
-    return(ESP_AZURE_IOT_SUCCESS );
+static void esp_azure_iot_hub_client_token_renew_timer_set(ESP_AZURE_IOT *esp_azure_iot_ptr, size_t seconds)
+{
+size_t seconds_max = (portMAX_DELAY / 2) / configTICK_RATE_HZ;
+
+    /* Far deadlines are approached in steps, the timer is re-armed each time it fires.  */
+    if (seconds > seconds_max)
+    {
+        seconds = seconds_max;
+    }
+
+    esp_azure_iot_event_group_timer_set(&(esp_azure_iot_ptr -> esp_azure_iot_event_group),
+                                        (TickType_t)(seconds * configTICK_RATE_HZ));
 }
 
-static uint32_t esp_azure_iot_hub_client_device_twin_message_type_get(az_iot_hub_client_twin_response *out_twin_response_ptr,
-                                                                 uint32_t request_id)
+static void esp_azure_iot_hub_client_token_renew_process(ESP_AZURE_IOT *esp_azure_iot_ptr)
 {
-uint32_t mesg_type;
+ESP_AZURE_IOT_RESOURCE *resource_ptr;
+ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr;
+ESP_AZURE_IOT_HUB_CLIENT *due_client_ptr;
+size_t current_time;
+size_t renew_time;
+size_t next_renew;
 
-    switch (out_twin_response_ptr -> response_type)
+    do
     {
-        case AZ_IOT_CLIENT_TWIN_RESPONSE_TYPE_GET :
-        /* fall through */
-        case AZ_IOT_CLIENT_TWIN_RESPONSE_TYPE_REPORTED_PROPERTIES :
+        due_client_ptr = NULL;
+        next_renew = 0;
+
+        /* Obtain the mutex.  */
+        xSemaphoreTake(esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr, ESP_WAIT_FOREVER);
+
+        if (esp_azure_iot_unix_time_get(esp_azure_iot_ptr, &current_time))
         {
-            /* odd requests are of reported properties and even of twin properties*/
-            mesg_type = request_id % 2 == 0 ? ESP_AZURE_IOT_HUB_DEVICE_TWIN_PROPERTIES :
-                        ESP_AZURE_IOT_HUB_DEVICE_TWIN_REPORTED_PROPERTIES_RESPONSE;
+
+            /* Release the mutex.  */
+            xSemaphoreGive(esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr);
+            return;
         }
-        break;
 
-        case AZ_IOT_CLIENT_TWIN_RESPONSE_TYPE_DESIRED_PROPERTIES :
+        /* Take out the first hub client whose token is due.  */
+        for (resource_ptr = esp_azure_iot_ptr -> esp_azure_iot_resource_list_header; resource_ptr;
+             resource_ptr = resource_ptr -> esp_azure_iot_resource_next)
         {
-            mesg_type = ESP_AZURE_IOT_HUB_DEVICE_TWIN_DESIRED_PROPERTIES;
+            if (resource_ptr -> esp_azure_iot_resource_type != ESP_AZURE_IOT_RESOURCE_IOT_HUB)
+            {
+                continue;
+            }
+
+            hub_client_ptr = (ESP_AZURE_IOT_HUB_CLIENT *)resource_ptr -> esp_azure_iot_resource_data_ptr;
+            renew_time = hub_client_ptr -> esp_azure_iot_hub_client_token_renew_time;
+            if (renew_time == 0)
+            {
+                continue;
+            }
+
+            if (current_time >= renew_time)
+            {
+
+                /* A session that is not up is given a fresh token when it connects again.  */
+                hub_client_ptr -> esp_azure_iot_hub_client_token_renew_time = 0;
+                if (hub_client_ptr -> esp_azure_iot_hub_client_state == ESP_AZURE_IOT_HUB_CLIENT_STATUS_CONNECTED)
+                {
+                    due_client_ptr = hub_client_ptr;
+                    break;
+                }
+            }
+
+            /* Remember the closest renewal still ahead.  */
+            else if ((next_renew == 0) || ((renew_time - current_time) < next_renew))
+            {
+                next_renew = renew_time - current_time;
+            }
         }
-        break;
 
-        default :
+        /* Release the mutex.  */
+        xSemaphoreGive(esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr);
+
+        /* Re-arm the timer for tokens that are not due yet, once no token is left to renew.  */
+        if ((due_client_ptr == NULL) && next_renew)
         {
-            mesg_type = ESP_AZURE_IOT_HUB_NONE;
+            esp_azure_iot_hub_client_token_renew_timer_set(esp_azure_iot_ptr, next_renew);
         }
-    }
 
-    return mesg_type;
+        if (due_client_ptr)
+        {
+            esp_azure_iot_hub_client_token_renew(due_client_ptr, current_time);
+        }
+    } while (due_client_ptr);
 }
 
-static uint32_t esp_azure_iot_hub_client_device_twin_process(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
-                                                        ESP_PACKET *packet_ptr,
-                                                        size_t topic_offset,
-                                                        uint16_t topic_length)
+/* Generate a new token and log the running MQTT session in again with it, current_time is when the renewal was found due.  */
+static void esp_azure_iot_hub_client_token_renew(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr, size_t current_time)
 {
-ESP_AZURE_IOT_THREAD_LIST *thread_list_ptr = NULL;
-uint32_t message_type;
-uint32_t request_id;
-uint32_t correlation_id;
 uint32_t status;
+ESP_AZURE_IOT_RESOURCE *resource_ptr = &(hub_client_ptr -> esp_azure_iot_hub_client_resource);
+uint8_t *buffer_ptr;
+uint32_t buffer_size;
+void *buffer_context;
+uint32_t buffer_length;
+uint32_t sas_length;
 az_result core_result;
-az_span topic_span;
-az_iot_hub_client_twin_response out_twin_response;
-
-    /* This function is protected by MQTT mutex. */
 
-    /* Check message type first. */
-    topic_span = az_span_init(&(packet_ptr -> esp_packet_prepend_ptr[topic_offset]), (int16_t)topic_length);
-    core_result = az_iot_hub_client_twin_parse_received_topic(&(hub_client_ptr -> iot_hub_client_core),
-                                                              topic_span, &out_twin_response);
-    if (az_failed(core_result))
+    /* Allocate buffer for user name and sas token.  */
+    status = esp_azure_iot_buffer_allocate(hub_client_ptr -> esp_azure_iot_ptr,
+                                          &buffer_ptr, &buffer_size, &buffer_context);
+    if (status)
     {
-        /* Topic name does not match device twin format. */
-            return(ESP_AZURE_IOT_NOT_FOUND);
+        LogError("IoTHub client token renew fail: BUFFER ALLOCATE FAIL");
+        buffer_context = NULL;
     }
 
-    if (az_span_ptr(out_twin_response.request_id)) {
-        core_result = az_span_atou32(out_twin_response.request_id, &request_id);
+    /* Obtain the mutex.  */
+    xSemaphoreTake(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr, portMAX_DELAY);
+
+    /* Build user name.  */
+    if (status == ESP_AZURE_IOT_SUCCESS)
+    {
+        buffer_length = buffer_size;
+        core_result = az_iot_hub_client_get_user_name(&hub_client_ptr -> iot_hub_client_core,
+                                                      (char *)buffer_ptr, buffer_length, &buffer_length);
         if (az_failed(core_result))
         {
-            /* Topic name does not match device twin format. */
-            return(ESP_AZURE_IOT_NOT_FOUND);
+            LogError("IoTHub client token renew fail, with error 0x%08x", core_result);
+            status = ESP_AZURE_IOT_SDK_CORE_ERROR;
         }
     }
 
-    message_type = esp_azure_iot_hub_client_device_twin_message_type_get(&out_twin_response, request_id);
-    if (message_type == ESP_AZURE_IOT_HUB_DEVICE_TWIN_REPORTED_PROPERTIES_RESPONSE)
+    /* Build sas token.  */
+    if (status == ESP_AZURE_IOT_SUCCESS)
     {
-        /* only requested thread should be woken*/
-        correlation_id = request_id;
+        status = hub_client_ptr -> esp_azure_iot_hub_client_token_refresh(hub_client_ptr,
+                                                                         current_time + ESP_AZURE_IOT_HUB_CLIENT_TOKEN_EXPIRY,
+                                                                         hub_client_ptr -> esp_azure_iot_hub_client_symmetric_key,
+                                                                         hub_client_ptr -> esp_azure_iot_hub_client_symmetric_key_length,
+                                                                         buffer_ptr + buffer_length, buffer_size - buffer_length,
+                                                                         &sas_length);
     }
-    else
+
+    /* The MQTT client keeps its own copy of the login, the buffer is released below.  */
+    if (status == ESP_AZURE_IOT_SUCCESS)
     {
-        /* any thread can be woken*/
-        correlation_id = 0;
+        status = esp_azure_iot_mqtt_client_login_set(&(resource_ptr -> esp_azure_iot_mqtt),
+                                                     (char *)buffer_ptr, buffer_length,
+                                                     (char *)(buffer_ptr + buffer_length), sas_length);
     }
 
-    status = esp_azure_iot_hub_client_receive_thread_find(hub_client_ptr,
-                                                         packet_ptr,
-                                                         message_type,
-                                                         correlation_id, &thread_list_ptr);
+    /* Release the mutex.  */
+    xSemaphoreGive(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr);
+
+    /* Drop the MQTT session and open it again with the new password. Messages published meanwhile wait in the
+       MQTT client outbox, but the broker may have dropped the subscriptions, so they are made again.  */
     if (status == ESP_AZURE_IOT_SUCCESS)
     {
-        thread_list_ptr -> esp_azure_iot_thread_response_status = (uint32_t)out_twin_response.status;
-        esp_azure_iot_thread_wait_abort(thread_list_ptr -> esp_azure_iot_thread_ptr);
-        return(ESP_AZURE_IOT_SUCCESS);
+        status = esp_azure_iot_mqtt_client_login_update(&(resource_ptr -> esp_azure_iot_mqtt),
+                                                        ESP_AZURE_IOT_HUB_CLIENT_TOKEN_RENEW_RECONNECT_TIMEOUT);
     }
 
-    switch(message_type)
+    if (status == ESP_AZURE_IOT_SUCCESS)
     {
-        case ESP_AZURE_IOT_HUB_DEVICE_TWIN_REPORTED_PROPERTIES_RESPONSE :
-        {
-            if (hub_client_ptr -> esp_azure_iot_hub_client_report_properties_response_callback)
-            {
-                hub_client_ptr -> esp_azure_iot_hub_client_report_properties_response_callback(hub_client_ptr,
-                                                                                              request_id,
-                                                                                              out_twin_response.status,
-                                                                                              hub_client_ptr -> esp_azure_iot_hub_client_report_properties_response_callback_args);
-            }
-
-            esp_azure_iot_packet_release(packet_ptr);
-        }
-        break;
-
-        case ESP_AZURE_IOT_HUB_DEVICE_TWIN_PROPERTIES :
-        {
-
-            /* No thread is waiting for device twin message yet. */
-            esp_azure_iot_hub_client_message_notify(hub_client_ptr,
-                                                   &(hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata),
-                                                   packet_ptr);
-        }
-        break;
-
-        case ESP_AZURE_IOT_HUB_DEVICE_TWIN_DESIRED_PROPERTIES :
-        {
-            /* No thread is waiting for device twin message yet. */
-            esp_azure_iot_hub_client_message_notify(hub_client_ptr,
-                                                   &(hub_client_ptr -> esp_azure_iot_hub_client_device_twin_desired_properties_metadata),
-                                                   packet_ptr);
-        }
-        break;
-
-        default :
-            esp_azure_iot_packet_release(packet_ptr);
+        status = esp_azure_iot_hub_client_subscriptions_restore(hub_client_ptr);
     }
 
-    return(ESP_AZURE_IOT_SUCCESS);
-}
+    /* Obtain the mutex.  */
+    xSemaphoreTake(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr, portMAX_DELAY);
 
-static void esp_azure_iot_hub_client_thread_dequeue(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
-                                                   ESP_AZURE_IOT_THREAD_LIST *thread_list_ptr)
-{
-    ESP_AZURE_IOT_THREAD_LIST *thread_list_prev = NULL;
-    ESP_AZURE_IOT_THREAD_LIST *thread_list_current;
+    if (status)
+    {
+        LogError("IoTHub client token renew fail: 0x%02x", status);
 
-    for (thread_list_current = hub_client_ptr -> esp_azure_iot_hub_client_thread_suspended;
-         thread_list_current;
-         thread_list_current = thread_list_current -> esp_azure_iot_thread_next)
+        /* Try again shortly, the current token is still valid for the renewal margin.  */
+        hub_client_ptr -> esp_azure_iot_hub_client_token_renew_time = current_time + ESP_AZURE_IOT_HUB_CLIENT_TOKEN_RENEW_RETRY;
+        esp_azure_iot_hub_client_token_renew_timer_set(hub_client_ptr -> esp_azure_iot_ptr, ESP_AZURE_IOT_HUB_CLIENT_TOKEN_RENEW_RETRY);
+    }
+    else
     {
-        if (thread_list_current == thread_list_ptr)
-        {
+        hub_client_ptr -> esp_azure_iot_hub_client_token_expiry = current_time + ESP_AZURE_IOT_HUB_CLIENT_TOKEN_EXPIRY;
+        esp_azure_iot_hub_client_token_renew_schedule(hub_client_ptr);
+    }
 
-            /* Found the thread to dequeue. */
-            if (thread_list_prev == NULL)
-            {
-                hub_client_ptr -> esp_azure_iot_hub_client_thread_suspended = thread_list_current -> esp_azure_iot_thread_next;
-            }
-            else
-            {
-                thread_list_prev -> esp_azure_iot_thread_next = thread_list_current -> esp_azure_iot_thread_next;
-            }
-            break;
-        }
+    /* Release the mutex.  */
+    xSemaphoreGive(hub_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr);
 
-        thread_list_prev = thread_list_current;
+    if (buffer_context)
+    {
+        esp_azure_iot_buffer_free(buffer_context);
     }
-}   
+}
 
-static uint32_t esp_azure_iot_hub_client_sas_token_get(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
-                                                  size_t expiry_time_secs, uint8_t *key, uint32_t key_len,
-                                                  uint8_t *sas_buffer, uint32_t sas_buffer_len, uint32_t *sas_length)
+/* Subscribe again to the topics of the features enabled, a feature is enabled while its message process is set.  */
+static uint32_t esp_azure_iot_hub_client_subscriptions_restore(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr)
 {
-    uint8_t *buffer_ptr;
-    uint32_t buffer_size;
-    void *buffer_context;
-    az_span span = az_span_init(sas_buffer, (int16_t)sas_buffer_len);
-    az_span buffer_span;
-    uint32_t status;
-    uint8_t *output_ptr;
-    uint32_t output_len;
-    az_result core_result;
+ESP_MQTT_CLIENT *mqtt_client_ptr = &(hub_client_ptr -> esp_azure_iot_hub_client_resource.esp_azure_iot_mqtt);
+uint32_t status = ESP_AZURE_IOT_SUCCESS;
 
-    status = esp_azure_iot_buffer_allocate(hub_client_ptr -> esp_azure_iot_ptr, &buffer_ptr, &buffer_size, &buffer_context);
-    if (status)
+    if (hub_client_ptr -> esp_azure_iot_hub_client_c2d_message_metadata.esp_azure_iot_hub_client_message_process)
     {
-        LogError("IoTProvisioning client connect fail: BUFFER ALLOCATE FAIL");
-        return(status);
+        status = esp_azure_iot_mqtt_client_subscribe(mqtt_client_ptr, AZ_IOT_HUB_CLIENT_C2D_SUBSCRIBE_TOPIC,
+                                                     sizeof(AZ_IOT_HUB_CLIENT_C2D_SUBSCRIBE_TOPIC) - 1,
+                                                     ESP_AZURE_IOT_MQTT_QOS_1);
     }
 
-    core_result = az_iot_hub_client_sas_get_signature(&(hub_client_ptr -> iot_hub_client_core),
-                                                      expiry_time_secs, span, &span);
-    if (az_failed(core_result))
+    if ((status == ESP_AZURE_IOT_SUCCESS) &&
+        hub_client_ptr -> esp_azure_iot_hub_client_device_twin_metadata.esp_azure_iot_hub_client_message_process)
     {
-        LogError("IoTHub failed failed to get signature with error : 0x%08x", core_result);
-        esp_azure_iot_buffer_free(buffer_context);
-        return(ESP_AZURE_IOT_SDK_CORE_ERROR);
+        status = esp_azure_iot_mqtt_client_subscribe(mqtt_client_ptr, AZ_IOT_HUB_CLIENT_TWIN_RESPONSE_SUBSCRIBE_TOPIC,
+                                                     sizeof(AZ_IOT_HUB_CLIENT_TWIN_RESPONSE_SUBSCRIBE_TOPIC) - 1,
+                                                     ESP_AZURE_IOT_MQTT_QOS_0);
+        if (status == ESP_AZURE_IOT_SUCCESS)
+        {
+            status = esp_azure_iot_mqtt_client_subscribe(mqtt_client_ptr, AZ_IOT_HUB_CLIENT_TWIN_PATCH_SUBSCRIBE_TOPIC,
+                                                         sizeof(AZ_IOT_HUB_CLIENT_TWIN_PATCH_SUBSCRIBE_TOPIC) - 1,
+                                                         ESP_AZURE_IOT_MQTT_QOS_0);
+        }
     }
 
-    status = esp_azure_iot_url_encoded_hmac_sha256_calculate(&(hub_client_ptr -> esp_azure_iot_hub_client_resource),
-                                                            key, key_len, az_span_ptr(span), (uint32_t)az_span_size(span),
-                                                            buffer_ptr, buffer_size, &output_ptr, &output_len);
-    if (status)
+    if ((status == ESP_AZURE_IOT_SUCCESS) &&
+        hub_client_ptr -> esp_azure_iot_hub_client_direct_method_metadata.esp_azure_iot_hub_client_message_process)
     {
-        LogError("IoTHub failed to encoded hash");
-        esp_azure_iot_buffer_free(buffer_context);
-        return(status);
+        status = esp_azure_iot_mqtt_client_subscribe(mqtt_client_ptr, AZ_IOT_HUB_CLIENT_METHODS_SUBSCRIBE_TOPIC,
+                                                     sizeof(AZ_IOT_HUB_CLIENT_METHODS_SUBSCRIBE_TOPIC) - 1,
+                                                     ESP_AZURE_IOT_MQTT_QOS_0);
     }
 
-    buffer_span = az_span_init(output_ptr, (int16_t)output_len);
-    core_result= az_iot_hub_client_sas_get_password(&(hub_client_ptr -> iot_hub_client_core),
-                                                    buffer_span, expiry_time_secs, AZ_SPAN_NULL,
-                                                    (char *)sas_buffer, sas_buffer_len, &sas_buffer_len);
-    if (az_failed(core_result))
+    if (status)
     {
-        LogError("IoTHub failed to generate token with error : 0x%08x", core_result);
-        esp_azure_iot_buffer_free(buffer_context);
-        return(ESP_AZURE_IOT_SDK_CORE_ERROR);
+        LogError("IoTHub client subscriptions restore fail: 0x%02x", status);
     }
 
-    *sas_length = sas_buffer_len;
-    esp_azure_iot_buffer_free(buffer_context);
-
-    return(ESP_AZURE_IOT_SUCCESS );
+    return(status);
 }
                                                   
 uint32_t esp_azure_iot_hub_client_direct_method_enable(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr)
@@ -2117,40 +4122,107 @@ uint32_t esp_azure_iot_hub_client_direct_method_message_response(ESP_AZURE_IOT_H
     }
 
 
-    packet_ptr -> esp_packet_append_ptr = packet_ptr -> esp_packet_prepend_ptr + topic_length;
     packet_ptr -> esp_packet_length = topic_length;
 
-    if (payload && (payload_length != 0))
+    if ((payload == NULL) || (payload_length == 0))
     {
+        payload = (uint8_t *)ESP_AZURE_IOT_HUB_CLIENT_EMPTY_JSON;
+        payload_length = sizeof(ESP_AZURE_IOT_HUB_CLIENT_EMPTY_JSON) - 1;
+    }
 
-        /* Append payload. */
-        status = esp_azure_iot_packet_append(packet_ptr, payload, payload_length, wait_option);
-        if (status)
-        {
-            LogError("Method reponse data append fail");
-            esp_azure_iot_packet_release(packet_ptr);
-            return(status);
-        }
+    /* Publish payload straight from the caller's buffer. */
+    status = esp_azure_iot_mqtt_client_publish(&(hub_client_ptr -> esp_azure_iot_hub_client_resource.esp_azure_iot_mqtt),
+                                               (char *)packet_ptr -> esp_packet_prepend_ptr, packet_ptr -> esp_packet_length,
+                                               (char *)payload, payload_length, 0, ESP_AZURE_IOT_MQTT_QOS_0, wait_option);
+    esp_azure_iot_packet_release(packet_ptr);
+    if (status)
+    {
+        LogError("IoTHub client method response fail: PUBLISH FAIL: 0x%02x", status);
+        return(status);
     }
-    else
+
+    return(ESP_AZURE_IOT_SUCCESS);
+}
+
+uint32_t esp_azure_iot_hub_client_topic_handler_register(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                    const uint8_t *prefix, uint32_t prefix_length,
+                                                    uint32_t (*handler)(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                                        ESP_PACKET *packet_ptr, size_t topic_offset,
+                                                                        uint16_t topic_length, void *args),
+                                                    void *handler_args)
+{
+ESP_MQTT_CLIENT *client_ptr;
+ESP_AZURE_IOT_HUB_CLIENT_TOPIC_HANDLER *handler_ptr;
+uint32_t i;
+
+    if ((hub_client_ptr == NULL) || (prefix == NULL) || (prefix_length == 0) || (handler == NULL))
     {
-        /* Append payload. */
-        status = esp_azure_iot_packet_append(packet_ptr, ESP_AZURE_IOT_HUB_CLIENT_EMPTY_JSON, sizeof(ESP_AZURE_IOT_HUB_CLIENT_EMPTY_JSON) - 1, wait_option);
-        if (status)
+        LogError("IoTHub client topic handler register fail: INVALID PARAMETER");
+        return(ESP_AZURE_IOT_INVALID_PARAMETER);
+    }
+
+    client_ptr = &(hub_client_ptr -> esp_azure_iot_hub_client_resource.esp_azure_iot_mqtt);
+
+    /* Obtain the MQTT client mutex the receive path runs under.  */
+    xSemaphoreTake(client_ptr -> esp_mqtt_client_mutex_ptr, portMAX_DELAY);
+
+    for (i = 0; i < ESP_AZURE_IOT_HUB_CLIENT_TOPIC_HANDLER_MAX; i++)
+    {
+        handler_ptr = &(hub_client_ptr -> esp_azure_iot_hub_client_topic_handlers[i]);
+        if (handler_ptr -> esp_topic_handler_prefix == NULL)
         {
-            LogError("Adding empty json failed.");
-            esp_azure_iot_packet_release(packet_ptr);
-            return(status);
+            handler_ptr -> esp_topic_handler_prefix_length = prefix_length;
+            handler_ptr -> esp_topic_handler_process = handler;
+            handler_ptr -> esp_topic_handler_args = handler_args;
+            handler_ptr -> esp_topic_handler_prefix = prefix;
+
+            /* Release the MQTT client mutex.  */
+            xSemaphoreGive(client_ptr -> esp_mqtt_client_mutex_ptr);
+            return(ESP_AZURE_IOT_SUCCESS);
         }
     }
 
-    status = esp_azure_iot_publish_mqtt_packet(&(hub_client_ptr -> esp_azure_iot_hub_client_resource.esp_azure_iot_mqtt), packet_ptr, ESP_AZURE_IOT_MQTT_QOS_0, wait_option);
-    if (status)
+    /* Release the MQTT client mutex.  */
+    xSemaphoreGive(client_ptr -> esp_mqtt_client_mutex_ptr);
+
+    LogError("IoTHub client topic handler register fail: TOO MANY HANDLERS");
+    return(ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE);
+}
+
+uint32_t esp_azure_iot_hub_client_topic_handler_deregister(ESP_AZURE_IOT_HUB_CLIENT *hub_client_ptr,
+                                                      const uint8_t *prefix, uint32_t prefix_length)
+{
+ESP_MQTT_CLIENT *client_ptr;
+ESP_AZURE_IOT_HUB_CLIENT_TOPIC_HANDLER *handler_ptr;
+uint32_t status = ESP_AZURE_IOT_NOT_FOUND;
+uint32_t i;
+
+    if ((hub_client_ptr == NULL) || (prefix == NULL))
     {
-        LogError("IoTHub client method response fail: PUBLISH FAIL: 0x%02x", status);
-        esp_azure_iot_packet_release(packet_ptr);
-        return(status);
+        LogError("IoTHub client topic handler deregister fail: INVALID PARAMETER");
+        return(ESP_AZURE_IOT_INVALID_PARAMETER);
     }
 
-    return(ESP_AZURE_IOT_SUCCESS);
+    client_ptr = &(hub_client_ptr -> esp_azure_iot_hub_client_resource.esp_azure_iot_mqtt);
+
+    /* Obtain the MQTT client mutex the receive path runs under.  */
+    xSemaphoreTake(client_ptr -> esp_mqtt_client_mutex_ptr, portMAX_DELAY);
+
+    for (i = 0; i < ESP_AZURE_IOT_HUB_CLIENT_TOPIC_HANDLER_MAX; i++)
+    {
+        handler_ptr = &(hub_client_ptr -> esp_azure_iot_hub_client_topic_handlers[i]);
+        if (handler_ptr -> esp_topic_handler_prefix &&
+            (handler_ptr -> esp_topic_handler_prefix_length == prefix_length) &&
+            (memcmp(handler_ptr -> esp_topic_handler_prefix, prefix, prefix_length) == 0))
+        {
+            handler_ptr -> esp_topic_handler_prefix = NULL;
+            status = ESP_AZURE_IOT_SUCCESS;
+            break;
+        }
+    }
+
+    /* Release the MQTT client mutex.  */
+    xSemaphoreGive(client_ptr -> esp_mqtt_client_mutex_ptr);
+
+    return(status);
 }
\ No newline at end of file
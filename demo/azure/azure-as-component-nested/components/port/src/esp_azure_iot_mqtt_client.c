@@ -27,6 +27,108 @@ static const char *TAG = "azure_iot_mqtt";
    to the AP with an IP? */
 static const int CONNECTED_BIT = BIT0;
 
+/* Hand a complete message to the client owner, messages are queued in arrival order until it consumes them.
+   The owner is notified without the mutex held, so that its callbacks may call back into the client.  */
+static void esp_azure_iot_mqtt_client_message_enqueue(ESP_MQTT_CLIENT *client_ptr, ESP_PACKET *packet_ptr)
+{
+    void (*receive_notify)(ESP_MQTT_CLIENT *client_ptr, uint32_t message_count);
+    uint32_t message_count;
+
+    xSemaphoreTake(client_ptr->esp_mqtt_client_mutex_ptr, portMAX_DELAY);
+
+    receive_notify = client_ptr->esp_mqtt_client_receive_notify;
+    if (receive_notify == NULL) {
+        xSemaphoreGive(client_ptr->esp_mqtt_client_mutex_ptr);
+        esp_azure_iot_packet_release(packet_ptr);
+        return;
+    }
+
+    packet_ptr->esp_packet_next = NULL;
+    if (client_ptr->message_receive_queue_tail) {
+        client_ptr->message_receive_queue_tail->esp_packet_next = packet_ptr;
+    } else {
+        client_ptr->message_receive_queue_head = packet_ptr;
+    }
+    client_ptr->message_receive_queue_tail = packet_ptr;
+    client_ptr->message_receive_queue_depth++;
+    message_count = client_ptr->message_receive_queue_depth;
+
+    xSemaphoreGive(client_ptr->esp_mqtt_client_mutex_ptr);
+
+    /* Only this task fills the queue and the owner empties it from the notify, so it needs no lock here.  */
+    receive_notify(client_ptr, message_count);
+}
+
+/* Drop the message being reassembled, the rest of its fragments are skipped.  */
+static void esp_azure_iot_mqtt_client_data_drop(ESP_MQTT_CLIENT *client_ptr)
+{
+    if (client_ptr->esp_mqtt_client_receive_packet) {
+        esp_azure_iot_packet_release(client_ptr->esp_mqtt_client_receive_packet);
+        client_ptr->esp_mqtt_client_receive_packet = NULL;
+    }
+}
+
+/* Reassemble MQTT_EVENT_DATA fragments into one packet, laid out as the topic followed by the payload.
+   Only the first fragment carries the topic; each byte is copied once, straight to its final place.  */
+static void esp_azure_iot_mqtt_client_data_receive(ESP_MQTT_CLIENT *client_ptr, esp_mqtt_event_handle_t event)
+{
+    ESP_PACKET *packet_ptr;
+    size_t total_length = (size_t)event->total_data_len;
+    size_t offset = (size_t)event->current_data_offset;
+    size_t data_length = (size_t)event->data_len;
+
+    if (offset == 0) {
+        if (client_ptr->esp_mqtt_client_receive_packet) {
+            ESP_LOGE(TAG, "Drop message: %zu bytes never arrived", client_ptr->esp_mqtt_client_receive_remaining);
+            esp_azure_iot_mqtt_client_data_drop(client_ptr);
+        }
+        client_ptr->esp_mqtt_client_receive_remaining = total_length;
+
+        if (client_ptr->esp_mqtt_client_receive_notify == NULL) {
+            ESP_LOGE(TAG, "Drop message: no receiver");
+        } else if (esp_azure_iot_packet_allocate(&packet_ptr, 0, 0)) {
+            ESP_LOGE(TAG, "Drop message: packet pool exhausted");
+        } else if ((size_t)(packet_ptr->esp_packet_data_end - packet_ptr->esp_packet_prepend_ptr) <
+                   ((size_t)event->topic_len + total_length)) {
+            ESP_LOGE(TAG, "Drop message: %zu bytes do not fit in a packet", (size_t)event->topic_len + total_length);
+            esp_azure_iot_packet_release(packet_ptr);
+        } else {
+            memcpy(packet_ptr->esp_packet_prepend_ptr, event->topic, event->topic_len);
+            packet_ptr->esp_packet_length = event->topic_len;
+            packet_ptr->esp_packet_append_ptr = packet_ptr->esp_packet_prepend_ptr + event->topic_len;
+            client_ptr->esp_mqtt_client_receive_packet = packet_ptr;
+        }
+    } else if ((offset + client_ptr->esp_mqtt_client_receive_remaining) != total_length) {
+        ESP_LOGE(TAG, "Drop message: fragment at %zu out of sequence", offset);
+        esp_azure_iot_mqtt_client_data_drop(client_ptr);
+        client_ptr->esp_mqtt_client_receive_remaining = 0;
+        return;
+    }
+
+    if (data_length > client_ptr->esp_mqtt_client_receive_remaining) {
+        ESP_LOGE(TAG, "Drop message: fragment overruns total length %zu", total_length);
+        esp_azure_iot_mqtt_client_data_drop(client_ptr);
+        client_ptr->esp_mqtt_client_receive_remaining = 0;
+        return;
+    }
+    client_ptr->esp_mqtt_client_receive_remaining -= data_length;
+
+    packet_ptr = client_ptr->esp_mqtt_client_receive_packet;
+    if (packet_ptr == NULL) {
+        return;
+    }
+
+    if (data_length) {
+        memcpy(packet_ptr->esp_packet_append_ptr, event->data, data_length);
+        packet_ptr->esp_packet_append_ptr += data_length;
+    }
+
+    if (client_ptr->esp_mqtt_client_receive_remaining == 0) {
+        client_ptr->esp_mqtt_client_receive_packet = NULL;
+        esp_azure_iot_mqtt_client_message_enqueue(client_ptr, packet_ptr);
+    }
+}
+
 static esp_err_t esp_azure_iot_hub_client_mqtt_event(esp_mqtt_event_handle_t event)
 {
     ESP_MQTT_CLIENT *client_ptr = event->user_context;
@@ -42,6 +144,8 @@ static esp_err_t esp_azure_iot_hub_client_mqtt_event(esp_mqtt_event_handle_t eve
         case MQTT_EVENT_DISCONNECTED:
             ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
             xEventGroupClearBits(client_ptr->esp_mqtt_client_event_ptr, CONNECTED_BIT);
+            esp_azure_iot_mqtt_client_data_drop(client_ptr);
+            client_ptr->esp_mqtt_client_receive_remaining = 0;
             break;
 
         case MQTT_EVENT_SUBSCRIBED:
@@ -55,23 +159,7 @@ static esp_err_t esp_azure_iot_hub_client_mqtt_event(esp_mqtt_event_handle_t eve
             break;
         case MQTT_EVENT_DATA:
             ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-            if (client_ptr->esp_mqtt_client_receive_notify) {
-                ESP_PACKET *packet_topic = NULL;
-                esp_azure_iot_packet_allocate(&packet_topic, 0, 0);
-                
-                packet_topic -> esp_packet_length = event->topic_len;
-                
-                memcpy(packet_topic->esp_packet_prepend_ptr, event->topic, event->topic_len);
-                packet_topic -> esp_packet_append_ptr = packet_topic -> esp_packet_prepend_ptr + event->topic_len;
-                
-                if (event->data && event->data_len) {
-                    memcpy(packet_topic->esp_packet_append_ptr, event->data, event->data_len);
-                    packet_topic -> esp_packet_append_ptr = packet_topic -> esp_packet_append_ptr + event->data_len;
-                }
-                
-                client_ptr->message_receive_queue_head = packet_topic;
-                client_ptr->esp_mqtt_client_receive_notify(client_ptr, 1);
-            }
+            esp_azure_iot_mqtt_client_data_receive(client_ptr, event);
             break;
         case MQTT_EVENT_ERROR:
             ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
@@ -111,6 +199,13 @@ uint32_t esp_azure_iot_mqtt_client_delete(ESP_MQTT_CLIENT *client_ptr)
             client_ptr->esp_mqtt_client_handle = NULL;
         }
 
+        esp_azure_iot_mqtt_client_data_drop(client_ptr);
+
+        free(client_ptr->esp_mqtt_username);
+        free(client_ptr->esp_mqtt_password);
+        client_ptr->esp_mqtt_username = NULL;
+        client_ptr->esp_mqtt_password = NULL;
+
         if (client_ptr->esp_mqtt_client_mutex_ptr) {
             vSemaphoreDelete(client_ptr->esp_mqtt_client_mutex_ptr);
             client_ptr->esp_mqtt_client_mutex_ptr = NULL;
@@ -192,6 +287,8 @@ uint32_t esp_azure_iot_mqtt_client_connect(ESP_MQTT_CLIENT *client_ptr, size_t *
         .user_context = client_ptr,
     };
 
+    client_ptr->esp_mqtt_keepalive = keepalive;
+    client_ptr->esp_mqtt_clean_session = clean_session;
     client_ptr->esp_mqtt_client_handle = esp_mqtt_client_init(&mqtt_cfg);
     ESP_LOGI(TAG, "CONNECT | URI: %s | CLLIENTID: %s | USERNAME: %s | PWD: %s", host_string, clientid, username, password);
     
@@ -236,6 +333,8 @@ uint32_t esp_azure_iot_mqtt_client_secure_connect(ESP_MQTT_CLIENT *client_ptr, s
         .user_context = client_ptr,
     };
 
+    client_ptr->esp_mqtt_keepalive = keepalive;
+    client_ptr->esp_mqtt_clean_session = clean_session;
     client_ptr->esp_mqtt_client_handle = esp_mqtt_client_init(&mqtt_cfg);
     ESP_LOGI(TAG, "CONNECT | URI: %s | CLLIENTID: %s | USERNAME: %s | PWD: %s", host_string, clientid, username, password);
     
@@ -253,16 +352,73 @@ uint32_t esp_azure_iot_mqtt_client_secure_connect(ESP_MQTT_CLIENT *client_ptr, s
     return(ESP_AZURE_IOT_SUCCESS);
 }
 
+/* Keep a copy of the login, so that the caller may release its buffers once this returns.  */
 uint32_t esp_azure_iot_mqtt_client_login_set(ESP_MQTT_CLIENT *client_ptr, char *username, uint32_t username_length, char *password, uint32_t password_length)
 {
-    client_ptr->esp_mqtt_username = username;
+    char *username_copy = strndup(username, username_length);
+    char *password_copy = strndup(password, password_length);
+
+    if ((username_copy == NULL) || (password_copy == NULL)) {
+        ESP_LOGE(TAG, "login set failed: no memory");
+        free(username_copy);
+        free(password_copy);
+        return(ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE);
+    }
+
+    free(client_ptr->esp_mqtt_username);
+    free(client_ptr->esp_mqtt_password);
+    client_ptr->esp_mqtt_username = username_copy;
     client_ptr->esp_mqtt_username_length = username_length;
-    client_ptr->esp_mqtt_password = password;
+    client_ptr->esp_mqtt_password = password_copy;
     client_ptr->esp_mqtt_password_length = password_length;
 
     return(ESP_AZURE_IOT_SUCCESS);
 }
 
+/* Log a running session in again with the current login. Only the MQTT session is dropped and opened again,
+   the client task and its outbox stay up, so messages queued meanwhile are sent once it is back.
+   Subscriptions are not restored here, that is up to the owner of the client.  */
+uint32_t esp_azure_iot_mqtt_client_login_update(ESP_MQTT_CLIENT *client_ptr, size_t wait_option)
+{
+    esp_err_t ret;
+    EventBits_t bits;
+
+    if ((client_ptr == NULL) || (client_ptr->esp_mqtt_client_handle == NULL)) {
+        return(ESP_AZURE_IOT_INVALID_PARAMETER);
+    }
+
+    /* esp_mqtt_set_config resets what it is not given, so pass the session settings of the connect again.  */
+    const esp_mqtt_client_config_t mqtt_cfg = {
+        .event_handle = esp_azure_iot_hub_client_mqtt_event,
+        .username = client_ptr->esp_mqtt_username,
+        .password = client_ptr->esp_mqtt_password,
+        .disable_clean_session = client_ptr->esp_mqtt_clean_session,
+        .keepalive = client_ptr->esp_mqtt_keepalive,
+        .user_context = client_ptr,
+    };
+
+    ret = esp_mqtt_set_config(client_ptr->esp_mqtt_client_handle, &mqtt_cfg);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "login update failed: %d", ret);
+        return(ESP_AZURE_IOT_INVALID_PARAMETER);
+    }
+
+    xEventGroupClearBits(client_ptr->esp_mqtt_client_event_ptr, CONNECTED_BIT);
+
+    /* A session the broker already closed is waiting to reconnect, and picks up the new login by itself.  */
+    esp_mqtt_client_disconnect(client_ptr->esp_mqtt_client_handle);
+    esp_mqtt_client_reconnect(client_ptr->esp_mqtt_client_handle);
+
+    bits = xEventGroupWaitBits(client_ptr->esp_mqtt_client_event_ptr, CONNECTED_BIT,
+                               false, true, wait_option);
+    if ((bits & CONNECTED_BIT) == 0) {
+        ESP_LOGE(TAG, "login update failed: not connected again");
+        return(ESP_AZURE_IOT_DISCONNECTED);
+    }
+
+    return(ESP_AZURE_IOT_SUCCESS);
+}
+
 uint32_t esp_azure_iot_mqtt_client_disconnect(ESP_MQTT_CLIENT *client_ptr)
 {
     esp_err_t ret = ESP_FAIL; 
@@ -309,66 +465,190 @@ uint32_t esp_azure_iot_get_host_by_name(uint8_t *host_name, size_t *host_address
     return(ESP_AZURE_IOT_SUCCESS);
 }
 
+/* Packet pool. Headers, data areas and the free list are static so that allocation
+   never touches the heap; the free list is a FreeRTOS queue of packet pointers, which
+   gives blocking allocation with wait_option and is safe to use from any task.
+   esp_packet_pool_in_use marks the packets handed out, so that releasing one twice
+   can't put it on the free list twice and give it to two owners.  */
+static ESP_PACKET esp_packet_pool_packets[ESP_AZURE_IOT_PACKET_POOL_BLOCK_COUNT];
+static uint8_t esp_packet_pool_in_use[ESP_AZURE_IOT_PACKET_POOL_BLOCK_COUNT];
+static uint8_t esp_packet_pool_data[ESP_AZURE_IOT_PACKET_POOL_BLOCK_COUNT][ESP_AZURE_IOT_PACKET_POOL_BLOCK_SIZE];
+static uint8_t esp_packet_pool_queue_storage[ESP_AZURE_IOT_PACKET_POOL_BLOCK_COUNT * sizeof(ESP_PACKET *)];
+static StaticQueue_t esp_packet_pool_queue_buffer;
+static QueueHandle_t esp_packet_pool_free_queue;
+static ESP_PACKET_POOL_STATS esp_packet_pool_stats;
+static portMUX_TYPE esp_packet_pool_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void esp_azure_iot_packet_reset(ESP_PACKET *packet_ptr)
+{
+    packet_ptr->esp_packet_data_end = packet_ptr->esp_packet_data_start + ESP_AZURE_IOT_PACKET_POOL_BLOCK_SIZE;
+    packet_ptr->esp_packet_append_ptr = packet_ptr->esp_packet_prepend_ptr = packet_ptr->esp_packet_data_start;
+    packet_ptr->esp_packet_length = 0;
+    packet_ptr->esp_packet_next = NULL;
+}
+
+uint32_t esp_azure_iot_packet_pool_create(void)
+{
+    ESP_PACKET *packet = NULL;
+    size_t index;
+
+    if (esp_packet_pool_free_queue) {
+        return(ESP_AZURE_IOT_SUCCESS);
+    }
+
+    esp_packet_pool_free_queue = xQueueCreateStatic(ESP_AZURE_IOT_PACKET_POOL_BLOCK_COUNT, sizeof(ESP_PACKET *),
+                                                    esp_packet_pool_queue_storage, &esp_packet_pool_queue_buffer);
+
+    for (index = 0; index < ESP_AZURE_IOT_PACKET_POOL_BLOCK_COUNT; index++) {
+        packet = &esp_packet_pool_packets[index];
+        packet->esp_packet_data_start = esp_packet_pool_data[index];
+        esp_azure_iot_packet_reset(packet);
+        xQueueSend(esp_packet_pool_free_queue, &packet, 0);
+    }
+
+    portENTER_CRITICAL(&esp_packet_pool_lock);
+    esp_packet_pool_stats.esp_packet_pool_total = ESP_AZURE_IOT_PACKET_POOL_BLOCK_COUNT;
+    esp_packet_pool_stats.esp_packet_pool_free_min = ESP_AZURE_IOT_PACKET_POOL_BLOCK_COUNT;
+    portEXIT_CRITICAL(&esp_packet_pool_lock);
+
+    return(ESP_AZURE_IOT_SUCCESS);
+}
+
+uint32_t esp_azure_iot_packet_pool_stats_get(ESP_PACKET_POOL_STATS *stats_ptr)
+{
+    if ((stats_ptr == NULL) || (esp_packet_pool_free_queue == NULL)) {
+        return(ESP_AZURE_IOT_INVALID_PARAMETER);
+    }
+
+    portENTER_CRITICAL(&esp_packet_pool_lock);
+    *stats_ptr = esp_packet_pool_stats;
+    portEXIT_CRITICAL(&esp_packet_pool_lock);
+
+    stats_ptr->esp_packet_pool_free = (uint32_t)uxQueueMessagesWaiting(esp_packet_pool_free_queue);
+
+    return(ESP_AZURE_IOT_SUCCESS);
+}
+
 uint32_t esp_azure_iot_packet_allocate(ESP_PACKET **packet_ptr, size_t packet_type, size_t wait_option)
 {
     ESP_PACKET *packet = NULL;
-    
-    packet = calloc(1, sizeof(ESP_PACKET));
-    
-    packet->esp_packet_data_start = calloc(1, 1536);
-    packet->esp_packet_data_end = packet->esp_packet_data_start + 1536;
-    packet->esp_packet_append_ptr = packet->esp_packet_prepend_ptr = packet->esp_packet_data_start;
-    packet->esp_packet_append_buf = xRingbufferCreate(1536, RINGBUF_TYPE_BYTEBUF);
-    
+    UBaseType_t free_count;
+
+    ESP_PARAMETER_NOT_USED(packet_type);
+
+    if ((packet_ptr == NULL) || (esp_packet_pool_free_queue == NULL)) {
+        return(ESP_AZURE_IOT_INVALID_PARAMETER);
+    }
+
+    if (uxQueueMessagesWaiting(esp_packet_pool_free_queue) == 0) {
+        portENTER_CRITICAL(&esp_packet_pool_lock);
+        esp_packet_pool_stats.esp_packet_pool_empty_requests++;
+        portEXIT_CRITICAL(&esp_packet_pool_lock);
+    }
+
+    if (xQueueReceive(esp_packet_pool_free_queue, &packet, (TickType_t)wait_option) != pdTRUE) {
+        portENTER_CRITICAL(&esp_packet_pool_lock);
+        esp_packet_pool_stats.esp_packet_pool_failures++;
+        portEXIT_CRITICAL(&esp_packet_pool_lock);
+        return(ESP_AZURE_IOT_NO_PACKET);
+    }
+
+    free_count = uxQueueMessagesWaiting(esp_packet_pool_free_queue);
+
+    portENTER_CRITICAL(&esp_packet_pool_lock);
+    esp_packet_pool_in_use[packet - esp_packet_pool_packets] = 1;
+    esp_packet_pool_stats.esp_packet_pool_allocations++;
+    if (free_count < esp_packet_pool_stats.esp_packet_pool_free_min) {
+        esp_packet_pool_stats.esp_packet_pool_free_min = (uint32_t)free_count;
+    }
+    portEXIT_CRITICAL(&esp_packet_pool_lock);
+
     *packet_ptr = packet;
-    
+
     return(ESP_AZURE_IOT_SUCCESS);
 }
 
 uint32_t esp_azure_iot_packet_release(ESP_PACKET *packet_ptr_ptr)
 {
-    if (packet_ptr_ptr) {
-        if (packet_ptr_ptr->esp_packet_data_start) {
-            free(packet_ptr_ptr->esp_packet_data_start);
-            packet_ptr_ptr->esp_packet_data_start = NULL;
-        }
+    size_t index;
+    uint32_t in_use;
 
-        if (packet_ptr_ptr->esp_packet_append_buf) {
-            vRingbufferDelete(packet_ptr_ptr->esp_packet_append_buf);
-            packet_ptr_ptr->esp_packet_append_buf = NULL;
-        }
+    if (packet_ptr_ptr == NULL) {
+        return(ESP_AZURE_IOT_SUCCESS);
+    }
 
-        free(packet_ptr_ptr);
-        packet_ptr_ptr = NULL;
+    if ((packet_ptr_ptr < &esp_packet_pool_packets[0]) ||
+        (packet_ptr_ptr > &esp_packet_pool_packets[ESP_AZURE_IOT_PACKET_POOL_BLOCK_COUNT - 1])) {
+        ESP_LOGE(TAG, "Packet release fail: %p is not a pool packet", packet_ptr_ptr);
+        return(ESP_AZURE_IOT_INVALID_PACKET);
     }
 
+    index = (size_t)(packet_ptr_ptr - esp_packet_pool_packets);
+
+    portENTER_CRITICAL(&esp_packet_pool_lock);
+    in_use = esp_packet_pool_in_use[index];
+    esp_packet_pool_in_use[index] = 0;
+    portEXIT_CRITICAL(&esp_packet_pool_lock);
+
+    if (!in_use) {
+        ESP_LOGE(TAG, "Packet release fail: %p is already released", packet_ptr_ptr);
+        return(ESP_AZURE_IOT_INVALID_PACKET);
+    }
+
+    esp_azure_iot_packet_reset(packet_ptr_ptr);
+    xQueueSend(esp_packet_pool_free_queue, &packet_ptr_ptr, 0);
+
     return(ESP_AZURE_IOT_SUCCESS);
 }
 
+/* Publish packets keep the topic NULL-terminated at esp_packet_prepend_ptr[esp_packet_length],
+   as esp-mqtt takes a C string; the payload starts right after the terminator.  */
 uint32_t esp_azure_iot_packet_append(ESP_PACKET *packet_ptr, void *data_start, size_t data_size, size_t wait_option)
 {
-    ESP_LOGD(TAG, "append data %s %u", (char *)data_start, data_size);
+    ESP_PARAMETER_NOT_USED(wait_option);
 
-    BaseType_t ret = xRingbufferSend(packet_ptr->esp_packet_append_buf, data_start, data_size, wait_option);
+    if ((size_t)(packet_ptr->esp_packet_data_end - packet_ptr->esp_packet_append_ptr) < data_size) {
+        ESP_LOGE(TAG, "Packet append fail: %zu bytes do not fit", data_size);
+        return(ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE);
+    }
 
-    return (ret == pdTRUE) ? (ESP_AZURE_IOT_SUCCESS) : (ESP_AZURE_IOT_INVALID_PARAMETER);
+    memcpy(packet_ptr->esp_packet_append_ptr, data_start, data_size);
+    packet_ptr->esp_packet_append_ptr += data_size;
+
+    return(ESP_AZURE_IOT_SUCCESS);
 }
 
-uint32_t esp_azure_iot_mqtt_client_publish_packet(ESP_MQTT_CLIENT *client_ptr, ESP_PACKET *packet_ptr, uint32_t QoS, size_t wait_option)
+uint32_t esp_azure_iot_packet_topic_append(ESP_PACKET *packet_ptr, void *data_start, size_t data_size)
 {
-    char *buffer = NULL;
-    size_t size = 0;
-    
-    buffer = xRingbufferReceive(packet_ptr->esp_packet_append_buf, &size, wait_option);
-    if (buffer) {
-        esp_azure_iot_mqtt_client_publish(client_ptr, (char *)packet_ptr -> esp_packet_prepend_ptr, packet_ptr->esp_packet_length, buffer, size, 0, QoS, wait_option);
-        
-        vRingbufferReturnItem(packet_ptr->esp_packet_append_buf, buffer);
+    uint8_t *topic_end = packet_ptr->esp_packet_prepend_ptr + packet_ptr->esp_packet_length;
+
+    /* Topic can only grow while no payload follows it.  */
+    if (packet_ptr->esp_packet_append_ptr != (topic_end + 1)) {
+        ESP_LOGE(TAG, "Topic append fail: payload already added");
+        return(ESP_AZURE_IOT_WRONG_STATE);
     }
 
+    if ((size_t)(packet_ptr->esp_packet_data_end - topic_end) < (data_size + 1)) {
+        ESP_LOGE(TAG, "Topic append fail: %zu bytes do not fit", data_size);
+        return(ESP_AZURE_IOT_TOPIC_TOO_LONG);
+    }
+
+    memcpy(topic_end, data_start, data_size);
+    topic_end[data_size] = 0;
+    packet_ptr->esp_packet_length += data_size;
+    packet_ptr->esp_packet_append_ptr = topic_end + data_size + 1;
+
     return(ESP_AZURE_IOT_SUCCESS);
 }
 
+uint32_t esp_azure_iot_mqtt_client_publish_packet(ESP_MQTT_CLIENT *client_ptr, ESP_PACKET *packet_ptr, uint32_t QoS, size_t wait_option)
+{
+    uint8_t *payload = packet_ptr->esp_packet_prepend_ptr + packet_ptr->esp_packet_length + 1;
+
+    return(esp_azure_iot_mqtt_client_publish(client_ptr, (char *)packet_ptr->esp_packet_prepend_ptr, packet_ptr->esp_packet_length,
+                                             (char *)payload, (uint32_t)(packet_ptr->esp_packet_append_ptr - payload), 0, QoS, wait_option));
+}
+
 uint32_t esp_azure_iot_mqtt_client_packet_process(ESP_PACKET *packet_ptr, size_t *topic_offset, uint16_t *topic_length, size_t *message_offset, size_t *message_length)
 {
     *topic_offset = 0;
@@ -396,39 +676,209 @@ uint32_t esp_azure_iot_mqtt_client_disconnect_notify_set(ESP_MQTT_CLIENT *client
 #define ESP_AZURE_IOT_EVENT_GROUP_BOUND                           0xF2
 #define ESP_AZURE_IOT_EVENT_GROUP_EVENT_INVALID                   0xF3
 
-#define ESP_AZURE_IOT_EVENT_ALL_EVENTS                             BIT0 | BIT1 | BIT2 | BIT3 | BIT4 | BIT5      /* All event flags.             */
+/* Flags of the event helper thread. Module events are kept per group, the thread is only woken.  */
+#define ESP_AZURE_IOT_EVENT_WAKEUP                                BIT0      /* Group events or timers changed. */
+#define ESP_AZURE_IOT_EVENT_TERMINATE                             BIT1      /* Thread is asked to exit.        */
+#define ESP_AZURE_IOT_EVENT_TERMINATED                            BIT2      /* Thread has exited.              */
 
 uint32_t esp_azure_iot_event_group_set(ESP_AZURE_IOT_EVENT_GROUP *event_group_ptr, size_t group_own_event)
 {
     ESP_AZURE_IOT_EVENT *event_ptr = event_group_ptr->esp_event_ptr;
 
-    xEventGroupSetBits(event_ptr->esp_event_events, group_own_event);
-    
+    if (event_ptr == NULL) {
+        return(ESP_AZURE_IOT_EVENT_GROUP_NOT_REGISTERED);
+    }
+
+    portENTER_CRITICAL(&event_ptr->esp_event_lock);
+    event_group_ptr->esp_event_group_own_events |= group_own_event;
+    portEXIT_CRITICAL(&event_ptr->esp_event_lock);
+
+    xEventGroupSetBits(event_ptr->esp_event_events, ESP_AZURE_IOT_EVENT_WAKEUP);
+
     return(ESP_AZURE_IOT_SUCCESS);
 }
 
+/* Arm the group timer to fire ESP_AZURE_IOT_EVENT_COMMON_TIMER_EVENT after ticks; an earlier deadline already armed is kept.  */
+uint32_t esp_azure_iot_event_group_timer_set(ESP_AZURE_IOT_EVENT_GROUP *event_group_ptr, TickType_t ticks)
+{
+    ESP_AZURE_IOT_EVENT *event_ptr = event_group_ptr->esp_event_ptr;
+    TickType_t deadline = xTaskGetTickCount() + ticks;
+
+    if (event_ptr == NULL) {
+        return(ESP_AZURE_IOT_EVENT_GROUP_NOT_REGISTERED);
+    }
+
+    portENTER_CRITICAL(&event_ptr->esp_event_lock);
+    if (!event_group_ptr->esp_event_group_timer_armed ||
+        ((int32_t)(deadline - event_group_ptr->esp_event_group_timer_deadline) < 0)) {
+        event_group_ptr->esp_event_group_timer_deadline = deadline;
+        event_group_ptr->esp_event_group_timer_armed = 1;
+    }
+    portEXIT_CRITICAL(&event_ptr->esp_event_lock);
+
+    xEventGroupSetBits(event_ptr->esp_event_events, ESP_AZURE_IOT_EVENT_WAKEUP);
+
+    return(ESP_AZURE_IOT_SUCCESS);
+}
+
+/* Mark expired timers as pending and return the ticks until the next one. Must be called with the lock held.  */
+static TickType_t esp_azure_iot_event_timers_update(ESP_AZURE_IOT_EVENT *event_ptr, TickType_t now)
+{
+    ESP_AZURE_IOT_EVENT_GROUP *group_ptr;
+    TickType_t wait = portMAX_DELAY;
+    TickType_t remaining;
+    uint32_t periodic_due = ((int32_t)(now - event_ptr->esp_event_periodic_deadline) >= 0);
+    uint32_t periodic_used = 0;
+
+    for (group_ptr = event_ptr->esp_event_groups_list_header; group_ptr; group_ptr = group_ptr->esp_event_group_next) {
+        if (group_ptr->esp_event_group_registered_events & ESP_AZURE_IOT_EVENT_COMMON_PERIODIC_EVENT) {
+            periodic_used = 1;
+            if (periodic_due) {
+                group_ptr->esp_event_group_common_events |= ESP_AZURE_IOT_EVENT_COMMON_PERIODIC_EVENT;
+            }
+        }
+
+        if (group_ptr->esp_event_group_timer_armed) {
+            if ((int32_t)(now - group_ptr->esp_event_group_timer_deadline) >= 0) {
+                group_ptr->esp_event_group_timer_armed = 0;
+                group_ptr->esp_event_group_common_events |= ESP_AZURE_IOT_EVENT_COMMON_TIMER_EVENT;
+            } else {
+                remaining = group_ptr->esp_event_group_timer_deadline - now;
+                if (remaining < wait) {
+                    wait = remaining;
+                }
+            }
+        }
+    }
+
+    if (periodic_due) {
+
+        /* Keep the period stable, but do not try to catch up on missed periods.  */
+        event_ptr->esp_event_periodic_deadline += ESP_AZURE_IOT_EVENT_PERIODIC_INTERVAL;
+        if ((int32_t)(now - event_ptr->esp_event_periodic_deadline) >= 0) {
+            event_ptr->esp_event_periodic_deadline = now + ESP_AZURE_IOT_EVENT_PERIODIC_INTERVAL;
+        }
+    }
+
+    if (periodic_used) {
+        remaining = event_ptr->esp_event_periodic_deadline - now;
+        if (remaining < wait) {
+            wait = remaining;
+        }
+    }
+
+    return(wait);
+}
+
+/* Find a group with pending events, starting after the group served last so that one busy
+   group can't starve the groups after it. Must be called with the lock held.  */
+static ESP_AZURE_IOT_EVENT_GROUP *esp_azure_iot_event_group_next_pending(ESP_AZURE_IOT_EVENT *event_ptr)
+{
+    ESP_AZURE_IOT_EVENT_GROUP *group_ptr = NULL;
+    size_t index;
+
+    if (event_ptr->esp_event_group_last_served) {
+        group_ptr = event_ptr->esp_event_group_last_served->esp_event_group_next;
+    }
+
+    for (index = 0; index < event_ptr->esp_event_groups_count; index++) {
+        if (group_ptr == NULL) {
+            group_ptr = event_ptr->esp_event_groups_list_header;
+        }
+
+        if (group_ptr->esp_event_group_common_events || group_ptr->esp_event_group_own_events) {
+            event_ptr->esp_event_group_last_served = group_ptr;
+            return(group_ptr);
+        }
+
+        group_ptr = group_ptr->esp_event_group_next;
+    }
+
+    return(NULL);
+}
+
 static void esp_azure_iot_event_task(void *pv)
 {
     ESP_AZURE_IOT_EVENT *event_ptr = (ESP_AZURE_IOT_EVENT *) pv;
-    ESP_AZURE_IOT_EVENT_GROUP *current_module = event_ptr->esp_event_groups_list_header;
+    ESP_AZURE_IOT_EVENT_GROUP *group_ptr;
+    size_t common_events;
+    size_t own_events;
+    TickType_t wait;
+    EventBits_t bits;
+
     while (1) {
-        EventBits_t uxBits = xEventGroupWaitBits(event_ptr->esp_event_events, ESP_AZURE_IOT_EVENT_ALL_EVENTS, true, false, 100 / portTICK_PERIOD_MS);
-        size_t common_events = (uxBits & (ESP_AZURE_IOT_EVENT_ALL_EVENTS)) ? 0 : ESP_AZURE_IOT_EVENT_COMMON_PERIODIC_EVENT;
+        portENTER_CRITICAL(&event_ptr->esp_event_lock);
+        wait = esp_azure_iot_event_timers_update(event_ptr, xTaskGetTickCount());
+        portEXIT_CRITICAL(&event_ptr->esp_event_lock);
+
+        /* Dispatch pending events one group at a time, without holding the lock in the module routine.  */
+        do {
+            portENTER_CRITICAL(&event_ptr->esp_event_lock);
+            group_ptr = esp_azure_iot_event_group_next_pending(event_ptr);
+
+            common_events = 0;
+            own_events = 0;
+            if (group_ptr) {
+                common_events = group_ptr->esp_event_group_common_events;
+                own_events = group_ptr->esp_event_group_own_events;
+                group_ptr->esp_event_group_common_events = 0;
+                group_ptr->esp_event_group_own_events = 0;
+            }
+            portEXIT_CRITICAL(&event_ptr->esp_event_lock);
 
-        current_module->esp_event_group_process(current_module->esp_event_group_context, common_events, uxBits);
+            if (group_ptr) {
+                group_ptr->esp_event_group_process(group_ptr->esp_event_group_context, common_events, own_events);
+            }
+        } while (group_ptr);
 
-        xEventGroupClearBits(event_ptr->esp_event_events, uxBits);
+        /* Events set during dispatch leave the wakeup flag set, so this does not sleep past them.  */
+        bits = xEventGroupWaitBits(event_ptr->esp_event_events, ESP_AZURE_IOT_EVENT_WAKEUP | ESP_AZURE_IOT_EVENT_TERMINATE,
+                                   pdTRUE, pdFALSE, wait);
+        if (bits & ESP_AZURE_IOT_EVENT_TERMINATE) {
+            break;
+        }
     }
+
+    xEventGroupSetBits(event_ptr->esp_event_events, ESP_AZURE_IOT_EVENT_TERMINATED);
+    vTaskDelete(NULL);
 }
 
 uint32_t esp_azure_iot_event_create(ESP_AZURE_IOT_EVENT *event_ptr, const char *event_name, void *memory_ptr, size_t memory_size, uint32_t priority)
 {
+    ESP_PARAMETER_NOT_USED(memory_ptr);
+
+    event_ptr->esp_event_name = event_name;
+    event_ptr->esp_event_groups_list_header = NULL;
+    event_ptr->esp_event_groups_count = 0;
+    event_ptr->esp_event_group_last_served = NULL;
+    portMUX_INITIALIZE(&event_ptr->esp_event_lock);
+    event_ptr->esp_event_periodic_deadline = xTaskGetTickCount() + ESP_AZURE_IOT_EVENT_PERIODIC_INTERVAL;
+
     event_ptr->esp_event_events = xEventGroupCreate();
     event_ptr->esp_event_mutex = xSemaphoreCreateMutex();
+    if ((event_ptr->esp_event_events == NULL) || (event_ptr->esp_event_mutex == NULL)) {
+        ESP_LOGE(TAG, "Event create fail: no memory");
+        goto cleanup;
+    }
+
+    if (xTaskCreate(esp_azure_iot_event_task, event_name, memory_size, event_ptr, priority, &event_ptr->esp_event_thread) != pdPASS) {
+        ESP_LOGE(TAG, "Event create fail: thread not created");
+        goto cleanup;
+    }
 
-    xTaskCreate(esp_azure_iot_event_task, event_name, memory_size, event_ptr, priority, NULL);
-    
     return(ESP_AZURE_IOT_SUCCESS);
+
+cleanup:
+    if (event_ptr->esp_event_events) {
+        vEventGroupDelete(event_ptr->esp_event_events);
+        event_ptr->esp_event_events = NULL;
+    }
+    if (event_ptr->esp_event_mutex) {
+        vSemaphoreDelete(event_ptr->esp_event_mutex);
+        event_ptr->esp_event_mutex = NULL;
+    }
+
+    return(ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE);
 }
 
 /* Register/deregister module in event thread.  */
@@ -457,73 +907,180 @@ uint32_t esp_azure_iot_event_group_register(ESP_AZURE_IOT_EVENT *event_ptr, ESP_
 
     /* Set module info.  */
     event_group_ptr -> esp_event_group_name = group_name;
+    event_group_ptr -> esp_event_group_registered_events = group_event;
+    event_group_ptr -> esp_event_group_own_events = 0;
+    event_group_ptr -> esp_event_group_common_events = 0;
+    event_group_ptr -> esp_event_group_timer_armed = 0;
     event_group_ptr -> esp_event_group_process = group_process;
     event_group_ptr -> esp_event_group_context = group_context;
     event_group_ptr -> esp_event_ptr = event_ptr;
 
     /* Update the module list and count.  */
+    portENTER_CRITICAL(&event_ptr -> esp_event_lock);
     event_group_ptr -> esp_event_group_next = event_ptr -> esp_event_groups_list_header;
     event_ptr -> esp_event_groups_list_header = event_group_ptr;
     event_ptr -> esp_event_groups_count ++;
+    portEXIT_CRITICAL(&event_ptr -> esp_event_lock);
 
     /* Release mutex. */
     xSemaphoreGive(event_ptr -> esp_event_mutex);
+
+    /* Let the thread account for the module's periodic event.  */
+    xEventGroupSetBits(event_ptr -> esp_event_events, ESP_AZURE_IOT_EVENT_WAKEUP);
     
     return(ESP_AZURE_IOT_SUCCESS);
 }
 
 uint32_t esp_azure_iot_event_group_deregister(ESP_AZURE_IOT_EVENT *event_ptr, ESP_AZURE_IOT_EVENT_GROUP *event_group_ptr)
 {
-    return(ESP_AZURE_IOT_SUCCESS);
+    ESP_AZURE_IOT_EVENT_GROUP **current_module_ptr;
+    uint32_t status = ESP_AZURE_IOT_EVENT_GROUP_NOT_REGISTERED;
+
+    /* Get mutex. */
+    xSemaphoreTake(event_ptr -> esp_event_mutex, ESP_WAIT_FOREVER);
+
+    portENTER_CRITICAL(&event_ptr -> esp_event_lock);
+    for (current_module_ptr = &(event_ptr -> esp_event_groups_list_header); *current_module_ptr;
+         current_module_ptr = &((*current_module_ptr) -> esp_event_group_next))
+    {
+        if (*current_module_ptr == event_group_ptr)
+        {
+            *current_module_ptr = event_group_ptr -> esp_event_group_next;
+            event_ptr -> esp_event_groups_count --;
+            if (event_ptr -> esp_event_group_last_served == event_group_ptr)
+            {
+                event_ptr -> esp_event_group_last_served = NULL;
+            }
+            event_group_ptr -> esp_event_group_next = NULL;
+            event_group_ptr -> esp_event_ptr = NULL;
+            status = ESP_AZURE_IOT_SUCCESS;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&event_ptr -> esp_event_lock);
+
+    /* Release mutex. */
+    xSemaphoreGive(event_ptr -> esp_event_mutex);
+
+    return(status);
 }
 
 uint32_t esp_azure_iot_event_delete(ESP_AZURE_IOT_EVENT *event_ptr)
 {
+    if (event_ptr -> esp_event_groups_list_header)
+    {
+        return(ESP_AZURE_IOT_EVENT_GROUP_BOUND);
+    }
+
+    /* Stop the thread, unless it is deleting itself from a module routine.  */
+    if (event_ptr -> esp_event_thread)
+    {
+        if (event_ptr -> esp_event_thread == xTaskGetCurrentTaskHandle())
+        {
+            return(ESP_AZURE_IOT_WRONG_STATE);
+        }
+
+        xEventGroupSetBits(event_ptr -> esp_event_events, ESP_AZURE_IOT_EVENT_TERMINATE);
+        xEventGroupWaitBits(event_ptr -> esp_event_events, ESP_AZURE_IOT_EVENT_TERMINATED, pdTRUE, pdTRUE, portMAX_DELAY);
+        event_ptr -> esp_event_thread = NULL;
+    }
+
+    vEventGroupDelete(event_ptr -> esp_event_events);
+    event_ptr -> esp_event_events = NULL;
+    vSemaphoreDelete(event_ptr -> esp_event_mutex);
+    event_ptr -> esp_event_mutex = NULL;
+
+    return(ESP_AZURE_IOT_SUCCESS);
+}
+
+/* Waiter pool. Every blocking wait borrows a waiter whose binary semaphore is created
+   once from static storage, so waiting for a response never allocates.  */
+static ESP_THRAED esp_thread_pool_threads[ESP_AZURE_IOT_THREAD_POOL_COUNT];
+static ESP_THRAED *esp_thread_pool_free_list;
+static uint32_t esp_thread_pool_created;
+static portMUX_TYPE esp_thread_pool_lock = portMUX_INITIALIZER_UNLOCKED;
+
+uint32_t esp_azure_iot_thread_pool_create(void)
+{
+    ESP_THRAED *thread_ptr;
+    size_t index;
+
+    if (esp_thread_pool_created) {
+        return(ESP_AZURE_IOT_SUCCESS);
+    }
+
+    for (index = 0; index < ESP_AZURE_IOT_THREAD_POOL_COUNT; index++) {
+        thread_ptr = &esp_thread_pool_threads[index];
+        thread_ptr->esp_thread_semaphore = xSemaphoreCreateBinaryStatic(&thread_ptr->esp_thread_semaphore_buffer);
+        thread_ptr->esp_thread_next = esp_thread_pool_free_list;
+        esp_thread_pool_free_list = thread_ptr;
+    }
+
+    esp_thread_pool_created = 1;
+
     return(ESP_AZURE_IOT_SUCCESS);
 }
 
 uint32_t esp_azure_iot_thread_sleep(ESP_THRAED *thread_ptr, size_t wait_option)
 {
     BaseType_t ret = pdFALSE;
-    
-    if (thread_ptr && thread_ptr->esp_thread_semaphore) {
-        ret = xSemaphoreTake(thread_ptr->esp_thread_semaphore, wait_option);
+
+    /* Without a waiter there is nothing to wait on; callers check esp_azure_iot_thread_identify() first.  */
+    if ((thread_ptr == NULL) || (thread_ptr->esp_thread_semaphore == NULL)) {
+        return(ESP_AZURE_IOT_INVALID_PARAMETER);
     }
-    
+
+    ret = xSemaphoreTake(thread_ptr->esp_thread_semaphore, wait_option);
+
     return (ret == pdTRUE) ? (ESP_AZURE_IOT_SUCCESS) : (ESP_AZURE_IOT_INVALID_PARAMETER);
 }
 
 uint32_t esp_azure_iot_thread_wait_abort(ESP_THRAED *thread_ptr)
 {
-
     BaseType_t ret = pdFALSE;
-    
-    if (thread_ptr && thread_ptr->esp_thread_semaphore) {
-        ret = xSemaphoreGive(thread_ptr->esp_thread_semaphore);
+
+    /* Nobody waits on a missing waiter, so there is no one to wake.  */
+    if ((thread_ptr == NULL) || (thread_ptr->esp_thread_semaphore == NULL)) {
+        return(ESP_AZURE_IOT_SUCCESS);
     }
-    
+
+    ret = xSemaphoreGive(thread_ptr->esp_thread_semaphore);
+
     return (ret == pdTRUE) ? (ESP_AZURE_IOT_SUCCESS) : (ESP_AZURE_IOT_INVALID_PARAMETER);
 }
 
 ESP_THRAED *esp_azure_iot_thread_identify(void)
 {
     ESP_THRAED *thread_ptr;
-    thread_ptr = calloc(1, sizeof(ESP_THRAED));
-    thread_ptr->esp_thread_semaphore = xSemaphoreCreateBinary();
+
+    portENTER_CRITICAL(&esp_thread_pool_lock);
+    thread_ptr = esp_thread_pool_free_list;
+    if (thread_ptr) {
+        esp_thread_pool_free_list = thread_ptr->esp_thread_next;
+        thread_ptr->esp_thread_next = NULL;
+    }
+    portEXIT_CRITICAL(&esp_thread_pool_lock);
+
+    if (thread_ptr == NULL) {
+        ESP_LOGE(TAG, "Thread identify fail: waiter pool exhausted");
+    }
 
     return thread_ptr;
 }
 
 uint32_t esp_azure_iot_thread_preemption(ESP_THRAED *thread_ptr)
 {
-    if (thread_ptr) {
-        if (thread_ptr->esp_thread_semaphore) {
-            vSemaphoreDelete(thread_ptr->esp_thread_semaphore);
-            thread_ptr->esp_thread_semaphore = NULL;
-        }
-        
-        free(thread_ptr);
+    if (thread_ptr == NULL) {
+        return ESP_AZURE_IOT_SUCCESS;
     }
 
+    /* Drop a wakeup given after the wait timed out so it cannot end the next wait early.  */
+    xSemaphoreTake(thread_ptr->esp_thread_semaphore, 0);
+
+    portENTER_CRITICAL(&esp_thread_pool_lock);
+    thread_ptr->esp_thread_next = esp_thread_pool_free_list;
+    esp_thread_pool_free_list = thread_ptr;
+    portEXIT_CRITICAL(&esp_thread_pool_lock);
+
     return ESP_AZURE_IOT_SUCCESS;
 }
\ No newline at end of file
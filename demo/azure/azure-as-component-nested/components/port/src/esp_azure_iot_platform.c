@@ -0,0 +1,40 @@
+// Copyright 2020 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
+#include "azure/core/az_platform.h"
+
+/* The SDK's platform layer for ESP-IDF, used for token expiry, context deadlines and retry delays.  */
+
+int64_t az_platform_clock_msec()
+{
+    /* esp_timer counts microseconds since boot and, unlike time(), isn't moved by SNTP.  */
+    return esp_timer_get_time() / 1000;
+}
+
+void az_platform_sleep_msec(int32_t milliseconds)
+{
+    /* Round up so that short sleeps still yield for at least one tick.  */
+    TickType_t ticks = (TickType_t)((milliseconds + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS);
+
+    vTaskDelay(ticks);
+}
+
+bool az_platform_atomic_compare_exchange(uintptr_t volatile *obj, uintptr_t expected, uintptr_t desired)
+{
+    return __sync_bool_compare_and_swap(obj, expected, desired);
+}
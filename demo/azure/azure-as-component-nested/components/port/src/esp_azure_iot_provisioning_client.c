@@ -183,7 +183,7 @@ ESP_PACKET *packet_ptr;
 ESP_PACKET *packet_next_ptr;
 uint32_t status;
 
-    /* This function is protected by MQTT mutex. */
+    /* This function runs in the MQTT thread, without the MQTT mutex held. */
 
     ESP_PARAMETER_NOT_USED(number_of_messages);
 
@@ -585,8 +585,9 @@ az_result core_result;
         return(ESP_AZURE_IOT_SDK_CORE_ERROR);
     }
 
-    packet_ptr -> esp_packet_append_ptr = packet_ptr -> esp_packet_prepend_ptr + mqtt_topic_length;
-    packet_ptr -> esp_packet_length += mqtt_topic_length;
+    /* Payload follows the NULL terminator of the topic.  */
+    packet_ptr -> esp_packet_append_ptr = packet_ptr -> esp_packet_prepend_ptr + mqtt_topic_length + 1;
+    packet_ptr -> esp_packet_length = mqtt_topic_length;
 
     status = esp_azure_iot_packet_append(packet_ptr, ESP_AZURE_IOT_PROVISIONING_CLIENT_PAYLOAD_START,
                                    sizeof(ESP_AZURE_IOT_PROVISIONING_CLIENT_PAYLOAD_START) - 1,
@@ -621,10 +622,12 @@ az_result core_result;
     status = esp_azure_iot_publish_mqtt_packet(&(prov_client_ptr -> esp_azure_iot_provisioning_client_resource.esp_azure_iot_mqtt),
                                               packet_ptr, ESP_AZURE_IOT_MQTT_QOS_1, wait_option);
 
+    /* MQTT client keeps its own copy of the message.  */
+    esp_azure_iot_packet_release(packet_ptr);
+
     if (status)
     {
         LogError("failed to publish packet");
-        esp_azure_iot_packet_release(packet_ptr);
         return(status);
     }
 
@@ -1057,8 +1060,17 @@ uint32_t status = ESP_AZURE_IOT_SUCCESS;
         if (prov_client_ptr -> esp_azure_iot_provisioning_client_state > ESP_AZURE_IOT_PROVISIONING_CLIENT_STATUS_INIT &&
              prov_client_ptr -> esp_azure_iot_provisioning_client_state < ESP_AZURE_IOT_PROVISIONING_CLIENT_STATUS_DONE)
         {
-            thread_list.esp_azure_iot_provisioning_thread_next = prov_client_ptr -> esp_azure_iot_provisioning_client_thread_suspended;
             thread_list.esp_azure_iot_provisioning_thread_ptr = esp_azure_iot_thread_identify();
+            if (thread_list.esp_azure_iot_provisioning_thread_ptr == NULL)
+            {
+
+                /* Release the mutex.  */
+                xSemaphoreGive(prov_client_ptr -> esp_azure_iot_ptr -> esp_azure_iot_mutex_ptr);
+                LogError("IoTProvisioning client register fail: NO WAITER AVAILABLE");
+                return(ESP_AZURE_IOT_INSUFFICIENT_BUFFER_SPACE);
+            }
+
+            thread_list.esp_azure_iot_provisioning_thread_next = prov_client_ptr -> esp_azure_iot_provisioning_client_thread_suspended;
             prov_client_ptr -> esp_azure_iot_provisioning_client_thread_suspended = &thread_list;
 
             /* Release the mutex.  */
@@ -0,0 +1,125 @@
+// Copyright 2020 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "unity.h"
+
+#include "esp_azure_iot.h"
+#include "esp_azure_iot_mqtt_client.h"
+
+/* One more waiter than the pool holds.  */
+#define TEST_WAITER_COUNT       (ESP_AZURE_IOT_THREAD_POOL_COUNT + 1)
+
+typedef struct TEST_WAITER_STRUCT
+{
+    ESP_THRAED          *thread_ptr;
+    uint32_t             status;
+    SemaphoreHandle_t    ready;
+    SemaphoreHandle_t    done;
+} TEST_WAITER;
+
+static void test_waiter_task(void *arg)
+{
+    TEST_WAITER *waiter = (TEST_WAITER *)arg;
+
+    /* Register the way the clients do, then block until woken.  */
+    waiter->thread_ptr = esp_azure_iot_thread_identify();
+    xSemaphoreGive(waiter->ready);
+
+    if (waiter->thread_ptr) {
+        waiter->status = esp_azure_iot_thread_sleep(waiter->thread_ptr, portMAX_DELAY);
+    } else {
+        waiter->status = esp_azure_iot_thread_sleep(NULL, portMAX_DELAY);
+    }
+
+    esp_azure_iot_thread_preemption(waiter->thread_ptr);
+    xSemaphoreGive(waiter->done);
+    vTaskDelete(NULL);
+}
+
+TEST_CASE("more concurrent waiters than the waiter pool holds", "[azure_iot]")
+{
+    static TEST_WAITER waiters[TEST_WAITER_COUNT];
+    ESP_THRAED *threads[ESP_AZURE_IOT_THREAD_POOL_COUNT];
+    SemaphoreHandle_t ready = xSemaphoreCreateCounting(TEST_WAITER_COUNT, 0);
+    SemaphoreHandle_t done = xSemaphoreCreateCounting(TEST_WAITER_COUNT, 0);
+    uint32_t without_waiter = 0;
+    size_t index;
+
+    TEST_ASSERT_NOT_NULL(ready);
+    TEST_ASSERT_NOT_NULL(done);
+    TEST_ASSERT_EQUAL_UINT32(ESP_AZURE_IOT_SUCCESS, esp_azure_iot_thread_pool_create());
+
+    for (index = 0; index < TEST_WAITER_COUNT; index++) {
+        waiters[index].thread_ptr = NULL;
+        waiters[index].status = ESP_AZURE_IOT_SUCCESS;
+        waiters[index].ready = ready;
+        waiters[index].done = done;
+        TEST_ASSERT_EQUAL(pdPASS, xTaskCreate(test_waiter_task, "waiter", 2048,
+                                              &waiters[index], uxTaskPriorityGet(NULL), NULL));
+    }
+
+    for (index = 0; index < TEST_WAITER_COUNT; index++) {
+        TEST_ASSERT_EQUAL(pdTRUE, xSemaphoreTake(ready, pdMS_TO_TICKS(1000)));
+    }
+
+    /* Exactly one task found the pool exhausted and did not wait.  */
+    for (index = 0; index < TEST_WAITER_COUNT; index++) {
+        if (waiters[index].thread_ptr == NULL) {
+            without_waiter++;
+        }
+    }
+    TEST_ASSERT_EQUAL_UINT32(1, without_waiter);
+    TEST_ASSERT_EQUAL(pdTRUE, xSemaphoreTake(done, pdMS_TO_TICKS(1000)));
+
+    /* The others are still blocked until aborted; aborting no waiter is a no-op.  */
+    TEST_ASSERT_EQUAL(pdFALSE, xSemaphoreTake(done, pdMS_TO_TICKS(100)));
+    TEST_ASSERT_EQUAL_UINT32(ESP_AZURE_IOT_SUCCESS, esp_azure_iot_thread_wait_abort(NULL));
+
+    for (index = 0; index < TEST_WAITER_COUNT; index++) {
+        if (waiters[index].thread_ptr) {
+            TEST_ASSERT_EQUAL_UINT32(ESP_AZURE_IOT_SUCCESS,
+                                     esp_azure_iot_thread_wait_abort(waiters[index].thread_ptr));
+        }
+    }
+
+    for (index = 0; index < ESP_AZURE_IOT_THREAD_POOL_COUNT; index++) {
+        TEST_ASSERT_EQUAL(pdTRUE, xSemaphoreTake(done, pdMS_TO_TICKS(1000)));
+    }
+
+    for (index = 0; index < TEST_WAITER_COUNT; index++) {
+        if (waiters[index].thread_ptr) {
+            TEST_ASSERT_EQUAL_UINT32(ESP_AZURE_IOT_SUCCESS, waiters[index].status);
+        } else {
+            TEST_ASSERT_EQUAL_UINT32(ESP_AZURE_IOT_INVALID_PARAMETER, waiters[index].status);
+        }
+    }
+
+    /* Every waiter went back to the pool.  */
+    for (index = 0; index < ESP_AZURE_IOT_THREAD_POOL_COUNT; index++) {
+        threads[index] = esp_azure_iot_thread_identify();
+        TEST_ASSERT_NOT_NULL(threads[index]);
+    }
+    TEST_ASSERT_NULL(esp_azure_iot_thread_identify());
+
+    for (index = 0; index < ESP_AZURE_IOT_THREAD_POOL_COUNT; index++) {
+        esp_azure_iot_thread_preemption(threads[index]);
+    }
+
+    vSemaphoreDelete(ready);
+    vSemaphoreDelete(done);
+}